@@ -0,0 +1,303 @@
+/*
+ * broadcast ring shared by every session of the "lws-minimal" protocol
+ *
+ * See broadcast_ring.h for the model.  Every slot carries the count of
+ * attached readers that still have to send it, so consume is O(1) and the
+ * ring only has to walk its readers when the slow reader policy runs.
+ */
+
+#include "broadcast_ring.h"
+#include "slab.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static uint64_t live_bytes;
+
+struct msg *
+msg_create(const void *data, size_t len)
+{
+	struct msg *m;
+
+	/*
+	 * notice we over-allocate by LWS_PRE, the header shares the block,
+	 * which comes from the slabs unless it is a very big message
+	 */
+	m = slab_alloc(sizeof(*m) + LWS_PRE + len);
+	if (!m)
+		return NULL;
+
+	__atomic_add_fetch(&live_bytes, sizeof(*m) + LWS_PRE + len,
+			   __ATOMIC_RELAXED);
+
+	memset(m, 0, sizeof(*m));
+	m->payload = m + 1;
+	m->len = len;
+	m->seq = MSG_NO_SEQ;
+	m->refcount = 1;
+	if (len)
+		memcpy((unsigned char *)m->payload + LWS_PRE, data, len);
+
+	return m;
+}
+
+/* messages are shared between service threads, so the count is atomic */
+
+struct msg *
+msg_ref(struct msg *m)
+{
+	__atomic_add_fetch(&m->refcount, 1, __ATOMIC_RELAXED);
+
+	return m;
+}
+
+void
+msg_unref(struct msg *m)
+{
+	if (!m || __atomic_sub_fetch(&m->refcount, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	__atomic_sub_fetch(&live_bytes, sizeof(*m) + LWS_PRE + m->len,
+			   __ATOMIC_RELAXED);
+	slab_free(m, sizeof(*m) + LWS_PRE + m->len);
+}
+
+uint64_t
+msg_live_bytes(void)
+{
+	return __atomic_load_n(&live_bytes, __ATOMIC_RELAXED);
+}
+
+static struct bcast_slot *
+__bcast_slot(const struct bcast_ring *ring, uint64_t pos)
+{
+	return &ring->slots[pos & (ring->size - 1)];
+}
+
+/* drop the ring's reference on every leading slot nobody still needs */
+
+static void
+__bcast_reclaim(struct bcast_ring *ring)
+{
+	struct bcast_slot *slot;
+
+	while (ring->oldest < ring->head) {
+		slot = __bcast_slot(ring, ring->oldest);
+		if (slot->readers_left)
+			break;
+		msg_unref(slot->msg);
+		slot->msg = NULL;
+		ring->oldest++;
+	}
+}
+
+/* the reader stops needing everything from its tail up to pos */
+
+static void
+__bcast_release(struct bcast_ring *ring, struct bcast_reader *rd, uint64_t pos)
+{
+	while (rd->tail < pos)
+		__bcast_slot(ring, rd->tail++)->readers_left--;
+}
+
+static void
+__bcast_apply(struct bcast_ring *ring, struct bcast_reader *rd,
+	      enum bcast_slow_policy policy)
+{
+	if (rd->tail >= ring->head)
+		return;
+
+	switch (policy) {
+	case BCAST_SLOW_DROP_OLDEST:
+		rd->dropped++;
+		__bcast_release(ring, rd, rd->tail + 1);
+		break;
+	case BCAST_SLOW_SKIP:
+		rd->dropped += ring->head - rd->tail;
+		__bcast_release(ring, rd, ring->head);
+		break;
+	case BCAST_SLOW_CLOSE:
+		rd->dropped += ring->head - rd->tail;
+		__bcast_release(ring, rd, ring->head);
+		rd->kicked = 1;
+		break;
+	}
+}
+
+/* apply the slow reader policy to everybody still parked on ring->oldest */
+
+static int
+__bcast_make_room(struct bcast_ring *ring)
+{
+	struct bcast_reader *rd;
+	int acted = 0;
+
+	for (rd = ring->readers; rd; rd = rd->next) {
+		if (rd->tail != ring->oldest)
+			continue;
+
+		__bcast_apply(ring, rd, ring->policy);
+		acted++;
+	}
+
+	__bcast_reclaim(ring);
+
+	return acted;
+}
+
+int
+bcast_ring_init(struct bcast_ring *ring, uint32_t size,
+		enum bcast_slow_policy policy)
+{
+	uint32_t n = 1;
+
+	if (!size)
+		return 1;
+
+	/* round up to a power of two so position -> slot is a mask */
+	while (n < size) {
+		if (n & 0x80000000u)
+			return 1;
+		n <<= 1;
+	}
+
+	memset(ring, 0, sizeof(*ring));
+	ring->slots = calloc(n, sizeof(struct bcast_slot));
+	if (!ring->slots)
+		return 1;
+
+	ring->size = n;
+	ring->policy = policy;
+
+	return 0;
+}
+
+void
+bcast_ring_destroy(struct bcast_ring *ring)
+{
+	if (!ring->slots)
+		return;
+
+	while (ring->oldest < ring->head)
+		msg_unref(__bcast_slot(ring, ring->oldest++)->msg);
+
+	free(ring->slots);
+	ring->slots = NULL;
+	ring->readers = NULL;
+	ring->count_readers = 0;
+}
+
+void
+bcast_ring_attach(struct bcast_ring *ring, struct bcast_reader *rd)
+{
+	rd->tail = ring->head;
+	rd->dropped = 0;
+	rd->kicked = 0;
+	rd->next = ring->readers;
+	ring->readers = rd;
+	ring->count_readers++;
+}
+
+void
+bcast_ring_detach(struct bcast_ring *ring, struct bcast_reader *rd)
+{
+	struct bcast_reader **prd;
+
+	for (prd = &ring->readers; *prd; prd = &(*prd)->next)
+		if (*prd == rd) {
+			*prd = rd->next;
+			rd->next = NULL;
+			ring->count_readers--;
+			__bcast_release(ring, rd, ring->head);
+			__bcast_reclaim(ring);
+			break;
+		}
+}
+
+int
+bcast_ring_insert(struct bcast_ring *ring, struct msg *m)
+{
+	struct bcast_slot *slot;
+	int acted = 0;
+
+	if (ring->head - ring->oldest == ring->size) {
+		acted = __bcast_make_room(ring);
+		if (ring->head - ring->oldest == ring->size)
+			return -1;
+	}
+
+	slot = __bcast_slot(ring, ring->head++);
+	slot->msg = msg_ref(m);
+	ring->bytes_in += m->len;
+	slot->bytes_end = ring->bytes_in;
+	slot->readers_left = ring->count_readers;
+
+	/* with nobody attached, nobody will ever want it */
+	__bcast_reclaim(ring);
+
+	return acted;
+}
+
+const struct msg *
+bcast_ring_peek(const struct bcast_ring *ring, const struct bcast_reader *rd)
+{
+	if (rd->tail >= ring->head || rd->tail < ring->oldest)
+		return NULL;
+
+	return __bcast_slot(ring, rd->tail)->msg;
+}
+
+void
+bcast_ring_consume(struct bcast_ring *ring, struct bcast_reader *rd)
+{
+	if (rd->tail >= ring->head)
+		return;
+
+	__bcast_release(ring, rd, rd->tail + 1);
+	if (rd->tail - 1 == ring->oldest)
+		__bcast_reclaim(ring);
+}
+
+uint64_t
+bcast_ring_pending(const struct bcast_ring *ring,
+		   const struct bcast_reader *rd)
+{
+	return rd->tail < ring->head ? ring->head - rd->tail : 0;
+}
+
+uint64_t
+bcast_ring_pending_bytes(const struct bcast_ring *ring,
+			 const struct bcast_reader *rd)
+{
+	const struct bcast_slot *slot;
+
+	if (rd->tail >= ring->head || rd->tail < ring->oldest)
+		return 0;
+
+	slot = __bcast_slot(ring, rd->tail);
+
+	return ring->bytes_in - (slot->bytes_end - slot->msg->len);
+}
+
+void
+bcast_ring_evict(struct bcast_ring *ring, struct bcast_reader *rd,
+		 enum bcast_slow_policy policy)
+{
+	__bcast_apply(ring, rd, policy);
+	__bcast_reclaim(ring);
+}
+
+int
+bcast_slow_policy_from_name(const char *name, enum bcast_slow_policy *policy)
+{
+	if (!strcmp(name, "drop"))
+		*policy = BCAST_SLOW_DROP_OLDEST;
+	else if (!strcmp(name, "skip"))
+		*policy = BCAST_SLOW_SKIP;
+	else if (!strcmp(name, "close"))
+		*policy = BCAST_SLOW_CLOSE;
+	else
+		return 1;
+
+	return 0;
+}
@@ -0,0 +1,148 @@
+/*
+ * broadcast ring shared by every session of the "lws-minimal" protocol
+ *
+ * One ring is held per service thread.  A received message is inserted once
+ * and each reader walks the ring with its own tail, so fanout costs no
+ * per-client copies.  Positions are 64-bit and only ever increase, the slot
+ * for a position is (position & (size - 1)).
+ *
+ * Messages are refcounted and allocated once with LWS_PRE headroom, every
+ * reader sends from the same buffer.  Each slot counts the readers that still
+ * have to send it, the ring drops its reference as soon as the last of them
+ * moves past.  The ring itself is not locked, only its own service thread
+ * may touch it.
+ *
+ * When the ring is full and some reader is still parked on the oldest slot,
+ * the configured slow reader policy decides what happens to that reader.
+ * The same policies can be applied to any one reader, eg, when it holds on
+ * to too many bytes.
+ *
+ * Each slot records the total bytes inserted up to and including it, so
+ * the bytes a reader still has to send is one subtraction.
+ */
+
+#if !defined(__BROADCAST_RING_H__)
+#define __BROADCAST_RING_H__
+
+#include <libwebsockets.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * one of these created for each message, in the same allocation as its
+ * payload.  payload points just past the struct and has LWS_PRE bytes of
+ * headroom before the message data.
+ */
+
+struct msg {
+	void *payload;
+	size_t len;
+	uint64_t timestamp;
+	uint64_t received; /* monotonic ns the server got it at, 0 if unknown */
+	uint64_t seq; /* its history sequence number, or MSG_NO_SEQ */
+	void *user; /* whatever the creator tags it with, eg, its room */
+	uint32_t refcount;
+};
+
+#define MSG_NO_SEQ ((uint64_t)-1)
+
+struct bcast_slot {
+	struct msg *msg;
+	uint64_t bytes_end;	/* ring's bytes_in once this was inserted */
+	uint32_t readers_left; /* attached readers that have not sent it yet */
+};
+
+enum bcast_slow_policy {
+	BCAST_SLOW_DROP_OLDEST,	/* laggard loses its oldest pending message */
+	BCAST_SLOW_SKIP,	/* laggard jumps ahead to the newest message */
+	BCAST_SLOW_CLOSE,	/* laggard is marked to be disconnected */
+};
+
+/* embedded in whatever represents a client reading the ring */
+
+struct bcast_reader {
+	struct bcast_reader *next;
+	uint64_t tail;		/* position of the next message to send */
+	uint64_t dropped;	/* messages this reader lost to the policy */
+	char kicked;		/* BCAST_SLOW_CLOSE chose this reader */
+};
+
+struct bcast_ring {
+	struct bcast_slot *slots;
+	uint32_t size;		/* slot count, a power of two */
+	uint32_t count_readers;	/* attached readers */
+	uint64_t head;		/* position the next insert goes to */
+	uint64_t oldest;	/* oldest position still holding a message */
+	uint64_t bytes_in;	/* payload bytes ever inserted */
+	enum bcast_slow_policy policy;
+
+	struct bcast_reader *readers; /* linked-list of attached readers */
+};
+
+/* a new message holding a copy of data, with one reference owned by caller */
+
+struct msg *
+msg_create(const void *data, size_t len);
+
+/* bytes held by every message not yet freed, from any thread */
+
+uint64_t
+msg_live_bytes(void);
+
+struct msg *
+msg_ref(struct msg *m);
+
+void
+msg_unref(struct msg *m);
+
+int
+bcast_ring_init(struct bcast_ring *ring, uint32_t size,
+		enum bcast_slow_policy policy);
+
+void
+bcast_ring_destroy(struct bcast_ring *ring);
+
+/* the reader starts at the current head, ie, with the next message in */
+
+void
+bcast_ring_attach(struct bcast_ring *ring, struct bcast_reader *rd);
+
+void
+bcast_ring_detach(struct bcast_ring *ring, struct bcast_reader *rd);
+
+/*
+ * The ring takes its own reference on m.  Returns the number of readers the
+ * slow reader policy acted on to make room, or -1 if nothing could be freed.
+ */
+
+int
+bcast_ring_insert(struct bcast_ring *ring, struct msg *m);
+
+/* the next message for this reader, or NULL if it is caught up */
+
+const struct msg *
+bcast_ring_peek(const struct bcast_ring *ring, const struct bcast_reader *rd);
+
+void
+bcast_ring_consume(struct bcast_ring *ring, struct bcast_reader *rd);
+
+uint64_t
+bcast_ring_pending(const struct bcast_ring *ring,
+		   const struct bcast_reader *rd);
+
+/* payload bytes of the messages this reader still has to send */
+
+uint64_t
+bcast_ring_pending_bytes(const struct bcast_ring *ring,
+			 const struct bcast_reader *rd);
+
+/* apply a slow reader policy to this reader, wherever it is */
+
+void
+bcast_ring_evict(struct bcast_ring *ring, struct bcast_reader *rd,
+		 enum bcast_slow_policy policy);
+
+int
+bcast_slow_policy_from_name(const char *name, enum bcast_slow_policy *policy);
+
+#endif
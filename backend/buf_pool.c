@@ -0,0 +1,141 @@
+/*
+ * size-classed buffer pool, for reassembling fragmented messages
+ */
+
+#include "buf_pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* the class for len bytes, or -1 if it's bigger than any class */
+
+static int
+__buf_pool_class(size_t len)
+{
+	int n = 0;
+
+	while (n < BUF_POOL_CLASSES &&
+	       ((size_t)BUF_POOL_MIN << n) < len)
+		n++;
+
+	return n < BUF_POOL_CLASSES ? n : -1;
+}
+
+int
+buf_pool_init(struct buf_pool *p, size_t max_size, uint32_t keep)
+{
+	memset(p, 0, sizeof(*p));
+
+	/* appends need a byte more for the NUL */
+	if (!max_size || __buf_pool_class(max_size + 1) < 0)
+		return 1;
+
+	p->max_size = max_size;
+	p->keep = keep;
+
+	return 0;
+}
+
+void
+buf_pool_destroy(struct buf_pool *p)
+{
+	void *buf;
+	int n;
+
+	for (n = 0; n < BUF_POOL_CLASSES; n++)
+		while ((buf = p->classes[n].free)) {
+			p->classes[n].free = *(void **)buf;
+			free(buf);
+		}
+
+	memset(p->classes, 0, sizeof(p->classes));
+}
+
+static void *
+__buf_pool_get(struct buf_pool *p, size_t len, size_t *cap)
+{
+	struct buf_pool_class *c;
+	void *buf;
+	int n;
+
+	n = __buf_pool_class(len);
+	c = &p->classes[n];
+	*cap = (size_t)BUF_POOL_MIN << n;
+
+	buf = c->free;
+	if (buf) {
+		c->free = *(void **)buf;
+		c->count_free--;
+		return buf;
+	}
+
+	p->mallocs++;
+
+	return malloc(*cap);
+}
+
+void *
+buf_pool_get(struct buf_pool *p, size_t len, size_t *cap)
+{
+	if (len > p->max_size)
+		return NULL;
+
+	return __buf_pool_get(p, len, cap);
+}
+
+void
+buf_pool_put(struct buf_pool *p, void *buf, size_t cap)
+{
+	struct buf_pool_class *c;
+	int n;
+
+	if (!buf)
+		return;
+
+	n = __buf_pool_class(cap);
+	c = &p->classes[n];
+	if (c->count_free >= p->keep) {
+		free(buf);
+		return;
+	}
+
+	*(void **)buf = c->free;
+	c->free = buf;
+	c->count_free++;
+}
+
+int
+buf_pool_append(struct buf_pool *p, struct pool_buf *b, const void *in,
+		size_t len)
+{
+	size_t need = b->len + len + 1, cap;
+	unsigned char *nb;
+
+	if (b->len + len > p->max_size)
+		return 1;
+
+	if (need > b->cap) {
+		nb = __buf_pool_get(p, need, &cap);
+		if (!nb)
+			return 1;
+		if (b->len)
+			memcpy(nb, b->data, b->len);
+		buf_pool_put(p, b->data, b->cap);
+		b->data = nb;
+		b->cap = cap;
+	}
+
+	if (len)
+		memcpy(b->data + b->len, in, len);
+	b->len += len;
+	b->data[b->len] = '\0';
+
+	return 0;
+}
+
+void
+buf_pool_release(struct buf_pool *p, struct pool_buf *b)
+{
+	buf_pool_put(p, b->data, b->cap);
+	memset(b, 0, sizeof(*b));
+}
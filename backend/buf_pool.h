@@ -0,0 +1,76 @@
+/*
+ * size-classed buffer pool, for reassembling fragmented messages
+ *
+ * Buffers come in power of two classes from BUF_POOL_MIN bytes up to the
+ * first class holding max_size.  A buffer given back goes on its class's
+ * free list, up to keep of them per class, so once the pool is warm a
+ * message arriving in any number of fragments costs no malloc() or free().
+ *
+ * The pool is not locked, give each service thread its own.
+ */
+
+#if !defined(__BUF_POOL_H__)
+#define __BUF_POOL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BUF_POOL_MIN_BITS 8
+#define BUF_POOL_MIN (1u << BUF_POOL_MIN_BITS)
+#define BUF_POOL_CLASSES 24 /* up to 2GB */
+
+struct buf_pool_class {
+	void *free; /* linked through the first bytes of each free buffer */
+	uint32_t count_free;
+};
+
+struct buf_pool {
+	struct buf_pool_class classes[BUF_POOL_CLASSES];
+	size_t max_size;
+	uint32_t keep; /* most free buffers kept per class */
+	uint64_t mallocs; /* buffers the pool had to allocate */
+};
+
+/* a message being reassembled, all zero when nothing is held */
+
+struct pool_buf {
+	unsigned char *data;
+	size_t len;
+	size_t cap; /* size of data's class */
+};
+
+int
+buf_pool_init(struct buf_pool *p, size_t max_size, uint32_t keep);
+
+/* frees the free buffers, the ones handed out must be put back first */
+
+void
+buf_pool_destroy(struct buf_pool *p);
+
+/*
+ * A buffer of at least len bytes, *cap is set to what it really holds.
+ * NULL if len is over max_size, or on OOM.
+ */
+
+void *
+buf_pool_get(struct buf_pool *p, size_t len, size_t *cap);
+
+void
+buf_pool_put(struct buf_pool *p, void *buf, size_t cap);
+
+/*
+ * Add a fragment to b, moving it to a bigger class as needed.  data stays
+ * NUL terminated, so text can be parsed in place.  Returns 0, or 1 if the
+ * message would be over max_size or on OOM, b is left as it was.
+ */
+
+int
+buf_pool_append(struct buf_pool *p, struct pool_buf *b, const void *in,
+		size_t len);
+
+/* gives b's buffer back, if it has one */
+
+void
+buf_pool_release(struct buf_pool *p, struct pool_buf *b);
+
+#endif
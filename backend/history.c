@@ -0,0 +1,312 @@
+/*
+ * message history for the "lws-minimal" protocol
+ *
+ * See history.h.  Records are 8-byte aligned.  While the records are not
+ * wrapped they occupy [tail, head), once a record did not fit at the end of
+ * the arena they occupy [tail, wrap_at) followed by [0, head).
+ */
+
+#include "history.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define HIST_ALIGN(_n) (((_n) + 7u) & ~(size_t)7u)
+/* the first arena of a history_init() one */
+#define HIST_MIN_ARENA 4096u
+
+/* arena allocated by every history_init() one, see history_arena_bytes() */
+static uint64_t arena_bytes;
+
+static struct hist_rec *
+__hist_rec_at(const struct history *h, uint32_t ofs)
+{
+	return (struct hist_rec *)(h->arena + ofs);
+}
+
+static void
+__hist_evict_oldest(struct history *h)
+{
+	struct hist_rec *r = __hist_rec_at(h, h->tail);
+
+	h->tail += r->size;
+	h->used -= r->size;
+	h->bytes -= r->len;
+	h->count--;
+	h->oldest_seq++;
+
+	if (h->wrapped && h->tail == h->wrap_at) {
+		h->tail = 0;
+		h->wrapped = 0;
+	}
+}
+
+/* find an offset with room for size bytes, evicting until there is one */
+
+static uint32_t
+__hist_reserve(struct history *h, uint32_t size)
+{
+	while (h->count >= h->max_count)
+		__hist_evict_oldest(h);
+
+	for (;;) {
+		if (!h->count) {
+			h->head = h->tail = 0;
+			h->wrapped = 0;
+		}
+
+		if (!h->wrapped) {
+			if (h->arena_size - h->head >= size)
+				return h->head;
+
+			/* no room at the end, start again from the front */
+			if (h->tail >= size) {
+				h->wrap_at = h->head;
+				h->head = 0;
+				h->wrapped = 1;
+
+				return 0;
+			}
+		} else
+			if (h->tail - h->head >= size)
+				return h->head;
+
+		__hist_evict_oldest(h);
+	}
+}
+
+/* the index has one slot per possible record, rounded up to a power of two */
+
+static uint32_t
+__hist_index_size(uint32_t max_count)
+{
+	uint32_t n = 1;
+
+	while (n < max_count) {
+		if (n & 0x80000000u)
+			return 0;
+		n <<= 1;
+	}
+
+	return n;
+}
+
+static int
+__hist_check(uint32_t max_count, uint32_t max_bytes)
+{
+	return !max_count || max_bytes < sizeof(struct hist_rec) + LWS_PRE ||
+	       !__hist_index_size(max_count);
+}
+
+static void
+__hist_setup(struct history *h, uint32_t max_count, uint32_t max_bytes)
+{
+	h->arena_max = max_bytes & ~7u;
+	h->index_mask = __hist_index_size(max_count) - 1;
+	h->max_count = max_count;
+}
+
+int
+history_init(struct history *h, uint32_t max_count, uint32_t max_bytes)
+{
+	memset(h, 0, sizeof(*h));
+
+	if (__hist_check(max_count, max_bytes))
+		return 1;
+
+	__hist_setup(h, max_count, max_bytes);
+
+	return 0;
+}
+
+/*
+ * A bigger arena for a history_init() one, doubled until it holds need
+ * bytes or is as big as it may be.  The records are copied over oldest
+ * first, so they are no longer wrapped.
+ */
+
+static int
+__hist_grow(struct history *h, size_t need)
+{
+	uint64_t size = h->arena_size ? h->arena_size : HIST_MIN_ARENA, seq;
+	unsigned char *arena;
+	struct hist_rec *r;
+	uint32_t ofs = 0;
+
+	while (size < need && size < h->arena_max)
+		size *= 2;
+	if (size > h->arena_max)
+		size = h->arena_max;
+
+	if (!h->index) {
+		h->index = malloc(((size_t)h->index_mask + 1) *
+				  sizeof(*h->index));
+		if (!h->index)
+			return 1;
+	}
+	arena = malloc((size_t)size);
+	if (!arena)
+		return 1;
+
+	for (seq = h->oldest_seq; h->count && seq < h->next_seq; seq++) {
+		r = history_get(h, seq);
+		memcpy(arena + ofs, r, r->size);
+		h->index[seq & h->index_mask] = ofs;
+		ofs += r->size;
+	}
+
+	free(h->arena);
+	__atomic_add_fetch(&arena_bytes, size - h->arena_size, __ATOMIC_RELAXED);
+	h->arena = arena;
+	h->arena_size = (uint32_t)size;
+	h->head = ofs;
+	h->tail = h->wrap_at = 0;
+	h->wrapped = 0;
+
+	return 0;
+}
+
+size_t
+history_mem_size(uint32_t max_count, uint32_t max_bytes)
+{
+	if (__hist_check(max_count, max_bytes))
+		return 0;
+
+	return HIST_ALIGN(max_bytes) +
+	       __hist_index_size(max_count) * sizeof(uint32_t);
+}
+
+int
+history_init_mem(struct history *h, void *mem, uint32_t max_count,
+		 uint32_t max_bytes)
+{
+	memset(h, 0, sizeof(*h));
+
+	if (__hist_check(max_count, max_bytes))
+		return 1;
+
+	h->arena = mem;
+	h->index = (uint32_t *)(h->arena + HIST_ALIGN(max_bytes));
+	__hist_setup(h, max_count, max_bytes);
+	h->arena_size = h->arena_max;
+
+	return 0;
+}
+
+void
+history_destroy(struct history *h)
+{
+	__atomic_sub_fetch(&arena_bytes, h->arena_size, __ATOMIC_RELAXED);
+	free(h->arena);
+	free(h->index);
+	memset(h, 0, sizeof(*h));
+}
+
+void
+history_reset(struct history *h)
+{
+	h->head = h->tail = h->wrap_at = 0;
+	h->wrapped = 0;
+	h->count = 0;
+	h->used = 0;
+	h->bytes = 0;
+	h->oldest_seq = h->next_seq;
+}
+
+void
+history_seek(struct history *h, uint64_t seq)
+{
+	if (seq == h->next_seq)
+		return;
+
+	h->next_seq = seq;
+	history_reset(h);
+}
+
+void
+history_release(struct history *h)
+{
+	__atomic_sub_fetch(&arena_bytes, h->arena_size, __ATOMIC_RELAXED);
+	free(h->arena);
+	free(h->index);
+	h->arena = NULL;
+	h->index = NULL;
+	h->arena_size = 0;
+	history_reset(h);
+}
+
+int
+history_append(struct history *h, const void *data, size_t len,
+	       uint64_t timestamp, uint64_t *seq)
+{
+	size_t size = HIST_ALIGN(sizeof(struct hist_rec) + LWS_PRE + len);
+	struct hist_rec *r;
+	uint32_t ofs;
+
+	if (size > h->arena_max)
+		return 1;
+
+	/* grow rather than evict while we may, or evict if we can't */
+	if (h->used + size > h->arena_size && h->arena_size < h->arena_max)
+		__hist_grow(h, h->used + size);
+	if (size > h->arena_size)
+		return 1;
+
+	ofs = __hist_reserve(h, (uint32_t)size);
+	r = __hist_rec_at(h, ofs);
+	r->size = (uint32_t)size;
+	r->len = (uint32_t)len;
+	r->seq = h->next_seq;
+	r->timestamp = timestamp;
+	if (data && len)
+		memcpy(hist_rec_payload(r), data, len);
+
+	if (!h->count)
+		h->oldest_seq = r->seq;
+
+	h->index[r->seq & h->index_mask] = ofs;
+	h->head = ofs + (uint32_t)size;
+	h->used += (uint32_t)size;
+	h->count++;
+	h->bytes += len;
+	h->next_seq++;
+
+	if (seq)
+		*seq = r->seq;
+
+	return 0;
+}
+
+struct hist_rec *
+history_get(const struct history *h, uint64_t seq)
+{
+	if (!h->count || seq < h->oldest_seq || seq >= h->next_seq)
+		return NULL;
+
+	return __hist_rec_at(h, h->index[seq & h->index_mask]);
+}
+
+uint64_t
+history_find_time(const struct history *h, uint64_t ts)
+{
+	uint64_t lo = h->oldest_seq, hi = h->next_seq, mid;
+
+	if (!h->count)
+		return h->next_seq;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (history_get(h, mid)->timestamp < ts)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+uint64_t
+history_arena_bytes(void)
+{
+	return __atomic_load_n(&arena_bytes, __ATOMIC_RELAXED);
+}
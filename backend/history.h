@@ -0,0 +1,126 @@
+/*
+ * message history for the "lws-minimal" protocol
+ *
+ * History lives in one byte arena of size-prefixed records, written one
+ * after the other and wrapping back to the start of the arena when the end
+ * is reached.  The arena is allocated small when the first record comes and
+ * doubles, while the records would not fit, up to its byte limit.  The
+ * oldest records are evicted to make room, so the arena is bounded both by
+ * its byte size and by a maximum record count.
+ *
+ * Every record gets a sequence number, a small index maps the sequence
+ * number to the record's offset in the arena, so a client replaying history
+ * only has to remember the next sequence number it wants.
+ *
+ * Each record keeps LWS_PRE bytes of headroom before its payload so it can
+ * be handed straight to lws_write() with no copy.
+ */
+
+#if !defined(__HISTORY_H__)
+#define __HISTORY_H__
+
+#include <libwebsockets.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct hist_rec {
+	uint32_t size;		/* whole record, header and padding included */
+	uint32_t len;		/* payload length */
+	uint64_t seq;
+	uint64_t timestamp;
+	/* LWS_PRE bytes of headroom, then the payload */
+};
+
+struct history {
+	unsigned char *arena;
+	uint32_t arena_size;	/* as allocated so far */
+	uint32_t arena_max;	/* ... and the most it grows to */
+	uint32_t used;		/* bytes of records, headers included */
+	uint32_t head;		/* offset the next record goes at */
+	uint32_t tail;		/* offset of the oldest record */
+	uint32_t wrap_at;	/* end of the records before a wrap */
+	char wrapped;		/* records run tail -> wrap_at, then 0 -> head */
+
+	uint32_t *index;	/* seq -> record offset */
+	uint32_t index_mask;
+
+	uint32_t count;
+	uint32_t max_count;
+	uint64_t oldest_seq;	/* seq of the record at tail */
+	uint64_t next_seq;	/* seq the next record will get */
+	uint64_t bytes;		/* payload bytes currently held */
+};
+
+#define hist_rec_payload(_r) \
+	((unsigned char *)(_r) + sizeof(struct hist_rec) + LWS_PRE)
+
+int
+history_init(struct history *h, uint32_t max_count, uint32_t max_bytes);
+
+void
+history_destroy(struct history *h);
+
+/*
+ * For a history living in memory the caller provides, eg, shared between
+ * processes: history_mem_size() says how much memory history_init_mem()
+ * needs for these limits, or 0 if they are invalid.  Such a history is not
+ * passed to history_destroy(), the caller frees the memory.
+ */
+
+size_t
+history_mem_size(uint32_t max_count, uint32_t max_bytes);
+
+int
+history_init_mem(struct history *h, void *mem, uint32_t max_count,
+		 uint32_t max_bytes);
+
+/* forget every record, sequence numbers carry on from where they were */
+
+void
+history_reset(struct history *h);
+
+/*
+ * history_reset(), and free the arena and index of a history_init() one
+ * until another record comes
+ */
+
+void
+history_release(struct history *h);
+
+/* bytes of arena the history_init() histories have allocated between them */
+
+uint64_t
+history_arena_bytes(void);
+
+/*
+ * Make seq the seq the next record gets.  Unless it already is, every
+ * record is forgotten, the index can only hold seqs with no gap.
+ */
+
+void
+history_seek(struct history *h, uint64_t seq);
+
+/*
+ * Copies the payload into the arena, evicting the oldest records as needed.
+ * With data NULL the caller writes the payload itself, from history_get().
+ * Returns 0 and sets *seq if given, or 1 if the message can never fit.
+ */
+
+int
+history_append(struct history *h, const void *data, size_t len,
+	       uint64_t timestamp, uint64_t *seq);
+
+/* the record with this seq, or NULL if it was evicted or is not there yet */
+
+struct hist_rec *
+history_get(const struct history *h, uint64_t seq);
+
+/*
+ * seq of the first record with a timestamp >= ts, by binary search over the
+ * index, or next_seq if there is none
+ */
+
+uint64_t
+history_find_time(const struct history *h, uint64_t ts);
+
+#endif
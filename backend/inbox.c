@@ -0,0 +1,102 @@
+/*
+ * cross-thread message inbox for the "lws-minimal" protocol
+ *
+ * This is the bounded queue from Dmitry Vyukov's MPMC design, with the
+ * consumer side simplified since only the owning thread ever pops.  Each
+ * cell's seq says whether it is free for the producer at position pos
+ * (seq == pos) or holds the message for the consumer at pos (seq == pos + 1).
+ */
+
+#include "inbox.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+int
+inbox_init(struct inbox *ib, uint32_t size)
+{
+	uint32_t n = 1, i;
+
+	memset(ib, 0, sizeof(*ib));
+
+	if (!size)
+		return 1;
+
+	while (n < size) {
+		if (n & 0x80000000u)
+			return 1;
+		n <<= 1;
+	}
+
+	ib->cells = calloc(n, sizeof(*ib->cells));
+	if (!ib->cells)
+		return 1;
+
+	for (i = 0; i < n; i++)
+		ib->cells[i].seq = i;
+	ib->mask = n - 1;
+
+	return 0;
+}
+
+void
+inbox_destroy(struct inbox *ib)
+{
+	struct msg *m;
+
+	if (!ib->cells)
+		return;
+
+	while ((m = inbox_pop(ib)))
+		msg_unref(m);
+
+	free(ib->cells);
+	ib->cells = NULL;
+}
+
+int
+inbox_push(struct inbox *ib, struct msg *m)
+{
+	uint64_t pos = __atomic_load_n(&ib->enq, __ATOMIC_RELAXED), seq;
+	struct inbox_cell *cell;
+	int64_t dif;
+
+	for (;;) {
+		cell = &ib->cells[pos & ib->mask];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		dif = (int64_t)(seq - pos);
+
+		if (!dif) {
+			if (__atomic_compare_exchange_n(&ib->enq, &pos, pos + 1,
+							1, __ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+			/* pos was reloaded by the failed CAS */
+		} else if (dif < 0)
+			return 1; /* the consumer has not freed this cell yet */
+		else
+			pos = __atomic_load_n(&ib->enq, __ATOMIC_RELAXED);
+	}
+
+	cell->msg = m;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+struct msg *
+inbox_pop(struct inbox *ib)
+{
+	struct inbox_cell *cell = &ib->cells[ib->deq & ib->mask];
+	struct msg *m;
+
+	if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != ib->deq + 1)
+		return NULL;
+
+	m = cell->msg;
+	cell->msg = NULL;
+	__atomic_store_n(&cell->seq, ib->deq + ib->mask + 1, __ATOMIC_RELEASE);
+	ib->deq++;
+
+	return m;
+}
@@ -0,0 +1,50 @@
+/*
+ * cross-thread message inbox for the "lws-minimal" protocol
+ *
+ * When the server runs several lws service threads, a message received on
+ * one thread is handed to every other thread through that thread's inbox.
+ * The inbox is a bounded lock-free queue: any thread may push, only the
+ * service thread owning the inbox pops.  Each pushed message carries a
+ * reference that the popper takes over.
+ */
+
+#if !defined(__INBOX_H__)
+#define __INBOX_H__
+
+#include <stdint.h>
+
+#include "broadcast_ring.h"
+
+struct inbox_cell {
+	uint64_t seq;		/* which lap of the ring this cell is ready for */
+	struct msg *msg;
+};
+
+struct inbox {
+	struct inbox_cell *cells;
+	uint32_t mask;
+
+	uint64_t enq;		/* next push position, shared by producers */
+	char pad[64 - sizeof(uint64_t)]; /* keep the consumer's line apart */
+	uint64_t deq;		/* next pop position, owning thread only */
+};
+
+int
+inbox_init(struct inbox *ib, uint32_t size);
+
+/* drops the references still queued */
+
+void
+inbox_destroy(struct inbox *ib);
+
+/* any thread.  Returns 0 if queued, or 1 if the inbox is full */
+
+int
+inbox_push(struct inbox *ib, struct msg *m);
+
+/* owning thread only.  NULL if empty */
+
+struct msg *
+inbox_pop(struct inbox *ib);
+
+#endif
@@ -0,0 +1,105 @@
+/*
+ * latency histogram for the "lws-minimal" protocol
+ *
+ * Bucket i < 16 counts the value i.  Above that, a value whose top set bit
+ * is e counts in bucket (e - 3) * 16 + the next 4 bits below e, the bucket
+ * covering 2^(e - 4) values.
+ */
+
+#include "lat_hist.h"
+
+#include <string.h>
+
+static int
+__lat_hist_bucket(uint64_t v)
+{
+	int e;
+
+	if (v < LAT_HIST_SUB)
+		return (int)v;
+
+	e = 63 - __builtin_clzll(v);
+
+	return (e - LAT_HIST_SUB_BITS + 1) * LAT_HIST_SUB +
+	       (int)((v >> (e - LAT_HIST_SUB_BITS)) & (LAT_HIST_SUB - 1));
+}
+
+/* the highest value counted in bucket i */
+
+static uint64_t
+__lat_hist_highest(int i)
+{
+	int shift;
+
+	if (i < LAT_HIST_SUB)
+		return (uint64_t)i;
+
+	shift = i / LAT_HIST_SUB - 1;
+
+	return (((uint64_t)(LAT_HIST_SUB + i % LAT_HIST_SUB) + 1) << shift) - 1;
+}
+
+void
+lat_hist_record(struct lat_hist *h, uint64_t value)
+{
+	uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+	__atomic_add_fetch(&h->counts[__lat_hist_bucket(value)], 1,
+			   __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+
+	while (value > max &&
+	       !__atomic_compare_exchange_n(&h->max, &max, value, 1,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+void
+lat_hist_merge(struct lat_hist *dst, const struct lat_hist *src)
+{
+	uint64_t c, max;
+	int n;
+
+	for (n = 0; n < LAT_HIST_BUCKETS; n++) {
+		c = __atomic_load_n(&src->counts[n], __ATOMIC_RELAXED);
+		if (c)
+			dst->counts[n] += c;
+	}
+
+	dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+	if (max > dst->max)
+		dst->max = max;
+}
+
+uint64_t
+lat_hist_quantile(const struct lat_hist *h, double q)
+{
+	uint64_t want, seen = 0, total = 0, max;
+	int n;
+
+	/* count the buckets themselves, count may be ahead of them */
+	for (n = 0; n < LAT_HIST_BUCKETS; n++)
+		total += __atomic_load_n(&h->counts[n], __ATOMIC_RELAXED);
+	if (!total)
+		return 0;
+
+	want = (uint64_t)(q * (double)total + 0.5);
+	if (!want)
+		want = 1;
+	if (want > total)
+		want = total;
+
+	for (n = 0; n < LAT_HIST_BUCKETS; n++) {
+		seen += __atomic_load_n(&h->counts[n], __ATOMIC_RELAXED);
+		if (seen >= want)
+			break;
+	}
+
+	/* no need to round up past the biggest value we saw */
+	max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	if (max && __lat_hist_highest(n) > max)
+		return max;
+
+	return __lat_hist_highest(n);
+}
@@ -0,0 +1,45 @@
+/*
+ * latency histogram for the "lws-minimal" protocol
+ *
+ * Values are bucketed HDR-style: exactly below 16, then 16 linear buckets
+ * per power of two, so any value is counted within 1/16th of itself and
+ * the whole 64-bit range fits in under a thousand counters.
+ *
+ * Recording is lock-free, a relaxed atomic add on the value's bucket, so
+ * one thread can record while others merge or read quantiles.  Give each
+ * recording thread its own histogram and merge them to read them, then no
+ * cache line is shared on the recording path.
+ */
+
+#if !defined(__LAT_HIST_H__)
+#define __LAT_HIST_H__
+
+#include <stdint.h>
+
+#define LAT_HIST_SUB_BITS 4
+#define LAT_HIST_SUB (1 << LAT_HIST_SUB_BITS)
+#define LAT_HIST_BUCKETS ((64 - LAT_HIST_SUB_BITS + 1) * LAT_HIST_SUB)
+
+struct lat_hist {
+	uint64_t counts[LAT_HIST_BUCKETS];
+	uint64_t count;
+	uint64_t max;
+};
+
+void
+lat_hist_record(struct lat_hist *h, uint64_t value);
+
+/* adds src's counts to dst, src may be recorded to meanwhile */
+
+void
+lat_hist_merge(struct lat_hist *dst, const struct lat_hist *src);
+
+/*
+ * The value at quantile q (0 - 1), the highest value counted alike with
+ * it, or 0 if nothing was recorded
+ */
+
+uint64_t
+lat_hist_quantile(const struct lat_hist *h, double q);
+
+#endif
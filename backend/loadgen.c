@@ -0,0 +1,608 @@
+/*
+ * im-loadgen - puts realistic load on lws-minimal-ws-server
+ *
+ * Opens many client connections from one lws event loop, all in the same
+ * room, and sends chat frames round-robin over them at a fixed total rate
+ * with the chosen size distribution.  Every connection gets a copy of every
+ * message, so each frame sent measures the server's whole fanout.
+ *
+ * Each frame carries the monotonic time it was sent at the start of its
+ * content.  Senders and receivers are all in this process, so when a copy
+ * comes back the difference is its one-way latency through the server.
+ *
+ * At the end the server is asked for its own fanout latencies with a stats
+ * frame, then connect times, throughput and latencies are reported.
+ */
+
+#include <libwebsockets.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if !defined(WIN32)
+#include <sys/time.h>
+#endif
+
+#include "lat_hist.h"
+
+#define LG_TICK_US 5000 /* how often sends are handed out */
+#define LG_CONNECT_TICK_US 10000
+#define LG_REPORT_US LWS_US_PER_SEC
+#define LG_DRAIN_US (2 * LWS_US_PER_SEC) /* wait for copies in flight */
+#define LG_MAX_SIZE (64 * 1024)
+/* "<ns>:" at the start of the content */
+#define LG_STAMP_LEN 21
+
+/* these match the server's frame types */
+#define LG_MSG_CHAT 0
+#define LG_MSG_JOIN 1
+#define LG_MSG_STATS 6
+
+enum lg_size_dist {
+	LG_SIZE_FIXED,
+	LG_SIZE_UNIFORM, /* 1 .. 2 * size - 1 */
+	LG_SIZE_EXP, /* exponential around size, a few big ones */
+};
+
+enum lg_phase {
+	LG_CONNECTING,
+	LG_SENDING,
+	LG_DRAINING,
+	LG_STATS,
+};
+
+/* one of these for each connection we make */
+
+struct lg_conn {
+	lws_sorted_usec_list_t sul; /* starts the connection */
+	struct lws *wsi;
+	int idx;
+	uint64_t connect_start; /* ns */
+	uint32_t pending; /* messages due to go out on us */
+	char established;
+	char stats_pending;
+};
+
+static struct lg {
+	struct lws_context *context;
+	struct lg_conn *conns;
+
+	/* options */
+	const char *address;
+	const char *room;
+	int port;
+	int count_conns;
+	int connect_rate; /* connections started per second */
+	uint32_t rate; /* messages per second, over all connections */
+	uint32_t size; /* typical content bytes */
+	enum lg_size_dist dist;
+	int duration; /* seconds of sending */
+
+	lws_sorted_usec_list_t sul_connect, sul_tick, sul_report, sul_phase;
+	enum lg_phase phase;
+	int next_connect;
+	int next_send; /* round-robin over the connections */
+	uint64_t send_start, send_end; /* ns */
+	uint64_t scheduled; /* messages handed out so far */
+	uint32_t rng;
+
+	int established, failed, closed;
+	uint64_t sent, sent_bytes, received, received_bytes;
+	uint64_t last_sent, last_received;
+
+	struct lat_hist connect; /* ns from connect to established */
+	struct lat_hist latency; /* ns from send to each copy coming back */
+	char server_stats[256];
+} lg;
+
+static unsigned char frame[LWS_PRE + LG_MAX_SIZE + 256];
+static int interrupted;
+
+static uint64_t
+lg_now_ns(void)
+{
+#if defined(WIN32)
+	return (uint64_t)lws_now_usecs() * 1000;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static uint64_t
+lg_wall_us(void)
+{
+#if defined(WIN32)
+	return (uint64_t)time(NULL) * 1000000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_usec;
+#endif
+}
+
+/* xorshift32, plenty for picking sizes */
+static uint32_t
+lg_rand(void)
+{
+	lg.rng ^= lg.rng << 13;
+	lg.rng ^= lg.rng >> 17;
+	lg.rng ^= lg.rng << 5;
+
+	return lg.rng;
+}
+
+static uint32_t
+lg_pick_size(void)
+{
+	double u;
+	uint32_t n;
+
+	switch (lg.dist) {
+	case LG_SIZE_UNIFORM:
+		n = 1 + lg_rand() % (2 * lg.size - 1);
+		break;
+	case LG_SIZE_EXP:
+		u = ((double)lg_rand() + 1.0) / 4294967297.0;
+		n = 1 + (uint32_t)(-log(u) * (double)lg.size);
+		break;
+	default:
+		n = lg.size;
+		break;
+	}
+
+	if (n < LG_STAMP_LEN)
+		n = LG_STAMP_LEN;
+
+	return n > LG_MAX_SIZE ? LG_MAX_SIZE : n;
+}
+
+static const uint32_t backoff_ms[] = { 1000, 2000, 3000 };
+
+static const lws_retry_bo_t retry = {
+	.retry_ms_table			= backoff_ms,
+	.retry_ms_table_count		= LWS_ARRAY_SIZE(backoff_ms),
+	.conceal_count			= LWS_ARRAY_SIZE(backoff_ms),
+
+	.secs_since_valid_ping		= 30,
+	.secs_since_valid_hangup	= 60,
+
+	.jitter_percent			= 20,
+};
+
+static void
+lg_connect(lws_sorted_usec_list_t *sul)
+{
+	struct lg_conn *c = lws_container_of(sul, struct lg_conn, sul);
+	struct lws_client_connect_info i;
+
+	memset(&i, 0, sizeof(i));
+
+	i.context = lg.context;
+	i.port = lg.port;
+	i.address = lg.address;
+	i.path = "/";
+	i.host = i.address;
+	i.origin = i.address;
+	i.protocol = "lws-minimal";
+	i.local_protocol_name = "im-loadgen";
+	i.pwsi = &c->wsi;
+	i.retry_and_idle_policy = &retry;
+	i.opaque_user_data = c;
+
+	c->connect_start = lg_now_ns();
+	if (!lws_client_connect_via_info(&i)) {
+		lg.failed++;
+		c->wsi = NULL;
+	}
+}
+
+/* start the next batch of connections, connect_rate of them a second */
+static void
+lg_connect_tick(lws_sorted_usec_list_t *sul)
+{
+	int n = lg.connect_rate / (int)(LWS_US_PER_SEC / LG_CONNECT_TICK_US);
+
+	if (n < 1)
+		n = 1;
+
+	while (n-- && lg.next_connect < lg.count_conns) {
+		lg.conns[lg.next_connect].idx = lg.next_connect;
+		lg_connect(&lg.conns[lg.next_connect++].sul);
+	}
+
+	if (lg.next_connect < lg.count_conns)
+		lws_sul_schedule(lg.context, 0, &lg.sul_connect,
+				 lg_connect_tick, LG_CONNECT_TICK_US);
+}
+
+/* hand out the messages that are due since the last tick */
+static void
+lg_send_tick(lws_sorted_usec_list_t *sul)
+{
+	uint64_t due = (lg_now_ns() - lg.send_start) * lg.rate / 1000000000;
+	struct lg_conn *c = NULL;
+	int tries;
+
+	if (lg.phase != LG_SENDING)
+		return;
+
+	while (lg.scheduled < due) {
+		/* find the next connection that is up */
+		for (tries = 0; tries < lg.count_conns; tries++) {
+			c = &lg.conns[lg.next_send];
+			lg.next_send = (lg.next_send + 1) % lg.count_conns;
+			if (c->established)
+				break;
+		}
+		if (tries == lg.count_conns) {
+			/* nobody to send on, don't build up a backlog */
+			lg.scheduled = due;
+			break;
+		}
+
+		c->pending++;
+		lws_callback_on_writable(c->wsi);
+		lg.scheduled++;
+	}
+
+	lws_sul_schedule(lg.context, 0, &lg.sul_tick, lg_send_tick,
+			 LG_TICK_US);
+}
+
+static void
+lg_report(lws_sorted_usec_list_t *sul)
+{
+	printf("[%4llus] conns %d/%d (%d failed, %d closed)  sent %llu/s  "
+	       "received %llu/s  latency p50 %.3fms p99 %.3fms\n",
+	       (unsigned long long)((lg_now_ns() - lg.send_start) /
+				    1000000000),
+	       lg.established, lg.count_conns, lg.failed, lg.closed,
+	       (unsigned long long)(lg.sent - lg.last_sent),
+	       (unsigned long long)(lg.received - lg.last_received),
+	       (double)lat_hist_quantile(&lg.latency, 0.5) / 1e6,
+	       (double)lat_hist_quantile(&lg.latency, 0.99) / 1e6);
+	fflush(stdout);
+
+	lg.last_sent = lg.sent;
+	lg.last_received = lg.received;
+
+	lws_sul_schedule(lg.context, 0, &lg.sul_report, lg_report,
+			 LG_REPORT_US);
+}
+
+/* sending for the duration, then draining, then asking the server */
+static void
+lg_next_phase(lws_sorted_usec_list_t *sul)
+{
+	int n;
+
+	switch (lg.phase) {
+	case LG_CONNECTING:
+		lg.phase = LG_SENDING;
+		lg.send_start = lg_now_ns();
+		lg_send_tick(&lg.sul_tick);
+		lws_sul_schedule(lg.context, 0, &lg.sul_report, lg_report,
+				 LG_REPORT_US);
+		lws_sul_schedule(lg.context, 0, &lg.sul_phase, lg_next_phase,
+				 (lws_usec_t)lg.duration * LWS_US_PER_SEC);
+		return;
+
+	case LG_SENDING:
+		lg.phase = LG_DRAINING;
+		lg.send_end = lg_now_ns();
+		lws_sul_schedule(lg.context, 0, &lg.sul_phase, lg_next_phase,
+				 LG_DRAIN_US);
+		return;
+
+	case LG_DRAINING:
+		lg.phase = LG_STATS;
+		for (n = 0; n < lg.count_conns; n++)
+			if (lg.conns[n].established) {
+				lg.conns[n].stats_pending = 1;
+				lws_callback_on_writable(lg.conns[n].wsi);
+				break;
+			}
+		/* give the server a second to answer */
+		lws_sul_schedule(lg.context, 0, &lg.sul_phase, lg_next_phase,
+				 LWS_US_PER_SEC);
+		return;
+
+	case LG_STATS:
+		interrupted = 1;
+		lws_cancel_service(lg.context);
+		return;
+	}
+}
+
+/* "0|<wall us>|lg<idx>|<mono ns>:xxx...|<room>" */
+static int
+lg_write(struct lws *wsi, struct lg_conn *c)
+{
+	unsigned char *p = &frame[LWS_PRE];
+	uint32_t size = lg_pick_size();
+	int n, m;
+
+	n = lws_snprintf((char *)p, 128, "%d|%llu|lg%d|%020llu:",
+			 LG_MSG_CHAT, (unsigned long long)lg_wall_us(),
+			 c->idx, (unsigned long long)lg_now_ns());
+	memset(p + n, 'x', size - LG_STAMP_LEN);
+	n += (int)(size - LG_STAMP_LEN);
+	n += lws_snprintf((char *)p + n, 128, "|%s", lg.room);
+
+	m = lws_write(wsi, p, (size_t)n, LWS_WRITE_TEXT);
+	if (m < 0)
+		return -1;
+
+	lg.sent++;
+	lg.sent_bytes += (uint64_t)n;
+
+	return 0;
+}
+
+/*
+ * A copy of one of our chat frames came back, how long did it take.  The
+ * history sent on joining may hold frames from earlier runs, those are
+ * older than our sending and not counted.
+ */
+static void
+lg_received(const char *in, size_t len)
+{
+	const char *p = in, *end = in + len;
+	uint64_t sent = 0;
+	int bars = 0;
+
+	if (len < 2 || in[0] != '0' + LG_MSG_CHAT || in[1] != '|')
+		return;
+
+	/* skip to the content */
+	while (p < end && bars < 3)
+		if (*p++ == '|')
+			bars++;
+	if (bars < 3)
+		return;
+
+	while (p < end && *p >= '0' && *p <= '9')
+		sent = sent * 10 + (uint64_t)(*p++ - '0');
+	if (p == end || *p != ':' || !lg.send_start || sent < lg.send_start)
+		return;
+
+	lg.received++;
+	lat_hist_record(&lg.latency, lg_now_ns() - sent);
+}
+
+static int
+callback_loadgen(struct lws *wsi, enum lws_callback_reasons reason,
+		 void *user, void *in, size_t len)
+{
+	struct lg_conn *c = (struct lg_conn *)lws_get_opaque_user_data(wsi);
+	unsigned char buf[LWS_PRE + 128];
+	int n;
+
+	switch (reason) {
+	case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+		lwsl_info("%s: connection error: %s\n", __func__,
+			  in ? (char *)in : "(null)");
+		lg.failed++;
+		if (c)
+			c->wsi = NULL;
+		break;
+
+	case LWS_CALLBACK_CLIENT_ESTABLISHED:
+		c->established = 1;
+		lg.established++;
+		lat_hist_record(&lg.connect, lg_now_ns() - c->connect_start);
+
+		if (*lg.room) {
+			/* everybody starts in the lobby, go to our room */
+			n = lws_snprintf((char *)buf + LWS_PRE, sizeof(buf) - LWS_PRE,
+					 "%d|0|lg%d|%s|", LG_MSG_JOIN, c->idx,
+					 lg.room);
+			if (lws_write(wsi, buf + LWS_PRE, (size_t)n,
+				      LWS_WRITE_TEXT) < 0)
+				return -1;
+		}
+
+		if (lg.established == lg.count_conns &&
+		    lg.phase == LG_CONNECTING) {
+			lws_sul_cancel(&lg.sul_phase);
+			lg_next_phase(&lg.sul_phase);
+		}
+		break;
+
+	case LWS_CALLBACK_CLIENT_RECEIVE:
+		lg.received_bytes += len;
+		if (!lws_is_first_fragment(wsi))
+			break;
+
+		if (len > 2 && ((const char *)in)[0] == '0' + LG_MSG_STATS &&
+		    ((const char *)in)[1] == '|') {
+			lws_snprintf(lg.server_stats, sizeof(lg.server_stats),
+				     "%.*s", (int)len, (const char *)in);
+			break;
+		}
+
+		lg_received((const char *)in, len);
+		break;
+
+	case LWS_CALLBACK_CLIENT_WRITEABLE:
+		if (c->stats_pending) {
+			c->stats_pending = 0;
+			n = lws_snprintf((char *)buf + LWS_PRE, 32, "%d|0|lg%d||",
+					 LG_MSG_STATS, c->idx);
+			if (lws_write(wsi, buf + LWS_PRE, (size_t)n,
+				      LWS_WRITE_TEXT) < 0)
+				return -1;
+			break;
+		}
+
+		if (!c->pending)
+			break;
+		c->pending--;
+		if (lg_write(wsi, c))
+			return -1;
+		if (c->pending)
+			lws_callback_on_writable(wsi);
+		break;
+
+	case LWS_CALLBACK_CLIENT_CLOSED:
+		if (c->established)
+			lg.established--;
+		c->established = 0;
+		c->wsi = NULL;
+		lg.closed++;
+		break;
+
+	default:
+		break;
+	}
+
+	return lws_callback_http_dummy(wsi, reason, user, in, len);
+}
+
+static const struct lws_protocols protocols[] = {
+	{ "im-loadgen", callback_loadgen, 0, 0, 0, NULL, 0 },
+	LWS_PROTOCOL_LIST_TERM
+};
+
+static void
+lg_print_hist(const char *what, struct lat_hist *h)
+{
+	printf("%-10s p50 %.3fms  p90 %.3fms  p99 %.3fms  p999 %.3fms  "
+	       "max %.3fms  (%llu samples)\n", what,
+	       (double)lat_hist_quantile(h, 0.5) / 1e6,
+	       (double)lat_hist_quantile(h, 0.9) / 1e6,
+	       (double)lat_hist_quantile(h, 0.99) / 1e6,
+	       (double)lat_hist_quantile(h, 0.999) / 1e6,
+	       (double)h->max / 1e6, (unsigned long long)h->count);
+}
+
+static void
+lg_final_report(double secs)
+{
+	printf("\n%d connections to %s:%d, %d failed, %d closed early\n",
+	       lg.count_conns, lg.address, lg.port, lg.failed, lg.closed);
+	lg_print_hist("connect", &lg.connect);
+	printf("sent      %llu messages, %.0f/s, %.2f MB/s\n",
+	       (unsigned long long)lg.sent, (double)lg.sent / secs,
+	       (double)lg.sent_bytes / secs / 1e6);
+	printf("received  %llu messages, %.0f/s, %.2f MB/s\n",
+	       (unsigned long long)lg.received, (double)lg.received / secs,
+	       (double)lg.received_bytes / secs / 1e6);
+	lg_print_hist("latency", &lg.latency);
+	if (*lg.server_stats)
+		printf("server    %s\n", lg.server_stats);
+}
+
+void sigint_handler(int sig)
+{
+	interrupted = 1;
+}
+
+int main(int argc, const char **argv)
+{
+	struct lws_context_creation_info info;
+	uint64_t started;
+	const char *p;
+	int n = 0, logs = LLL_USER | LLL_ERR | LLL_WARN;
+
+	signal(SIGINT, sigint_handler);
+
+	if ((p = lws_cmdline_option(argc, argv, "-d")))
+		logs = atoi(p);
+	lws_set_log_level(logs, NULL);
+
+	lg.address = "localhost";
+	lg.port = 7681;
+	lg.room = "";
+	lg.count_conns = 100;
+	lg.connect_rate = 1000;
+	lg.rate = 100;
+	lg.size = 64;
+	lg.duration = 10;
+	lg.rng = 2463534242u;
+
+	if ((p = lws_cmdline_option(argc, argv, "--server")))
+		lg.address = p;
+	if ((p = lws_cmdline_option(argc, argv, "--port")))
+		lg.port = atoi(p);
+	if ((p = lws_cmdline_option(argc, argv, "--room")))
+		lg.room = p;
+	if ((p = lws_cmdline_option(argc, argv, "-c")))
+		lg.count_conns = atoi(p);
+	if ((p = lws_cmdline_option(argc, argv, "--connect-rate")))
+		lg.connect_rate = atoi(p);
+	if ((p = lws_cmdline_option(argc, argv, "-r")))
+		lg.rate = (uint32_t)atoi(p);
+	if ((p = lws_cmdline_option(argc, argv, "--size")))
+		lg.size = (uint32_t)atoi(p);
+	if ((p = lws_cmdline_option(argc, argv, "-t")))
+		lg.duration = atoi(p);
+	if ((p = lws_cmdline_option(argc, argv, "--size-dist"))) {
+		if (!strcmp(p, "uniform"))
+			lg.dist = LG_SIZE_UNIFORM;
+		else if (!strcmp(p, "exp"))
+			lg.dist = LG_SIZE_EXP;
+		else if (strcmp(p, "fixed")) {
+			lwsl_err("--size-dist is fixed, uniform or exp\n");
+			return 1;
+		}
+	}
+
+	if (lg.count_conns < 1 || lg.connect_rate < 1 || !lg.rate ||
+	    !lg.size || lg.size > LG_MAX_SIZE || lg.duration < 1 ||
+	    strlen(lg.room) > 64) {
+		lwsl_err("bad options\n");
+		return 1;
+	}
+
+	lg.conns = calloc((size_t)lg.count_conns, sizeof(*lg.conns));
+	if (!lg.conns)
+		return 1;
+
+	lwsl_user("im-loadgen: %d connections to %s:%d, %u msg/s of ~%u bytes "
+		  "for %ds\n", lg.count_conns, lg.address, lg.port, lg.rate,
+		  lg.size, lg.duration);
+
+	memset(&info, 0, sizeof info);
+	info.port = CONTEXT_PORT_NO_LISTEN;
+	info.protocols = protocols;
+	/* one event loop for all of them */
+	info.fd_limit_per_thread = 1 + (unsigned int)lg.count_conns + 16;
+
+	lg.context = lws_create_context(&info);
+	if (!lg.context) {
+		lwsl_err("lws init failed\n");
+		free(lg.conns);
+		return 1;
+	}
+
+	started = lg_now_ns();
+	lg_connect_tick(&lg.sul_connect);
+	/* start sending once everybody is up, or after a while anyway */
+	lws_sul_schedule(lg.context, 0, &lg.sul_phase, lg_next_phase,
+			 (lws_usec_t)(lg.count_conns / lg.connect_rate + 5) *
+			 LWS_US_PER_SEC);
+
+	while (n >= 0 && !interrupted)
+		n = lws_service(lg.context, 0);
+
+	/* rates are over the time we were sending */
+	if (!lg.send_start)
+		lg.send_start = started;
+	if (!lg.send_end)
+		lg.send_end = lg_now_ns();
+	lg_final_report((double)(lg.send_end - lg.send_start) / 1e9);
+
+	lws_context_destroy(lg.context);
+	free(lg.conns);
+
+	return 0;
+}
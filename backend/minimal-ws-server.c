@@ -17,6 +17,15 @@
 #include <libwebsockets.h>
 #include <string.h>
 #include <signal.h>
+#if LWS_MAX_SMP > 1
+#include <pthread.h>
+#endif
+#if !defined(WIN32)
+#include <errno.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#endif
 
 #define LWS_PLUGIN_STATIC
 #include "protocol_lws_minimal.c"
@@ -24,17 +33,43 @@
 static struct lws_protocols protocols[] = {
 	{ "http", lws_callback_http_dummy, 0, 0, 0, NULL, 0},
 	LWS_PLUGIN_PROTOCOL_MINIMAL,
+	LWS_PLUGIN_PROTOCOL_MINIMAL_BIN,
+	LWS_PLUGIN_PROTOCOL_MINIMAL_METRICS,
 	LWS_PROTOCOL_LIST_TERM
 };
 
+#if !defined(LWS_WITHOUT_EXTENSIONS)
+/* offered to clients that ask, tuned per connection by the deflate- pvos */
+static const struct lws_extension extensions[] = {
+	{
+		"permessage-deflate",
+		lws_extension_callback_pm_deflate,
+		"permessage-deflate"
+		 "; client_no_context_takeover"
+		 "; client_max_window_bits"
+	},
+	{ NULL, NULL, NULL /* terminator */ }
+};
+#endif
+
 static const lws_retry_bo_t retry = {
 	.secs_since_valid_ping = 3,
 	.secs_since_valid_hangup = 10,
 };
 
+static struct lws_context *context;
 static int interrupted;
 
+/* live counters for Prometheus, see __minimal_metrics() */
+static const struct lws_http_mount mount_metrics = {
+	.mountpoint		= "/metrics",		/* mountpoint URL */
+	.origin			= "lws-minimal-metrics", /* protocol */
+	.origin_protocol	= LWSMPRO_CALLBACK,	/* dynamic */
+	.mountpoint_len		= 8,			/* char count */
+};
+
 static const struct lws_http_mount mount = {
+	.mount_next		= &mount_metrics,	/* linked-list "next" */
 	.mountpoint		= "/",			/* mountpoint URL */
 	.origin			= "./mount-origin",	/* serve from dir */
 	.def			= "index.html",		/* default filename */
@@ -42,22 +77,277 @@ static const struct lws_http_mount mount = {
 	.mountpoint_len		= 1,			/* char count */
 };
 
-#if defined(LWS_WITH_PLUGINS)
+/* per-vhost options for the lws-minimal protocol, filled from the cmdline */
+static struct lws_protocol_vhost_options pvo_log_writer = {
+	NULL, NULL, "log-writer", "1"
+};
+static struct lws_protocol_vhost_options pvo_log_recover = {
+	&pvo_log_writer, NULL, "log-recover", "10000"
+};
+static struct lws_protocol_vhost_options pvo_log_sync_ms = {
+	&pvo_log_recover, NULL, "log-sync-ms", "50"
+};
+static struct lws_protocol_vhost_options pvo_log_dir = {
+	&pvo_log_sync_ms, NULL, "log-dir", ""
+};
+static struct lws_protocol_vhost_options pvo_deflate_no_takeover = {
+	&pvo_log_dir, NULL, "deflate-no-context-takeover", "0"
+};
+static struct lws_protocol_vhost_options pvo_deflate_window_bits = {
+	&pvo_deflate_no_takeover, NULL, "deflate-window-bits", "15"
+};
+static struct lws_protocol_vhost_options pvo_deflate_mem_level = {
+	&pvo_deflate_window_bits, NULL, "deflate-mem-level", "8"
+};
+static struct lws_protocol_vhost_options pvo_deflate_level = {
+	&pvo_deflate_mem_level, NULL, "deflate-level", "1"
+};
+static struct lws_protocol_vhost_options pvo_evict_policy = {
+	&pvo_deflate_level, NULL, "evict-policy", "skip"
+};
+static struct lws_protocol_vhost_options pvo_mem_budget_mb = {
+	&pvo_evict_policy, NULL, "mem-budget-mb", "256"
+};
+static struct lws_protocol_vhost_options pvo_client_max_bytes = {
+	&pvo_mem_budget_mb, NULL, "client-max-bytes", "1048576"
+};
+static struct lws_protocol_vhost_options pvo_max_message = {
+	&pvo_client_max_bytes, NULL, "max-message", "262144"
+};
+static struct lws_protocol_vhost_options pvo_coalesce_ms = {
+	&pvo_max_message, NULL, "coalesce-ms", "0"
+};
+static struct lws_protocol_vhost_options pvo_admit_max_wait_ms = {
+	&pvo_coalesce_ms, NULL, "admit-max-wait-ms", "5000"
+};
+static struct lws_protocol_vhost_options pvo_admit_burst = {
+	&pvo_admit_max_wait_ms, NULL, "admit-burst", "0"
+};
+static struct lws_protocol_vhost_options pvo_admit_rate = {
+	&pvo_admit_burst, NULL, "admit-rate", "0"
+};
+static struct lws_protocol_vhost_options pvo_room_idle_s = {
+	&pvo_admit_rate, NULL, "room-idle-s", "0"
+};
+static struct lws_protocol_vhost_options pvo_client_max_rooms = {
+	&pvo_room_idle_s, NULL, "client-max-rooms", "16"
+};
+static struct lws_protocol_vhost_options pvo_max_rooms = {
+	&pvo_client_max_rooms, NULL, "max-rooms", "1024"
+};
+static struct lws_protocol_vhost_options pvo_join_history = {
+	&pvo_max_rooms, NULL, "join-history", "20"
+};
+static struct lws_protocol_vhost_options pvo_replay_quantum = {
+	&pvo_join_history, NULL, "replay-quantum", "65536"
+};
+static struct lws_protocol_vhost_options pvo_history_bytes = {
+	&pvo_replay_quantum, NULL, "history-bytes", "1048576"
+};
+static struct lws_protocol_vhost_options pvo_history_messages = {
+	&pvo_history_bytes, NULL, "history-messages", "50"
+};
+static struct lws_protocol_vhost_options pvo_slow_policy = {
+	&pvo_history_messages, NULL, "slow-policy", "drop"
+};
+static struct lws_protocol_vhost_options pvo_ring_size = {
+	&pvo_slow_policy, NULL, "ring-size", "4096"
+};
+
 /* if plugins enabled, only protocols explicitly named in pvo bind to vhost */
-static struct lws_protocol_vhost_options pvo = { NULL, NULL, "lws-minimal", "" };
-#endif
+static struct lws_protocol_vhost_options pvo = {
+	NULL, &pvo_ring_size, "lws-minimal", ""
+};
 
 void sigint_handler(int sig)
 {
 	interrupted = 1;
 }
 
+#define MAX_WORKERS 64
+
+#if !defined(WIN32)
+/* the workers' shm_bus carries every room, so it's sized on its own */
+static uint32_t bus_messages = 16384, bus_bytes = 16 * 1024 * 1024;
+#endif
+
+#if LWS_MAX_SMP > 1
+static void *
+thread_service(void *threadid)
+{
+	while (lws_service_tsi(context, 0,
+			       (int)(lws_intptr_t)threadid) >= 0 &&
+	       !interrupted)
+		;
+
+	/* what we cached of the slabs goes back for the others */
+	slab_thread_flush();
+	pthread_exit(NULL);
+
+	return NULL;
+}
+#endif
+
+/* create the context and service it until we are interrupted */
+
+static int
+run_service(struct lws_context_creation_info *info)
+{
+	int n = 0;
+
+	context = lws_create_context(info);
+	if (!context) {
+		lwsl_err("lws init failed\n");
+		return 1;
+	}
+
+#if LWS_MAX_SMP > 1
+	n = lws_get_count_threads(context);
+	if (n > 1) {
+		pthread_t pts[LWS_MAX_SMP];
+		void *retval;
+		int m;
+
+		lwsl_user("  Service threads: %d\n", n);
+
+		for (m = 0; m < n; m++)
+			if (pthread_create(&pts[m], NULL, thread_service,
+					   (void *)(lws_intptr_t)m)) {
+				lwsl_err("thread creation failed\n");
+				interrupted = 1;
+				n = m;
+				break;
+			}
+
+		for (m = 0; m < n; m++)
+			pthread_join(pts[m], &retval);
+
+		lws_context_destroy(context);
+
+		return 0;
+	}
+	n = 0;
+#endif
+
+	while (n >= 0 && !interrupted)
+		n = lws_service(context, 0);
+
+	lws_context_destroy(context);
+
+	return 0;
+}
+
+#if !defined(WIN32)
+static pid_t
+spawn_worker(struct lws_context_creation_info *info, int idx)
+{
+	pid_t pid = fork();
+
+	if (pid)
+		return pid;
+
+	/* child: a worker with its own listen socket on the shared port */
+	lwsl_user("  Worker %d: pid %d\n", idx, (int)getpid());
+
+	/* they all see every message, one of them is enough to log them */
+	pvo_log_writer.value = idx ? "0" : "1";
+	_exit(run_service(info));
+}
+
+/*
+ * Run count workers, each a whole lws context bound to the same port with
+ * SO_REUSEPORT, so the kernel spreads the connections over them.  They
+ * share history and live messages through a shm_bus made here before they
+ * fork.  A worker that dies is restarted on its own, the others and their
+ * connections carry on.
+ */
+
+static int
+run_workers(struct lws_context_creation_info *info, int count)
+{
+	pid_t pids[MAX_WORKERS];
+	time_t started[MAX_WORKERS];
+	struct sigaction sa;
+	struct shm_bus *bus;
+	int n, live = 0, st;
+	pid_t pid;
+
+	if (count > MAX_WORKERS) {
+		lwsl_warn("limiting to %d workers\n", MAX_WORKERS);
+		count = MAX_WORKERS;
+	}
+
+	bus = shm_bus_create(bus_messages, bus_bytes,
+			     (uint32_t)atoi(pvo_max_rooms.value));
+	if (!bus) {
+		lwsl_err("unable to create shared history\n");
+		return 1;
+	}
+
+	info->user = bus;
+	info->options |= LWS_SERVER_OPTION_ALLOW_LISTEN_SHARE;
+
+	/* no SA_RESTART, so SIGINT gets us out of wait() */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigint_handler;
+	sigaction(SIGINT, &sa, NULL);
+
+	for (n = 0; n < count; n++) {
+		pids[n] = spawn_worker(info, n);
+		started[n] = time(NULL);
+		if (pids[n] > 0)
+			live++;
+	}
+
+	while (live) {
+		pid = wait(&st);
+		if (pid < 0) {
+			if (errno != EINTR)
+				break;
+			if (!interrupted)
+				continue;
+			/* pass it on, then reap them as they exit */
+			for (n = 0; n < count; n++)
+				if (pids[n] > 0)
+					kill(pids[n], SIGINT);
+			continue;
+		}
+
+		for (n = 0; n < count; n++)
+			if (pids[n] == pid)
+				break;
+		if (n == count)
+			continue;
+
+		pids[n] = 0;
+		live--;
+		if (interrupted)
+			continue;
+
+		lwsl_warn("worker %d (pid %d) died with status 0x%x, restarting\n",
+			  n, (int)pid, st);
+
+		/* don't spin if it dies straight away */
+		if (time(NULL) - started[n] < 1)
+			sleep(1);
+
+		pids[n] = spawn_worker(info, n);
+		started[n] = time(NULL);
+		if (pids[n] > 0)
+			live++;
+	}
+
+	shm_bus_destroy(bus);
+
+	return 0;
+}
+#endif
+
 int main(int argc, const char **argv)
 {
 	struct lws_context_creation_info info;
-	struct lws_context *context;
 	const char *p;
-	int n = 0, logs = LLL_USER | LLL_ERR | LLL_WARN | LLL_NOTICE
+	int logs = LLL_USER | LLL_ERR | LLL_WARN | LLL_NOTICE
 			/* for LLL_ verbosity above NOTICE to be built into lws,
 			 * lws must have been configured and built with
 			 * -DCMAKE_BUILD_TYPE=DEBUG instead of =RELEASE */
@@ -78,9 +368,82 @@ int main(int argc, const char **argv)
 	info.mounts = &mount;
 	info.protocols = protocols;
 	info.vhost_name = "localhost";
-#if defined(LWS_WITH_PLUGINS)
 	info.pvo = &pvo;
+
+	if ((p = lws_cmdline_option(argc, argv, "--ring-size")))
+		pvo_ring_size.value = p;
+
+	if ((p = lws_cmdline_option(argc, argv, "--slow-policy")))
+		pvo_slow_policy.value = p;
+
+	if ((p = lws_cmdline_option(argc, argv, "--history-messages")))
+		pvo_history_messages.value = p;
+
+	if ((p = lws_cmdline_option(argc, argv, "--history-bytes")))
+		pvo_history_bytes.value = p;
+
+	if ((p = lws_cmdline_option(argc, argv, "--replay-quantum")))
+		pvo_replay_quantum.value = p;
+
+	if ((p = lws_cmdline_option(argc, argv, "--join-history")))
+		pvo_join_history.value = p;
+	if ((p = lws_cmdline_option(argc, argv, "--max-message")))
+		pvo_max_message.value = p;
+	if ((p = lws_cmdline_option(argc, argv, "--client-max-bytes")))
+		pvo_client_max_bytes.value = p;
+	if ((p = lws_cmdline_option(argc, argv, "--mem-budget-mb")))
+		pvo_mem_budget_mb.value = p;
+	if ((p = lws_cmdline_option(argc, argv, "--evict-policy")))
+		pvo_evict_policy.value = p;
+	if ((p = lws_cmdline_option(argc, argv, "--coalesce-ms")))
+		pvo_coalesce_ms.value = p;
+	if ((p = lws_cmdline_option(argc, argv, "--admit-rate")))
+		pvo_admit_rate.value = p;
+	if ((p = lws_cmdline_option(argc, argv, "--admit-burst")))
+		pvo_admit_burst.value = p;
+	if ((p = lws_cmdline_option(argc, argv, "--admit-max-wait-ms")))
+		pvo_admit_max_wait_ms.value = p;
+
+	if ((p = lws_cmdline_option(argc, argv, "--max-rooms")))
+		pvo_max_rooms.value = p;
+	if ((p = lws_cmdline_option(argc, argv, "--client-max-rooms")))
+		pvo_client_max_rooms.value = p;
+	if ((p = lws_cmdline_option(argc, argv, "--room-idle-s")))
+		pvo_room_idle_s.value = p;
+
+	if ((p = lws_cmdline_option(argc, argv, "--log-dir")))
+		pvo_log_dir.value = p;
+
+	if ((p = lws_cmdline_option(argc, argv, "--log-sync-ms")))
+		pvo_log_sync_ms.value = p;
+
+	if ((p = lws_cmdline_option(argc, argv, "--log-recover")))
+		pvo_log_recover.value = p;
+
+#if !defined(LWS_WITHOUT_EXTENSIONS)
+	if (!lws_cmdline_option(argc, argv, "--no-deflate"))
+		info.extensions = extensions;
+
+	if ((p = lws_cmdline_option(argc, argv, "--deflate-level")))
+		pvo_deflate_level.value = p;
+
+	if ((p = lws_cmdline_option(argc, argv, "--deflate-mem-level")))
+		pvo_deflate_mem_level.value = p;
+
+	if ((p = lws_cmdline_option(argc, argv, "--deflate-window-bits")))
+		pvo_deflate_window_bits.value = p;
+
+	if (lws_cmdline_option(argc, argv, "--deflate-no-context-takeover"))
+		pvo_deflate_no_takeover.value = "1";
 #endif
+
+	if ((p = lws_cmdline_option(argc, argv, "-t"))) {
+		info.count_threads = (unsigned int)atoi(p);
+		if (info.count_threads > LWS_MAX_SMP)
+			lwsl_warn("lws built with LWS_MAX_SMP %d, "
+				  "limiting service threads\n", LWS_MAX_SMP);
+	}
+
 	info.options =
 		LWS_SERVER_OPTION_HTTP_HEADERS_SECURITY_BEST_PRACTICES_ENFORCE;
 
@@ -99,16 +462,15 @@ int main(int argc, const char **argv)
 	if (lws_cmdline_option(argc, argv, "-v"))
 		info.retry_and_idle_policy = &retry;
 
-	context = lws_create_context(&info);
-	if (!context) {
-		lwsl_err("lws init failed\n");
-		return 1;
-	}
-
-	while (n >= 0 && !interrupted)
-		n = lws_service(context, 0);
-
-	lws_context_destroy(context);
+#if !defined(WIN32)
+	if ((p = lws_cmdline_option(argc, argv, "--bus-messages")))
+		bus_messages = (uint32_t)atoi(p);
+	if ((p = lws_cmdline_option(argc, argv, "--bus-bytes")))
+		bus_bytes = (uint32_t)atoi(p);
+	if ((p = lws_cmdline_option(argc, argv, "--workers")) && atoi(p) > 1)
+		return run_workers(&info, atoi(p));
+#endif
 
-	return 0;
+	return run_service(&info);
 }
+
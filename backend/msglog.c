@@ -0,0 +1,664 @@
+/*
+ * persistent message log for the "lws-minimal" protocol
+ *
+ * See msglog.h.  Each record in a .log is a struct msglog_rec, then the
+ * payload, padded to 8 bytes.  The .idx is made at its full size up front,
+ * entries past the segment's last record read as zero since the file is
+ * sparse, and only the first record can really be at offset 0.
+ */
+
+#include "msglog.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MSGLOG_ALIGN(_n) (((_n) + 7u) & ~(uint64_t)7u)
+#define MSGLOG_MAX_LEN (16u * 1024 * 1024)
+
+struct msglog_rec {
+	uint32_t len;		/* payload length */
+	uint32_t crc;		/* of the payload */
+	uint64_t seq;
+	uint64_t timestamp;
+	uint64_t tag;
+};
+
+static uint32_t crc_table[256];
+
+static void
+__msglog_crc_init(void)
+{
+	uint32_t c;
+	int n, k;
+
+	for (n = 0; n < 256; n++) {
+		c = (uint32_t)n;
+		for (k = 0; k < 8; k++)
+			c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+		crc_table[n] = c;
+	}
+}
+
+static uint32_t
+__msglog_crc(const void *data, size_t len)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	const unsigned char *p = data;
+	uint32_t c = 0xffffffffu;
+
+	pthread_once(&once, __msglog_crc_init);
+
+	while (len--)
+		c = crc_table[(c ^ *p++) & 0xff] ^ (c >> 8);
+
+	return c ^ 0xffffffffu;
+}
+
+static void
+__msglog_path(const struct msglog *l, uint64_t base, const char *ext,
+	      char *path, size_t len)
+{
+	snprintf(path, len, "%s/%020llu.%s", l->dir, (unsigned long long)base,
+		 ext);
+}
+
+static size_t
+__msglog_idx_size(const struct msglog *l)
+{
+	return (size_t)l->seg_records * sizeof(struct msglog_idx);
+}
+
+static void
+__msglog_seg_close(struct msglog *l, struct msglog_seg *seg)
+{
+	if (seg->idx)
+		munmap(seg->idx, __msglog_idx_size(l));
+	if (seg->fd >= 0)
+		close(seg->fd);
+	seg->idx = NULL;
+	seg->fd = -1;
+}
+
+/* is there a whole, intact record for seq at offset */
+
+static int
+__msglog_rec_ok(struct msglog_seg *seg, uint64_t ofs, uint64_t seq,
+		uint64_t file_size, struct msglog_rec *hdr)
+{
+	unsigned char stack[4096], *buf = stack;
+	int ok;
+
+	if (ofs + sizeof(*hdr) > file_size ||
+	    pread(seg->fd, hdr, sizeof(*hdr), (off_t)ofs) != sizeof(*hdr) ||
+	    hdr->seq != seq || hdr->len > MSGLOG_MAX_LEN ||
+	    ofs + sizeof(*hdr) + hdr->len > file_size)
+		return 0;
+
+	if (hdr->len > sizeof(stack)) {
+		buf = malloc(hdr->len);
+		if (!buf)
+			return 0;
+	}
+
+	ok = pread(seg->fd, buf, hdr->len, (off_t)(ofs + sizeof(*hdr))) ==
+							(ssize_t)hdr->len &&
+	     __msglog_crc(buf, hdr->len) == hdr->crc;
+
+	if (buf != stack)
+		free(buf);
+
+	return ok;
+}
+
+/*
+ * Work out how many records the segment holds.  The index entries in use
+ * are a prefix, so find its end with a binary search, then walk back over
+ * any entries whose record didn't make it.  For the newest segment of a
+ * writer, also pick up records that made it to the .log but not the .idx
+ * and cut off anything torn after them.
+ */
+
+static int
+__msglog_seg_recover(struct msglog *l, struct msglog_seg *seg, int newest)
+{
+	uint64_t file_size, ofs;
+	struct msglog_rec hdr;
+	struct stat st;
+	uint32_t lo = 1, hi = l->seg_records, mid, n;
+
+	if (fstat(seg->fd, &st))
+		return 1;
+	file_size = (uint64_t)st.st_size;
+
+	/* entry 0 is always used if the segment has anything in it */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (seg->idx[mid].offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	n = file_size ? lo : 0;
+
+	while (n && !__msglog_rec_ok(seg, seg->idx[n - 1].offset,
+				     seg->base_seq + n - 1, file_size, &hdr))
+		n--;
+
+	seg->count = n;
+	seg->size = n ? seg->idx[n - 1].offset +
+			MSGLOG_ALIGN(sizeof(hdr) + hdr.len) : 0;
+
+	if (!newest || l->readonly)
+		return 0;
+
+	for (ofs = seg->size; seg->count < l->seg_records &&
+	     __msglog_rec_ok(seg, ofs, seg->base_seq + seg->count, file_size,
+			     &hdr); ofs = seg->size) {
+		seg->idx[seg->count].offset = ofs;
+		seg->idx[seg->count].timestamp = hdr.timestamp;
+		seg->count++;
+		seg->size = ofs + MSGLOG_ALIGN(sizeof(hdr) + hdr.len);
+	}
+
+	/* forget index entries past the end, and anything torn */
+	if (seg->count < l->seg_records)
+		memset(&seg->idx[seg->count], 0,
+		       (l->seg_records - seg->count) * sizeof(*seg->idx));
+	if (ftruncate(seg->fd, (off_t)seg->size))
+		return 1;
+
+	return 0;
+}
+
+static int
+__msglog_seg_open(struct msglog *l, struct msglog_seg *seg, uint64_t base,
+		  int create)
+{
+	char path[300];
+	int fd, flags = l->readonly ? O_RDONLY : O_RDWR;
+
+	memset(seg, 0, sizeof(*seg));
+	seg->fd = -1;
+	seg->base_seq = base;
+
+	if (create)
+		flags |= O_CREAT | O_EXCL;
+
+	__msglog_path(l, base, "log", path, sizeof(path));
+	seg->fd = open(path, flags, 0644);
+	if (seg->fd < 0)
+		return 1;
+
+	__msglog_path(l, base, "idx", path, sizeof(path));
+	fd = open(path, flags, 0644);
+	if (fd < 0)
+		goto bail;
+
+	if (create && ftruncate(fd, (off_t)__msglog_idx_size(l))) {
+		close(fd);
+		goto bail;
+	}
+
+	seg->idx = mmap(NULL, __msglog_idx_size(l),
+			PROT_READ | (l->readonly ? 0 : PROT_WRITE), MAP_SHARED,
+			fd, 0);
+	close(fd);
+	if (seg->idx == MAP_FAILED) {
+		seg->idx = NULL;
+		goto bail;
+	}
+
+	return 0;
+
+bail:
+	__msglog_seg_close(l, seg);
+
+	return 1;
+}
+
+static struct msglog_seg *
+__msglog_seg_add(struct msglog *l)
+{
+	struct msglog_seg *segs;
+
+	if (l->count_segs == l->alloc_segs) {
+		segs = realloc(l->segs, (l->alloc_segs ? l->alloc_segs * 2 : 8) *
+				       sizeof(*segs));
+		if (!segs)
+			return NULL;
+		l->segs = segs;
+		l->alloc_segs = l->alloc_segs ? l->alloc_segs * 2 : 8;
+	}
+
+	return &l->segs[l->count_segs];
+}
+
+/*
+ * A segment's .idx is made at its full size before anything is appended,
+ * so one that isn't is being made by the writer, or the writer died making
+ * it, and the segment has no records
+ */
+
+static int
+__msglog_seg_unmade(const struct msglog *l, uint64_t base)
+{
+	char path[300];
+	struct stat st;
+
+	__msglog_path(l, base, "idx", path, sizeof(path));
+
+	return stat(path, &st) || (uint64_t)st.st_size < __msglog_idx_size(l);
+}
+
+static void
+__msglog_seg_unlink(const struct msglog *l, uint64_t base)
+{
+	char path[300];
+
+	__msglog_path(l, base, "log", path, sizeof(path));
+	unlink(path);
+	__msglog_path(l, base, "idx", path, sizeof(path));
+	unlink(path);
+}
+
+static int
+__msglog_cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* find the segments already in the directory, oldest first */
+
+static int
+__msglog_scan(struct msglog *l)
+{
+	uint64_t *bases = NULL, *b;
+	struct msglog_seg *seg;
+	size_t count = 0, alloc = 0, n;
+	struct dirent *de;
+	char *end;
+	DIR *d;
+	int ret = 0;
+
+	d = opendir(l->dir);
+	if (!d)
+		return 1;
+
+	while ((de = readdir(d))) {
+		if (strlen(de->d_name) != 24 || strcmp(de->d_name + 20, ".log"))
+			continue;
+		if (count == alloc) {
+			alloc = alloc ? alloc * 2 : 16;
+			b = realloc(bases, alloc * sizeof(*bases));
+			if (!b) {
+				ret = 1;
+				goto bail;
+			}
+			bases = b;
+		}
+		bases[count] = strtoull(de->d_name, &end, 10);
+		if (end == de->d_name + 20)
+			count++;
+	}
+
+	if (count)
+		qsort(bases, count, sizeof(*bases), __msglog_cmp_u64);
+
+	for (n = 0; n < count; n++) {
+		if (n == count - 1 && __msglog_seg_unmade(l, bases[n])) {
+			if (!l->readonly)
+				__msglog_seg_unlink(l, bases[n]);
+			l->next_seq = bases[n];
+			break;
+		}
+
+		seg = __msglog_seg_add(l);
+		if (!seg || __msglog_seg_open(l, seg, bases[n], 0) ||
+		    __msglog_seg_recover(l, seg, n == count - 1)) {
+			if (seg)
+				__msglog_seg_close(l, seg);
+			ret = 1;
+			goto bail;
+		}
+		l->count_segs++;
+		l->next_seq = seg->base_seq + seg->count;
+	}
+
+bail:
+	closedir(d);
+	free(bases);
+
+	return ret;
+}
+
+static int
+__msglog_sync_locked_segs(struct msglog *l, int *fds, struct msglog_idx **idx,
+			  uint32_t max)
+{
+	uint32_t n, count = 0;
+
+	for (n = 0; n < l->count_segs && count < max; n++)
+		if (l->segs[n].dirty) {
+			l->segs[n].dirty = 0;
+			fds[count] = l->segs[n].fd;
+			idx[count++] = l->segs[n].idx;
+		}
+
+	return (int)count;
+}
+
+int
+msglog_sync(struct msglog *l)
+{
+	struct msglog_idx *idx[4];
+	int fds[4], count, n, ret = 0;
+
+	if (l->readonly)
+		return 0;
+
+	/*
+	 * Take note of what is dirty under the lock, but sync outside it so
+	 * appends carry on meanwhile.  Segments are never closed while the
+	 * log is open, so the fds stay good.
+	 */
+	do {
+		pthread_mutex_lock(&l->lock);
+		count = __msglog_sync_locked_segs(l, fds, idx, 4);
+		pthread_mutex_unlock(&l->lock);
+
+		for (n = 0; n < count; n++)
+			if (fdatasync(fds[n]) ||
+			    msync(idx[n], __msglog_idx_size(l), MS_SYNC))
+				ret = 1;
+	} while (count == 4);
+
+	return ret;
+}
+
+static void *
+__msglog_flusher(void *arg)
+{
+	struct msglog *l = arg;
+	struct timespec ts;
+	int stop = 0;
+
+	while (!stop) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += l->sync_ms / 1000;
+		ts.tv_nsec += (long)(l->sync_ms % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+
+		pthread_mutex_lock(&l->lock);
+		if (!l->stop)
+			pthread_cond_timedwait(&l->cond, &l->lock, &ts);
+		stop = l->stop;
+		pthread_mutex_unlock(&l->lock);
+
+		msglog_sync(l);
+	}
+
+	return NULL;
+}
+
+int
+msglog_open(struct msglog *l, const char *dir, uint32_t seg_records,
+	    uint64_t seg_bytes, int sync_ms, int readonly)
+{
+	pthread_condattr_t ca;
+
+	memset(l, 0, sizeof(*l));
+
+	if (!seg_records || !seg_bytes || strlen(dir) >= sizeof(l->dir))
+		return 1;
+
+	strcpy(l->dir, dir);
+	l->seg_records = seg_records;
+	l->seg_bytes = seg_bytes;
+	l->sync_ms = sync_ms;
+	l->readonly = readonly;
+
+	if (!readonly && mkdir(dir, 0755) && errno != EEXIST)
+		return 1;
+
+	pthread_mutex_init(&l->lock, NULL);
+	pthread_condattr_init(&ca);
+	pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+	pthread_cond_init(&l->cond, &ca);
+	pthread_condattr_destroy(&ca);
+
+	if (__msglog_scan(l))
+		goto bail;
+
+	if (!readonly && sync_ms > 0) {
+		if (pthread_create(&l->flusher, NULL, __msglog_flusher, l))
+			goto bail;
+		l->flusher_running = 1;
+	}
+
+	return 0;
+
+bail:
+	msglog_close(l);
+
+	return 1;
+}
+
+void
+msglog_close(struct msglog *l)
+{
+	uint32_t n;
+
+	if (l->flusher_running) {
+		pthread_mutex_lock(&l->lock);
+		l->stop = 1;
+		pthread_cond_signal(&l->cond);
+		pthread_mutex_unlock(&l->lock);
+		pthread_join(l->flusher, NULL);
+	}
+
+	msglog_sync(l);
+
+	for (n = 0; n < l->count_segs; n++)
+		__msglog_seg_close(l, &l->segs[n]);
+	free(l->segs);
+
+	pthread_cond_destroy(&l->cond);
+	pthread_mutex_destroy(&l->lock);
+	memset(l, 0, sizeof(*l));
+}
+
+/* the segment to append a record of size bytes to, starting one if needed */
+
+static struct msglog_seg *
+__msglog_tail(struct msglog *l, uint64_t size)
+{
+	struct msglog_seg *seg = l->count_segs ?
+				 &l->segs[l->count_segs - 1] : NULL;
+
+	if (seg && seg->count < l->seg_records &&
+	    (!seg->count || seg->size + size <= l->seg_bytes))
+		return seg;
+
+	seg = __msglog_seg_add(l);
+	if (!seg || __msglog_seg_open(l, seg, l->next_seq, 1))
+		return NULL;
+	l->count_segs++;
+
+	return seg;
+}
+
+int
+msglog_append(struct msglog *l, const void *data, size_t len,
+	      uint64_t timestamp, uint64_t tag, uint64_t *seq)
+{
+	static const unsigned char pad[8];
+	struct msglog_rec hdr;
+	struct msglog_seg *seg;
+	struct iovec iov[3];
+	uint64_t size;
+	int ret = 1;
+
+	if (l->readonly || len > MSGLOG_MAX_LEN)
+		return 1;
+
+	hdr.len = (uint32_t)len;
+	hdr.crc = __msglog_crc(data, len);
+	hdr.timestamp = timestamp;
+	hdr.tag = tag;
+	size = MSGLOG_ALIGN(sizeof(hdr) + len);
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (void *)data;
+	iov[1].iov_len = len;
+	iov[2].iov_base = (void *)pad;
+	iov[2].iov_len = (size_t)(size - sizeof(hdr) - len);
+
+	pthread_mutex_lock(&l->lock);
+
+	seg = __msglog_tail(l, size);
+	if (!seg)
+		goto bail;
+
+	hdr.seq = l->next_seq;
+	if (pwritev(seg->fd, iov, 3, (off_t)seg->size) != (ssize_t)size)
+		goto bail;
+
+	/* the record is in the .log before the index points at it */
+	seg->idx[seg->count].offset = seg->size;
+	seg->idx[seg->count].timestamp = timestamp;
+	seg->count++;
+	seg->size += size;
+	seg->dirty = 1;
+
+	if (seq)
+		*seq = l->next_seq;
+	l->next_seq++;
+	ret = 0;
+
+bail:
+	pthread_mutex_unlock(&l->lock);
+
+	if (!ret && !l->sync_ms)
+		ret = msglog_sync(l);
+
+	return ret;
+}
+
+uint64_t
+msglog_oldest(struct msglog *l)
+{
+	uint64_t seq;
+
+	pthread_mutex_lock(&l->lock);
+	seq = l->count_segs ? l->segs[0].base_seq : l->next_seq;
+	pthread_mutex_unlock(&l->lock);
+
+	return seq;
+}
+
+/* the segment holding seq, called with the lock held */
+
+static struct msglog_seg *
+__msglog_seg_of(struct msglog *l, uint64_t seq)
+{
+	uint32_t lo = 0, hi = l->count_segs, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (l->segs[mid].base_seq <= seq)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (!lo || seq >= l->segs[lo - 1].base_seq + l->segs[lo - 1].count)
+		return NULL;
+
+	return &l->segs[lo - 1];
+}
+
+long long
+msglog_read(struct msglog *l, uint64_t seq, void *buf, size_t buf_len,
+	    uint64_t *timestamp, uint64_t *tag)
+{
+	struct msglog_rec hdr;
+	struct msglog_seg *seg;
+	long long ret = -1;
+	uint64_t ofs;
+
+	pthread_mutex_lock(&l->lock);
+
+	seg = __msglog_seg_of(l, seq);
+	if (!seg)
+		goto bail;
+
+	ofs = seg->idx[seq - seg->base_seq].offset;
+	if (pread(seg->fd, &hdr, sizeof(hdr), (off_t)ofs) != sizeof(hdr) ||
+	    hdr.seq != seq)
+		goto bail;
+
+	ret = hdr.len;
+	if (timestamp)
+		*timestamp = hdr.timestamp;
+	if (tag)
+		*tag = hdr.tag;
+	if (hdr.len <= buf_len &&
+	    pread(seg->fd, buf, hdr.len, (off_t)(ofs + sizeof(hdr))) !=
+							(ssize_t)hdr.len)
+		ret = -1;
+
+bail:
+	pthread_mutex_unlock(&l->lock);
+
+	return ret;
+}
+
+uint64_t
+msglog_find_time(struct msglog *l, uint64_t ts)
+{
+	struct msglog_seg *seg;
+	uint32_t s, lo, hi, mid;
+	uint64_t seq;
+
+	pthread_mutex_lock(&l->lock);
+
+	seq = l->next_seq;
+
+	/* the first segment whose last record is new enough */
+	for (s = 0; s < l->count_segs; s++) {
+		seg = &l->segs[s];
+		if (!seg->count || seg->idx[seg->count - 1].timestamp < ts)
+			continue;
+
+		lo = 0;
+		hi = seg->count - 1;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (seg->idx[mid].timestamp < ts)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		seq = seg->base_seq + lo;
+		break;
+	}
+
+	pthread_mutex_unlock(&l->lock);
+
+	return seq;
+}
@@ -0,0 +1,112 @@
+/*
+ * persistent message log for the "lws-minimal" protocol
+ *
+ * Every message is appended to a log made of segment files in one
+ * directory.  A segment is named after the seq of its first record,
+ * "<seq>.log" holds the records one after the other and "<seq>.idx" is a
+ * fixed-width index, one { offset, timestamp } entry per record, that is
+ * mmap'd, so finding any record by seq is O(1) and by time is a binary
+ * search.
+ *
+ * Appends only go as far as the page cache.  A flusher thread syncs
+ * whatever was appended since it last looked every sync_ms, so one
+ * fdatasync() covers a whole batch of messages (group commit).  With
+ * sync_ms 0 every append is synced before it returns.
+ *
+ * Records carry a CRC, and a 64-bit tag that is the caller's, eg, the
+ * protocol keeps the seq the message got in its room there.  When the log
+ * is opened after a crash, only the tail of the newest segment is checked,
+ * a torn record at the end is cut off and records that made it to the log
+ * but not the index are indexed.  A newest segment whose index isn't full
+ * size yet has no records, a reader passes over it and the writer removes
+ * it.
+ */
+
+#if !defined(__MSGLOG_H__)
+#define __MSGLOG_H__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct msglog_idx {
+	uint64_t offset;	/* of the record in the segment's .log */
+	uint64_t timestamp;
+};
+
+struct msglog_seg {
+	uint64_t base_seq;	/* seq of its first record */
+	uint32_t count;		/* records in it */
+	uint64_t size;		/* bytes of records in the .log */
+	int fd;
+	struct msglog_idx *idx;	/* mmap'd, seg_records entries */
+	char dirty;		/* appended to since the last sync */
+};
+
+struct msglog {
+	char dir[256];
+	int readonly;
+
+	struct msglog_seg *segs; /* oldest first */
+	uint32_t count_segs;
+	uint32_t alloc_segs;
+
+	uint32_t seg_records;	/* most records in one segment */
+	uint64_t seg_bytes;	/* a segment is closed once this big */
+	uint64_t next_seq;	/* seq the next record will get */
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* wakes the flusher early, to stop */
+	pthread_t flusher;
+	int sync_ms;
+	char flusher_running;
+	char stop;
+};
+
+/*
+ * Opens the log in dir, making the directory if needed.  A readonly log
+ * may be opened alongside a writer, eg, to rebuild history from it.
+ * Returns 0, or 1 on failure.
+ */
+
+int
+msglog_open(struct msglog *l, const char *dir, uint32_t seg_records,
+	    uint64_t seg_bytes, int sync_ms, int readonly);
+
+/* syncs anything pending and closes the log */
+
+void
+msglog_close(struct msglog *l);
+
+/* any thread.  Returns 0 and sets *seq if given, or 1 on error */
+
+int
+msglog_append(struct msglog *l, const void *data, size_t len,
+	      uint64_t timestamp, uint64_t tag, uint64_t *seq);
+
+/* push everything appended so far to disk.  Returns 0, or 1 on error */
+
+int
+msglog_sync(struct msglog *l);
+
+/* seq of the oldest record still in the log */
+
+uint64_t
+msglog_oldest(struct msglog *l);
+
+/*
+ * Copies record seq into buf if it fits.  Returns its length, which may be
+ * more than buf_len in which case nothing was copied, or -1 if there is no
+ * such record.
+ */
+
+long long
+msglog_read(struct msglog *l, uint64_t seq, void *buf, size_t buf_len,
+	    uint64_t *timestamp, uint64_t *tag);
+
+/* seq of the first record with a timestamp >= ts, or next_seq if none */
+
+uint64_t
+msglog_find_time(struct msglog *l, uint64_t ts);
+
+#endif
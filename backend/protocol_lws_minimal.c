@@ -6,129 +6,2576 @@
  * This file is made available under the Creative Commons CC0 1.0
  * Universal Public Domain Dedication.
  *
- * This version holds a single message at a time, which may be lost if a new
- * message comes.  See the minimal-ws-server-ring sample for the same thing
- * but using an lws_ring ringbuffer to hold up to 8 messages at a time.
+ * Clients talk in named rooms (see room.h).  Every client is in the "lobby"
+ * room from the start and joins or leaves others with join and leave
+ * frames, a chat frame goes to the room named in its metadata, or the lobby
+ * if it names none.  A client may be in up to MINIMAL_MAX_JOINED rooms.
+ *
+ * Each room has a broadcast ring per service thread, read by that thread's
+ * subscribers through their own tails (see broadcast_ring.h), so a message
+ * only wakes the subscribers of its room.  The ring size and what happens
+ * to a subscriber that falls a whole ring behind are set by the "ring-size"
+ * and "slow-policy" per-vhost options.
+ *
+ * What each client still has to be sent from the rings is accounted in
+ * bytes and messages.  A client whose backlog passes "client-max-bytes",
+ * or the client furthest behind in a room whenever the messages held in
+ * memory pass "mem-budget-mb", has the "evict-policy" applied to all its
+ * rooms: "skip" drops its backlog and "close" disconnects it.
+ *
+ * When lws runs several service threads, a message received on one thread
+ * is handed to the others whose clients are in the room through their
+ * lock-free inboxes (see inbox.h), and the other thread is woken with
+ * lws_cancel_service_pt() to feed it into its ring for the room.
+ *
+ * Each message is also copied into its room's history arena (see
+ * history.h).  A joining client is sent the newest "join-history" records
+ * of it before it starts reading the room's live ring, then a history
+ * response naming the seq to page back from.  Older history is only sent
+ * when the client asks for a page of it, by seq or by time.  Each room's
+ * history is bounded by the "history-messages" and "history-bytes"
+ * per-vhost options.  Its arena grows as it fills.  With "room-idle-s" set,
+ * it is freed, history and all, once nobody is in the room and it had no
+ * message for that long, the lobby's never is.  A room's rings go as soon
+ * as their thread has nobody in the room.
+ *
+ * When the server runs several worker processes, the context user pointer
+ * is the shared memory bus they all use (see shm_bus.h).  Received frames
+ * are appended to the bus, and each worker pulls the frames it has not seen
+ * yet from it and routes them to its own rooms as if it received them.
+ *
+ * When the client negotiated permessage-deflate, its compression is tuned
+ * by the "deflate-level", "deflate-mem-level", "deflate-window-bits" and
+ * "deflate-no-context-takeover" per-vhost options, and what the zlib
+ * streams cost is added up per connection and for the vhost.
+ *
+ * Each service thread keeps its own counters, and once a second works out
+ * its rates and samples its clients' queue depths, so "lws-minimal-metrics"
+ * can serve them all on /metrics for Prometheus without taking a lock.
+ *
+ * A message arriving in several fragments is put back together in a buffer
+ * from the thread's size-classed pool (see buf_pool.h), messages over the
+ * "max-message" per-vhost option close the connection.
+ *
+ * Every message gets the next sequence number of its room's history.  A
+ * client that connects with "?seq=N" in its URL, or sends a resume frame
+ * "7|TS|USER|N|ROOM" for a room, has the room's frames sent to it as
+ * "7|TS|SEQ|ROOM|FRAME", and is sent what it missed from seq N on instead
+ * of the usual join history.  N is 0 for a client that has seen nothing.
+ *
+ * With the "coalesce-ms" per-vhost option set, a message fanned out to a
+ * room only marks the room as having news on that thread.  A timer on each
+ * thread wakes the subscribers of the marked rooms once per tick, and each
+ * writable then sends the client everything it has waiting, up to
+ * "replay-quantum" bytes, so a burst costs a wakeup per client per tick
+ * instead of per message.
+ *
+ * With the "admit-rate" per-vhost option set, connections are still
+ * accepted at once, but their history replay is started at most that many
+ * times a second, with bursts of "admit-burst", so a restart that brings
+ * every client back together doesn't replay to all of them at once.  A
+ * client that would wait longer than "admit-max-wait-ms" is sent a status
+ * frame "3|TS|server|retry-after|MS" and closed, and reconnects after MS.
+ *
+ * Messages are allocated from size-classed slabs with a cache per thread
+ * (see slab.h), so steady traffic makes no system allocator calls.
+ *
+ * Messages are stamped with a monotonic clock when received, and the time
+ * from then to each client's lws_write() goes in its thread's latency
+ * histogram (see lat_hist.h).  A client sends a stats frame to get the
+ * percentiles back, and they are logged at shutdown.
+ *
+ * If the "log-dir" per-vhost option is set, every message is also appended
+ * to a persistent log there (see msglog.h), and at startup the room
+ * histories are rebuilt from the newest "log-recover" messages in it.  Of
+ * several workers only the one with "log-writer" 1 writes the log, the
+ * others just read it at startup.
+ *
+ * Clients that negotiate "lws-minimal-bin" instead talk the same frames in
+ * binary (see wire.h).  A record is stored, logged and put on the bus in
+ * the format it arrived in, and only recoded for a client talking the other
+ * one, so a room of binary clients never goes through decimal or '|'.
+ *
+ * Text frames are checked to be UTF-8 in the same pass that finds their
+ * fields (see text_scan.h), and a client sending one that isn't is closed
+ * with 1007.
+ */
+
+#if !defined (LWS_PLUGIN_STATIC)
+#define LWS_DLL
+#define LWS_INTERNAL
+#include <libwebsockets.h>
+#endif
+
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#if !defined(WIN32)
+#include <sys/time.h>
+#endif
+
+#include "broadcast_ring.h"
+#include "buf_pool.h"
+#include "history.h"
+#include "inbox.h"
+#include "lat_hist.h"
+#include "room.h"
+#include "slab.h"
+#include "text_scan.h"
+#include "wire.h"
+#if !defined(WIN32)
+#define MINIMAL_WITH_WORKERS
+#define MINIMAL_WITH_LOG
+#include "msglog.h"
+#include "shm_bus.h"
+#endif
+
+#if LWS_MAX_SMP > 1
+#include <pthread.h>
+typedef pthread_mutex_t minimal_mutex_t;
+#define minimal_mutex_init(_m)		pthread_mutex_init(_m, NULL)
+#define minimal_mutex_destroy(_m)	pthread_mutex_destroy(_m)
+#define minimal_lock(_m)		pthread_mutex_lock(_m)
+#define minimal_unlock(_m)		pthread_mutex_unlock(_m)
+#else
+/* lws was built for one service thread, nothing to lock against */
+typedef char minimal_mutex_t;
+#define minimal_mutex_init(_m)		((void)(_m))
+#define minimal_mutex_destroy(_m)	((void)(_m))
+#define minimal_lock(_m)		((void)(_m))
+#define minimal_unlock(_m)		((void)(_m))
+#endif
+
+#define MINIMAL_DEF_RING_SIZE 4096
+#define MINIMAL_DEF_HISTORY_MESSAGES 50
+#define MINIMAL_DEF_HISTORY_BYTES (1024 * 1024)
+#define MINIMAL_DEF_REPLAY_QUANTUM (64 * 1024)
+#define MINIMAL_DEF_MAX_ROOMS 1024
+#define MINIMAL_DEF_CLIENT_MAX_ROOMS 16
+#define MINIMAL_DEF_ROOM_IDLE_S 0
+#define MINIMAL_DEF_JOIN_HISTORY 20
+#define MINIMAL_DEF_MAX_MESSAGE (256 * 1024)
+/* history bytes sent between two live messages to one client */
+#define MINIMAL_HISTORY_SLICE (8 * 1024)
+/* free reassembly buffers each thread keeps per size class */
+#define MINIMAL_RX_POOL_KEEP 16
+#define MINIMAL_DEF_CLIENT_MAX_BYTES (1024 * 1024)
+#define MINIMAL_DEF_MEM_BUDGET_MB 256
+/* most clients evicted for the budget per message fanned out */
+#define MINIMAL_MAX_BUDGET_EVICTIONS 4
+/* longest coalescing tick, more only adds latency */
+#define MINIMAL_MAX_COALESCE_MS 5
+#define MINIMAL_DEF_ADMIT_MAX_WAIT_MS 5000
+#define MINIMAL_DEF_LOG_SYNC_MS 50
+#define MINIMAL_DEF_LOG_RECOVER 10000
+
+/* an index of 1MB per segment */
+#define MINIMAL_LOG_SEG_RECORDS 65536
+#define MINIMAL_LOG_SEG_BYTES (64 * 1024 * 1024)
+
+/* how often each thread works out its rates and samples queue depths */
+#define MINIMAL_STATS_INTERVAL_US LWS_US_PER_SEC
+/* log2 buckets of messages waiting for a client, the last takes the rest */
+#define MINIMAL_QDEPTH_BUCKETS 24
+#define MINIMAL_METRICS_LEN 8192
+
+#define MINIMAL_MAX_JOINED 8
+#define MINIMAL_DEF_PAGE 50
+#define MINIMAL_MAX_PAGE 200
+#define MINIMAL_LOBBY "lobby"
+
+/* these match MessageType in the client's message_types.h */
+#define MINIMAL_MSG_JOIN 1
+#define MINIMAL_MSG_LEAVE 2
+#define MINIMAL_MSG_STATUS 3
+#define MINIMAL_MSG_HISTORY_REQUEST 4
+#define MINIMAL_MSG_HISTORY_RESPONSE 5
+#define MINIMAL_MSG_STATS 6
+#define MINIMAL_MSG_RESUME 7
+
+struct per_session_data__minimal;
+
+/* what a history request asks for, see __minimal_page_request() */
+
+struct minimal_page_req {
+	uint64_t before; /* by seq, or with by_seq 0, by this timestamp */
+	uint32_t count;
+	int by_seq;
+};
+
+/* a client's membership of one room */
+
+struct minimal_sub {
+	struct minimal_sub *sub_list; /* room's next subscriber on our thread */
+	struct per_session_data__minimal *pss;
+	struct room *room; /* NULL if this slot is free */
+	struct bcast_reader reader; /* our tail in the room's ring */
+	int attached; /* reader is in the ring, ie, history is done */
+	int needs_history; /* flag to indicate this client needs history */
+	uint64_t history_seq; /* next history record to send */
+	uint64_t live_from; /* ring messages older than this came via history */
+	int page_pending; /* the client asked for a page of older history */
+	uint64_t page_seq; /* the page goes on with the record before this */
+	uint32_t page_left; /* records still to send for the page */
+	struct minimal_page_req queued; /* asked for before the join was done */
+	int page_queued;
+	int sequenced; /* frames go out in resume frames, with their seq */
+};
+
+/* one of these is created for each client connecting to us */
+
+struct per_session_data__minimal {
+	struct per_session_data__minimal *pss_list;
+	struct lws *wsi;
+	int tsi; /* the service thread we belong to */
+	struct minimal_sub subs[MINIMAL_MAX_JOINED];
+	int next_sub; /* where the next live message is looked for */
+	int next_hist; /* ... and the next history */
+	uint32_t deflate_mem; /* zlib state bytes, 0 if not compressed */
+	uint32_t evicted; /* times the evict-policy was applied to us */
+	int stats_pending; /* the client asked for a stats frame */
+	int binary; /* it talks "lws-minimal-bin", see wire.h */
+	lws_usec_t admit_at; /* our history waits till then, 0 once admitted */
+	uint32_t retry_after_ms; /* we are full, say so and close */
+	uint32_t rooms_made; /* rooms our joins and resumes created */
+	struct pool_buf rx; /* a message still arriving in fragments */
+};
+
+/* a room's state on one service thread, only that thread touches it */
+
+struct minimal_room_pt {
+	struct bcast_ring ring; /* made when the first subscriber joins */
+	struct minimal_sub *subs; /* linked-list of subscribers */
+	int count_subs; /* other threads skip us when it is 0 */
+	struct minimal_room_pt *dirty_list; /* next room with news for a tick */
+	int dirty; /* we are on our thread's dirty list */
+};
+
+/* our part of each room, its room_priv() */
+
+struct minimal_room {
+	minimal_mutex_t lock; /* the room's history */
+	struct minimal_room_pt pt[LWS_MAX_SMP];
+};
+
+/*
+ * A service thread's counters.  Only that thread writes them, so they are
+ * bumped with plain relaxed stores, anybody may read them with relaxed
+ * loads.
+ */
+
+struct minimal_stats {
+	lws_sorted_usec_list_t sul; /* our once a second tick */
+	struct lws_context *context;
+	int tsi;
+
+	uint32_t clients;
+	uint64_t rx; /* messages received from our clients */
+	uint64_t tx; /* frames written to our clients */
+	uint64_t tx_bytes;
+	uint64_t writables; /* writable callbacks */
+	uint64_t admit_waits; /* clients whose history waited for a token */
+	uint64_t admit_rejects; /* clients told to come back later */
+
+	/* as of the last tick */
+	lws_usec_t last_us;
+	uint64_t last_rx, last_tx, last_writables;
+	uint64_t rx_rate, tx_rate, writable_rate; /* per second */
+	uint32_t qdepth[MINIMAL_QDEPTH_BUCKETS]; /* clients by waiting msgs */
+
+	struct lat_hist fanout; /* ns from receive to lws_write() */
+};
+
+#define minimal_stat_add(_c, _n) \
+	__atomic_store_n(&(_c), (_c) + (_n), __ATOMIC_RELAXED)
+#define minimal_stat_get(_c) __atomic_load_n(&(_c), __ATOMIC_RELAXED)
+
+/*
+ * one of these per service thread.  Only its own thread touches it, except
+ * for the inbox, the wake state, the members under waker_lock and reading
+ * the stats.
+ */
+
+struct minimal_pt {
+	struct per_session_data__minimal *pss_list; /* linked-list of live pss*/
+
+	struct inbox inbox; /* messages received on other threads */
+
+	minimal_mutex_t waker_lock;
+	struct lws *waker; /* any of our wsi, to cancel our service wait */
+
+	int wake_pending; /* a cancel is already on its way to us */
+
+	unsigned char *page_buf; /* frames we make are encoded in here */
+	size_t page_buf_len;
+	unsigned char *recode_buf; /* records a client needs in its format */
+	size_t recode_buf_len;
+
+	struct buf_pool rx_pool; /* for reassembling fragmented messages */
+
+	/* when coalescing, rooms whose subscribers the next tick wakes */
+	lws_sorted_usec_list_t sul_coalesce;
+	struct per_vhost_data__minimal *vhd;
+	struct minimal_room_pt *dirty;
+
+	/* history replay admission, see __minimal_admit() */
+	lws_usec_t admit_next; /* when the next token is due */
+	lws_usec_t admit_retry; /* ... and the next client sent away is */
+
+	struct minimal_stats stats;
+};
+
+/* one of these is created for each vhost our protocol is used with */
+
+struct per_vhost_data__minimal {
+	struct lws_context *context;
+	struct lws_vhost *vhost;
+	const struct lws_protocols *protocol;
+
+	struct minimal_pt pt[LWS_MAX_SMP];
+	int count_threads;
+
+	minimal_mutex_t rooms_lock; /* the table, not the rooms in it */
+	struct room_table rooms;
+	struct room *lobby;
+	uint64_t history_count; /* records in all the room histories */
+	uint64_t history_bytes; /* ... and their payload bytes */
+
+	uint32_t ring_size; /* for each room on each thread */
+	enum bcast_slow_policy policy;
+	uint32_t replay_quantum; /* most bytes sent per writable */
+	uint32_t join_history; /* most history records sent on join */
+	uint64_t room_idle_us; /* 0, or how long an empty room keeps history */
+	uint32_t max_message; /* biggest message we take from a client */
+	lws_usec_t coalesce_us; /* 0, or how long fanout wakeups wait */
+	uint32_t admit_rate; /* history replays started per second, 0 for all */
+	uint32_t admit_burst; /* ... or at once, after a quiet spell */
+	uint32_t admit_max_wait_ms; /* longer and the client is sent away */
+
+	uint32_t client_max_bytes; /* most backlog one client may pin */
+	uint32_t client_max_rooms; /* most rooms one client may create */
+	uint64_t mem_budget; /* most bytes of messages held for everybody */
+	enum bcast_slow_policy evict_policy;
+	uint64_t evictions;
+
+	char deflate_level[4]; /* our permessage-deflate settings, as */
+	char deflate_mem_level[4]; /* lws_set_extension_option() takes */
+	int deflate_window_bits; /* lowered to this if the client allows more */
+	int deflate_no_takeover;
+	uint64_t deflate_mem; /* ... summed over our connections */
+	int count_deflate;
+
+#if defined(MINIMAL_WITH_WORKERS)
+	struct shm_bus *bus; /* set when we are one of several workers */
+	pthread_t bus_thread;
+	int bus_stop;
+	minimal_mutex_t bus_lock; /* one thread at a time pulls the bus */
+	uint64_t bus_seq; /* next bus record to pull */
+	uint64_t bus_logged; /* bus records before this are in our log */
+#endif
+#if defined(MINIMAL_WITH_LOG)
+	struct msglog log;
+	int log_open; /* we write every message to log */
+#endif
+};
+
+#define minimal_room(_r) ((struct minimal_room *)room_priv(_r))
+
+/*
+ * room_frame_parse() for either format.  A binary frame's room is its whole
+ * metadata, or content for a join or leave.  Returns -1 for a binary frame
+ * that doesn't parse or couldn't be recoded as text for a text client, or a
+ * text one that isn't UTF-8, other text frames always parse, if only as a
+ * chat frame.
+ */
+static int
+__minimal_frame_parse(const void *in, size_t len, struct room_frame *f)
+{
+	struct wire_frame wf;
+
+	if (!wire_is_binary(in, len))
+		return room_frame_parse(in, len, f);
+
+	if (wire_parse(in, len, &wf) || !wire_text_ok(&wf))
+		return -1;
+
+	f->type = wf.type;
+	f->timestamp = wf.timestamp;
+	f->content = wf.content;
+	f->content_len = wf.content_len;
+	if (wf.type == MINIMAL_MSG_JOIN || wf.type == MINIMAL_MSG_LEAVE) {
+		f->room = wf.content;
+		f->room_len = wf.content_len;
+	} else {
+		f->room = wf.metadata;
+		f->room_len = wf.metadata_len;
+	}
+
+	return 0;
+}
+
+/*
+ * Find a room by name, or make it.  An empty name is the lobby.  Any thread
+ * may call this, rooms live until the vhost goes away.
+ */
+static struct room *
+__minimal_room_lookup(struct per_vhost_data__minimal *vhd, const char *name,
+		      size_t len, int create)
+{
+	struct room *r;
+	uint32_t count;
+
+	if (!len)
+		return vhd->lobby;
+
+	minimal_lock(&vhd->rooms_lock);
+	if (!create)
+		r = room_find(&vhd->rooms, name, len);
+	else {
+		count = vhd->rooms.count;
+		r = room_get(&vhd->rooms, name, len);
+		if (r && vhd->rooms.count != count)
+			minimal_mutex_init(&minimal_room(r)->lock);
+	}
+	minimal_unlock(&vhd->rooms_lock);
+
+	return r;
+}
+
+/*
+ * The room a client joins or resumes, made if need be.  Rooms are never
+ * freed, so each client may only make "client-max-rooms" of them, and one
+ * client can't use up "max-rooms" for everybody else.
+ */
+static struct room *
+__minimal_client_room(struct per_vhost_data__minimal *vhd,
+		      struct per_session_data__minimal *pss,
+		      const struct room_frame *f)
+{
+	struct room *r = __minimal_room_lookup(vhd, f->room, f->room_len, 0);
+
+	if (r || pss->rooms_made >= vhd->client_max_rooms)
+		return r;
+
+	r = __minimal_room_lookup(vhd, f->room, f->room_len, 1);
+	if (r)
+		pss->rooms_made++;
+
+	return r;
+}
+
+static struct minimal_sub *
+__minimal_sub_of(struct per_session_data__minimal *pss, struct room *room)
+{
+	int n;
+
+	for (n = 0; n < MINIMAL_MAX_JOINED; n++)
+		if (pss->subs[n].room == room)
+			return &pss->subs[n];
+
+	return NULL;
+}
+
+/*
+ * Once history is done, the subscriber starts reading the room's live ring
+ * from the current head.  Anything that arrived during replay was also
+ * added to the history and so has already been sent, with several service
+ * threads it may still be on its way through our inbox, live_from lets us
+ * skip it.
+ *
+ * Called with the room locked.
+ */
+static void
+__minimal_attach_live(struct minimal_sub *sub)
+{
+	struct minimal_room_pt *rp = &minimal_room(sub->room)->pt[sub->pss->tsi];
+
+	sub->needs_history = 0;
+	sub->live_from = sub->room->history.next_seq;
+	bcast_ring_attach(&rp->ring, &sub->reader);
+	sub->attached = 1;
+}
+
+/* Join a room, its history is sent before anything live */
+static struct minimal_sub *
+__minimal_subscribe(struct per_vhost_data__minimal *vhd,
+		    struct per_session_data__minimal *pss, struct room *room)
+{
+	struct minimal_room *mr = minimal_room(room);
+	struct minimal_room_pt *rp = &mr->pt[pss->tsi];
+	struct minimal_sub *sub = __minimal_sub_of(pss, room);
+
+	if (sub)
+		return sub; /* already in it */
+
+	sub = __minimal_sub_of(pss, NULL);
+	if (!sub)
+		return NULL;
+
+	if (!rp->ring.slots &&
+	    bcast_ring_init(&rp->ring, vhd->ring_size, vhd->policy)) {
+		lwsl_err("%s: OOM allocating %u slot ring\n", __func__,
+			 vhd->ring_size);
+		return NULL;
+	}
+
+	memset(sub, 0, sizeof(*sub));
+	sub->pss = pss;
+	sub->room = room;
+	lws_ll_fwd_insert(sub, sub_list, rp->subs);
+	/* before we look at the history, so other threads post to us */
+	__atomic_add_fetch(&rp->count_subs, 1, __ATOMIC_ACQ_REL);
+
+	minimal_lock(&mr->lock);
+	if (!room->history.count)
+		__minimal_attach_live(sub);
+	else {
+		/* Mark this client as needing history and set starting position */
+		sub->needs_history = 1;
+		sub->history_seq = room->history.oldest_seq;
+		if (room->history.next_seq - sub->history_seq > vhd->join_history)
+			sub->history_seq = room->history.next_seq -
+					   vhd->join_history;
+		/* where the client pages back from once it has these */
+		sub->page_seq = sub->history_seq;
+	}
+	minimal_unlock(&mr->lock);
+
+	if (sub->needs_history)
+		lws_callback_on_writable(pss->wsi);
+
+	return sub;
+}
+
+static void
+__minimal_unsubscribe(struct minimal_sub *sub)
+{
+	struct minimal_room_pt *rp = &minimal_room(sub->room)->pt[sub->pss->tsi];
+
+	lws_ll_fwd_remove(struct minimal_sub, sub_list, sub, rp->subs);
+	if (sub->attached)
+		bcast_ring_detach(&rp->ring, &sub->reader);
+	__atomic_sub_fetch(&rp->count_subs, 1, __ATOMIC_ACQ_REL);
+
+	sub->room = NULL;
+	sub->attached = 0;
+	sub->needs_history = 0;
+	sub->page_pending = 0;
+	sub->page_queued = 0;
+}
+
+/*
+ * With "admit-rate" set, a new connection's history replay waits for a
+ * token.  Each thread hands them out at its share of the rate, from a
+ * bucket holding its share of "admit-burst": admit_next is when the next
+ * one is due, a full bucket puts it burst - 1 tokens in the past.
+ *
+ * A client whose token is due later has its history held back until a
+ * timer says it is its turn.  One that would wait more than
+ * "admit-max-wait-ms" is told when to try again and closed, those times
+ * are handed out at the same rate, so a storm of reconnects comes back
+ * spread out instead of together.
+ */
+static void
+__minimal_admit(struct per_vhost_data__minimal *vhd, struct minimal_pt *pt,
+		struct per_session_data__minimal *pss)
+{
+	lws_usec_t now = lws_now_usecs(), interval, full, at;
+	uint32_t burst;
+
+	if (!vhd->admit_rate)
+		return;
+
+	interval = (lws_usec_t)vhd->count_threads * LWS_US_PER_SEC /
+		   vhd->admit_rate;
+	burst = vhd->admit_burst / (uint32_t)vhd->count_threads;
+	if (!burst)
+		burst = 1;
+
+	full = now - (lws_usec_t)(burst - 1) * interval;
+	if (pt->admit_next < full)
+		pt->admit_next = full;
+	at = pt->admit_next;
+
+	if (at - now > (lws_usec_t)vhd->admit_max_wait_ms * LWS_US_PER_MS) {
+		if (pt->admit_retry < at)
+			pt->admit_retry = at;
+		pss->retry_after_ms = (uint32_t)((pt->admit_retry - now) /
+						 LWS_US_PER_MS) + 1;
+		pt->admit_retry += interval;
+		minimal_stat_add(pt->stats.admit_rejects, 1);
+		return;
+	}
+
+	pt->admit_next += interval;
+	if (at <= now)
+		return;
+
+	pss->admit_at = at;
+	lws_set_timer_usecs(pss->wsi, at - now);
+	minimal_stat_add(pt->stats.admit_waits, 1);
+}
+
+/* bytes, and messages if asked, waiting for this client in all its rings */
+static uint64_t
+__minimal_backlog(struct per_session_data__minimal *pss, uint64_t *msgs)
+{
+	struct minimal_room_pt *rp;
+	uint64_t bytes = 0;
+	int n;
+
+	if (msgs)
+		*msgs = 0;
+
+	for (n = 0; n < MINIMAL_MAX_JOINED; n++) {
+		if (!pss->subs[n].attached)
+			continue;
+		rp = &minimal_room(pss->subs[n].room)->pt[pss->tsi];
+		bytes += bcast_ring_pending_bytes(&rp->ring,
+						  &pss->subs[n].reader);
+		if (msgs)
+			*msgs += bcast_ring_pending(&rp->ring,
+						    &pss->subs[n].reader);
+	}
+
+	return bytes;
+}
+
+/*
+ * Apply the evict-policy to the client in every room, so it stops pinning
+ * messages.  With "close" the writable callback then closes it.
+ */
+static void
+__minimal_evict(struct per_vhost_data__minimal *vhd,
+		struct per_session_data__minimal *pss, const char *why)
+{
+	struct minimal_room_pt *rp;
+	uint64_t bytes, msgs;
+	int n;
+
+	bytes = __minimal_backlog(pss, &msgs);
+
+	for (n = 0; n < MINIMAL_MAX_JOINED; n++) {
+		if (!pss->subs[n].attached)
+			continue;
+		rp = &minimal_room(pss->subs[n].room)->pt[pss->tsi];
+		bcast_ring_evict(&rp->ring, &pss->subs[n].reader,
+				 vhd->evict_policy);
+	}
+
+	pss->evicted++;
+	__atomic_add_fetch(&vhd->evictions, 1, __ATOMIC_RELAXED);
+	lwsl_notice("%s: %s, client was %llu messages / %llu bytes behind\n",
+		    __func__, why, (unsigned long long)msgs,
+		    (unsigned long long)bytes);
+
+	lws_callback_on_writable(pss->wsi);
+}
+
+/*
+ * While the messages held in memory are over the budget, evict whoever is
+ * furthest behind in the room.  Other threads' rings may hold the same
+ * messages, so how many we evict for one message is bounded.
+ */
+static void
+__minimal_enforce_budget(struct per_vhost_data__minimal *vhd,
+			 struct minimal_room_pt *rp)
+{
+	struct per_session_data__minimal *worst;
+	uint64_t bytes, worst_bytes;
+	int n;
+
+	for (n = 0; n < MINIMAL_MAX_BUDGET_EVICTIONS &&
+		    msg_live_bytes() > vhd->mem_budget; n++) {
+		worst = NULL;
+		worst_bytes = 0;
+
+		lws_start_foreach_ll(struct minimal_sub *, sub, rp->subs) {
+			bytes = sub->attached ?
+				bcast_ring_pending_bytes(&rp->ring,
+							 &sub->reader) : 0;
+			if (bytes > worst_bytes) {
+				worst = sub->pss;
+				worst_bytes = bytes;
+			}
+		} lws_end_foreach_ll(sub, sub_list);
+
+		if (!worst)
+			break;
+
+		__minimal_evict(vhd, worst, "over memory budget");
+	}
+}
+
+/* ask for writable on the room's subscribers, evicting any too far behind */
+static void
+__minimal_wake_subs(struct per_vhost_data__minimal *vhd,
+		    struct minimal_room_pt *rp)
+{
+	lws_start_foreach_ll(struct minimal_sub *, sub, rp->subs) {
+		if (sub->attached &&
+		    __minimal_backlog(sub->pss, NULL) > vhd->client_max_bytes)
+			__minimal_evict(vhd, sub->pss, "backlog too big");
+		lws_callback_on_writable(sub->pss->wsi);
+	} lws_end_foreach_ll(sub, sub_list);
+}
+
+/* wake the subscribers of every room that had news since the last tick */
+static void
+__minimal_coalesce_tick(lws_sorted_usec_list_t *sul)
+{
+	struct minimal_pt *pt = lws_container_of(sul, struct minimal_pt,
+						 sul_coalesce);
+	struct minimal_room_pt *rp;
+
+	while ((rp = pt->dirty)) {
+		pt->dirty = rp->dirty_list;
+		rp->dirty_list = NULL;
+		rp->dirty = 0;
+		__minimal_wake_subs(pt->vhd, rp);
+	}
+}
+
+/*
+ * Put a message in the room's ring on thread tsi and let the room's
+ * subscribers there know we want to write something on them as soon as
+ * they are ready, or on the next tick if we are coalescing
+ */
+static void
+__minimal_room_fanout(struct per_vhost_data__minimal *vhd, struct room *room,
+		      int tsi, struct msg *amsg)
+{
+	struct minimal_room_pt *rp = &minimal_room(room)->pt[tsi];
+	struct minimal_pt *pt = &vhd->pt[tsi];
+	int m;
+
+	if (!rp->subs)
+		return;
+
+	m = bcast_ring_insert(&rp->ring, amsg);
+	if (m < 0) {
+		lwsl_user("ring full: dropping\n");
+		return;
+	}
+	if (m)
+		lwsl_info("%s: slow policy applied to %d clients\n",
+			  __func__, m);
+
+	if (!vhd->coalesce_us)
+		__minimal_wake_subs(vhd, rp);
+	else if (!rp->dirty) {
+		rp->dirty = 1;
+		rp->dirty_list = pt->dirty;
+		/* the first room with news starts the tick */
+		if (!pt->dirty)
+			lws_sul_schedule(vhd->context, tsi, &pt->sul_coalesce,
+					 __minimal_coalesce_tick,
+					 vhd->coalesce_us);
+		pt->dirty = rp;
+	}
+
+	if (msg_live_bytes() > vhd->mem_budget)
+		__minimal_enforce_budget(vhd, rp);
+}
+
+/*
+ * Hand a message received on thread tsi to every other service thread that
+ * has subscribers in its room.  A thread is only woken if no wake is
+ * already pending for it, it drains everything queued by then when it
+ * handles the wake.
+ */
+static void
+__minimal_post_others(struct per_vhost_data__minimal *vhd, int tsi,
+		      struct room *room, struct msg *amsg)
+{
+	struct minimal_room *mr = minimal_room(room);
+	struct minimal_pt *pt;
+	int n;
+
+	for (n = 0; n < vhd->count_threads; n++) {
+		pt = &vhd->pt[n];
+		if (n == tsi ||
+		    !__atomic_load_n(&mr->pt[n].count_subs, __ATOMIC_ACQUIRE))
+			continue;
+
+		if (inbox_push(&pt->inbox, msg_ref(amsg))) {
+			lwsl_warn("%s: thread %d inbox full: dropping\n",
+				  __func__, n);
+			msg_unref(amsg);
+			continue;
+		}
+
+		if (__atomic_exchange_n(&pt->wake_pending, 1, __ATOMIC_ACQ_REL))
+			continue;
+
+		minimal_lock(&pt->waker_lock);
+		if (pt->waker)
+			lws_cancel_service_pt(pt->waker);
+		else
+			/* it lost its last client, the next one wakes it */
+			__atomic_store_n(&pt->wake_pending, 0, __ATOMIC_RELEASE);
+		minimal_unlock(&pt->waker_lock);
+	}
+}
+
+static void
+__minimal_drain_inbox(struct per_vhost_data__minimal *vhd, int tsi)
+{
+	struct minimal_pt *pt = &vhd->pt[tsi];
+	struct msg *amsg;
+
+	/* clear first, so anything pushed while we drain wakes us again */
+	__atomic_store_n(&pt->wake_pending, 0, __ATOMIC_RELEASE);
+
+	while ((amsg = inbox_pop(&pt->inbox))) {
+		__minimal_room_fanout(vhd, amsg->user, tsi, amsg);
+		msg_unref(amsg);
+	}
+}
+
+/* wall clock, messages are looked up by it */
+static uint64_t
+__minimal_now_us(void)
+{
+#if defined(WIN32)
+	return (uint64_t)time(NULL) * 1000000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_usec;
+#endif
+}
+
+/*
+ * monotonic, for latencies.  CLOCK_MONOTONIC is the same for every process
+ * on the machine, so it is good across workers too.
+ */
+static uint64_t
+__minimal_mono_ns(void)
+{
+#if defined(WIN32)
+	return (uint64_t)lws_now_usecs() * 1000;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/*
+ * Add a message to its room's history and send it to the room's
+ * subscribers on every thread, starting with thread tsi which we are on.
+ *
+ * A message from the bus already has its seq, it is dropped if the room
+ * has it already.  Otherwise it gets the room's next seq.  A room's seqs
+ * start from the wall clock in us, not 0, so a client that saw seqs of a
+ * room from before a restart that lost its history can't take new ones
+ * for them, they are all higher.  A room read back from the log carries on
+ * from its last seq there.
+ *
+ * It is logged unless log is 0, for one the log has already.
+ */
+static void
+__minimal_deliver(struct per_vhost_data__minimal *vhd, int tsi,
+		  struct room *room, struct msg *amsg, int log)
+{
+	struct minimal_room *mr = minimal_room(room);
+	struct history *h = &room->history;
+	uint64_t count, bytes;
+
+	amsg->timestamp = __minimal_now_us();
+
+	minimal_lock(&mr->lock);
+	if (amsg->seq != MSG_NO_SEQ && amsg->seq < h->next_seq) {
+		minimal_unlock(&mr->lock);
+		return;
+	}
+
+	count = h->count;
+	bytes = h->bytes;
+	if (amsg->seq != MSG_NO_SEQ)
+		history_seek(h, amsg->seq);
+	else if (!h->next_seq)
+		history_seek(h, amsg->timestamp);
+	if (history_append(h, (unsigned char *)amsg->payload + LWS_PRE,
+			   amsg->len, amsg->timestamp, &amsg->seq))
+		lwsl_warn("%s: %u byte message too big for history\n",
+			  __func__, (unsigned int)amsg->len);
+	/* what the append added less what it evicted, for the metrics */
+	count = h->count - count;
+	bytes = h->bytes - bytes;
+
+#if defined(MINIMAL_WITH_LOG)
+	/*
+	 * it goes to the page cache here, the log's flusher syncs it.  Under
+	 * the room lock, so the log has each room's seqs in order.
+	 */
+	if (vhd->log_open && log &&
+	    msglog_append(&vhd->log, (unsigned char *)amsg->payload + LWS_PRE,
+			  amsg->len, amsg->timestamp, amsg->seq, NULL))
+		lwsl_warn("%s: unable to log %u byte message\n", __func__,
+			  (unsigned int)amsg->len);
+#endif
+	minimal_unlock(&mr->lock);
+
+	__atomic_add_fetch(&vhd->history_count, count, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&vhd->history_bytes, bytes, __ATOMIC_RELAXED);
+
+	amsg->user = room;
+	__minimal_post_others(vhd, tsi, room, amsg);
+	__minimal_room_fanout(vhd, room, tsi, amsg);
+}
+
+#if defined(MINIMAL_WITH_WORKERS)
+/*
+ * Route whatever any worker appended to the bus since we last looked, as if
+ * we had received it ourselves.  If we fell so far behind that records were
+ * evicted before we saw them, those are lost for our clients.
+ */
+static void
+__minimal_bus_pull(struct per_vhost_data__minimal *vhd, int tsi)
+{
+	struct history *h = &vhd->bus->history;
+	struct room_frame f;
+	struct hist_rec *hrec;
+	struct room *room;
+	struct msg *amsg;
+	int log;
+
+	minimal_lock(&vhd->bus_lock);
+
+	for (;;) {
+		/* only hold the bus while we copy the record out */
+		shm_bus_lock(vhd->bus);
+		if (vhd->bus_seq < h->oldest_seq) {
+			lwsl_warn("%s: missed %llu messages\n", __func__,
+				  (unsigned long long)(h->oldest_seq -
+						       vhd->bus_seq));
+			vhd->bus_seq = h->oldest_seq;
+		}
+		if (vhd->bus_seq == h->next_seq) {
+			shm_bus_unlock(vhd->bus);
+			break;
+		}
+		log = vhd->bus_seq >= vhd->bus_logged;
+		hrec = history_get(h, vhd->bus_seq++);
+		amsg = msg_create(shm_bus_rec_payload(hrec),
+				  shm_bus_rec_len(hrec));
+		if (amsg) {
+			amsg->received = hrec->timestamp;
+			amsg->seq = shm_bus_rec_seq(hrec);
+		}
+		shm_bus_unlock(vhd->bus);
+
+		if (!amsg) {
+			lwsl_user("OOM: dropping\n");
+			continue;
+		}
+
+		/* another worker may have made the room, we make it here too */
+		room = __minimal_frame_parse((unsigned char *)amsg->payload +
+					     LWS_PRE, amsg->len, &f) ? NULL :
+		       __minimal_room_lookup(vhd, f.room, f.room_len, 1);
+		if (room)
+			__minimal_deliver(vhd, tsi, room, amsg, log);
+		msg_unref(amsg);
+	}
+
+	minimal_unlock(&vhd->bus_lock);
+}
+
+/* a room's key in the bus's table of seqs, the 64-bit FNV-1a of its name */
+static uint64_t
+__minimal_room_key(const struct room *room)
+{
+	const unsigned char *p = (const unsigned char *)room->name;
+	uint64_t h = 14695981039346656037ull;
+
+	while (*p) {
+		h ^= *p++;
+		h *= 1099511628211ull;
+	}
+
+	return h;
+}
+
+/*
+ * Sleeps on the bus for the whole worker, and wakes every service thread
+ * with lws_cancel_service() when any worker appended something
+ */
+static void *
+__minimal_bus_waiter(void *arg)
+{
+	struct per_vhost_data__minimal *vhd = arg;
+	uint64_t seen;
+
+	shm_bus_lock(vhd->bus);
+	seen = vhd->bus->history.next_seq;
+	shm_bus_unlock(vhd->bus);
+
+	while (!__atomic_load_n(&vhd->bus_stop, __ATOMIC_RELAXED))
+		if (shm_bus_wait(vhd->bus, &seen, 250))
+			lws_cancel_service(vhd->context);
+
+	return NULL;
+}
+#endif
+
+/* Send a frame received from a client at received ns to its room */
+static void
+__minimal_publish(struct per_vhost_data__minimal *vhd, int tsi,
+		  struct room *room, const void *in, size_t len,
+		  uint64_t received)
+{
+	struct msg *amsg;
+#if defined(MINIMAL_WITH_WORKERS)
+	uint64_t first;
+
+	if (vhd->bus) {
+		/*
+		 * everybody, us included, takes it from the bus.  We pull at
+		 * once, the bus thread wakes our other threads and the other
+		 * workers.  The bus hands out the room's seq, if no worker
+		 * has it yet, it carries on from ours or starts from the clock.
+		 */
+		minimal_lock(&minimal_room(room)->lock);
+		first = room->history.next_seq;
+		minimal_unlock(&minimal_room(room)->lock);
+		if (!first)
+			first = __minimal_now_us();
+
+		shm_bus_lock(vhd->bus);
+		if (shm_bus_append(vhd->bus, __minimal_room_key(room), first,
+				   in, len, received, NULL))
+			lwsl_warn("%s: %u byte message too big for the bus\n",
+				  __func__, (unsigned int)len);
+		shm_bus_unlock(vhd->bus);
+
+		__minimal_bus_pull(vhd, tsi);
+		return;
+	}
+#endif
+
+	/* one refcounted copy, shared by every reader of the live rings */
+	amsg = msg_create(in, len);
+	if (!amsg) {
+		lwsl_user("OOM: dropping\n");
+		return;
+	}
+	amsg->received = received;
+
+	__minimal_deliver(vhd, tsi, room, amsg, 1);
+	msg_unref(amsg);
+}
+
+/*
+ * Start sending the page req asks for, newest first from the writable
+ * callback.  Called with the room locked.
+ */
+static void
+__minimal_page_start(struct minimal_sub *sub,
+		     const struct minimal_page_req *req)
+{
+	struct history *h = &sub->room->history;
+
+	if (req->by_seq)
+		sub->page_seq = req->before < h->next_seq ? req->before :
+							     h->next_seq;
+	else if (req->before)
+		sub->page_seq = history_find_time(h, req->before);
+	else
+		sub->page_seq = h->next_seq;
+
+	sub->page_left = req->count;
+	sub->page_pending = 1;
+	lws_callback_on_writable(sub->pss->wsi);
+}
+
+/*
+ * A client asks for "<count>@<seq>" records before seq, or for count
+ * records older than the frame's timestamp, or with neither for the newest
+ * count.  One asked for while the join history is still going out waits
+ * for it to end, a later one replacing it.
+ */
+static void
+__minimal_page_request(struct minimal_sub *sub, const struct room_frame *f)
+{
+	struct minimal_room *mr = minimal_room(sub->room);
+	const char *p = f->content, *end = p + f->content_len;
+	struct minimal_page_req req;
+
+	memset(&req, 0, sizeof(req));
+	while (p < end && *p >= '0' && *p <= '9' &&
+	       req.count <= MINIMAL_MAX_PAGE)
+		req.count = (req.count * 10) + (uint32_t)(*p++ - '0');
+	if (p < end && *p == '@') {
+		req.by_seq = 1;
+		while (++p < end && *p >= '0' && *p <= '9')
+			req.before = (req.before * 10) + (uint64_t)(*p - '0');
+	} else
+		req.before = f->timestamp;
+
+	if (!req.count)
+		req.count = MINIMAL_DEF_PAGE;
+	if (req.count > MINIMAL_MAX_PAGE)
+		req.count = MINIMAL_MAX_PAGE;
+
+	/* the join history ends with where to page back from, wait for it */
+	if (sub->needs_history) {
+		sub->queued = req;
+		sub->page_queued = 1;
+		return;
+	}
+
+	minimal_lock(&mr->lock);
+	__minimal_page_start(sub, &req);
+	minimal_unlock(&mr->lock);
+}
+
+/*
+ * Start sub over in sequenced mode, from seq want if the history still
+ * reaches back to it.  want 0, or one past what we have, say the client
+ * has nothing of ours and it gets the usual join history.
+ */
+static void
+__minimal_resume(struct per_vhost_data__minimal *vhd, struct minimal_sub *sub,
+		 uint64_t want)
+{
+	struct minimal_room_pt *rp = &minimal_room(sub->room)->pt[sub->pss->tsi];
+	struct minimal_room *mr = minimal_room(sub->room);
+	struct history *h = &sub->room->history;
+
+	/* anything live it was sent already is in the gap we send again */
+	if (sub->attached) {
+		bcast_ring_detach(&rp->ring, &sub->reader);
+		sub->attached = 0;
+	}
+	sub->sequenced = 1;
+
+	minimal_lock(&mr->lock);
+	if (want && want <= h->next_seq)
+		sub->history_seq = want;
+	else
+		sub->history_seq = h->next_seq > vhd->join_history ?
+				   h->next_seq - vhd->join_history : 0;
+	if (sub->history_seq < h->oldest_seq)
+		sub->history_seq = h->oldest_seq;
+	sub->page_seq = sub->history_seq;
+	minimal_unlock(&mr->lock);
+
+	sub->needs_history = 1;
+	lws_callback_on_writable(sub->pss->wsi);
+}
+
+/*
+ * Act on one whole frame from a client.  Returns -1 if the client is to be
+ * closed.
+ */
+static int
+__minimal_receive(struct per_vhost_data__minimal *vhd,
+		  struct per_session_data__minimal *pss, const void *in,
+		  size_t len)
+{
+	uint64_t received = __minimal_mono_ns(), want = 0;
+	struct minimal_sub *sub;
+	struct room_frame f;
+	struct room *room;
+	int n;
+
+	minimal_stat_add(vhd->pt[pss->tsi].stats.rx, 1);
+	if (__minimal_frame_parse(in, len, &f)) {
+		if (wire_is_binary(in, len)) {
+			lwsl_info("%s: dropping malformed binary frame\n",
+				  __func__);
+			return 0;
+		}
+		/* RFC 6455 8.1, a text frame that isn't UTF-8 fails the ws */
+		lwsl_notice("%s: text frame isn't UTF-8\n", __func__);
+		lws_close_reason(pss->wsi, LWS_CLOSE_STATUS_INVALID_PAYLOAD,
+				 (unsigned char *)"invalid UTF-8", 13);
+		return -1;
+	}
+
+	switch (f.type) {
+	case MINIMAL_MSG_JOIN:
+		room = __minimal_client_room(vhd, pss, &f);
+		if (!room) {
+			lwsl_warn("%s: unable to make room '%.*s'\n", __func__,
+				  (int)f.room_len, f.room);
+			return 0;
+		}
+		if (!__minimal_subscribe(vhd, pss, room)) {
+			lwsl_notice("%s: client is in too many rooms\n",
+				    __func__);
+			return 0;
+		}
+		/* let the room know, the joiner included */
+		__minimal_publish(vhd, pss->tsi, room, in, len, received);
+		break;
+
+	case MINIMAL_MSG_LEAVE:
+		room = __minimal_room_lookup(vhd, f.room, f.room_len, 0);
+		sub = room ? __minimal_sub_of(pss, room) : NULL;
+		if (!sub)
+			return 0;
+		__minimal_publish(vhd, pss->tsi, room, in, len, received);
+		__minimal_unsubscribe(sub);
+		break;
+
+	case MINIMAL_MSG_HISTORY_REQUEST:
+		room = __minimal_room_lookup(vhd, f.room, f.room_len, 0);
+		sub = room ? __minimal_sub_of(pss, room) : NULL;
+		if (sub)
+			__minimal_page_request(sub, &f);
+		break;
+
+	case MINIMAL_MSG_STATS:
+		pss->stats_pending = 1;
+		lws_callback_on_writable(pss->wsi);
+		break;
+
+	case MINIMAL_MSG_RESUME:
+		/* back after a reconnect, quietly rejoin if need be */
+		room = __minimal_client_room(vhd, pss, &f);
+		sub = room ? __minimal_subscribe(vhd, pss, room) : NULL;
+		if (!sub) {
+			lwsl_notice("%s: unable to resume '%.*s'\n", __func__,
+				    (int)f.room_len, f.room);
+			return 0;
+		}
+		for (n = 0; (size_t)n < f.content_len &&
+			    f.content[n] >= '0' && f.content[n] <= '9'; n++)
+			want = (want * 10) + (uint64_t)(f.content[n] - '0');
+		__minimal_resume(vhd, sub, want);
+		break;
+
+	default:
+		/* only members may talk in a room */
+		room = __minimal_room_lookup(vhd, f.room, f.room_len, 0);
+		if (!room || !__minimal_sub_of(pss, room)) {
+			lwsl_info("%s: not in room '%.*s'\n", __func__,
+				  (int)f.room_len, f.room);
+			return 0;
+		}
+		__minimal_publish(vhd, pss->tsi, room, in, len, received);
+		break;
+	}
+	return 0;
+}
+
+static int
+__minimal_grow(unsigned char **buf, size_t *buf_len, size_t need)
+{
+	unsigned char *p;
+
+	if (*buf_len >= need)
+		return 0;
+
+	p = realloc(*buf, need);
+	if (!p)
+		return -1;
+	*buf = p;
+	*buf_len = need;
+
+	return 0;
+}
+
+/*
+ * Frames we make go to each client in the format it talks, text or binary
+ * (see wire.h).  They are encoded in the thread's page_buf.
+ */
+static int
+__minimal_write_frame(struct per_session_data__minimal *pss,
+		      struct minimal_pt *pt, const struct wire_frame *f)
+{
+	unsigned char *p;
+	size_t n;
+	int m;
+
+	if (__minimal_grow(&pt->page_buf, &pt->page_buf_len,
+			   LWS_PRE + wire_bound(f)))
+		return -1;
+
+	p = pt->page_buf + LWS_PRE;
+	n = pss->binary ? wire_encode(f, p) : wire_text_encode(f, p);
+
+	m = lws_write(pss->wsi, p, n,
+		      pss->binary ? LWS_WRITE_BINARY : LWS_WRITE_TEXT);
+	if (m < 0) {
+		lwsl_err("ERROR %d writing to ws\n", m);
+		return -1;
+	}
+	minimal_stat_add(pt->stats.tx, 1);
+	minimal_stat_add(pt->stats.tx_bytes, n);
+
+	return 0;
+}
+
+/*
+ * Messages are kept as the client that sent them wrote them.  Point *out at
+ * rec in the format pss talks, rec itself if it is in it already, which it
+ * usually is, else a copy recoded in the thread's recode_buf.  Either way
+ * there are LWS_PRE bytes before it.  A record that doesn't parse goes as
+ * it is.
+ */
+static int
+__minimal_recode(struct per_session_data__minimal *pss, struct minimal_pt *pt,
+		 const void *rec, size_t len, const char **out,
+		 size_t *out_len)
+{
+	struct wire_frame f;
+	unsigned char *p;
+
+	*out = rec;
+	*out_len = len;
+	if (!len || wire_is_binary(rec, len) == pss->binary ||
+	    wire_parse(rec, len, &f))
+		return 0;
+
+	if (__minimal_grow(&pt->recode_buf, &pt->recode_buf_len,
+			   LWS_PRE + wire_bound(&f)))
+		return -1;
+
+	p = pt->recode_buf + LWS_PRE;
+	*out = (const char *)p;
+	*out_len = pss->binary ? wire_encode(&f, p) : wire_text_encode(&f, p);
+
+	return 0;
+}
+
+/* one stored message, with LWS_PRE before it, as it is or recoded */
+static int
+__minimal_write_record(struct per_session_data__minimal *pss,
+		       struct minimal_pt *pt, const void *rec, size_t len)
+{
+	const char *p;
+	size_t n;
+	int m;
+
+	if (__minimal_recode(pss, pt, rec, len, &p, &n))
+		return -1;
+
+	m = lws_write(pss->wsi, (unsigned char *)p, n,
+		      pss->binary ? LWS_WRITE_BINARY : LWS_WRITE_TEXT);
+	if (m < 0) {
+		lwsl_err("ERROR %d writing to ws\n", m);
+		return -1;
+	}
+	minimal_stat_add(pt->stats.tx, 1);
+	minimal_stat_add(pt->stats.tx_bytes, n);
+
+	return 0;
+}
+
+/*
+ * Send one record of a page as "5|<ts>|<seq>|<room>|<record>".  With no
+ * record it ends a page or a join's history, and seq is where the client
+ * pages back from next, or 0 if there is nothing older.
+ */
+static int
+__minimal_write_page_frame(struct per_session_data__minimal *pss,
+			   struct minimal_pt *pt, int type, struct room *room,
+			   uint64_t ts, uint64_t seq, const void *rec,
+			   size_t len)
+{
+	struct wire_frame f;
+
+	memset(&f, 0, sizeof(f));
+	f.type = type;
+	f.timestamp = ts;
+	f.seq = seq; /* and no user, text puts the seq in its place */
+	f.content = room->name;
+	f.content_len = strlen(room->name);
+	if (__minimal_recode(pss, pt, rec, len, &f.metadata, &f.metadata_len))
+		return -1;
+
+	return __minimal_write_frame(pss, pt, &f);
+}
+
+/*
+ * Send as much of a requested page as the connection takes, up to *budget
+ * bytes, newest record first, like __minimal_replay_history()
+ */
+static int
+__minimal_send_page(struct lws *wsi, struct minimal_sub *sub,
+		    struct per_vhost_data__minimal *vhd, size_t *budget)
+{
+	struct minimal_pt *pt = &vhd->pt[sub->pss->tsi];
+	struct minimal_room *mr = minimal_room(sub->room);
+	struct history *h = &sub->room->history;
+	struct hist_rec *hrec;
+	size_t sent = 0;
+	int ret = 0;
+
+	minimal_lock(&mr->lock);
+
+	while (sub->page_left && sub->page_seq > h->oldest_seq) {
+		hrec = history_get(h, sub->page_seq - 1);
+		if (!hrec)
+			break;
+
+		if (__minimal_write_page_frame(sub->pss, pt,
+					       MINIMAL_MSG_HISTORY_RESPONSE,
+					       sub->room, hrec->timestamp,
+					       hrec->seq,
+					       hist_rec_payload(hrec),
+					       hrec->len)) {
+			ret = -1;
+			goto bail;
+		}
+
+		sub->page_seq--;
+		sub->page_left--;
+		sent += hrec->len;
+
+		if (sent >= *budget || lws_send_pipe_choked(wsi))
+			goto bail; /* the rest next time */
+	}
+
+	/* the page is done, say where the next one starts */
+	sub->page_pending = 0;
+	if (__minimal_write_page_frame(sub->pss, pt,
+				       MINIMAL_MSG_HISTORY_RESPONSE, sub->room, 0,
+				       sub->page_seq > h->oldest_seq ?
+						sub->page_seq : 0, NULL, 0))
+		ret = -1;
+
+bail:
+	minimal_unlock(&mr->lock);
+	*budget -= sent < *budget ? sent : *budget;
+
+	return ret;
+}
+
+/*
+ * Send as much of a room's history as the connection takes: keep writing
+ * records until the pipe chokes or *budget bytes went out.  A joining
+ * client gets a typical history in one event loop iteration instead of one
+ * per message.
+ */
+static int
+__minimal_replay_history(struct lws *wsi, struct minimal_sub *sub,
+			 struct per_vhost_data__minimal *vhd, size_t *budget)
+{
+	struct minimal_pt *pt = &vhd->pt[sub->pss->tsi];
+	struct minimal_room *mr = minimal_room(sub->room);
+	struct history *h = &sub->room->history;
+	struct hist_rec *hrec;
+	size_t sent = 0;
+	int ret = 0;
+
+	/*
+	 * Other threads append while we replay, and we write straight from
+	 * the arena, so hold the lock for this burst.  It is bounded by the
+	 * budget and the socket never blocks.
+	 */
+	minimal_lock(&mr->lock);
+
+	/* whatever was evicted meanwhile is gone, skip past it */
+	if (sub->history_seq < h->oldest_seq)
+		sub->history_seq = h->oldest_seq;
+
+	while (sub->history_seq < h->next_seq) {
+		hrec = history_get(h, sub->history_seq);
+		if (!hrec)
+			break;
+
+		if (sub->sequenced) {
+			if (__minimal_write_page_frame(sub->pss, pt,
+						MINIMAL_MSG_RESUME, sub->room,
+						hrec->timestamp, hrec->seq,
+						hist_rec_payload(hrec),
+						hrec->len)) {
+				ret = -1;
+				goto bail;
+			}
+		} else if (__minimal_write_record(sub->pss, pt,
+						  hist_rec_payload(hrec),
+						  hrec->len)) {
+			ret = -1;
+			goto bail;
+		}
+
+		sub->history_seq++;
+		sent += hrec->len;
+
+		if (sent >= *budget || lws_send_pipe_choked(wsi))
+			break;
+	}
+
+	/* Done sending history, say where paging starts and go live */
+	if (sub->history_seq >= h->next_seq) {
+		if (__minimal_write_page_frame(sub->pss, pt,
+				MINIMAL_MSG_HISTORY_RESPONSE, sub->room, 0,
+				sub->page_seq > h->oldest_seq ?
+						sub->page_seq : 0, NULL, 0)) {
+			ret = -1;
+			goto bail;
+		}
+		__minimal_attach_live(sub);
+		if (sub->page_queued) {
+			sub->page_queued = 0;
+			__minimal_page_start(sub, &sub->queued);
+		}
+	}
+
+bail:
+	minimal_unlock(&mr->lock);
+	*budget -= sent < *budget ? sent : *budget;
+
+	return ret;
+}
+
+/* does this subscription have anything for its client */
+static int
+__minimal_sub_busy(struct minimal_sub *sub)
+{
+	struct minimal_room_pt *rp;
+
+	if (!sub->room)
+		return 0;
+	if (sub->needs_history || sub->page_pending)
+		return 1;
+
+	rp = &minimal_room(sub->room)->pt[sub->pss->tsi];
+
+	return sub->attached && (sub->reader.kicked ||
+				 bcast_ring_pending(&rp->ring, &sub->reader));
+}
+
+/* every thread's fanout latencies, for reading */
+static void
+__minimal_fanout_latency(struct per_vhost_data__minimal *vhd,
+			 struct lat_hist *h)
+{
+	int n;
+
+	memset(h, 0, sizeof(*h));
+	for (n = 0; n < vhd->count_threads; n++)
+		lat_hist_merge(h, &vhd->pt[n].stats.fanout);
+}
+
+static int
+__minimal_latency_summary(struct per_vhost_data__minimal *vhd, char *buf,
+			  size_t len)
+{
+	struct lat_hist h;
+
+	__minimal_fanout_latency(vhd, &h);
+
+	return lws_snprintf(buf, len, "count=%llu p50_ns=%llu p99_ns=%llu "
+			    "p999_ns=%llu max_ns=%llu",
+			    (unsigned long long)h.count,
+			    (unsigned long long)lat_hist_quantile(&h, 0.5),
+			    (unsigned long long)lat_hist_quantile(&h, 0.99),
+			    (unsigned long long)lat_hist_quantile(&h, 0.999),
+			    (unsigned long long)h.max);
+}
+
+/* "6|<ts>|server|count=<n> p50_ns=<ns> ...|", what a stats frame gets back */
+static int
+__minimal_send_stats(struct per_session_data__minimal *pss,
+		     struct per_vhost_data__minimal *vhd)
+{
+	struct wire_frame f;
+	char summary[256];
+
+	memset(&f, 0, sizeof(f));
+	f.type = MINIMAL_MSG_STATS;
+	f.timestamp = __minimal_now_us();
+	f.user = "server";
+	f.user_len = 6;
+	f.content = summary;
+	f.content_len = (size_t)__minimal_latency_summary(vhd, summary,
+							  sizeof(summary));
+
+	return __minimal_write_frame(pss, &vhd->pt[pss->tsi], &f);
+}
+
+/*
+ * "3|<ts>|server|retry-after|<ms>", the client should reconnect no sooner
+ * than ms from now
+ */
+static int
+__minimal_send_retry_after(struct per_session_data__minimal *pss,
+			   struct per_vhost_data__minimal *vhd)
+{
+	struct wire_frame f;
+	char ms[12];
+
+	memset(&f, 0, sizeof(f));
+	f.type = MINIMAL_MSG_STATUS;
+	f.timestamp = __minimal_now_us();
+	f.user = "server";
+	f.user_len = 6;
+	f.content = "retry-after";
+	f.content_len = 11;
+	f.metadata = ms;
+	f.metadata_len = (size_t)lws_snprintf(ms, sizeof(ms), "%u",
+					      pss->retry_after_ms);
+
+	return __minimal_write_frame(pss, &vhd->pt[pss->tsi], &f);
+}
+
+/*
+ * One live message from the next of our rooms that has one, round robin.
+ * Returns its bytes, 0 if no room had any, or -1 to close.
+ */
+static int
+__minimal_write_live(struct lws *wsi, struct per_session_data__minimal *pss,
+		     struct per_vhost_data__minimal *vhd)
+{
+	struct minimal_stats *st = &vhd->pt[pss->tsi].stats;
+	struct minimal_room_pt *rp;
+	struct minimal_sub *sub;
+	const struct msg *pmsg;
+	int n, len;
+
+	for (n = 0; n < MINIMAL_MAX_JOINED; n++) {
+		sub = &pss->subs[(pss->next_sub + n) % MINIMAL_MAX_JOINED];
+		if (!sub->room || !sub->attached)
+			continue;
+
+		if (sub->reader.kicked) {
+			lwsl_notice("%s: closing slow client, %llu dropped, "
+				    "evicted %u times\n", __func__,
+				    (unsigned long long)sub->reader.dropped,
+				    pss->evicted);
+			lws_close_reason(wsi, LWS_CLOSE_STATUS_POLICY_VIOLATION,
+					 (unsigned char *)"too slow", 8);
+			return -1;
+		}
+
+		rp = &minimal_room(sub->room)->pt[pss->tsi];
+
+		/* skip what history sent */
+		while ((pmsg = bcast_ring_peek(&rp->ring, &sub->reader)) &&
+		       pmsg->seq != MSG_NO_SEQ && pmsg->seq < sub->live_from)
+			bcast_ring_consume(&rp->ring, &sub->reader);
+		if (!pmsg)
+			continue;
+
+		pss->next_sub = (pss->next_sub + n + 1) % MINIMAL_MAX_JOINED;
+
+		/*
+		 * notice we allowed for LWS_PRE in the payload already.  If
+		 * the socket takes less than all of it, lws keeps the rest and
+		 * holds off our next writable until it is sent, so only an
+		 * error is fatal.
+		 */
+		if (sub->sequenced && pmsg->seq != MSG_NO_SEQ) {
+			if (__minimal_write_page_frame(pss, &vhd->pt[pss->tsi],
+					MINIMAL_MSG_RESUME, sub->room,
+					pmsg->timestamp, pmsg->seq,
+					(unsigned char *)pmsg->payload + LWS_PRE,
+					pmsg->len))
+				return -1;
+		} else if (__minimal_write_record(pss, &vhd->pt[pss->tsi],
+				(unsigned char *)pmsg->payload + LWS_PRE,
+				pmsg->len))
+			return -1;
+		if (pmsg->received)
+			lat_hist_record(&st->fanout,
+					__minimal_mono_ns() - pmsg->received);
+
+		/* the ring may free it when we move past */
+		len = (int)pmsg->len;
+		bcast_ring_consume(&rp->ring, &sub->reader);
+
+		return len ? len : 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Up to a slice of join history, resumed history or a requested page from
+ * the next of our rooms that wants one, round robin.  Returns the bytes,
+ * 0 if no room wanted any, or we are still waiting to be admitted, or -1 to
+ * close.
+ */
+static int
+__minimal_write_history(struct lws *wsi, struct per_session_data__minimal *pss,
+			struct per_vhost_data__minimal *vhd, size_t slice)
+{
+	struct minimal_sub *sub;
+	size_t left = slice;
+	int n;
+
+	if (pss->admit_at)
+		return 0;
+
+	for (n = 0; n < MINIMAL_MAX_JOINED; n++) {
+		sub = &pss->subs[(pss->next_hist + n) % MINIMAL_MAX_JOINED];
+		if (!sub->room || (!sub->needs_history && !sub->page_pending))
+			continue;
+
+		pss->next_hist = (pss->next_hist + n + 1) % MINIMAL_MAX_JOINED;
+
+		if (sub->needs_history ?
+		    __minimal_replay_history(wsi, sub, vhd, &left) :
+		    __minimal_send_page(wsi, sub, vhd, &left))
+			return -1;
+
+		/* frames with no record count too */
+		return slice - left ? (int)(slice - left) : 1;
+	}
+
+	return 0;
+}
+
+/*
+ * A writable callback sends up to "replay-quantum" bytes, taking turns
+ * between one live message and a slice of history, so live traffic keeps
+ * flowing to a client pulling a big backlog, and the backlog still moves
+ * while the room is busy.  A room's join or resume history still goes out
+ * before its live messages, those follow on from it.  Control frames go
+ * first.
+ */
+static int
+__minimal_writeable(struct lws *wsi, struct per_session_data__minimal *pss,
+		    struct per_vhost_data__minimal *vhd)
+{
+	struct minimal_stats *st = &vhd->pt[pss->tsi].stats;
+	size_t budget = vhd->replay_quantum, slice;
+	struct minimal_sub *sub;
+	int n, live, hist;
+
+	minimal_stat_add(st->writables, 1);
+
+	/* still draining an earlier write, come back when it is gone */
+	if (lws_send_pipe_choked(wsi)) {
+		lws_callback_on_writable(wsi);
+		return 0;
+	}
+
+	if (pss->stats_pending) {
+		pss->stats_pending = 0;
+		if (__minimal_send_stats(pss, vhd))
+			return -1;
+	}
+
+	if (pss->retry_after_ms) {
+		__minimal_send_retry_after(pss, vhd);
+		lws_close_reason(wsi, LWS_CLOSE_STATUS_TRY_AGAIN_LATER,
+				 (unsigned char *)"busy", 4);
+		return -1;
+	}
+
+	while (budget && !lws_send_pipe_choked(wsi)) {
+		live = __minimal_write_live(wsi, pss, vhd);
+		if (live < 0)
+			return -1;
+		budget -= (size_t)live < budget ? (size_t)live : budget;
+		if (!budget || lws_send_pipe_choked(wsi))
+			break;
+
+		slice = budget < MINIMAL_HISTORY_SLICE ? budget :
+							 MINIMAL_HISTORY_SLICE;
+		hist = __minimal_write_history(wsi, pss, vhd, slice);
+		if (hist < 0)
+			return -1;
+		budget -= (size_t)hist < budget ? (size_t)hist : budget;
+
+		if (!live && !hist)
+			break;
+	}
+
+	/* come back for the rest, in this room or another */
+	for (n = 0; n < MINIMAL_MAX_JOINED; n++) {
+		sub = &pss->subs[n];
+		/* history we aren't admitted for yet, our timer wakes us */
+		if (pss->admit_at && (sub->needs_history || sub->page_pending))
+			continue;
+		if (__minimal_sub_busy(sub)) {
+			lws_callback_on_writable(wsi);
+			break;
+		}
+	}
+
+	return 0;
+}
+
+#if !defined(LWS_WITHOUT_EXTENSIONS)
+/*
+ * zlib's own sizing: deflate takes (1 << (windowBits + 2)) +
+ * (1 << (memLevel + 9)) bytes and inflate 1 << windowBits plus about 7KB.
+ * We inflate what the client sends with the full 32KB window.
+ */
+static uint32_t
+__minimal_deflate_mem(int window_bits, int mem_level)
+{
+	return (1u << (window_bits + 2)) + (1u << (mem_level + 9)) +
+	       (1u << 15) + 7168;
+}
+
+static void
+__minimal_deflate_opts(struct per_vhost_data__minimal *vhd,
+		       const struct lws_protocol_vhost_options *pvo)
+{
+	const struct lws_protocol_vhost_options *o;
+	int level = 1, mem_level = 8, window_bits = 15;
+
+	o = lws_pvo_search(pvo, "deflate-level");
+	if (o)
+		level = atoi(o->value);
+	o = lws_pvo_search(pvo, "deflate-mem-level");
+	if (o)
+		mem_level = atoi(o->value);
+	o = lws_pvo_search(pvo, "deflate-window-bits");
+	if (o)
+		window_bits = atoi(o->value);
+	o = lws_pvo_search(pvo, "deflate-no-context-takeover");
+	vhd->deflate_no_takeover = o && atoi(o->value);
+
+	/* what zlib accepts */
+	if (level < 1 || level > 9)
+		level = 1;
+	if (mem_level < 1 || mem_level > 9)
+		mem_level = 8;
+	if (window_bits < 9 || window_bits > 15)
+		window_bits = 15;
+
+	lws_snprintf(vhd->deflate_level, sizeof(vhd->deflate_level), "%d",
+		     level);
+	lws_snprintf(vhd->deflate_mem_level, sizeof(vhd->deflate_mem_level),
+		     "%d", mem_level);
+	vhd->deflate_window_bits = window_bits;
+}
+
+/*
+ * The server_max_window_bits the client offered, lws negotiates no more.
+ * 15 if no offer names one, 0 if we can't tell.  With several offers we
+ * take the smallest, lowering the window is always safe.
+ */
+static int
+__minimal_deflate_offered_bits(struct lws *wsi)
+{
+	char ext[512], *p = ext;
+	int bits = 15, n;
+
+	if (lws_hdr_copy(wsi, ext, sizeof(ext), WSI_TOKEN_EXTENSIONS) < 0)
+		return 0;
+
+	while ((p = strstr(p, "server_max_window_bits="))) {
+		p += 23;
+		n = atoi(p);
+		if (n < bits)
+			bits = n;
+	}
+
+	return bits;
+}
+
+/*
+ * If the client negotiated permessage-deflate, apply our settings before
+ * anything is compressed.  A smaller window than was negotiated, or
+ * dropping the context after each message, is always safe for the
+ * client's inflater, so the window is only ever lowered.
+ */
+static void
+__minimal_deflate_setup(struct lws *wsi, struct per_vhost_data__minimal *vhd,
+			struct per_session_data__minimal *pss)
+{
+	int bits = __minimal_deflate_offered_bits(wsi);
+	char val[4];
+
+	if (lws_set_extension_option(wsi, "permessage-deflate",
+				     "compression_level", vhd->deflate_level))
+		return; /* not negotiated */
+
+	lws_set_extension_option(wsi, "permessage-deflate", "mem_level",
+				 vhd->deflate_mem_level);
+	if (vhd->deflate_window_bits < bits) {
+		bits = vhd->deflate_window_bits;
+		lws_snprintf(val, sizeof(val), "%d", bits);
+		lws_set_extension_option(wsi, "permessage-deflate",
+					 "server_max_window_bits", val);
+	}
+	if (vhd->deflate_no_takeover)
+		lws_set_extension_option(wsi, "permessage-deflate",
+					 "server_no_context_takeover", "1");
+
+	/* a window we couldn't find out is counted as the biggest */
+	pss->deflate_mem = __minimal_deflate_mem(bits ? bits : 15,
+					atoi(vhd->deflate_mem_level));
+	__atomic_add_fetch(&vhd->deflate_mem, pss->deflate_mem,
+			   __ATOMIC_RELAXED);
+	__atomic_add_fetch(&vhd->count_deflate, 1, __ATOMIC_RELAXED);
+
+	lwsl_info("%s: deflate, %u bytes of zlib state\n", __func__,
+		  pss->deflate_mem);
+}
+
+static void
+__minimal_deflate_release(struct per_vhost_data__minimal *vhd,
+			  struct per_session_data__minimal *pss)
+{
+	if (!pss->deflate_mem)
+		return;
+
+	lwsl_info("%s: %d deflate connections left, %llu bytes\n", __func__,
+		  __atomic_sub_fetch(&vhd->count_deflate, 1, __ATOMIC_RELAXED),
+		  (unsigned long long)__atomic_sub_fetch(&vhd->deflate_mem,
+				pss->deflate_mem, __ATOMIC_RELAXED));
+	pss->deflate_mem = 0;
+}
+#endif
+
+/*
+ * Give back what rooms nobody uses hold, from thread tsi's stats tick.  A
+ * room's ring on this thread goes once this thread has no subscribers in
+ * it, a new one makes it again.  If room_idle_us is set, thread 0 also
+ * frees the history arena, and the history in it, of rooms other than the
+ * lobby with no subscribers anywhere and no message for that long.  The
+ * rooms themselves stay, with their seqs, room pointers are never freed.
  */
+static void
+__minimal_reclaim_rooms(struct per_vhost_data__minimal *vhd, int tsi)
+{
+	uint64_t now = __minimal_now_us(), count, bytes;
+	struct minimal_room *mr;
+	struct hist_rec *hrec;
+	struct room *r;
+	int n, subs;
 
-#if !defined (LWS_PLUGIN_STATIC)
-#define LWS_DLL
-#define LWS_INTERNAL
-#include <libwebsockets.h>
-#endif
+	/* rooms are only ever added at the head, the rest can be walked */
+	minimal_lock(&vhd->rooms_lock);
+	r = vhd->rooms.all;
+	minimal_unlock(&vhd->rooms_lock);
 
-#include <string.h>
+	for (; r; r = r->all) {
+		mr = minimal_room(r);
+		if (!mr->pt[tsi].subs)
+			bcast_ring_destroy(&mr->pt[tsi].ring);
 
-/* one of these created for each message */
+		if (tsi || !vhd->room_idle_us || r == vhd->lobby)
+			continue;
 
-struct msg {
-	void *payload; /* is malloc'd */
-	size_t len;
-	uint64_t timestamp;
-	struct msg *next;
-};
+		minimal_lock(&mr->lock);
+		for (n = 0, subs = 0; n < vhd->count_threads; n++)
+			subs += __atomic_load_n(&mr->pt[n].count_subs,
+						__ATOMIC_ACQUIRE);
+		hrec = r->history.count ?
+		       history_get(&r->history, r->history.next_seq - 1) : NULL;
+		if (r->history.arena && !subs &&
+		    (!hrec || hrec->timestamp + vhd->room_idle_us < now)) {
+			count = r->history.count;
+			bytes = r->history.bytes;
+			history_release(&r->history);
+			__atomic_sub_fetch(&vhd->history_count, count,
+					   __ATOMIC_RELAXED);
+			__atomic_sub_fetch(&vhd->history_bytes, bytes,
+					   __ATOMIC_RELAXED);
+		}
+		minimal_unlock(&mr->lock);
+	}
+}
 
-/* one of these is created for each client connecting to us */
+/*
+ * Once a second on each service thread: work out the thread's rates since
+ * the last tick, and sort its clients by how many messages they have
+ * waiting into the queue depth buckets
+ */
+static void
+__minimal_stats_tick(lws_sorted_usec_list_t *sul)
+{
+	struct minimal_stats *st = lws_container_of(sul, struct minimal_stats,
+						    sul);
+	struct minimal_pt *pt = lws_container_of(st, struct minimal_pt, stats);
+	uint32_t qdepth[MINIMAL_QDEPTH_BUCKETS];
+	lws_usec_t now = lws_now_usecs(), us = now - st->last_us;
+	uint64_t msgs;
+	int n;
 
-struct per_session_data__minimal {
-	struct per_session_data__minimal *pss_list;
-	struct lws *wsi;
-	int last; /* the last message number we sent */
-	int needs_history; /* flag to indicate this client needs history */
-	struct msg *history_pos; /* current position in history sending */
-};
+	memset(qdepth, 0, sizeof(qdepth));
+	lws_start_foreach_ll(struct per_session_data__minimal *, pss,
+			     pt->pss_list) {
+		__minimal_backlog(pss, &msgs);
+		n = msgs ? 64 - __builtin_clzll(msgs) : 0;
+		if (n >= MINIMAL_QDEPTH_BUCKETS)
+			n = MINIMAL_QDEPTH_BUCKETS - 1;
+		qdepth[n]++;
+	} lws_end_foreach_ll(pss, pss_list);
 
-/* one of these is created for each vhost our protocol is used with */
+	for (n = 0; n < MINIMAL_QDEPTH_BUCKETS; n++)
+		__atomic_store_n(&st->qdepth[n], qdepth[n], __ATOMIC_RELAXED);
 
-struct per_vhost_data__minimal {
-	struct lws_context *context;
-	struct lws_vhost *vhost;
-	const struct lws_protocols *protocol;
+	if (st->last_us && us > 0) {
+		__atomic_store_n(&st->rx_rate, (st->rx - st->last_rx) *
+				 LWS_US_PER_SEC / (uint64_t)us,
+				 __ATOMIC_RELAXED);
+		__atomic_store_n(&st->tx_rate, (st->tx - st->last_tx) *
+				 LWS_US_PER_SEC / (uint64_t)us,
+				 __ATOMIC_RELAXED);
+		__atomic_store_n(&st->writable_rate,
+				 (st->writables - st->last_writables) *
+				 LWS_US_PER_SEC / (uint64_t)us,
+				 __ATOMIC_RELAXED);
+	}
+	st->last_us = now;
+	st->last_rx = st->rx;
+	st->last_tx = st->tx;
+	st->last_writables = st->writables;
 
-	struct per_session_data__minimal *pss_list; /* linked-list of live pss*/
+	__minimal_reclaim_rooms(pt->vhd, st->tsi);
 
-	struct msg amsg; /* the one pending message... */
-	int current; /* the current message number we are caching */
-	
-	/* Message history */
-	struct msg *message_history_head;
-	struct msg *message_history_tail;
-	int message_count;
-	int max_history_messages;
-};
+	lws_sul_schedule(st->context, st->tsi, &st->sul, __minimal_stats_tick,
+			 MINIMAL_STATS_INTERVAL_US);
+}
 
-/* destroys the message when everyone has had a copy of it */
+/* the most messages waiting for the client at quantile q, from the buckets */
+static uint64_t
+__minimal_qdepth_quantile(const uint32_t *qdepth, uint64_t total, double q)
+{
+	uint64_t want = (uint64_t)(q * (double)total + 0.999999), seen = 0;
+	int n;
 
-static void
-__minimal_destroy_message(void *_msg)
+	for (n = 0; n < MINIMAL_QDEPTH_BUCKETS - 1; n++) {
+		seen += qdepth[n];
+		if (seen >= want)
+			break;
+	}
+
+	/* bucket n holds up to 2^n - 1 */
+	return (1ull << n) - 1;
+}
+
+static int
+__minimal_metric(char *p, size_t len, const char *name, const char *type,
+		 const char *help, uint64_t value)
+{
+	return lws_snprintf(p, len, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n",
+			    name, help, name, type, name,
+			    (unsigned long long)value);
+}
+
+/*
+ * Format the vhost's metrics in the Prometheus text format.  Everything is
+ * read with relaxed loads, the service threads are never held up for it.
+ */
+static size_t
+__minimal_metrics(struct per_vhost_data__minimal *vhd, char *buf, size_t len)
+{
+	uint64_t clients = 0, rx = 0, rx_rate = 0, tx = 0, tx_rate = 0,
+		 tx_bytes = 0, writables = 0, writable_rate = 0,
+		 admit_waits = 0, admit_rejects = 0;
+	uint32_t qdepth[MINIMAL_QDEPTH_BUCKETS];
+	static const double quantiles[] = { 0.5, 0.9, 0.99 },
+			    lat_quantiles[] = { 0.5, 0.99, 0.999 };
+	struct slab_stats slab;
+	struct minimal_stats *st;
+	struct lat_hist h;
+	char *p = buf, *end = buf + len;
+	int n, m;
+
+	memset(qdepth, 0, sizeof(qdepth));
+	for (n = 0; n < vhd->count_threads; n++) {
+		st = &vhd->pt[n].stats;
+		clients += minimal_stat_get(st->clients);
+		rx += minimal_stat_get(st->rx);
+		rx_rate += minimal_stat_get(st->rx_rate);
+		tx += minimal_stat_get(st->tx);
+		tx_rate += minimal_stat_get(st->tx_rate);
+		tx_bytes += minimal_stat_get(st->tx_bytes);
+		writables += minimal_stat_get(st->writables);
+		writable_rate += minimal_stat_get(st->writable_rate);
+		admit_waits += minimal_stat_get(st->admit_waits);
+		admit_rejects += minimal_stat_get(st->admit_rejects);
+		for (m = 0; m < MINIMAL_QDEPTH_BUCKETS; m++)
+			qdepth[m] += minimal_stat_get(st->qdepth[m]);
+	}
+
+	p += __minimal_metric(p, (size_t)(end - p), "im_clients",
+			"gauge", "Connected websocket clients.", clients);
+	p += __minimal_metric(p, (size_t)(end - p), "im_rooms",
+			"gauge", "Rooms created.",
+			minimal_stat_get(vhd->rooms.count));
+	p += __minimal_metric(p, (size_t)(end - p),
+			"im_messages_received_total", "counter",
+			"Frames received from clients.", rx);
+	p += __minimal_metric(p, (size_t)(end - p),
+			"im_messages_received_per_second", "gauge",
+			"Frames received from clients over the last second.",
+			rx_rate);
+	p += __minimal_metric(p, (size_t)(end - p),
+			"im_messages_sent_total", "counter",
+			"Frames written to clients, history included.", tx);
+	p += __minimal_metric(p, (size_t)(end - p),
+			"im_messages_sent_per_second", "gauge",
+			"Frames written to clients over the last second.",
+			tx_rate);
+	p += __minimal_metric(p, (size_t)(end - p),
+			"im_sent_bytes_total", "counter",
+			"Payload bytes written to clients.", tx_bytes);
+	p += __minimal_metric(p, (size_t)(end - p),
+			"im_writable_callbacks_total", "counter",
+			"Writable callbacks served.", writables);
+	p += __minimal_metric(p, (size_t)(end - p),
+			"im_writable_callbacks_per_second", "gauge",
+			"Writable callbacks served over the last second.",
+			writable_rate);
+	p += __minimal_metric(p, (size_t)(end - p),
+			"im_history_messages", "gauge",
+			"Messages held in all the room histories.",
+			minimal_stat_get(vhd->history_count));
+	p += __minimal_metric(p, (size_t)(end - p),
+			"im_history_bytes", "gauge",
+			"Payload bytes held in all the room histories.",
+			minimal_stat_get(vhd->history_bytes));
+	p += __minimal_metric(p, (size_t)(end - p),
+			"im_evictions_total", "counter",
+			"Times the evict-policy was applied to a client.",
+			minimal_stat_get(vhd->evictions));
+	p += __minimal_metric(p, (size_t)(end - p),
+			"im_admit_waits_total", "counter",
+			"Clients whose history waited for an admit-rate token.",
+			admit_waits);
+	p += __minimal_metric(p, (size_t)(end - p),
+			"im_admit_rejects_total", "counter",
+			"Clients told to retry after admit-max-wait-ms.",
+			admit_rejects);
+
+	p += lws_snprintf(p, (size_t)(end - p),
+			"# HELP im_client_queue_depth Messages waiting for "
+			"each client, as of the last second, rounded up to a "
+			"power of two less one.\n"
+			"# TYPE im_client_queue_depth summary\n");
+	for (n = 0; n < (int)LWS_ARRAY_SIZE(quantiles); n++)
+		p += lws_snprintf(p, (size_t)(end - p),
+			"im_client_queue_depth{quantile=\"%g\"} %llu\n",
+			quantiles[n], (unsigned long long)
+			__minimal_qdepth_quantile(qdepth, clients,
+						  quantiles[n]));
+	p += lws_snprintf(p, (size_t)(end - p),
+			"im_client_queue_depth_count %llu\n",
+			(unsigned long long)clients);
+
+	p += __minimal_metric(p, (size_t)(end - p),
+			"im_message_bytes", "gauge",
+			"Bytes of messages held in the broadcast rings.",
+			msg_live_bytes());
+	slab_get_stats(&slab);
+	p += __minimal_metric(p, (size_t)(end - p),
+			"im_slab_bytes", "gauge",
+			"Bytes of slabs the messages are allocated from.",
+			slab.slab_bytes);
+	p += __minimal_metric(p, (size_t)(end - p),
+			"im_slab_depot_trips_total", "counter",
+			"Times a thread's slab cache went to the shared depot.",
+			slab.depot_gets + slab.depot_puts);
+	p += __minimal_metric(p, (size_t)(end - p),
+			"im_slab_big_allocs_total", "counter",
+			"Messages too big for the slabs, from malloc().",
+			slab.big_allocs);
+	p += __minimal_metric(p, (size_t)(end - p),
+			"im_history_arena_bytes", "gauge",
+			"Bytes of history arena allocated for the rooms.",
+			history_arena_bytes());
+	p += __minimal_metric(p, (size_t)(end - p),
+			"im_deflate_bytes", "gauge",
+			"Bytes of zlib state for permessage-deflate.",
+			minimal_stat_get(vhd->deflate_mem));
+
+	__minimal_fanout_latency(vhd, &h);
+	p += lws_snprintf(p, (size_t)(end - p),
+			"# HELP im_fanout_latency_seconds From receiving a "
+			"message to writing it to each client.\n"
+			"# TYPE im_fanout_latency_seconds summary\n");
+	for (n = 0; n < (int)LWS_ARRAY_SIZE(lat_quantiles); n++)
+		p += lws_snprintf(p, (size_t)(end - p),
+			"im_fanout_latency_seconds{quantile=\"%g\"} %.9f\n",
+			lat_quantiles[n],
+			(double)lat_hist_quantile(&h, lat_quantiles[n]) / 1e9);
+	p += lws_snprintf(p, (size_t)(end - p),
+			"im_fanout_latency_seconds_count %llu\n",
+			(unsigned long long)h.count);
+
+	return (size_t)(p - buf);
+}
+
+static uint32_t
+__minimal_pvo_u32(const struct lws_protocol_vhost_options *pvo,
+		  const char *name, uint32_t def)
 {
-	struct msg *msg = _msg;
+	const struct lws_protocol_vhost_options *o = lws_pvo_search(pvo, name);
+	long long v;
 
-	free(msg->payload);
-	msg->payload = NULL;
-	msg->len = 0;
+	if (!o)
+		return def;
+
+	v = atoll(o->value);
+	if (v <= 0 || v > 0xffffffffll) {
+		lwsl_warn("%s: ignoring %s '%s'\n", __func__, name, o->value);
+		return def;
+	}
+
+	return (uint32_t)v;
 }
 
-/* Function to add message to history */
+#if defined(MINIMAL_WITH_LOG)
+/*
+ * Refill the room histories from the newest count messages in the log,
+ * so a restart, or a crash, doesn't lose them.  Only the records read here
+ * are touched, the rest of the log stays on disk.
+ */
 static void
-__minimal_add_to_history(struct per_vhost_data__minimal *vhd, void *payload, size_t len)
+__minimal_log_recover(struct per_vhost_data__minimal *vhd, uint32_t count)
 {
-	struct msg *new_msg = malloc(sizeof(struct msg));
-	if (!new_msg) return;
+	uint64_t seq, end = vhd->log.next_seq, ts, rseq;
+	unsigned char *buf = NULL, *p;
+	size_t buf_len = 0;
+	struct room_frame f;
+	struct room *room;
+	uint32_t done = 0;
+	long long n;
 
-	new_msg->payload = malloc(LWS_PRE + len);
-	if (!new_msg->payload) {
-		free(new_msg);
-		return;
+	seq = msglog_oldest(&vhd->log);
+	if (end - seq > count)
+		seq = end - count;
+
+	for (; seq < end; seq++) {
+		n = msglog_read(&vhd->log, seq, buf, buf_len, &ts, &rseq);
+		if (n > (long long)buf_len) {
+			p = realloc(buf, (size_t)n);
+			if (!p)
+				break;
+			buf = p;
+			buf_len = (size_t)n;
+			n = msglog_read(&vhd->log, seq, buf, buf_len, &ts,
+					&rseq);
+		}
+		if (n < 0 || rseq == MSG_NO_SEQ)
+			continue;
+
+		if (__minimal_frame_parse(buf, (size_t)n, &f))
+			continue;
+		room = __minimal_room_lookup(vhd, f.room, f.room_len, 1);
+		/* each room's seqs carry on from where they were */
+		if (!room || rseq < room->history.next_seq)
+			continue;
+		history_seek(&room->history, rseq);
+		if (history_append(&room->history, buf, (size_t)n, ts, NULL))
+			continue;
+		done++;
 	}
 
-	memcpy((char *)new_msg->payload + LWS_PRE, payload, len);
-	new_msg->len = len;
-	new_msg->next = NULL;
+	free(buf);
 
-	/* Add to tail of history list */
-	if (vhd->message_history_tail) {
-		vhd->message_history_tail->next = new_msg;
-	} else {
-		vhd->message_history_head = new_msg;
+	/* nothing is live yet, so just add up what the rooms ended up with */
+	lws_start_foreach_ll(struct room *, r, vhd->rooms.all) {
+		vhd->history_count += r->history.count;
+		vhd->history_bytes += r->history.bytes;
+	} lws_end_foreach_ll(r, all);
+
+	lwsl_user("%s: %u messages restored from %s\n", __func__, done,
+		  vhd->log.dir);
+}
+
+static int
+__minimal_init_log(struct per_vhost_data__minimal *vhd,
+		   const struct lws_protocol_vhost_options *pvo)
+{
+	const struct lws_protocol_vhost_options *dir, *o;
+	int sync_ms = MINIMAL_DEF_LOG_SYNC_MS, readonly;
+
+	dir = lws_pvo_search(pvo, "log-dir");
+	if (!dir || !dir->value[0])
+		return 0;
+
+	o = lws_pvo_search(pvo, "log-sync-ms");
+	if (o)
+		sync_ms = atoi(o->value);
+	o = lws_pvo_search(pvo, "log-writer");
+	readonly = o && !atoi(o->value);
+
+	if (msglog_open(&vhd->log, dir->value, MINIMAL_LOG_SEG_RECORDS,
+			MINIMAL_LOG_SEG_BYTES, sync_ms < 0 ? 0 : sync_ms,
+			readonly)) {
+		if (readonly) {
+			/* the writer may not have made it yet */
+			lwsl_warn("%s: no log in %s yet\n", __func__,
+				  dir->value);
+			return 0;
+		}
+		lwsl_err("%s: unable to open log in %s\n", __func__,
+			 dir->value);
+		return 1;
+	}
+
+	__minimal_log_recover(vhd, __minimal_pvo_u32(pvo, "log-recover",
+						     MINIMAL_DEF_LOG_RECOVER));
+
+	if (readonly)
+		/* the writer's view of it moves on without us */
+		msglog_close(&vhd->log);
+	else
+		vhd->log_open = 1;
+
+	return 0;
+}
+
+#if defined(MINIMAL_WITH_WORKERS)
+/*
+ * The log writer logs what it pulls from the bus, in bus order, so the log
+ * ends with a run of the bus.  Find where on the bus the log's newest record
+ * is, by its room seq and frame, so a restarted writer logs what the other
+ * workers appended while it was down and nothing twice.  If the bus no
+ * longer has it, everything the bus holds is newer.
+ */
+static uint64_t
+__minimal_bus_logged(struct per_vhost_data__minimal *vhd)
+{
+	struct history *h = &vhd->bus->history;
+	uint64_t seq, tag, found;
+	struct hist_rec *hrec;
+	unsigned char *buf;
+	long long n;
+
+	shm_bus_lock(vhd->bus);
+	found = h->oldest_seq;
+	shm_bus_unlock(vhd->bus);
+
+	if (vhd->log.next_seq == msglog_oldest(&vhd->log))
+		return found;
+
+	seq = vhd->log.next_seq - 1;
+	n = msglog_read(&vhd->log, seq, NULL, 0, NULL, NULL);
+	buf = n < 0 ? NULL : malloc((size_t)n + 1);
+	if (!buf ||
+	    msglog_read(&vhd->log, seq, buf, (size_t)n, NULL, &tag) != n) {
+		free(buf);
+		return found;
+	}
+
+	shm_bus_lock(vhd->bus);
+	for (seq = h->next_seq; seq > h->oldest_seq; seq--) {
+		hrec = history_get(h, seq - 1);
+		if (shm_bus_rec_seq(hrec) == tag &&
+		    shm_bus_rec_len(hrec) == (size_t)n &&
+		    !memcmp(shm_bus_rec_payload(hrec), buf, (size_t)n)) {
+			found = seq;
+			break;
+		}
+	}
+	shm_bus_unlock(vhd->bus);
+
+	free(buf);
+
+	return found;
+}
+#endif
+#endif
+
+static int
+__minimal_init_store(struct per_vhost_data__minimal *vhd,
+		     const struct lws_protocol_vhost_options *pvo)
+{
+	const struct lws_protocol_vhost_options *o;
+	uint32_t hmsgs, hbytes, max_rooms;
+	int n;
+
+	vhd->policy = BCAST_SLOW_DROP_OLDEST;
+	vhd->ring_size = __minimal_pvo_u32(pvo, "ring-size",
+					   MINIMAL_DEF_RING_SIZE);
+	hmsgs = __minimal_pvo_u32(pvo, "history-messages",
+				  MINIMAL_DEF_HISTORY_MESSAGES);
+	hbytes = __minimal_pvo_u32(pvo, "history-bytes",
+				   MINIMAL_DEF_HISTORY_BYTES);
+	max_rooms = __minimal_pvo_u32(pvo, "max-rooms", MINIMAL_DEF_MAX_ROOMS);
+	vhd->replay_quantum = __minimal_pvo_u32(pvo, "replay-quantum",
+						MINIMAL_DEF_REPLAY_QUANTUM);
+	vhd->join_history = __minimal_pvo_u32(pvo, "join-history",
+					      MINIMAL_DEF_JOIN_HISTORY);
+	vhd->room_idle_us = (uint64_t)__minimal_pvo_u32(pvo, "room-idle-s",
+				MINIMAL_DEF_ROOM_IDLE_S) * LWS_US_PER_SEC;
+	vhd->max_message = __minimal_pvo_u32(pvo, "max-message",
+					     MINIMAL_DEF_MAX_MESSAGE);
+	o = lws_pvo_search(pvo, "coalesce-ms");
+	if (o && atoi(o->value)) {
+		n = atoi(o->value);
+		if (n < 0 || n > MINIMAL_MAX_COALESCE_MS) {
+			lwsl_warn("%s: coalesce-ms must be 0 to %d\n", __func__,
+				  MINIMAL_MAX_COALESCE_MS);
+			n = n < 0 ? 0 : MINIMAL_MAX_COALESCE_MS;
+		}
+		vhd->coalesce_us = (lws_usec_t)n * LWS_US_PER_MS;
+	}
+	o = lws_pvo_search(pvo, "admit-rate");
+	if (o && atoi(o->value) > 0) {
+		vhd->admit_rate = (uint32_t)atoi(o->value);
+		o = lws_pvo_search(pvo, "admit-burst");
+		vhd->admit_burst = o && atoi(o->value) > 0 ?
+				   (uint32_t)atoi(o->value) : vhd->admit_rate;
+		vhd->admit_max_wait_ms = __minimal_pvo_u32(pvo,
+				"admit-max-wait-ms",
+				MINIMAL_DEF_ADMIT_MAX_WAIT_MS);
+	}
+	vhd->client_max_bytes = __minimal_pvo_u32(pvo, "client-max-bytes",
+						MINIMAL_DEF_CLIENT_MAX_BYTES);
+	vhd->client_max_rooms = __minimal_pvo_u32(pvo, "client-max-rooms",
+						MINIMAL_DEF_CLIENT_MAX_ROOMS);
+	vhd->mem_budget = (uint64_t)__minimal_pvo_u32(pvo, "mem-budget-mb",
+					MINIMAL_DEF_MEM_BUDGET_MB) << 20;
+
+	vhd->evict_policy = BCAST_SLOW_SKIP;
+	o = lws_pvo_search(pvo, "evict-policy");
+	if (o && bcast_slow_policy_from_name(o->value, &vhd->evict_policy))
+		lwsl_warn("%s: unknown evict-policy '%s', using skip\n",
+			  __func__, o->value);
+
+#if !defined(LWS_WITHOUT_EXTENSIONS)
+	__minimal_deflate_opts(vhd, pvo);
+#endif
+
+	o = lws_pvo_search(pvo, "slow-policy");
+	if (o && bcast_slow_policy_from_name(o->value, &vhd->policy))
+		lwsl_warn("%s: unknown slow-policy '%s', using drop\n",
+			  __func__, o->value);
+
+	vhd->count_threads = lws_get_count_threads(vhd->context);
+	for (n = 0; n < vhd->count_threads; n++) {
+		minimal_mutex_init(&vhd->pt[n].waker_lock);
+		vhd->pt[n].vhd = vhd;
+		vhd->pt[n].stats.context = vhd->context;
+		vhd->pt[n].stats.tsi = n;
+		lws_sul_schedule(vhd->context, n, &vhd->pt[n].stats.sul,
+				 __minimal_stats_tick,
+				 MINIMAL_STATS_INTERVAL_US);
+		if (buf_pool_init(&vhd->pt[n].rx_pool, vhd->max_message,
+				  MINIMAL_RX_POOL_KEEP)) {
+			lwsl_err("%s: bad max-message %u\n", __func__,
+				 vhd->max_message);
+			vhd->count_threads = n + 1;
+			return 1;
+		}
+		if (inbox_init(&vhd->pt[n].inbox, vhd->ring_size)) {
+			lwsl_err("%s: OOM allocating %u slot inbox\n",
+				 __func__, vhd->ring_size);
+			vhd->count_threads = n + 1;
+			return 1;
+		}
+	}
+
+	minimal_mutex_init(&vhd->rooms_lock);
+	if (room_table_init(&vhd->rooms, max_rooms, hmsgs, hbytes,
+			    sizeof(struct minimal_room)))
+		return 1;
+
+	vhd->lobby = __minimal_room_lookup(vhd, MINIMAL_LOBBY,
+					   strlen(MINIMAL_LOBBY), 1);
+	if (!vhd->lobby) {
+		lwsl_err("%s: unable to allocate history for %u messages / %u bytes\n",
+			 __func__, hmsgs, hbytes);
+		return 1;
 	}
-	vhd->message_history_tail = new_msg;
-	vhd->message_count++;
 
-	/* Remove old messages if we exceed limit */
-	while (vhd->message_count > vhd->max_history_messages && vhd->message_history_head) {
-		struct msg *old_head = vhd->message_history_head;
-		vhd->message_history_head = vhd->message_history_head->next;
-		if (!vhd->message_history_head) {
-			vhd->message_history_tail = NULL;
+#if defined(MINIMAL_WITH_LOG)
+	if (__minimal_init_log(vhd, pvo))
+		return 1;
+#endif
+
+#if defined(MINIMAL_WITH_WORKERS)
+	vhd->bus = lws_context_user(vhd->context);
+	if (vhd->bus) {
+		/*
+		 * A restarted worker gets back what the bus still holds, on
+		 * top of what the log gave back, rooms skip the seqs they
+		 * have already.  Nobody is subscribed yet to be sent it.  The
+		 * log writer logs the part of it that came after its log.
+		 */
+		minimal_mutex_init(&vhd->bus_lock);
+		shm_bus_lock(vhd->bus);
+		vhd->bus_seq = vhd->bus->history.oldest_seq;
+		shm_bus_unlock(vhd->bus);
+#if defined(MINIMAL_WITH_LOG)
+		if (vhd->log_open)
+			vhd->bus_logged = __minimal_bus_logged(vhd);
+#endif
+		__minimal_bus_pull(vhd, 0);
+
+		if (pthread_create(&vhd->bus_thread, NULL,
+				   __minimal_bus_waiter, vhd)) {
+			lwsl_err("%s: unable to start bus thread\n", __func__);
+			minimal_mutex_destroy(&vhd->bus_lock);
+			vhd->bus = NULL;
+			return 1;
 		}
-		free(old_head->payload);
-		free(old_head);
-		vhd->message_count--;
 	}
+#endif
+
+	return 0;
 }
 
-/* Function to send message history to a new client */
 static void
-__minimal_send_history(struct per_session_data__minimal *pss, struct per_vhost_data__minimal *vhd)
+__minimal_destroy_store(struct per_vhost_data__minimal *vhd)
 {
-	/* Mark this client as needing history and set starting position */
-	pss->needs_history = 1;
-	pss->history_pos = vhd->message_history_head;
-	lws_callback_on_writable(pss->wsi);
+	struct minimal_room *mr;
+	char lat[160];
+	int n;
+
+	if (vhd->count_threads) {
+		__minimal_latency_summary(vhd, lat, sizeof(lat));
+		lwsl_user("%s: fanout latency %s\n", __func__, lat);
+	}
+
+#if defined(MINIMAL_WITH_WORKERS)
+	if (vhd->bus) {
+		/* the bus outlives us, it belongs to the parent */
+		__atomic_store_n(&vhd->bus_stop, 1, __ATOMIC_RELAXED);
+		pthread_join(vhd->bus_thread, NULL);
+		minimal_mutex_destroy(&vhd->bus_lock);
+		vhd->bus = NULL;
+	}
+#endif
+#if defined(MINIMAL_WITH_LOG)
+	if (vhd->log_open) {
+		msglog_close(&vhd->log);
+		vhd->log_open = 0;
+	}
+#endif
+
+	for (n = 0; n < vhd->count_threads; n++) {
+		lws_sul_cancel(&vhd->pt[n].stats.sul);
+		lws_sul_cancel(&vhd->pt[n].sul_coalesce);
+		buf_pool_destroy(&vhd->pt[n].rx_pool);
+		inbox_destroy(&vhd->pt[n].inbox);
+		minimal_mutex_destroy(&vhd->pt[n].waker_lock);
+		free(vhd->pt[n].page_buf);
+		vhd->pt[n].page_buf = NULL;
+		free(vhd->pt[n].recode_buf);
+		vhd->pt[n].recode_buf = NULL;
+	}
+
+	if (!vhd->rooms.buckets)
+		return;
+
+	lws_start_foreach_ll(struct room *, r, vhd->rooms.all) {
+		mr = minimal_room(r);
+		for (n = 0; n < vhd->count_threads; n++)
+			bcast_ring_destroy(&mr->pt[n].ring);
+		minimal_mutex_destroy(&mr->lock);
+	} lws_end_foreach_ll(r, all);
+
+	room_table_destroy(&vhd->rooms);
+	minimal_mutex_destroy(&vhd->rooms_lock);
 }
 
 static int
-callback_minimal(struct lws *wsi, enum lws_callback_reasons reason,
-			void *user, void *in, size_t len)
+__minimal_callback(struct lws *wsi, enum lws_callback_reasons reason,
+		   void *user, void *in, size_t len,
+		   struct per_vhost_data__minimal *vhd)
 {
 	struct per_session_data__minimal *pss =
 			(struct per_session_data__minimal *)user;
-	struct per_vhost_data__minimal *vhd =
-			(struct per_vhost_data__minimal *)
-			lws_protocol_vh_priv_get(lws_get_vhost(wsi),
-					lws_get_protocol(wsi));
-	int m;
+	struct minimal_sub *sub;
+	struct minimal_pt *pt;
+	char seq[24];
+	int n;
 
 	switch (reason) {
 	case LWS_CALLBACK_PROTOCOL_INIT:
@@ -140,108 +2587,248 @@ callback_minimal(struct lws *wsi, enum lws_callback_reasons reason,
 		vhd->context = lws_get_context(wsi);
 		vhd->protocol = lws_get_protocol(wsi);
 		vhd->vhost = lws_get_vhost(wsi);
-		
-		/* Initialize message history */
-		vhd->message_history_head = NULL;
-		vhd->message_history_tail = NULL;
-		vhd->message_count = 0;
-		vhd->max_history_messages = 50; /* Store up to 50 messages */
+
+		if (__minimal_init_store(vhd,
+				(const struct lws_protocol_vhost_options *)in)) {
+			__minimal_destroy_store(vhd);
+			return 1;
+		}
+		lwsl_info("%s: text frames scanned with %s\n", __func__,
+			  text_scan_kernel_name());
+		break;
+
+	case LWS_CALLBACK_PROTOCOL_DESTROY:
+		if (!vhd)
+			break;
+		__minimal_destroy_store(vhd);
+		break;
+
+	case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
+		if (!vhd || !vhd->count_threads)
+			break;
+		n = lws_get_tsi(wsi);
+#if defined(MINIMAL_WITH_WORKERS)
+		/* another worker may have sent something */
+		if (vhd->bus)
+			__minimal_bus_pull(vhd, n);
+#endif
+		/* another thread may have left messages in our inbox */
+		__minimal_drain_inbox(vhd, n);
 		break;
 
 	case LWS_CALLBACK_ESTABLISHED:
+		pss->tsi = lws_get_tsi(wsi);
+		pt = &vhd->pt[pss->tsi];
+
 		/* add ourselves to the list of live pss held in the vhd */
-		lws_ll_fwd_insert(pss, pss_list, vhd->pss_list);
+		lws_ll_fwd_insert(pss, pss_list, pt->pss_list);
 		pss->wsi = wsi;
-		pss->last = vhd->current;
-		pss->needs_history = 0;
-		pss->history_pos = NULL;
-		
-		/* Send message history to the new client */
-		__minimal_send_history(pss, vhd);
+		minimal_stat_add(pt->stats.clients, 1);
+
+		minimal_lock(&pt->waker_lock);
+		if (!pt->waker)
+			pt->waker = wsi;
+		minimal_unlock(&pt->waker_lock);
+
+#if !defined(LWS_WITHOUT_EXTENSIONS)
+		__minimal_deflate_setup(wsi, vhd, pss);
+#endif
+
+		/* when we are swamped, history may have to wait its turn */
+		__minimal_admit(vhd, pt, pss);
+		if (pss->retry_after_ms) {
+			/* ... or the client is told to come back later */
+			lws_callback_on_writable(wsi);
+			break;
+		}
+
+		/* everybody starts in the lobby, and gets its history */
+		sub = __minimal_subscribe(vhd, pss, vhd->lobby);
+		if (!sub) {
+			lwsl_warn("%s: unable to join lobby\n", __func__);
+			break;
+		}
+		/* ... or what it missed, if it says where it got to */
+		if (lws_get_urlarg_by_name(wsi, "seq=", seq, sizeof(seq)))
+			__minimal_resume(vhd, sub, strtoull(seq, NULL, 10));
 		break;
 
 	case LWS_CALLBACK_CLOSED:
+		pt = &vhd->pt[pss->tsi];
+
+		for (n = 0; n < MINIMAL_MAX_JOINED; n++)
+			if (pss->subs[n].room)
+				__minimal_unsubscribe(&pss->subs[n]);
+
 		/* remove our closing pss from the list of live pss */
 		lws_ll_fwd_remove(struct per_session_data__minimal, pss_list,
-				  pss, vhd->pss_list);
+				  pss, pt->pss_list);
+		minimal_stat_add(pt->stats.clients, -1);
+
+		minimal_lock(&pt->waker_lock);
+		if (pt->waker == wsi)
+			pt->waker = pt->pss_list ? pt->pss_list->wsi : NULL;
+		minimal_unlock(&pt->waker_lock);
+
+		buf_pool_release(&pt->rx_pool, &pss->rx);
+
+#if !defined(LWS_WITHOUT_EXTENSIONS)
+		__minimal_deflate_release(vhd, pss);
+#endif
+		break;
+
+	case LWS_CALLBACK_TIMER:
+		/* our turn for the history __minimal_admit() held back */
+		pss->admit_at = 0;
+		lws_callback_on_writable(wsi);
 		break;
 
 	case LWS_CALLBACK_SERVER_WRITEABLE:
-		/* Handle history sending first for new clients */
-		if (pss->needs_history && pss->history_pos) {
-			/* Send one history message at a time */
-			m = lws_write(wsi, ((unsigned char *)pss->history_pos->payload) +
-				      LWS_PRE, pss->history_pos->len, LWS_WRITE_TEXT);
-			if (m < (int)pss->history_pos->len) {
-				lwsl_err("ERROR %d writing history to ws\n", m);
-				return -1;
-			}
-			
-			/* Move to next history message */
-			pss->history_pos = pss->history_pos->next;
-			
-			/* If more history to send, request another writable callback */
-			if (pss->history_pos) {
-				lws_callback_on_writable(wsi);
-			} else {
-				/* Done sending history */
-				pss->needs_history = 0;
-				pss->last = vhd->current; /* Catch up to current */
-			}
-			break;
+		return __minimal_writeable(wsi, pss, vhd);
+
+	case LWS_CALLBACK_RECEIVE:
+		pt = &vhd->pt[pss->tsi];
+
+		if (pss->retry_after_ms)
+			break; /* on our way out */
+
+		if (pss->rx.len + len > vhd->max_message) {
+			lwsl_notice("%s: message over %u bytes\n", __func__,
+				    vhd->max_message);
+			lws_close_reason(wsi, LWS_CLOSE_STATUS_MESSAGE_TOO_LARGE,
+					 (unsigned char *)"too big", 7);
+			return -1;
 		}
-		
-		/* Handle regular new messages */
-		if (!vhd->amsg.payload)
-			break;
 
-		if (pss->last == vhd->current)
-			break;
+		/* the usual case, the whole message at once, needs no copy */
+		if (!pss->rx.len && lws_is_final_fragment(wsi))
+			return __minimal_receive(vhd, pss, in, len);
 
-		/* notice we allowed for LWS_PRE in the payload already */
-		m = lws_write(wsi, ((unsigned char *)vhd->amsg.payload) +
-			      LWS_PRE, vhd->amsg.len, LWS_WRITE_TEXT);
-		if (m < (int)vhd->amsg.len) {
-			lwsl_err("ERROR %d writing to ws\n", m);
+		if (buf_pool_append(&pt->rx_pool, &pss->rx, in, len)) {
+			lwsl_err("%s: OOM reassembling message\n", __func__);
 			return -1;
 		}
+		if (!lws_is_final_fragment(wsi))
+			break;
 
-		pss->last = vhd->current;
+		n = __minimal_receive(vhd, pss, pss->rx.data, pss->rx.len);
+		buf_pool_release(&pt->rx_pool, &pss->rx);
+		if (n)
+			return -1;
 		break;
 
-	case LWS_CALLBACK_RECEIVE:
-		/* Add message to history before processing */
-		__minimal_add_to_history(vhd, in, len);
-		
-		if (vhd->amsg.payload)
-			__minimal_destroy_message(&vhd->amsg);
-
-		vhd->amsg.len = len;
-		/* notice we over-allocate by LWS_PRE */
-		vhd->amsg.payload = malloc(LWS_PRE + len);
-		if (!vhd->amsg.payload) {
-			lwsl_user("OOM: dropping\n");
-			break;
-		}
+	default:
+		break;
+	}
 
-		memcpy((char *)vhd->amsg.payload + LWS_PRE, in, len);
-		vhd->current++;
+	return 0;
+}
 
-		/*
-		 * let everybody know we want to write something on them
-		 * as soon as they are ready
-		 */
-		lws_start_foreach_llp(struct per_session_data__minimal **,
-				      ppss, vhd->pss_list) {
-			lws_callback_on_writable((*ppss)->wsi);
-		} lws_end_foreach_llp(ppss, pss_list);
+static int
+callback_minimal(struct lws *wsi, enum lws_callback_reasons reason,
+			void *user, void *in, size_t len)
+{
+	return __minimal_callback(wsi, reason, user, in, len,
+			(struct per_vhost_data__minimal *)
+			lws_protocol_vh_priv_get(lws_get_vhost(wsi),
+					lws_get_protocol(wsi)));
+}
+
+/*
+ * "lws-minimal-bin" is the same protocol, for clients that want binary
+ * frames (see wire.h).  Its clients share the rooms of "lws-minimal", so it
+ * has no vhost state of its own and leaves the vhost-wide callbacks to it.
+ * lws picks the first subprotocol the client offers that we have, a client
+ * offering both gets binary from us, and text from a server without it.
+ */
+static int
+callback_minimal_bin(struct lws *wsi, enum lws_callback_reasons reason,
+		     void *user, void *in, size_t len)
+{
+	struct per_session_data__minimal *pss =
+			(struct per_session_data__minimal *)user;
+	struct lws_vhost *vh = lws_get_vhost(wsi);
+
+	switch (reason) {
+	case LWS_CALLBACK_PROTOCOL_INIT:
+	case LWS_CALLBACK_PROTOCOL_DESTROY:
+	case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
+		return 0;
+
+	case LWS_CALLBACK_ESTABLISHED:
+		pss->binary = 1;
 		break;
 
 	default:
 		break;
 	}
 
-	return 0;
+	return __minimal_callback(wsi, reason, user, in, len,
+			(struct per_vhost_data__minimal *)
+			lws_protocol_vh_priv_get(vh,
+				lws_vhost_name_to_protocol(vh, "lws-minimal")));
+}
+
+/* one of these is created for each /metrics request */
+
+struct per_session_data__minimal_metrics {
+	size_t len;
+	char body[LWS_PRE + MINIMAL_METRICS_LEN];
+};
+
+/*
+ * Serves /metrics, mounted with LWSMPRO_CALLBACK on a vhost that also has
+ * "lws-minimal".  The page is formatted when the request comes in, so we
+ * know its length for the headers, and sent in one go when writable.
+ */
+static int
+callback_minimal_metrics(struct lws *wsi, enum lws_callback_reasons reason,
+			 void *user, void *in, size_t len)
+{
+	struct per_session_data__minimal_metrics *mpss =
+			(struct per_session_data__minimal_metrics *)user;
+	struct lws_vhost *vh = lws_get_vhost(wsi);
+	struct per_vhost_data__minimal *vhd;
+	unsigned char buf[LWS_PRE + 256], *start = &buf[LWS_PRE], *p = start,
+		      *end = &buf[sizeof(buf) - 1];
+
+	switch (reason) {
+	case LWS_CALLBACK_HTTP:
+		vhd = (struct per_vhost_data__minimal *)
+			lws_protocol_vh_priv_get(vh,
+				lws_vhost_name_to_protocol(vh, "lws-minimal"));
+		if (!vhd || !vhd->count_threads) {
+			lws_return_http_status(wsi,
+					HTTP_STATUS_SERVICE_UNAVAILABLE, NULL);
+			return -1;
+		}
+
+		mpss->len = __minimal_metrics(vhd, mpss->body + LWS_PRE,
+					      MINIMAL_METRICS_LEN);
+
+		if (lws_add_http_common_headers(wsi, HTTP_STATUS_OK,
+				"text/plain; version=0.0.4", mpss->len,
+				&p, end) ||
+		    lws_finalize_write_http_header(wsi, start, &p, end))
+			return 1;
+
+		lws_callback_on_writable(wsi);
+		return 0;
+
+	case LWS_CALLBACK_HTTP_WRITEABLE:
+		if (lws_write(wsi, (unsigned char *)mpss->body + LWS_PRE,
+			      mpss->len, LWS_WRITE_HTTP_FINAL) < 0)
+			return 1;
+
+		if (lws_http_transaction_completed(wsi))
+			return -1;
+		return 0;
+
+	default:
+		break;
+	}
+
+	return lws_callback_http_dummy(wsi, reason, user, in, len);
 }
 
 #define LWS_PLUGIN_PROTOCOL_MINIMAL \
@@ -249,6 +2836,24 @@ callback_minimal(struct lws *wsi, enum lws_callback_reasons reason,
 		"lws-minimal", \
 		callback_minimal, \
 		sizeof(struct per_session_data__minimal), \
-		128, \
+		4096, \
+		0, NULL, 0 \
+	}
+
+#define LWS_PLUGIN_PROTOCOL_MINIMAL_BIN \
+	{ \
+		WIRE_SUBPROTOCOL, \
+		callback_minimal_bin, \
+		sizeof(struct per_session_data__minimal), \
+		4096, \
+		0, NULL, 0 \
+	}
+
+#define LWS_PLUGIN_PROTOCOL_MINIMAL_METRICS \
+	{ \
+		"lws-minimal-metrics", \
+		callback_minimal_metrics, \
+		sizeof(struct per_session_data__minimal_metrics), \
+		0, \
 		0, NULL, 0 \
 	}
@@ -0,0 +1,209 @@
+/*
+ * rooms for the "lws-minimal" protocol
+ *
+ * See room.h.
+ */
+
+#include "room.h"
+#include "text_scan.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ROOM_INITIAL_BUCKETS 16
+
+/* these match MSG_TYPE_JOIN and MSG_TYPE_LEAVE in message_types.h */
+#define ROOM_FRAME_JOIN 1
+#define ROOM_FRAME_LEAVE 2
+
+/* FNV-1a */
+
+static uint32_t
+__room_hash(const char *name, size_t len)
+{
+	uint32_t h = 2166136261u;
+
+	while (len--) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static int
+__room_grow(struct room_table *t)
+{
+	uint32_t size = (t->mask + 1) * 2, n;
+	struct room **b, *r, *next;
+
+	b = calloc(size, sizeof(*b));
+	if (!b)
+		return 1;
+
+	for (n = 0; n <= t->mask; n++)
+		for (r = t->buckets[n]; r; r = next) {
+			next = r->next;
+			r->next = b[r->hash & (size - 1)];
+			b[r->hash & (size - 1)] = r;
+		}
+
+	free(t->buckets);
+	t->buckets = b;
+	t->mask = size - 1;
+
+	return 0;
+}
+
+int
+room_table_init(struct room_table *t, uint32_t max_rooms,
+		uint32_t history_messages, uint32_t history_bytes,
+		size_t priv_size)
+{
+	memset(t, 0, sizeof(*t));
+
+	if (!max_rooms)
+		return 1;
+
+	t->buckets = calloc(ROOM_INITIAL_BUCKETS, sizeof(*t->buckets));
+	if (!t->buckets)
+		return 1;
+
+	t->mask = ROOM_INITIAL_BUCKETS - 1;
+	t->max_rooms = max_rooms;
+	t->history_messages = history_messages;
+	t->history_bytes = history_bytes;
+	t->priv_size = priv_size;
+
+	return 0;
+}
+
+void
+room_table_destroy(struct room_table *t)
+{
+	struct room *r, *next;
+
+	for (r = t->all; r; r = next) {
+		next = r->all;
+		history_destroy(&r->history);
+		free(r);
+	}
+
+	free(t->buckets);
+	memset(t, 0, sizeof(*t));
+}
+
+static struct room *
+__room_find(const struct room_table *t, const char *name, size_t len,
+	    uint32_t hash)
+{
+	struct room *r;
+
+	for (r = t->buckets[hash & t->mask]; r; r = r->next)
+		if (r->hash == hash && !strncmp(r->name, name, len) &&
+		    !r->name[len])
+			return r;
+
+	return NULL;
+}
+
+struct room *
+room_find(const struct room_table *t, const char *name, size_t len)
+{
+	if (!len || len >= ROOM_NAME_LEN)
+		return NULL;
+
+	return __room_find(t, name, len, __room_hash(name, len));
+}
+
+struct room *
+room_get(struct room_table *t, const char *name, size_t len)
+{
+	uint32_t hash;
+	struct room *r;
+
+	if (!len || len >= ROOM_NAME_LEN)
+		return NULL;
+
+	hash = __room_hash(name, len);
+	r = __room_find(t, name, len, hash);
+	if (r || t->count >= t->max_rooms)
+		return r;
+
+	/* keep chains short, grow before we go over one room per bucket */
+	if (t->count > t->mask && __room_grow(t))
+		return NULL;
+
+	r = calloc(1, sizeof(*r) + t->priv_size);
+	if (!r)
+		return NULL;
+
+	if (history_init(&r->history, t->history_messages, t->history_bytes)) {
+		free(r);
+		return NULL;
+	}
+
+	memcpy(r->name, name, len);
+	r->hash = hash;
+	r->next = t->buckets[hash & t->mask];
+	t->buckets[hash & t->mask] = r;
+	r->all = t->all;
+	t->all = r;
+	t->count++;
+
+	return r;
+}
+
+int
+room_frame_parse(const void *in, size_t len, struct room_frame *f)
+{
+	const char *p = in, *end = p + len, *field[5];
+	size_t bars[4];
+	int n, k, want;
+
+	f->type = -1;
+	f->timestamp = 0;
+	f->room = NULL;
+	f->room_len = 0;
+	f->content = NULL;
+	f->content_len = 0;
+
+	/* check it's UTF-8 and find where each of the five fields starts */
+	k = text_scan(in, len, bars, 4);
+	if (k < 0)
+		return -1;
+
+	if (p == end || *p < '0' || *p > '9')
+		return 0;
+
+	f->type = 0;
+	while (p < end && *p >= '0' && *p <= '9' && f->type < 1000)
+		f->type = (f->type * 10) + (*p++ - '0');
+
+	field[0] = in;
+	for (n = 1; n <= k; n++)
+		field[n] = (const char *)in + bars[n - 1] + 1;
+
+	if (n > 1)
+		for (p = field[1]; p < end && *p >= '0' && *p <= '9'; p++)
+			f->timestamp = (f->timestamp * 10) + (uint64_t)(*p - '0');
+
+	if (n > 3) {
+		f->content = field[3];
+		f->content_len = (size_t)((n > 4 ? field[4] - 1 : end) -
+					  f->content);
+	}
+
+	want = f->type == ROOM_FRAME_JOIN || f->type == ROOM_FRAME_LEAVE ? 3 : 4;
+	if (n <= want)
+		return 0;
+
+	f->room = field[want];
+	if (want == 4)
+		/* metadata runs to the end of the frame */
+		f->room_len = (size_t)(end - f->room);
+	else
+		f->room_len = f->content_len;
+
+	return 0;
+}
@@ -0,0 +1,92 @@
+/*
+ * rooms for the "lws-minimal" protocol
+ *
+ * A room is a named conversation with its own history.  Rooms are found by
+ * name through a chained hash index that doubles as it fills, so looking one
+ * up costs the same however many rooms there are.  Rooms are never freed
+ * until the table is destroyed, a room pointer stays valid for the life of
+ * the table and may be handed between threads.
+ *
+ * The protocol keeps its own per-room state, eg, subscribers, in priv_size
+ * zeroed bytes allocated after each room, see room_priv().
+ *
+ * The table itself is not locked, callers serialize access to it.
+ */
+
+#if !defined(__ROOM_H__)
+#define __ROOM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "history.h"
+
+#define ROOM_NAME_LEN 64
+
+struct room {
+	struct room *next;	/* hash chain */
+	struct room *all;	/* every room, newest first */
+	uint32_t hash;
+	char name[ROOM_NAME_LEN];
+	struct history history;
+};
+
+#define room_priv(_r) ((void *)((_r) + 1))
+
+struct room_table {
+	struct room **buckets;
+	struct room *all;
+	uint32_t mask;
+	uint32_t count;
+	uint32_t max_rooms;
+
+	uint32_t history_messages;	/* limits for each room's history */
+	uint32_t history_bytes;
+	size_t priv_size;
+};
+
+int
+room_table_init(struct room_table *t, uint32_t max_rooms,
+		uint32_t history_messages, uint32_t history_bytes,
+		size_t priv_size);
+
+/* frees every room, the caller tears down room_priv() first */
+
+void
+room_table_destroy(struct room_table *t);
+
+/* NULL if there is no room called name */
+
+struct room *
+room_find(const struct room_table *t, const char *name, size_t len);
+
+/*
+ * The room called name, created if needed.  NULL if the name is empty or
+ * too long, the table is full, or on OOM.
+ */
+
+struct room *
+room_get(struct room_table *t, const char *name, size_t len);
+
+/*
+ * What the router needs from a "TYPE|TIMESTAMP|USERNAME|CONTENT|METADATA"
+ * frame, found in place without copying.  Join and leave name their room in
+ * CONTENT, everything else is for the room named in METADATA.  type is -1
+ * if the frame does not start with a number, room_len is 0 if it names no
+ * room, and content is NULL if the frame has no CONTENT field.  Returns -1,
+ * with nothing found, if the frame isn't UTF-8 (see text_scan.h).
+ */
+
+struct room_frame {
+	int type;
+	uint64_t timestamp;
+	const char *room;
+	size_t room_len;
+	const char *content;
+	size_t content_len;
+};
+
+int
+room_frame_parse(const void *in, size_t len, struct room_frame *f);
+
+#endif
@@ -0,0 +1,225 @@
+/*
+ * shared memory message bus for the "lws-minimal" protocol
+ *
+ * See shm_bus.h.
+ */
+
+#include "shm_bus.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+/* slots a room is looked for in, past its own, before one is taken over */
+#define SHM_BUS_PROBES 8
+
+#define SHM_BUS_HDR ((sizeof(struct shm_bus) + 63) & ~(size_t)63)
+
+/* twice max_rooms, rounded up to a power of two, or 0 if too many */
+
+static uint32_t
+__shm_bus_slots(uint32_t max_rooms)
+{
+	uint32_t n = 16;
+
+	while (n < max_rooms * 2ull) {
+		if (n & 0x80000000u)
+			return 0;
+		n <<= 1;
+	}
+
+	return n;
+}
+
+static size_t
+__shm_bus_size(uint32_t max_count, uint32_t max_bytes, uint32_t slots)
+{
+	size_t mem = history_mem_size(max_count, max_bytes);
+
+	return mem && slots ? SHM_BUS_HDR +
+			      slots * sizeof(struct shm_bus_room) + mem : 0;
+}
+
+struct shm_bus *
+shm_bus_create(uint32_t max_count, uint32_t max_bytes, uint32_t max_rooms)
+{
+	uint32_t slots = __shm_bus_slots(max_rooms);
+	size_t size = __shm_bus_size(max_count, max_bytes, slots);
+	pthread_mutexattr_t ma;
+	pthread_condattr_t ca;
+	struct shm_bus *bus;
+	void *p;
+
+	if (!size)
+		return NULL;
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	/* the mapping starts zeroed, so every room slot is free */
+	bus = p;
+	bus->rooms = (struct shm_bus_room *)((unsigned char *)p + SHM_BUS_HDR);
+	bus->rooms_mask = slots - 1;
+
+	pthread_mutexattr_init(&ma);
+	pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&bus->lock, &ma);
+	pthread_mutexattr_destroy(&ma);
+
+	pthread_condattr_init(&ca);
+	pthread_condattr_setpshared(&ca, PTHREAD_PROCESS_SHARED);
+	pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+	pthread_cond_init(&bus->cond, &ca);
+	pthread_condattr_destroy(&ca);
+
+	history_init_mem(&bus->history,
+			 (unsigned char *)p + (size - history_mem_size(max_count,
+							max_bytes)),
+			 max_count, max_bytes);
+
+	return bus;
+}
+
+void
+shm_bus_destroy(struct shm_bus *bus)
+{
+	size_t size;
+
+	if (!bus)
+		return;
+
+	size = __shm_bus_size(bus->history.max_count,
+			      bus->history.arena_max, bus->rooms_mask + 1);
+	pthread_cond_destroy(&bus->cond);
+	pthread_mutex_destroy(&bus->lock);
+	munmap(bus, size);
+}
+
+/* the previous owner died holding the lock, make the history usable again */
+
+static void
+__shm_bus_recover(struct shm_bus *bus)
+{
+	if (bus->appending) {
+		history_reset(&bus->history);
+		bus->appending = 0;
+	}
+	pthread_mutex_consistent(&bus->lock);
+}
+
+void
+shm_bus_lock(struct shm_bus *bus)
+{
+	if (pthread_mutex_lock(&bus->lock) == EOWNERDEAD)
+		__shm_bus_recover(bus);
+}
+
+void
+shm_bus_unlock(struct shm_bus *bus)
+{
+	pthread_mutex_unlock(&bus->lock);
+}
+
+/*
+ * The slot of the room with key, or a free one for it.  Slots are never
+ * freed, if the ones it may be in are all taken the room in its own slot
+ * is forgotten, when that room is next seen it starts over from first.
+ */
+
+static struct shm_bus_room *
+__shm_bus_room(struct shm_bus *bus, uint64_t key)
+{
+	struct shm_bus_room *r;
+	uint32_t n;
+
+	for (n = 0; n < SHM_BUS_PROBES; n++) {
+		r = &bus->rooms[(key + n) & bus->rooms_mask];
+		if (!r->next_seq || r->key == key)
+			return r;
+	}
+
+	r = &bus->rooms[key & bus->rooms_mask];
+	r->next_seq = 0;
+
+	return r;
+}
+
+int
+shm_bus_append(struct shm_bus *bus, uint64_t key, uint64_t first,
+	       const void *data, size_t len, uint64_t timestamp,
+	       uint64_t *seq)
+{
+	struct shm_bus_room *r;
+	struct hist_rec *hrec;
+	uint64_t room_seq, n;
+	int ret;
+
+	bus->appending = 1;
+	r = __shm_bus_room(bus, key);
+	room_seq = r->next_seq ? r->next_seq : first;
+	ret = history_append(&bus->history, NULL, sizeof(room_seq) + len,
+			     timestamp, &n);
+	if (!ret) {
+		hrec = history_get(&bus->history, n);
+		memcpy(hist_rec_payload(hrec), &room_seq, sizeof(room_seq));
+		if (len)
+			memcpy(shm_bus_rec_payload(hrec), data, len);
+		/* last, a worker dying before here leaves the seq unused */
+		r->key = key;
+		r->next_seq = room_seq + 1;
+	}
+	bus->appending = 0;
+
+	if (ret)
+		return ret;
+
+	if (seq)
+		*seq = room_seq;
+	pthread_cond_broadcast(&bus->cond);
+
+	return 0;
+}
+
+uint64_t
+shm_bus_rec_seq(const struct hist_rec *r)
+{
+	uint64_t seq;
+
+	memcpy(&seq, hist_rec_payload(r), sizeof(seq));
+
+	return seq;
+}
+
+int
+shm_bus_wait(struct shm_bus *bus, uint64_t *seen, int timeout_ms)
+{
+	struct timespec ts;
+	int moved, n;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += timeout_ms / 1000;
+	ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	shm_bus_lock(bus);
+	while (bus->history.next_seq == *seen) {
+		n = pthread_cond_timedwait(&bus->cond, &bus->lock, &ts);
+		if (n == EOWNERDEAD)
+			/* we hold the lock, but its last owner died */
+			__shm_bus_recover(bus);
+		else if (n)
+			break;
+	}
+	moved = bus->history.next_seq != *seen;
+	*seen = bus->history.next_seq;
+	shm_bus_unlock(bus);
+
+	return moved;
+}
@@ -0,0 +1,91 @@
+/*
+ * shared memory message bus for the "lws-minimal" protocol
+ *
+ * When the server runs several worker processes, they share one history in
+ * an anonymous shared mapping made by the parent before it forks them, so
+ * every worker, including a restarted one, sees it at the same address.
+ *
+ * The shared history is the bus: a worker appends what it receives and
+ * signals the condition, every worker then pulls the records it has not
+ * seen yet and handles them as if it received them itself.
+ *
+ * The seq a message gets in its room is handed out on the bus too, from a
+ * table of each room's next seq in the mapping, and goes in front of the
+ * message in its record.  So a room's seqs are the same in every worker,
+ * and a client may resume on another worker than the one it was on.
+ *
+ * The lock is a robust process-shared mutex, a worker dying while holding it
+ * does not wedge the others.  If it died in the middle of an append the
+ * history is reset, otherwise it is left as it was.
+ */
+
+#if !defined(__SHM_BUS_H__)
+#define __SHM_BUS_H__
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "history.h"
+
+struct shm_bus_room {
+	uint64_t key;		/* hash of the room's name */
+	uint64_t next_seq;	/* 0 while the slot is free */
+};
+
+struct shm_bus {
+	pthread_mutex_t lock;	/* robust, process shared */
+	pthread_cond_t cond;	/* broadcast when next_seq moves */
+	int appending;		/* history is mid-update while this is set */
+
+	struct shm_bus_room *rooms; /* in the mapping, open addressed */
+	uint32_t rooms_mask;
+
+	struct history history;	/* arena and index follow in the mapping */
+};
+
+/*
+ * call in the parent, before forking the workers.  The room table has
+ * space for max_rooms with room to spare.  NULL on failure.
+ */
+
+struct shm_bus *
+shm_bus_create(uint32_t max_count, uint32_t max_bytes, uint32_t max_rooms);
+
+void
+shm_bus_destroy(struct shm_bus *bus);
+
+void
+shm_bus_lock(struct shm_bus *bus);
+
+void
+shm_bus_unlock(struct shm_bus *bus);
+
+/*
+ * with the lock held.  Appends a message of the room whose name hashes to
+ * key, with the room's next seq from the table, or first if the table
+ * doesn't have the room.  Returns like history_append(), with *seq set to
+ * the room seq, and wakes the waiters.
+ */
+
+int
+shm_bus_append(struct shm_bus *bus, uint64_t key, uint64_t first,
+	       const void *data, size_t len, uint64_t timestamp,
+	       uint64_t *seq);
+
+/* the room seq a record on the bus has, then its message */
+
+uint64_t
+shm_bus_rec_seq(const struct hist_rec *r);
+
+#define shm_bus_rec_payload(_r) (hist_rec_payload(_r) + sizeof(uint64_t))
+#define shm_bus_rec_len(_r) ((_r)->len - sizeof(uint64_t))
+
+/*
+ * Wait up to timeout_ms for next_seq to move past *seen, then update *seen.
+ * Returns nonzero if it moved.
+ */
+
+int
+shm_bus_wait(struct shm_bus *bus, uint64_t *seen, int timeout_ms);
+
+#endif
@@ -0,0 +1,223 @@
+/*
+ * slab allocator for the messages of the "lws-minimal" protocol
+ *
+ * Free objects are linked through their first bytes, in the thread caches
+ * and in the depots alike.  Each slab starts with a SLAB_MIN byte header
+ * linking it to the others, so the objects stay aligned like malloc()'s.
+ */
+
+#include "slab.h"
+
+#include <stdlib.h>
+
+struct slab_cache {
+	void *free;
+	uint32_t count;
+};
+
+struct slab_depot {
+	int lock;
+	void *free;
+	uint32_t count;
+	char pad[64 - sizeof(int) - sizeof(void *) - sizeof(uint32_t)];
+};
+
+static struct slab_depot depots[SLAB_CLASSES];
+static int slabs_lock;
+static void *slabs; /* every slab, linked through its header */
+static struct slab_stats stats;
+
+static __thread struct slab_cache caches[SLAB_CLASSES];
+
+static int
+__slab_class(size_t size)
+{
+	int n = 0;
+
+	while (n < SLAB_CLASSES && ((size_t)SLAB_MIN << n) < size)
+		n++;
+
+	return n < SLAB_CLASSES ? n : -1;
+}
+
+/* held only to move a batch, so a spinlock will do */
+
+static void
+__slab_lock(int *lock)
+{
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+		while (__atomic_load_n(lock, __ATOMIC_RELAXED))
+			;
+}
+
+static void
+__slab_unlock(int *lock)
+{
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+/* move up to count objects from one free list to another */
+
+static uint32_t
+__slab_move(void **from, void **to, uint32_t count)
+{
+	uint32_t n = 0;
+	void *o;
+
+	while (n < count && (o = *from)) {
+		*from = *(void **)o;
+		*(void **)o = *to;
+		*to = o;
+		n++;
+	}
+
+	return n;
+}
+
+/* carve a new slab for class n into the depot, with the depot locked */
+
+static int
+__slab_grow(struct slab_depot *d, int n)
+{
+	size_t size = (size_t)SLAB_MIN << n, bytes = SLAB_BYTES;
+	unsigned char *s, *o;
+
+	if (bytes < size * SLAB_MIN_OBJS)
+		bytes = size * SLAB_MIN_OBJS;
+
+	s = malloc(SLAB_MIN + bytes);
+	if (!s)
+		return 1;
+
+	__slab_lock(&slabs_lock);
+	*(void **)s = slabs;
+	slabs = s;
+	__slab_unlock(&slabs_lock);
+
+	for (o = s + SLAB_MIN; o + size <= s + SLAB_MIN + bytes; o += size) {
+		*(void **)o = d->free;
+		d->free = o;
+		d->count++;
+	}
+
+	__atomic_add_fetch(&stats.slabs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats.slab_bytes, SLAB_MIN + bytes,
+			   __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+void *
+slab_alloc(size_t size)
+{
+	struct slab_cache *c;
+	struct slab_depot *d;
+	uint32_t m;
+	void *o;
+	int n;
+
+	n = __slab_class(size);
+	if (n < 0) {
+		o = malloc(size);
+		if (o) {
+			__atomic_add_fetch(&stats.big_allocs, 1,
+					   __ATOMIC_RELAXED);
+			__atomic_add_fetch(&stats.big_live, 1,
+					   __ATOMIC_RELAXED);
+		}
+		return o;
+	}
+
+	c = &caches[n];
+	if (!c->free) {
+		d = &depots[n];
+		__slab_lock(&d->lock);
+		if (!d->free && __slab_grow(d, n)) {
+			__slab_unlock(&d->lock);
+			return NULL;
+		}
+		m = __slab_move(&d->free, &c->free, SLAB_BATCH);
+		d->count -= m;
+		__slab_unlock(&d->lock);
+		c->count += m;
+
+		__atomic_add_fetch(&stats.depot_gets, 1, __ATOMIC_RELAXED);
+	}
+
+	o = c->free;
+	c->free = *(void **)o;
+	c->count--;
+
+	return o;
+}
+
+void
+slab_free(void *p, size_t size)
+{
+	struct slab_cache *c;
+	struct slab_depot *d;
+	uint32_t m;
+	int n;
+
+	if (!p)
+		return;
+
+	n = __slab_class(size);
+	if (n < 0) {
+		free(p);
+		__atomic_sub_fetch(&stats.big_live, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	c = &caches[n];
+	*(void **)p = c->free;
+	c->free = p;
+	if (++c->count <= SLAB_CACHE)
+		return;
+
+	d = &depots[n];
+	__slab_lock(&d->lock);
+	m = __slab_move(&c->free, &d->free, SLAB_BATCH);
+	d->count += m;
+	__slab_unlock(&d->lock);
+	c->count -= m;
+
+	__atomic_add_fetch(&stats.depot_puts, 1, __ATOMIC_RELAXED);
+}
+
+size_t
+slab_size(size_t size)
+{
+	int n = __slab_class(size);
+
+	return n < 0 ? 0 : (size_t)SLAB_MIN << n;
+}
+
+void
+slab_get_stats(struct slab_stats *st)
+{
+	st->slabs = __atomic_load_n(&stats.slabs, __ATOMIC_RELAXED);
+	st->slab_bytes = __atomic_load_n(&stats.slab_bytes, __ATOMIC_RELAXED);
+	st->depot_gets = __atomic_load_n(&stats.depot_gets, __ATOMIC_RELAXED);
+	st->depot_puts = __atomic_load_n(&stats.depot_puts, __ATOMIC_RELAXED);
+	st->big_allocs = __atomic_load_n(&stats.big_allocs, __ATOMIC_RELAXED);
+	st->big_live = __atomic_load_n(&stats.big_live, __ATOMIC_RELAXED);
+}
+
+void
+slab_thread_flush(void)
+{
+	struct slab_depot *d;
+	int n;
+
+	for (n = 0; n < SLAB_CLASSES; n++) {
+		if (!caches[n].count)
+			continue;
+		d = &depots[n];
+		__slab_lock(&d->lock);
+		d->count += __slab_move(&caches[n].free, &d->free,
+					caches[n].count);
+		__slab_unlock(&d->lock);
+		caches[n].count = 0;
+	}
+}
@@ -0,0 +1,67 @@
+/*
+ * slab allocator for the messages of the "lws-minimal" protocol
+ *
+ * Objects come in power of two classes from SLAB_MIN bytes up to SLAB_MAX,
+ * carved out of slabs of at least SLAB_BYTES taken from the system once and
+ * never given back.  Anything bigger goes to malloc() as before.
+ *
+ * Each thread keeps a small cache of free objects per class, so allocating
+ * and freeing touch nothing shared.  Only when a cache runs dry, or grows
+ * past SLAB_CACHE, does the thread move SLAB_BATCH objects from or to the
+ * class's depot under a spinlock.  An object may be freed on any thread,
+ * it goes to the freeing thread's cache.
+ *
+ * Once the slabs cover the most messages held at once, steady traffic makes
+ * no system allocator calls and the memory held stays flat.
+ */
+
+#if !defined(__SLAB_H__)
+#define __SLAB_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SLAB_MIN_BITS 6
+#define SLAB_MIN (1u << SLAB_MIN_BITS)
+#define SLAB_CLASSES 11 /* up to 64KB */
+#define SLAB_MAX (SLAB_MIN << (SLAB_CLASSES - 1))
+#define SLAB_BYTES (64 * 1024)
+#define SLAB_MIN_OBJS 8 /* big classes get slabs of at least this many */
+#define SLAB_CACHE 64 /* most free objects a thread keeps per class */
+#define SLAB_BATCH 32 /* objects moved between a thread and the depot */
+
+struct slab_stats {
+	uint64_t slabs; /* slabs taken from the system */
+	uint64_t slab_bytes; /* ... and what they hold */
+	uint64_t depot_gets; /* times a thread's cache ran dry */
+	uint64_t depot_puts; /* times a thread's cache overflowed */
+	uint64_t big_allocs; /* objects over SLAB_MAX, from malloc() */
+	uint64_t big_live; /* ... still allocated */
+};
+
+/* size bytes, from any thread, NULL on OOM */
+
+void *
+slab_alloc(size_t size);
+
+/* size must be what it was allocated with */
+
+void
+slab_free(void *p, size_t size);
+
+/* the class size holding size bytes, or 0 if it is over SLAB_MAX */
+
+size_t
+slab_size(size_t size);
+
+/* a snapshot of the counters, any thread */
+
+void
+slab_get_stats(struct slab_stats *st);
+
+/* hand the calling thread's cached objects back to the depots, eg, on exit */
+
+void
+slab_thread_flush(void);
+
+#endif
@@ -0,0 +1,455 @@
+/*
+ * UTF-8 validation and field splitting for text frames
+ *
+ * See text_scan.h.
+ */
+
+#include "text_scan.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TEXT_SCAN_X86
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__)
+#define TEXT_SCAN_ARM
+#include <arm_neon.h>
+#endif
+
+typedef int (*text_scan_fn)(const unsigned char *s, size_t len, size_t *bars,
+			    int max);
+
+/*
+ * The length of the UTF-8 character at p, or 0 if it isn't one: a stray
+ * continuation byte, an overlong form, a surrogate, past U+10FFFF, or cut
+ * short by end
+ */
+static size_t
+__utf8_char(const unsigned char *p, const unsigned char *end)
+{
+	size_t left = (size_t)(end - p);
+	unsigned char c = p[0];
+
+	if (c < 0x80)
+		return 1;
+	if (c < 0xc2)
+		return 0;
+	if (c < 0xe0)
+		return left >= 2 && (p[1] & 0xc0) == 0x80 ? 2 : 0;
+	if (c < 0xf0) {
+		if (left < 3 || (p[1] & 0xc0) != 0x80 ||
+		    (p[2] & 0xc0) != 0x80 ||
+		    (c == 0xe0 && p[1] < 0xa0) ||
+		    (c == 0xed && p[1] >= 0xa0))
+			return 0;
+		return 3;
+	}
+	if (c < 0xf5) {
+		if (left < 4 || (p[1] & 0xc0) != 0x80 ||
+		    (p[2] & 0xc0) != 0x80 || (p[3] & 0xc0) != 0x80 ||
+		    (c == 0xf0 && p[1] < 0x90) ||
+		    (c == 0xf4 && p[1] >= 0x90))
+			return 0;
+		return 4;
+	}
+
+	return 0;
+}
+
+/* the scalar kernel from p on, for the tails of the others too */
+static int
+__scan_bytes(const unsigned char *s, const unsigned char *p,
+	     const unsigned char *end, size_t *bars, int n, int max)
+{
+	size_t k;
+
+	while (p < end) {
+		if (*p < 0x80) {
+			if (*p == '|' && n < max)
+				bars[n++] = (size_t)(p - s);
+			p++;
+			continue;
+		}
+		k = __utf8_char(p, end);
+		if (!k)
+			return -1;
+		p += k;
+	}
+
+	return n;
+}
+
+static int
+__scan_scalar(const unsigned char *s, size_t len, size_t *bars, int max)
+{
+	return __scan_bytes(s, s, s + len, bars, 0, max);
+}
+
+/*
+ * Check the characters from p on, which starts one, until one ends at or
+ * past until.  Returns where the next one starts, past until by what the
+ * last one runs over it, or NULL if they aren't UTF-8.  A block with any
+ * non-ASCII byte goes through here, its '|' were already noted.
+ */
+static const unsigned char *
+__utf8_run(const unsigned char *p, const unsigned char *end,
+	   const unsigned char *until)
+{
+	size_t k;
+
+	while (p < until) {
+		if (*p < 0x80) {
+			p++;
+			continue;
+		}
+		k = __utf8_char(p, end);
+		if (!k)
+			return NULL;
+		p += k;
+	}
+
+	return p;
+}
+
+#if defined(TEXT_SCAN_X86)
+
+static unsigned int
+__ctz(unsigned int m)
+{
+	return (unsigned int)__builtin_ctz(m);
+}
+
+__attribute__((target("sse2"))) static int
+__scan_sse2(const unsigned char *s, size_t len, size_t *bars, int max)
+{
+	const unsigned char *p = s, *end = s + len;
+	const __m128i bar = _mm_set1_epi8('|');
+	unsigned int hi, m;
+	__m128i v;
+	int n = 0;
+
+	while (end - p >= 16) {
+		v = _mm_loadu_si128((const __m128i *)p);
+
+		if (n < max) {
+			m = (unsigned int)_mm_movemask_epi8(
+						_mm_cmpeq_epi8(v, bar));
+			for (; m && n < max; m &= m - 1)
+				bars[n++] = (size_t)(p - s) + __ctz(m);
+		}
+
+		hi = (unsigned int)_mm_movemask_epi8(v);
+		if (!hi) {
+			p += 16;
+			continue;
+		}
+
+		p = __utf8_run(p + __ctz(hi), end, p + 16);
+		if (!p)
+			return -1;
+	}
+
+	return __scan_bytes(s, p, end, bars, n, max);
+}
+
+/*
+ * The AVX2 kernel checks 32 bytes at once by looking up what each byte's
+ * high and low nibbles and the next byte's high nibble may mean, and
+ * and-ing them, any bit left is an error.  The lookups need the byte
+ * before each byte, and where the 3rd and 4th bytes of a character must be
+ * continuations they need the bytes 2 and 3 before, from the last block
+ * for the first bytes of this one.  The tables are from "Validating UTF-8
+ * In Less Than One Instruction Per Byte", Keiser and Lemire, 2021.
+ */
+
+#define TOO_SHORT	(1 << 0) /* a lead byte not followed by enough */
+#define TOO_LONG	(1 << 1) /* a continuation after ASCII */
+#define OVERLONG_3	(1 << 2)
+#define TOO_LARGE	(1 << 3) /* past U+10FFFF */
+#define SURROGATE	(1 << 4)
+#define OVERLONG_2	(1 << 5)
+#define TOO_LARGE_1000	(1 << 6)
+#define OVERLONG_4	(1 << 6)
+#define TWO_CONTS	(1 << 7) /* fine if it's a 3rd or 4th byte */
+#define CARRY		(TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+#define TABLE(...) _mm256_setr_epi8(__VA_ARGS__, __VA_ARGS__)
+
+/* the 32 bytes ending n before the start of v, the block after prev */
+#define PREV(v, prev, n) _mm256_alignr_epi8(v, \
+			_mm256_permute2x128_si256(prev, v, 0x21), 16 - (n))
+
+#define HIGH_NIBBLES(v) \
+	_mm256_and_si256(_mm256_srli_epi16(v, 4), _mm256_set1_epi8(0x0f))
+
+__attribute__((target("avx2"))) static __m256i
+__avx2_block_errors(__m256i v, __m256i prev)
+{
+	const __m256i byte_1_high_table = TABLE(
+		/* 0_______ ________, ASCII then a continuation */
+		TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+		TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+		/* 10______ ________ */
+		TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+		/* 1100____ ________ */
+		TOO_SHORT | OVERLONG_2,
+		/* 1101____ ________ */
+		TOO_SHORT,
+		/* 1110____ ________ */
+		TOO_SHORT | OVERLONG_3 | SURROGATE,
+		/* 1111____ ________ */
+		TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4);
+	const __m256i byte_1_low_table = TABLE(
+		/* ____0000 ________ */
+		CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+		/* ____0001 ________ */
+		CARRY | OVERLONG_2,
+		/* ____001_ ________ */
+		CARRY,
+		CARRY,
+		/* ____0100 ________ */
+		CARRY | TOO_LARGE,
+		/* ____0101 ________ */
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		/* ____011_ ________ */
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		/* ____1___ ________ */
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		/* ____1101 ________ */
+		CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000);
+	const __m256i byte_2_high_table = TABLE(
+		/* ________ 0_______ */
+		TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+		TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+		/* ________ 1000____ */
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 |
+						TOO_LARGE_1000 | OVERLONG_4,
+		/* ________ 1001____ */
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+		/* ________ 101_____ */
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+		/* ________ 11______ */
+		TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT);
+	__m256i prev1 = PREV(v, prev, 1), sc, must23;
+
+	sc = _mm256_and_si256(
+		_mm256_and_si256(
+			_mm256_shuffle_epi8(byte_1_high_table,
+					    HIGH_NIBBLES(prev1)),
+			_mm256_shuffle_epi8(byte_1_low_table,
+				_mm256_and_si256(prev1,
+						 _mm256_set1_epi8(0x0f)))),
+		_mm256_shuffle_epi8(byte_2_high_table, HIGH_NIBBLES(v)));
+
+	/* only 111_____ two back and 1111____ three back reach 0x80 */
+	must23 = _mm256_or_si256(
+		_mm256_subs_epu8(PREV(v, prev, 2), _mm256_set1_epi8(0xe0 - 0x80)),
+		_mm256_subs_epu8(PREV(v, prev, 3),
+				 _mm256_set1_epi8(0xf0 - 0x80)));
+
+	return _mm256_xor_si256(
+		_mm256_and_si256(must23, _mm256_set1_epi8((char)0x80)), sc);
+}
+
+/* lead bytes in the last 3 of v that the block after must continue */
+__attribute__((target("avx2"))) static __m256i
+__avx2_incomplete(__m256i v)
+{
+	const __m256i max = _mm256_setr_epi8(
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		(char)(0xf0 - 1), (char)(0xe0 - 1), (char)(0xc0 - 1));
+
+	return _mm256_subs_epu8(v, max);
+}
+
+__attribute__((target("avx2"))) static int
+__scan_avx2(const unsigned char *s, size_t len, size_t *bars, int max)
+{
+	const __m256i bar = _mm256_set1_epi8('|');
+	__m256i v, prev = _mm256_setzero_si256(),
+		error = _mm256_setzero_si256(),
+		incomplete = _mm256_setzero_si256();
+	unsigned char tail[32];
+	unsigned int m;
+	size_t off;
+	int n = 0;
+
+	for (off = 0; off < len; off += 32) {
+		if (len - off >= 32)
+			v = _mm256_loadu_si256((const __m256i *)(s + off));
+		else {
+			/* the rest, padded with NULs, which are ASCII */
+			memset(tail, 0, sizeof(tail));
+			memcpy(tail, s + off, len - off);
+			v = _mm256_loadu_si256((const __m256i *)tail);
+		}
+
+		if (n < max) {
+			m = (unsigned int)_mm256_movemask_epi8(
+						_mm256_cmpeq_epi8(v, bar));
+			for (; m && n < max; m &= m - 1)
+				bars[n++] = off + __ctz(m);
+		}
+
+		if (!_mm256_movemask_epi8(v))
+			/* all ASCII, fine unless the last block left a lead */
+			error = _mm256_or_si256(error, incomplete);
+		else {
+			error = _mm256_or_si256(error,
+						__avx2_block_errors(v, prev));
+			incomplete = __avx2_incomplete(v);
+		}
+
+		prev = v;
+	}
+
+	error = _mm256_or_si256(error, incomplete);
+
+	return _mm256_testz_si256(error, error) ? n : -1;
+}
+
+#endif /* TEXT_SCAN_X86 */
+
+#if defined(TEXT_SCAN_ARM)
+
+static int
+__scan_neon(const unsigned char *s, size_t len, size_t *bars, int max)
+{
+	const unsigned char *p = s, *end = s + len;
+	const uint8x16_t bar = vdupq_n_u8('|');
+	uint8x16_t v;
+	int n = 0, k;
+
+	while (end - p >= 16) {
+		v = vld1q_u8(p);
+
+		/* there are few '|' to note, find them a byte at a time */
+		if (n < max && vmaxvq_u8(vceqq_u8(v, bar)))
+			for (k = 0; k < 16 && n < max; k++)
+				if (p[k] == '|')
+					bars[n++] = (size_t)(p - s) + (size_t)k;
+
+		if (vmaxvq_u8(v) < 0x80) {
+			p += 16;
+			continue;
+		}
+
+		p = __utf8_run(p, end, p + 16);
+		if (!p)
+			return -1;
+	}
+
+	return __scan_bytes(s, p, end, bars, n, max);
+}
+
+#endif /* TEXT_SCAN_ARM */
+
+static int
+__scan_resolve(const unsigned char *s, size_t len, size_t *bars, int max);
+
+static text_scan_fn __scan = __scan_resolve;
+static const char *__scan_name = "scalar";
+
+#if defined(__GNUC__)
+#define __scan_get() __atomic_load_n(&__scan, __ATOMIC_ACQUIRE)
+#define __scan_set(_f) __atomic_store_n(&__scan, _f, __ATOMIC_RELEASE)
+#else
+#define __scan_get() (__scan)
+#define __scan_set(_f) (__scan = (_f))
+#endif
+
+static text_scan_fn
+__scan_kernel(enum text_scan_kernel k, const char **name)
+{
+	switch (k) {
+	case TEXT_SCAN_AUTO:
+#if defined(TEXT_SCAN_X86)
+		if (__builtin_cpu_supports("avx2"))
+			return __scan_kernel(TEXT_SCAN_AVX2, name);
+		if (__builtin_cpu_supports("sse2"))
+			return __scan_kernel(TEXT_SCAN_SSE2, name);
+#elif defined(TEXT_SCAN_ARM)
+		return __scan_kernel(TEXT_SCAN_NEON, name);
+#endif
+		return __scan_kernel(TEXT_SCAN_SCALAR, name);
+
+	case TEXT_SCAN_SCALAR:
+		*name = "scalar";
+		return __scan_scalar;
+
+#if defined(TEXT_SCAN_X86)
+	case TEXT_SCAN_SSE2:
+		if (!__builtin_cpu_supports("sse2"))
+			return NULL;
+		*name = "sse2";
+		return __scan_sse2;
+
+	case TEXT_SCAN_AVX2:
+		if (!__builtin_cpu_supports("avx2"))
+			return NULL;
+		*name = "avx2";
+		return __scan_avx2;
+#endif
+
+#if defined(TEXT_SCAN_ARM)
+	case TEXT_SCAN_NEON:
+		*name = "neon";
+		return __scan_neon;
+#endif
+
+	default:
+		return NULL;
+	}
+}
+
+/*
+ * The first scan lands here and picks the kernel.  Threads racing here all
+ * pick the same one, and store the same name and pointer.
+ */
+static int
+__scan_resolve(const unsigned char *s, size_t len, size_t *bars, int max)
+{
+	text_scan_select(TEXT_SCAN_AUTO);
+
+	return __scan_get()(s, len, bars, max);
+}
+
+int
+text_scan(const void *in, size_t len, size_t *bars, int max)
+{
+	return __scan_get()(in, len, bars, max);
+}
+
+int
+text_scan_select(enum text_scan_kernel k)
+{
+	const char *name = NULL;
+	text_scan_fn f = __scan_kernel(k, &name);
+
+	if (!f)
+		return -1;
+
+	__scan_name = name;
+	__scan_set(f);
+
+	return 0;
+}
+
+const char *
+text_scan_kernel_name(void)
+{
+	if (__scan_get() == __scan_resolve)
+		text_scan_select(TEXT_SCAN_AUTO);
+
+	return __scan_name;
+}
@@ -0,0 +1,50 @@
+/*
+ * UTF-8 validation and field splitting for text frames, in one pass
+ *
+ * Websocket text frames must be UTF-8, and ours are split into fields on
+ * '|'.  text_scan() does both in one pass over the frame, a block of 16 or
+ * 32 bytes at a time where the CPU has SSE2, AVX2 or NEON, or a byte at a
+ * time where it doesn't.  The kernel is picked the first time it is called,
+ * from what the CPU running us has, not what we were built for.
+ *
+ * The AVX2 kernel validates whole blocks with table lookups.  The SSE2 and
+ * NEON ones pass blocks that are all ASCII, what chat mostly is, and check
+ * the characters of any other block one by one.
+ */
+
+#if !defined(__TEXT_SCAN_H__)
+#define __TEXT_SCAN_H__
+
+#include <stddef.h>
+
+enum text_scan_kernel {
+	TEXT_SCAN_AUTO, /* the best this CPU has */
+	TEXT_SCAN_SCALAR,
+	TEXT_SCAN_SSE2,
+	TEXT_SCAN_AVX2,
+	TEXT_SCAN_NEON,
+};
+
+/*
+ * Check the len bytes at in are UTF-8, and note the offsets of the first
+ * max '|' in them in bars.  Returns how many it noted, or -1 if they aren't
+ * UTF-8.
+ */
+
+int
+text_scan(const void *in, size_t len, size_t *bars, int max);
+
+/*
+ * Use kernel k from now on, eg, to compare them.  Returns -1 if this CPU or
+ * build doesn't have it.  Call it before any thread scans.
+ */
+
+int
+text_scan_select(enum text_scan_kernel k);
+
+/* "scalar", "sse2", "avx2" or "neon", what text_scan() uses */
+
+const char *
+text_scan_kernel_name(void);
+
+#endif
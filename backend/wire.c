@@ -0,0 +1,225 @@
+/*
+ * binary frames for the "lws-minimal" protocol
+ *
+ * See wire.h.
+ */
+
+#include "wire.h"
+#include "text_scan.h"
+
+#include <string.h>
+
+int
+wire_is_binary(const void *in, size_t len)
+{
+	return len && *(const unsigned char *)in == WIRE_VERSION;
+}
+
+static const unsigned char *
+__wire_get_varint(const unsigned char *p, const unsigned char *end,
+		  uint64_t *v)
+{
+	int shift = 0;
+
+	*v = 0;
+	while (p < end && shift < 64) {
+		*v |= (uint64_t)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80))
+			return p;
+		shift += 7;
+	}
+
+	return NULL; /* cut short, or too long */
+}
+
+static const unsigned char *
+__wire_get_field(const unsigned char *p, const unsigned char *end,
+		 const char **field, size_t *len)
+{
+	uint64_t v;
+
+	p = __wire_get_varint(p, end, &v);
+	if (!p || v > (uint64_t)(end - p))
+		return NULL;
+
+	*field = (const char *)p;
+	*len = (size_t)v;
+
+	return p + v;
+}
+
+static int
+__wire_parse_binary(const unsigned char *p, const unsigned char *end,
+		    struct wire_frame *f)
+{
+	int n;
+
+	if (end - p < WIRE_HDR || p[0] != WIRE_VERSION)
+		return -1;
+
+	f->type = p[1];
+	f->timestamp = 0;
+	for (n = 7; n >= 0; n--)
+		f->timestamp = (f->timestamp << 8) | p[2 + n];
+	p += WIRE_HDR;
+
+	p = __wire_get_varint(p, end, &f->seq);
+	if (p)
+		p = __wire_get_field(p, end, &f->user, &f->user_len);
+	if (p)
+		p = __wire_get_field(p, end, &f->content, &f->content_len);
+	if (p)
+		p = __wire_get_field(p, end, &f->metadata, &f->metadata_len);
+
+	return p == end ? 0 : -1;
+}
+
+static uint64_t
+__wire_digits(const char *p, const char *end)
+{
+	uint64_t v = 0;
+
+	while (p < end && *p >= '0' && *p <= '9')
+		v = (v * 10) + (uint64_t)(*p++ - '0');
+
+	return v;
+}
+
+static int
+__wire_parse_text(const char *p, const char *end, struct wire_frame *f)
+{
+	const char *field[5];
+	int n = 0;
+
+	/* find where each of the five fields starts */
+	field[n++] = p;
+	while (n < 5 && (p = memchr(p, '|', (size_t)(end - p))))
+		field[n++] = ++p;
+	if (n < 4)
+		return -1;
+
+	f->type = (int)__wire_digits(field[0], end);
+	f->timestamp = __wire_digits(field[1], end);
+	f->seq = 0;
+	f->user = field[2];
+	f->user_len = (size_t)(field[3] - 1 - field[2]);
+	f->content = field[3];
+	/* metadata, if there is any, runs to the end */
+	f->metadata = n == 5 ? field[4] : end;
+	f->metadata_len = (size_t)(end - f->metadata);
+	f->content_len = (size_t)(f->metadata - f->content) - (n == 5);
+
+	return 0;
+}
+
+int
+wire_parse(const void *in, size_t len, struct wire_frame *f)
+{
+	const char *p = in;
+
+	if (wire_is_binary(in, len))
+		return __wire_parse_binary(in, (const unsigned char *)in + len,
+					   f);
+
+	return __wire_parse_text(p, p + len, f);
+}
+
+int
+wire_text_ok(const struct wire_frame *f)
+{
+	size_t bar;
+
+	return (!f->user || !text_scan(f->user, f->user_len, &bar, 1)) &&
+	       !text_scan(f->content, f->content_len, &bar, 1) &&
+	       text_scan(f->metadata, f->metadata_len, &bar, 0) >= 0;
+}
+
+size_t
+wire_bound(const struct wire_frame *f)
+{
+	/* text: the type, up to 20 digits for each other number, 4 '|' */
+	return 64 + f->user_len + f->content_len + f->metadata_len;
+}
+
+static unsigned char *
+__wire_put_varint(unsigned char *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = (unsigned char)(v | 0x80);
+		v >>= 7;
+	}
+	*p++ = (unsigned char)v;
+
+	return p;
+}
+
+static void *
+__wire_put_bytes(void *p, const void *bytes, size_t len)
+{
+	if (len)
+		memcpy(p, bytes, len);
+
+	return (char *)p + len;
+}
+
+static unsigned char *
+__wire_put_field(unsigned char *p, const char *field, size_t len)
+{
+	return __wire_put_bytes(__wire_put_varint(p, len), field, len);
+}
+
+size_t
+wire_encode(const struct wire_frame *f, void *buf)
+{
+	unsigned char *p = buf;
+	int n;
+
+	*p++ = WIRE_VERSION;
+	*p++ = (unsigned char)f->type;
+	for (n = 0; n < 8; n++)
+		*p++ = (unsigned char)(f->timestamp >> (n * 8));
+
+	p = __wire_put_varint(p, f->seq);
+	p = __wire_put_field(p, f->user, f->user ? f->user_len : 0);
+	p = __wire_put_field(p, f->content, f->content_len);
+	p = __wire_put_field(p, f->metadata, f->metadata_len);
+
+	return (size_t)(p - (unsigned char *)buf);
+}
+
+static char *
+__wire_put_dec(char *p, uint64_t v)
+{
+	char tmp[20];
+	int n = 0;
+
+	do
+		tmp[n++] = (char)('0' + v % 10);
+	while (v /= 10);
+
+	while (n)
+		*p++ = tmp[--n];
+
+	return p;
+}
+
+size_t
+wire_text_encode(const struct wire_frame *f, void *buf)
+{
+	char *p = buf;
+
+	p = __wire_put_dec(p, (uint64_t)f->type);
+	*p++ = '|';
+	p = __wire_put_dec(p, f->timestamp);
+	*p++ = '|';
+	if (f->user)
+		p = __wire_put_bytes(p, f->user, f->user_len);
+	else
+		p = __wire_put_dec(p, f->seq);
+	*p++ = '|';
+	p = __wire_put_bytes(p, f->content, f->content_len);
+	*p++ = '|';
+	p = __wire_put_bytes(p, f->metadata, f->metadata_len);
+
+	return (size_t)(p - (char *)buf);
+}
@@ -0,0 +1,89 @@
+/*
+ * binary frames for the "lws-minimal" protocol
+ *
+ * A client that negotiates the "lws-minimal-bin" subprotocol is sent its
+ * frames as binary websocket messages in this layout, instead of as
+ * "TYPE|TIMESTAMP|USERNAME|CONTENT|METADATA" text:
+ *
+ *   u8      version, WIRE_VERSION
+ *   u8      type
+ *   u64     timestamp, little endian
+ *   varint  seq, 0 if the frame has none
+ *   varint  username length, then its bytes
+ *   varint  content length, then its bytes
+ *   varint  metadata length, then its bytes
+ *
+ * varints are LEB128, seven bits a byte, least significant first.  Empty
+ * fields keep their place and no number goes through decimal.  Fields may
+ * hold any bytes, but a frame that is to be recoded as text must pass
+ * wire_text_ok().  The version byte is never an ASCII digit, so either kind
+ * of frame is told apart by its first byte, and any client may send either.
+ *
+ * Frames wrapping another, history (5) and resume (7), carry the room as
+ * content and the wrapped frame, in the same format, as metadata.  Text has
+ * no seq field, the seq goes where the username would.
+ *
+ * Nothing here allocates, parsed fields point into the frame.
+ */
+
+#if !defined(__WIRE_H__)
+#define __WIRE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WIRE_VERSION 1
+#define WIRE_HDR 10 /* version, type and timestamp */
+#define WIRE_SUBPROTOCOL "lws-minimal-bin"
+
+struct wire_frame {
+	int type;
+	uint64_t timestamp;
+	uint64_t seq;
+	const char *user; /* NULL when encoding puts the seq in text */
+	size_t user_len;
+	const char *content;
+	size_t content_len;
+	const char *metadata;
+	size_t metadata_len;
+};
+
+/* nonzero if in starts like a binary frame */
+
+int
+wire_is_binary(const void *in, size_t len);
+
+/*
+ * Parse a frame of either kind.  Returns 0, or -1 if a binary one is cut
+ * short, has another version or trails extra bytes, or a text one has no
+ * content field.  Text metadata runs to the end of the frame.
+ */
+
+int
+wire_parse(const void *in, size_t len, struct wire_frame *f);
+
+/*
+ * nonzero if f survives wire_text_encode(): each field is UTF-8, and the
+ * username and content have no '|', that would move the text fields after
+ * them.  Metadata runs to the end of a text frame, so may have '|'.
+ */
+
+int
+wire_text_ok(const struct wire_frame *f);
+
+/* the most bytes f takes in either encoding */
+
+size_t
+wire_bound(const struct wire_frame *f);
+
+/* encode f as binary, buf holds at least wire_bound(f), returns the length */
+
+size_t
+wire_encode(const struct wire_frame *f, void *buf);
+
+/* ... or as text */
+
+size_t
+wire_text_encode(const struct wire_frame *f, void *buf);
+
+#endif
@@ -1,45 +1,83 @@
 #include "message_types.h"
+#include "text_scan.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+// The number the digits from p on spell, up to the first that isn't one
+static uint64_t parse_digits(const char* p, const char* end) {
+    uint64_t n = 0;
+
+    while (p < end && *p >= '0' && *p <= '9')
+        n = n * 10 + (uint64_t)(*p++ - '0');
+
+    return n;
+}
+
+static MessageField field_at(const char* p, const char* end) {
+    const char* bar = memchr(p, '|', (size_t)(end - p));
+    MessageField f = {p, (size_t)((bar ? bar : end) - p)};
+
+    return f;
+}
+
+bool message_view_parse(const char* raw, size_t len, MessageView* view) {
+    if (!raw || !view) return false;
+
+    // Simple format: "TYPE|TIMESTAMP|USERNAME|CONTENT|METADATA", find where
+    // each field starts in the same pass that checks the frame is UTF-8
+    const char* end = raw + len;
+    const char* field[5];
+    size_t bars[4];
+    int n = text_scan(raw, len, bars, 4);
+
+    if (n < 3) return false; // Not UTF-8, or no type, timestamp, username, content
+
+    field[0] = raw;
+    for (int i = 0; i < n; i++)
+        field[i + 1] = raw + bars[i] + 1;
+    n++;
+
+    view->type = (MessageType)parse_digits(field[0], end);
+    view->timestamp = parse_digits(field[1], end);
+    view->username = field_at(field[2], end);
+    view->content = field_at(field[3], end);
+    view->metadata = n > 4 ? field_at(field[4], end) : (MessageField){end, 0};
+
+    return true;
+}
+
+static void copy_field(char* to, size_t size, MessageField f) {
+    size_t n = f.len < size - 1 ? f.len : size - 1;
+
+    memcpy(to, f.data, n);
+    to[n] = '\0';
+}
+
+// Length of a string held in a field of size bytes
+static size_t field_len(const char* s, size_t size) {
+    const char* nul = memchr(s, '\0', size - 1);
+
+    return nul ? (size_t)(nul - s) : size - 1;
+}
+
+void message_from_view(const MessageView* view, Message* message) {
+    message->type = view->type;
+    message->timestamp = view->timestamp;
+    copy_field(message->username, MAX_USERNAME_LENGTH, view->username);
+    copy_field(message->content, MAX_MESSAGE_LENGTH, view->content);
+    copy_field(message->metadata, MAX_METADATA_LENGTH, view->metadata);
+}
+
 bool message_parse_from_string(const char* raw_message, Message* message) {
+    MessageView view;
+
     if (!raw_message || !message) return false;
-    
-    // Simple format: "TYPE|TIMESTAMP|USERNAME|CONTENT|METADATA"
-    char* buffer = strdup(raw_message);
-    char* token;
-    char* saveptr;
-    int field = 0;
-    
-    token = strtok_r(buffer, "|", &saveptr);
-    while (token && field < 5) {
-        switch (field) {
-            case 0: // Type
-                message->type = (MessageType)atoi(token);
-                break;
-            case 1: // Timestamp
-                message->timestamp = strtoull(token, NULL, 10);
-                break;
-            case 2: // Username
-                strncpy(message->username, token, MAX_USERNAME_LENGTH - 1);
-                message->username[MAX_USERNAME_LENGTH - 1] = '\0';
-                break;
-            case 3: // Content
-                strncpy(message->content, token, MAX_MESSAGE_LENGTH - 1);
-                message->content[MAX_MESSAGE_LENGTH - 1] = '\0';
-                break;
-            case 4: // Metadata
-                strncpy(message->metadata, token, MAX_METADATA_LENGTH - 1);
-                message->metadata[MAX_METADATA_LENGTH - 1] = '\0';
-                break;
-        }
-        token = strtok_r(NULL, "|", &saveptr);
-        field++;
-    }
-    
-    free(buffer);
-    return field >= 4; // At minimum we need type, timestamp, username, content
+    if (!message_view_parse(raw_message, strlen(raw_message), &view))
+        return false;
+
+    message_from_view(&view, message);
+    return true;
 }
 
 int message_serialize_to_string(const Message* message, char* buffer, int buffer_size) {
@@ -53,8 +91,372 @@ int message_serialize_to_string(const Message* message, char* buffer, int buffer
                    message->metadata);
 }
 
+// "TYPE|TIMESTAMP|SEQ|ROOM|RECORD", the shape of history and resume frames
+static bool parse_wrapped(const char* raw_message, MessageType type,
+                          uint64_t* seq, const char** record) {
+    if (!raw_message || !seq || !record) return false;
+    if (atoi(raw_message) != (int)type) return false;
+
+    // Skip TYPE and TIMESTAMP, read SEQ, skip ROOM
+    const char* p = strchr(raw_message, '|');
+    if (!p || !(p = strchr(p + 1, '|'))) return false;
+    *seq = strtoull(p + 1, NULL, 10);
+    if (!(p = strchr(p + 1, '|')) || !(p = strchr(p + 1, '|'))) return false;
+
+    *record = p + 1;
+    return true;
+}
+
+bool message_parse_history_response(const char* raw_message, uint64_t* seq,
+                                    const char** record) {
+    return parse_wrapped(raw_message, MSG_TYPE_HISTORY_RESPONSE, seq, record);
+}
+
+bool message_parse_sequenced(const char* raw_message, uint64_t* seq,
+                             const char** record) {
+    return parse_wrapped(raw_message, MSG_TYPE_RESUME, seq, record);
+}
+
+static char* put_digits(char* p, uint64_t n) {
+    char tmp[20];
+    int len = 0;
+
+    do
+        tmp[len++] = (char)('0' + n % 10);
+    while (n /= 10);
+
+    while (len)
+        *p++ = tmp[--len];
+
+    return p;
+}
+
+static size_t count_digits(uint64_t n) {
+    size_t len = 1;
+
+    while (n /= 10)
+        len++;
+
+    return len;
+}
+
+static char* put_field(char* p, const char* field, size_t len) {
+    memcpy(p, field, len);
+    return p + len;
+}
+
+int message_batch_serialize(const Message* messages, int count, char* buffer,
+                            size_t buffer_size) {
+    char* p = buffer;
+    char* end = buffer + buffer_size;
+
+    if ((!messages && count) || count < 0 || !buffer) return -1;
+
+    // "8|0|COUNT||"
+    if (buffer_size < 6 + count_digits((uint64_t)count)) return -1;
+    p = put_digits(p, MSG_TYPE_BATCH);
+    p = put_field(p, "|0|", 3);
+    p = put_digits(p, (uint64_t)count);
+    p = put_field(p, "||", 2);
+
+    for (int n = 0; n < count; n++) {
+        const Message* m = &messages[n];
+        size_t username_len = field_len(m->username, MAX_USERNAME_LENGTH);
+        size_t content_len = field_len(m->content, MAX_MESSAGE_LENGTH);
+        size_t metadata_len = field_len(m->metadata, MAX_METADATA_LENGTH);
+        size_t len = count_digits((uint64_t)m->type) +
+                     count_digits(m->timestamp) + username_len +
+                     content_len + metadata_len + 4;
+
+        // Sized up front, so each record is written straight in
+        if ((size_t)(end - p) < count_digits(len) + 1 + len) return -1;
+
+        p = put_digits(p, len);
+        *p++ = ':';
+        p = put_digits(p, (uint64_t)m->type);
+        *p++ = '|';
+        p = put_digits(p, m->timestamp);
+        *p++ = '|';
+        p = put_field(p, m->username, username_len);
+        *p++ = '|';
+        p = put_field(p, m->content, content_len);
+        *p++ = '|';
+        p = put_field(p, m->metadata, metadata_len);
+    }
+
+    if (p == end) return -1; // No room left for the NUL
+    *p = '\0';
+
+    return (int)(p - buffer);
+}
+
+bool message_batch_parse(const char* raw, size_t len, MessageBatchIter* it) {
+    MessageView view;
+
+    if (!raw || !it || !message_view_parse(raw, len, &view) ||
+        view.type != MSG_TYPE_BATCH || !view.username.len ||
+        view.username.data[0] < '0' || view.username.data[0] > '9')
+        return false;
+
+    // The records start after the fourth '|', where the metadata does
+    it->p = view.metadata.data;
+    it->end = raw + len;
+    it->count = (int)parse_digits(view.username.data,
+                                  view.username.data + view.username.len);
+    it->remaining = it->count;
+
+    return true;
+}
+
+bool message_batch_next(MessageBatchIter* it, MessageView* view) {
+    const char* p = it->p;
+    uint64_t len = 0;
+
+    if (!it->remaining) return false;
+
+    while (p < it->end && *p >= '0' && *p <= '9' && len <= UINT32_MAX)
+        len = len * 10 + (uint64_t)(*p++ - '0');
+
+    if (p == it->p || p == it->end || *p++ != ':' ||
+        len > (uint64_t)(it->end - p) ||
+        !message_view_parse(p, (size_t)len, view)) {
+        it->remaining = 0;
+        return false;
+    }
+
+    it->p = p + len;
+    it->remaining--;
+
+    return true;
+}
+
+bool message_parse_retry_after(const char* raw_message, uint32_t* ms) {
+    MessageView view;
+
+    if (!raw_message || !ms ||
+        !message_view_parse(raw_message, strlen(raw_message), &view))
+        return false;
+    if (view.type != MSG_TYPE_STATUS || view.content.len != 11 ||
+        memcmp(view.content.data, "retry-after", 11) != 0)
+        return false;
+
+    *ms = (uint32_t)parse_digits(view.metadata.data,
+                                 view.metadata.data + view.metadata.len);
+    return true;
+}
+
+// The arena a list's records are carved from, see MESSAGE_CHUNK_SIZE
+struct MessageChunk {
+    size_t used;
+    size_t live; // Records in it still in the list
+    char data[];
+};
+
+#define CHUNK_DATA (MESSAGE_CHUNK_SIZE - offsetof(MessageChunk, data))
+#define RECORD_ALIGN 8
+
+static MessageNode* node_alloc(MessageList* list, size_t size) {
+    MessageChunk* chunk = list->chunk;
+    MessageNode* node;
+
+    size = (size + RECORD_ALIGN - 1) & ~(size_t)(RECORD_ALIGN - 1);
+    if (size > CHUNK_DATA) return NULL;
+
+    if (!chunk || chunk->used + size > CHUNK_DATA) {
+        // This one is full, the next is the spare if we kept one
+        chunk = list->spare;
+        list->spare = NULL;
+        if (!chunk) {
+            chunk = malloc(MESSAGE_CHUNK_SIZE);
+            if (!chunk) return NULL;
+            list->chunk_bytes += MESSAGE_CHUNK_SIZE;
+        }
+        chunk->used = 0;
+        chunk->live = 0;
+        list->chunk = chunk; // The full one goes with its last record
+    }
+
+    node = (MessageNode*)(chunk->data + chunk->used);
+    node->chunk = chunk;
+    chunk->used += size;
+    chunk->live++;
+
+    return node;
+}
+
+// A username in the intern table, with how many records use it
+struct MessageName {
+    size_t hash;
+    size_t refs;
+    size_t len;
+    char text[];
+};
+
+#define NAME_OF(username) \
+    ((MessageName*)((username) - offsetof(MessageName, text)))
+
+// FNV-1a
+static size_t name_hash(const char* name, size_t len) {
+    uint32_t h = 2166136261u;
+
+    while (len--)
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+
+    return h;
+}
+
+static bool interns_grow(MessageInterns* interns) {
+    size_t size = interns->size ? interns->size * 2 : 16;
+    MessageName** names = calloc(size, sizeof(*names));
+
+    if (!names) return false;
+
+    for (size_t n = 0; n < interns->size; n++) {
+        if (!interns->names[n]) continue;
+        size_t i = interns->names[n]->hash & (size - 1);
+        while (names[i])
+            i = (i + 1) & (size - 1);
+        names[i] = interns->names[n];
+    }
+
+    free(interns->names);
+    interns->names = names;
+    interns->size = size;
+
+    return true;
+}
+
+// The list's copy of the len bytes of name, made the first time it is seen.
+// Each record holding it must let go of it with unintern()
+static const char* intern(MessageInterns* interns, const char* name,
+                          size_t len) {
+    size_t hash = name_hash(name, len);
+    MessageName* n;
+    size_t i;
+
+    // Kept at most half full, so probes stay short
+    if (interns->count * 2 >= interns->size && !interns_grow(interns))
+        return NULL;
+
+    i = hash & (interns->size - 1);
+    while ((n = interns->names[i])) {
+        if (n->hash == hash && n->len == len && !memcmp(n->text, name, len)) {
+            n->refs++;
+            return n->text;
+        }
+        i = (i + 1) & (interns->size - 1);
+    }
+
+    n = malloc(offsetof(MessageName, text) + len + 1);
+    if (!n) return NULL;
+    n->hash = hash;
+    n->refs = 1;
+    n->len = len;
+    memcpy(n->text, name, len);
+    n->text[len] = '\0';
+
+    interns->names[i] = n;
+    interns->count++;
+    interns->bytes += offsetof(MessageName, text) + len + 1;
+
+    return n->text;
+}
+
+// Drop a record's hold on its username, freeing it with the last one
+static void unintern(MessageInterns* interns, const char* username) {
+    MessageName* n = NAME_OF(username);
+    size_t mask = interns->size - 1;
+    size_t i, j, home;
+
+    if (--n->refs) return;
+
+    i = n->hash & mask;
+    while (interns->names[i] != n)
+        i = (i + 1) & mask;
+
+    // Pull back any later name in the run that may no longer be found past
+    // the hole, so the table needs no tombstones
+    for (j = (i + 1) & mask; interns->names[j]; j = (j + 1) & mask) {
+        home = interns->names[j]->hash & mask;
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue; // Still reachable from its home
+        interns->names[i] = interns->names[j];
+        i = j;
+    }
+    interns->names[i] = NULL;
+
+    interns->count--;
+    interns->bytes -= offsetof(MessageName, text) + n->len + 1;
+    free(n);
+}
+
+static void interns_clear(MessageInterns* interns) {
+    for (size_t n = 0; n < interns->size; n++)
+        free(interns->names[n]);
+    free(interns->names);
+    memset(interns, 0, sizeof(*interns));
+}
+
+static void node_free(MessageList* list, MessageNode* node) {
+    MessageChunk* chunk = node->chunk;
+
+    unintern(&list->interns, node->username);
+    if (--chunk->live) return;
+
+    if (chunk == list->chunk) {
+        chunk->used = 0; // Start it over
+    } else if (!list->spare) {
+        list->spare = chunk;
+    } else {
+        free(chunk);
+        list->chunk_bytes -= MESSAGE_CHUNK_SIZE;
+    }
+}
+
+// A record of message, or NULL if we are out of memory
+static MessageNode* node_create(MessageList* list, const Message* message) {
+    size_t content_len = field_len(message->content, MAX_MESSAGE_LENGTH);
+    size_t metadata_len = field_len(message->metadata, MAX_METADATA_LENGTH);
+    const char* username;
+    MessageNode* node;
+
+    username = intern(&list->interns, message->username,
+                      field_len(message->username, MAX_USERNAME_LENGTH));
+    if (!username) return NULL;
+
+    node = node_alloc(list, offsetof(MessageNode, text) + content_len + 1 +
+                                metadata_len + 1);
+    if (!node) {
+        unintern(&list->interns, username);
+        return NULL;
+    }
+
+    node->next = NULL;
+    node->timestamp = message->timestamp;
+    node->username = username;
+    node->type = message->type;
+    node->content_len = (uint16_t)content_len;
+    node->metadata_len = (uint16_t)metadata_len;
+    memcpy(node->text, message->content, content_len);
+    node->text[content_len] = '\0';
+    memcpy(node->text + content_len + 1, message->metadata, metadata_len);
+    node->text[content_len + 1 + metadata_len] = '\0';
+
+    return node;
+}
+
+void message_node_to_message(const MessageNode* node, Message* message) {
+    message->timestamp = node->timestamp;
+    message->type = node->type;
+    strcpy(message->username, node->username);
+    memcpy(message->content, message_node_content(node),
+           (size_t)node->content_len + 1);
+    memcpy(message->metadata, message_node_metadata(node),
+           (size_t)node->metadata_len + 1);
+}
+
 MessageList* message_list_create(int max_messages) {
-    MessageList* list = malloc(sizeof(MessageList));
+    MessageList* list = calloc(1, sizeof(MessageList));
     if (!list) return NULL;
     
     list->head = NULL;
@@ -69,18 +471,17 @@ void message_list_destroy(MessageList* list) {
     if (!list) return;
     
     message_list_clear(list);
+    free(list->chunk);
+    free(list->spare);
     free(list);
 }
 
 bool message_list_add(MessageList* list, const Message* message) {
     if (!list || !message) return false;
     
-    MessageNode* new_node = malloc(sizeof(MessageNode));
+    MessageNode* new_node = node_create(list, message);
     if (!new_node) return false;
     
-    new_node->message = *message;
-    new_node->next = NULL;
-    
     // Add to end of list
     if (list->tail) {
         list->tail->next = new_node;
@@ -97,13 +498,33 @@ bool message_list_add(MessageList* list, const Message* message) {
         if (!list->head) {
             list->tail = NULL;
         }
-        free(old_head);
+        node_free(list, old_head);
         list->count--;
     }
     
     return true;
 }
 
+bool message_list_prepend(MessageList* list, const Message* message) {
+    if (!list || !message) return false;
+
+    // Older messages never push out newer ones
+    if (list->count >= list->max_messages) return false;
+
+    MessageNode* new_node = node_create(list, message);
+    if (!new_node) return false;
+
+    new_node->next = list->head;
+
+    list->head = new_node;
+    if (!list->tail) {
+        list->tail = new_node;
+    }
+    list->count++;
+
+    return true;
+}
+
 MessageNode* message_list_get_latest(MessageList* list, int count) {
     if (!list || count <= 0) return NULL;
     
@@ -117,10 +538,20 @@ void message_list_clear(MessageList* list) {
     while (list->head) {
         MessageNode* current = list->head;
         list->head = list->head->next;
-        free(current);
+        node_free(list, current);
     }
     
     list->head = NULL;
     list->tail = NULL;
     list->count = 0;
-}
\ No newline at end of file
+
+    // Every name went with its last message, this frees the table
+    interns_clear(&list->interns);
+}
+
+size_t message_list_bytes(const MessageList* list) {
+    if (!list) return 0;
+
+    return list->chunk_bytes + list->interns.bytes +
+           list->interns.size * sizeof(*list->interns.names);
+}
@@ -1,6 +1,7 @@
 #ifndef MESSAGE_TYPES_H
 #define MESSAGE_TYPES_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <time.h>
 #include <stdbool.h>
@@ -15,7 +16,10 @@ typedef enum {
     MSG_TYPE_LEAVE = 2,
     MSG_TYPE_STATUS = 3,
     MSG_TYPE_HISTORY_REQUEST = 4,
-    MSG_TYPE_HISTORY_RESPONSE = 5
+    MSG_TYPE_HISTORY_RESPONSE = 5,
+    MSG_TYPE_STATS = 6,
+    MSG_TYPE_RESUME = 7,
+    MSG_TYPE_BATCH = 8
 } MessageType;
 
 typedef struct {
@@ -26,27 +30,136 @@ typedef struct {
     char metadata[MAX_METADATA_LENGTH];
 } Message;
 
+// A field of a received frame, in place: not NUL-terminated
+typedef struct {
+    const char* data;
+    size_t len;
+} MessageField;
+
+// A frame parsed without copying it, the fields point into the frame
+typedef struct {
+    MessageType type;
+    uint64_t timestamp;
+    MessageField username;
+    MessageField content;
+    MessageField metadata;
+} MessageView;
+
+// A list keeps its messages as variable-length records carved from chunks of
+// MESSAGE_CHUNK_SIZE bytes. A chunk is freed once none of its records are
+// left in the list, so the memory held follows what the messages take, not
+// sizeof(Message) each
+#define MESSAGE_CHUNK_SIZE (64 * 1024)
+
+typedef struct MessageChunk MessageChunk;
+
+// A stored message. Its content and metadata follow it, each NUL-terminated,
+// read them with message_node_content() and message_node_metadata()
 typedef struct MessageNode {
-    Message message;
     struct MessageNode* next;
+    MessageChunk* chunk;
+    uint64_t timestamp;
+    const char* username; // Interned, every message from a sender shares it
+    MessageType type;
+    uint16_t content_len;
+    uint16_t metadata_len;
+    char text[];
 } MessageNode;
 
+typedef struct MessageName MessageName;
+
+// Each distinct username is kept once per list, in an open addressing table
+// of power of two size. A name is freed with the last message that has it
+typedef struct {
+    MessageName** names;
+    size_t size;
+    size_t count;
+    size_t bytes; // Taken by the names themselves
+} MessageInterns;
+
 typedef struct {
     MessageNode* head;
     MessageNode* tail;
     int count;
     int max_messages;
+    MessageChunk* chunk; // Records are carved from here
+    MessageChunk* spare; // An emptied chunk, kept for the next one
+    size_t chunk_bytes;  // Held in chunks, for all the records
+    MessageInterns interns;
 } MessageList;
 
 // Message parsing functions
 bool message_parse_from_string(const char* raw_message, Message* message);
+
+// Parse the len bytes at raw, eg, straight from the lws receive buffer. They
+// needn't be NUL-terminated and nothing is allocated or copied, the view is
+// only good while they are. Needs at least TYPE|TIMESTAMP|USERNAME|CONTENT, and
+// fails on bytes that are not UTF-8
+bool message_view_parse(const char* raw, size_t len, MessageView* view);
+
+// Copy a view into message, each field cut to fit
+void message_from_view(const MessageView* view, Message* message);
 int message_serialize_to_string(const Message* message, char* buffer, int buffer_size);
 
+// A history response is "5|TIMESTAMP|SEQ|ROOM|RECORD", RECORD being an older
+// message in the usual format. With no RECORD it ends a page, and SEQ is what
+// to page back from next, or 0 when there is nothing older.
+bool message_parse_history_response(const char* raw_message, uint64_t* seq,
+                                    const char** record);
+
+// Once we resumed, live messages come as "7|TIMESTAMP|SEQ|ROOM|RECORD", SEQ
+// being the message's place in the room
+bool message_parse_sequenced(const char* raw_message, uint64_t* seq,
+                             const char** record);
+
+// A busy server turns us away with "3|TIMESTAMP|server|retry-after|MS", we
+// shouldn't reconnect for MS milliseconds
+bool message_parse_retry_after(const char* raw_message, uint32_t* ms);
+
+// Many messages in one frame: "8|0|COUNT||" and then COUNT records, each
+// "LEN:RECORD", RECORD being a message in the usual format and LEN its length
+// in decimal, so finding the next record never scans the one before it.
+//
+// Serialize count messages into buffer. Returns the length, or -1 if they
+// don't all fit
+int message_batch_serialize(const Message* messages, int count, char* buffer,
+                            size_t buffer_size);
+
+// Walks the records of a batch in place, one at a time
+typedef struct {
+    const char* p;
+    const char* end;
+    int count;     // Records the batch says it holds
+    int remaining; // Of them, not yet returned
+} MessageBatchIter;
+
+// Start on the len bytes at raw, false if they aren't a batch
+bool message_batch_parse(const char* raw, size_t len, MessageBatchIter* it);
+
+// The next record as a view into the batch, false after the last or at one
+// that is cut short or doesn't parse, which ends the walk
+bool message_batch_next(MessageBatchIter* it, MessageView* view);
+
 // Message list functions
 MessageList* message_list_create(int max_messages);
 void message_list_destroy(MessageList* list);
 bool message_list_add(MessageList* list, const Message* message);
+bool message_list_prepend(MessageList* list, const Message* message);
 MessageNode* message_list_get_latest(MessageList* list, int count);
 void message_list_clear(MessageList* list);
 
+// Bytes held for the list's messages and usernames
+size_t message_list_bytes(const MessageList* list);
+
+static inline const char* message_node_content(const MessageNode* node) {
+    return node->text;
+}
+
+static inline const char* message_node_metadata(const MessageNode* node) {
+    return node->text + node->content_len + 1;
+}
+
+// Copy a stored message back out whole
+void message_node_to_message(const MessageNode* node, Message* message);
+
 #endif
\ No newline at end of file
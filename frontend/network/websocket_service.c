@@ -2,11 +2,14 @@
 #include "../clay.h"
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
 
 #ifndef DISABLE_NETWORKING
 #include <libwebsockets.h>
+#include "buf_pool.h"
+#include "wire.h"
 
 static struct lws_context *ws_context = NULL;
 static WebSocketData ws_data = {0};
@@ -23,6 +26,68 @@ static const lws_retry_bo_t retry = {
     .jitter_percent = 20,
 };
 
+// Received messages are reassembled in buffers from here
+#define RX_POOL_KEEP 4
+static size_t max_message = WEBSOCKET_DEFAULT_MAX_MESSAGE;
+static struct buf_pool rx_pool;
+static struct pool_buf rx_msg;
+static bool rx_dropping; // Rest of a message that was too big
+
+static WebSocketDeflateOptions deflate_options = {
+    .enabled = true,
+    .level = 1,
+    .mem_level = 8,
+    .window_bits = 15,
+};
+
+#if !defined(LWS_WITHOUT_EXTENSIONS)
+static char deflate_offer[128];
+static struct lws_extension extensions[] = {
+    {"permessage-deflate", lws_extension_callback_pm_deflate, deflate_offer},
+    {NULL, NULL, NULL}};
+
+// Apply our compression settings before anything is compressed
+static void setup_deflate(struct lws *wsi) {
+  char level[4], mem_level[4];
+
+  ws_data.deflate_mem = 0;
+  snprintf(level, sizeof(level), "%d", deflate_options.level);
+  if (lws_set_extension_option(wsi, "permessage-deflate", "compression_level",
+                               level))
+    return; // Not negotiated
+
+  snprintf(mem_level, sizeof(mem_level), "%d", deflate_options.mem_level);
+  lws_set_extension_option(wsi, "permessage-deflate", "mem_level", mem_level);
+
+  // zlib's sizing: our deflater, plus an inflater for the server's window
+  ws_data.deflate_mem = (1u << (deflate_options.window_bits + 2)) +
+                        (1u << (deflate_options.mem_level + 9)) +
+                        (1u << 15) + 7168;
+  lwsl_user("permessage-deflate: %u bytes of zlib state\n",
+            ws_data.deflate_mem);
+}
+#endif
+
+void websocket_service_set_deflate(const WebSocketDeflateOptions* options) {
+  if (!options) return;
+
+  deflate_options = *options;
+  if (deflate_options.level < 1 || deflate_options.level > 9)
+    deflate_options.level = 1;
+  if (deflate_options.mem_level < 1 || deflate_options.mem_level > 9)
+    deflate_options.mem_level = 8;
+  if (deflate_options.window_bits < 9 || deflate_options.window_bits > 15)
+    deflate_options.window_bits = 15;
+}
+
+void websocket_service_set_max_message(size_t max) {
+  if (max)
+    max_message = max;
+}
+
+// Holds the path while lws connects
+static char connect_path[32];
+
 static void connect_client(lws_sorted_usec_list_t *sul) {
   // printf("connect_client called.\n");
   // What does container_of macro do?
@@ -37,11 +102,16 @@ static void connect_client(lws_sorted_usec_list_t *sul) {
   // printf("%s\n", m->ipaddr);
   // i.port = 7681;
   // i.address = "localhost";
-  i.path = "/";
+  // Ask for our messages with their seq, and what we missed since the last
+  snprintf(connect_path, sizeof(connect_path), "/?seq=%llu",
+           (unsigned long long)ws_data.next_seq);
+  ws_data.resuming = ws_data.next_seq != 0;
+  i.path = connect_path;
   i.host = i.address;
   i.origin = i.address;
   i.ssl_connection = 0; // No SSL
-  i.protocol = "lws-minimal";
+  // Binary frames if the server has them, text if not
+  i.protocol = WIRE_SUBPROTOCOL ",lws-minimal";
   i.local_protocol_name = "lws-minimal-client";
   i.pwsi = &m->wsi;
   i.retry_and_idle_policy = &retry;
@@ -56,46 +126,185 @@ static void connect_client(lws_sorted_usec_list_t *sul) {
   }
 }
 
+// True once the server agreed to "lws-minimal-bin", we send binary frames
+static bool wire_binary;
+
+// What each kind of frame does, whichever format it came in
+
+static void on_retry_after(uint32_t ms) {
+  // The server is busy and closes us, come back when it said
+  ws_connection.retry_after_ms = ms ? ms : 1;
+  snprintf(ws_data.connection_status, sizeof(ws_data.connection_status),
+           "Server busy, retrying in %us", (ms + 999) / 1000);
+}
+
+static void on_message(const Message *message) {
+  if (ws_data.messages) {
+    message_list_add(ws_data.messages, message);
+    ws_data.has_new_message = true;
+  }
+}
+
+// These come in seq order, one lower than before means the server's seqs
+// for the room started over and we follow them
+static void on_sequenced(uint64_t seq) {
+  ws_data.next_seq = seq + 1;
+}
+
+static void on_history_end(uint64_t seq) {
+  if (ws_data.resuming) {
+    // End of what we missed, we still page back from where we were
+    ws_data.resuming = false;
+    ws_data.history_more = ws_data.history_before != 0;
+  } else {
+    // End of a page, or of the history sent when we connected
+    ws_data.history_before = seq;
+    ws_data.history_more = seq != 0;
+  }
+  ws_data.history_pending = false;
+}
+
+static void on_history(const Message *message) {
+  // Pages come newest first
+  if (ws_data.messages && message_list_prepend(ws_data.messages, message))
+    ws_data.has_new_message = true;
+}
+
+// A binary frame's fields, as a text one's would be parsed
+static void view_from_wire(const struct wire_frame *f, MessageView *view) {
+  view->type = (MessageType)f->type;
+  view->timestamp = f->timestamp;
+  view->username.data = f->user;
+  view->username.len = f->user_len;
+  view->content.data = f->content;
+  view->content.len = f->content_len;
+  view->metadata.data = f->metadata;
+  view->metadata.len = f->metadata_len;
+}
+
+// Parse and store one whole binary message, see wire.h
+static void handle_binary(const void *in, size_t len) {
+  struct wire_frame f, rec;
+  MessageView view;
+  Message parsed_message;
+  char ms[11] = "";
+
+  if (wire_parse(in, len, &f))
+    return;
+
+  switch (f.type) {
+  case MSG_TYPE_STATUS:
+    if (f.content_len == 11 && !memcmp(f.content, "retry-after", 11) &&
+        f.metadata_len < sizeof(ms)) {
+      memcpy(ms, f.metadata, f.metadata_len);
+      on_retry_after((uint32_t)strtoul(ms, NULL, 10));
+    }
+    return;
+
+  case MSG_TYPE_HISTORY_RESPONSE:
+  case MSG_TYPE_RESUME:
+    // The room, then the record in the same format, or none at a page end
+    if (f.type == MSG_TYPE_RESUME)
+      on_sequenced(f.seq);
+    else if (!f.metadata_len) {
+      on_history_end(f.seq);
+      return;
+    }
+    if (wire_parse(f.metadata, f.metadata_len, &rec))
+      return;
+    view_from_wire(&rec, &view);
+    message_from_view(&view, &parsed_message);
+    if (f.type == MSG_TYPE_RESUME)
+      on_message(&parsed_message);
+    else
+      on_history(&parsed_message);
+    return;
+
+  default:
+    view_from_wire(&f, &view);
+    message_from_view(&view, &parsed_message);
+    on_message(&parsed_message);
+    return;
+  }
+}
+
+// Parse and store one whole received message
+static void handle_message(const char *text, size_t len) {
+  Message parsed_message;
+  MessageBatchIter batch;
+  MessageView view;
+  const char *record;
+  uint64_t seq;
+  uint32_t ms;
+
+  if (message_batch_parse(text, len, &batch)) {
+    // Each record is read in place as we get to it
+    while (message_batch_next(&batch, &view)) {
+      message_from_view(&view, &parsed_message);
+      on_message(&parsed_message);
+    }
+  } else if (message_parse_retry_after(text, &ms)) {
+    on_retry_after(ms);
+  } else if (message_parse_sequenced(text, &seq, &record)) {
+    on_sequenced(seq);
+    if (message_parse_from_string(record, &parsed_message))
+      on_message(&parsed_message);
+  } else if (message_parse_history_response(text, &seq, &record)) {
+    if (!*record)
+      on_history_end(seq);
+    else if (message_parse_from_string(record, &parsed_message))
+      on_history(&parsed_message);
+  } else if (message_parse_from_string(text, &parsed_message)) {
+    on_message(&parsed_message);
+  } else {
+    // Fallback for simple text messages
+    Message simple_message = {0};
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    simple_message.timestamp = tv.tv_sec * 1000000ULL + tv.tv_usec;
+    simple_message.type = MSG_TYPE_CHAT;
+    strcpy(simple_message.username, "Unknown");
+    strncpy(simple_message.content, text, MAX_MESSAGE_LENGTH - 1);
+    simple_message.content[MAX_MESSAGE_LENGTH - 1] = '\0';
+
+    on_message(&simple_message);
+  }
+}
+
 static int callback_minimal(struct lws *wsi, enum lws_callback_reasons reason,
                             void *user, void *in, size_t len) {
+  uint32_t jitter;
+  char proto[32];
+
   switch (reason) {
   case LWS_CALLBACK_CLIENT_ESTABLISHED:
     // printf("LWS_CALLBACK_CLIENT_ESTABLISHED\n");
     ws_data.connected = true;
     strcpy(ws_data.connection_status, "Connected");
+    // An older server only knows "lws-minimal", then we stay on text
+    wire_binary = lws_hdr_copy(wsi, proto, sizeof(proto),
+                               WSI_TOKEN_PROTOCOL) > 0 &&
+                  !strcmp(proto, WIRE_SUBPROTOCOL);
+#if !defined(LWS_WITHOUT_EXTENSIONS)
+    setup_deflate(wsi);
+#endif
     break;
 
   case LWS_CALLBACK_CLIENT_RECEIVE:
-    // printf("LWS_CALLBACK_CLIENT_RECEIVE\n");
-    // Parse and store the received message
-    if (len < 2048) { // Reasonable message size limit
-      char temp_buffer[2048];
-      memcpy(temp_buffer, in, len);
-      temp_buffer[len] = '\0';
-      
-      Message parsed_message;
-      if (message_parse_from_string(temp_buffer, &parsed_message)) {
-        if (ws_data.messages) {
-          message_list_add(ws_data.messages, &parsed_message);
-          ws_data.has_new_message = true;
-        }
-      } else {
-        // Fallback for simple text messages
-        Message simple_message = {0};
-        struct timeval tv;
-        gettimeofday(&tv, NULL);
-        simple_message.timestamp = tv.tv_sec * 1000000ULL + tv.tv_usec;
-        simple_message.type = MSG_TYPE_CHAT;
-        strcpy(simple_message.username, "Unknown");
-        strncpy(simple_message.content, temp_buffer, MAX_MESSAGE_LENGTH - 1);
-        simple_message.content[MAX_MESSAGE_LENGTH - 1] = '\0';
-        
-        if (ws_data.messages) {
-          message_list_add(ws_data.messages, &simple_message);
-          ws_data.has_new_message = true;
-        }
-      }
+    // Frames may come in pieces, put them back together before parsing
+    if (!rx_dropping && buf_pool_append(&rx_pool, &rx_msg, in, len)) {
+      lwsl_warn("Dropping message over %zu bytes\n", max_message);
+      rx_dropping = true;
     }
+    if (!lws_is_final_fragment(wsi))
+      break;
+
+    if (!rx_dropping && wire_is_binary(rx_msg.data, rx_msg.len))
+      handle_binary(rx_msg.data, rx_msg.len);
+    else if (!rx_dropping)
+      handle_message((const char *)rx_msg.data, rx_msg.len);
+    rx_dropping = false;
+    buf_pool_release(&rx_pool, &rx_msg); // Back to the pool for the next
     break;
 
   case LWS_CALLBACK_CLIENT_WRITEABLE:
@@ -104,11 +313,20 @@ static int callback_minimal(struct lws *wsi, enum lws_callback_reasons reason,
       // printf("tried to write\n");
       unsigned char buf[LWS_PRE + 512];
       unsigned char *p = &buf[LWS_PRE];
-
-      int len = sprintf((char *)p, "%s", ws_connection.send_buffer);
-
-      if (lws_write(wsi, p, len, LWS_WRITE_TEXT) < len) {
-        return -1;
+      struct wire_frame f;
+      int len;
+
+      if (wire_binary &&
+          !wire_parse(ws_connection.send_buffer,
+                      strlen(ws_connection.send_buffer), &f)) {
+        // send_buffer is at most 256 bytes, that's under 512 in binary too
+        len = (int)wire_encode(&f, p);
+        if (lws_write(wsi, p, len, LWS_WRITE_BINARY) < len)
+          return -1;
+      } else {
+        len = sprintf((char *)p, "%s", ws_connection.send_buffer);
+        if (lws_write(wsi, p, len, LWS_WRITE_TEXT) < len)
+          return -1;
       }
 
       ws_connection.has_data_to_send = false; // Clear flag
@@ -126,6 +344,12 @@ static int callback_minimal(struct lws *wsi, enum lws_callback_reasons reason,
   case LWS_CALLBACK_CLIENT_CLOSED:
     // printf("LWS_CALLBACK_CLIENT_CLOSED\n");
     ws_data.connected = false;
+    ws_data.history_more = false;
+    ws_data.history_pending = false;
+    buf_pool_release(&rx_pool, &rx_msg); // Whatever was half way in
+    rx_dropping = false;
+    if (ws_connection.retry_after_ms)
+      goto retry_after;
     strcpy(ws_data.connection_status, "Disconnected");
     goto do_retry;
 
@@ -136,6 +360,17 @@ static int callback_minimal(struct lws *wsi, enum lws_callback_reasons reason,
   }
   return lws_callback_http_dummy(wsi, reason, user, in, len);
 
+retry_after:
+  // The server's wait, plus our jitter so everybody it sent away at once
+  // doesn't come back at once, and the backoff starts over
+  lws_get_random(ws_context, &jitter, sizeof(jitter));
+  jitter %= ws_connection.retry_after_ms * retry.jitter_percent / 100 + 1;
+  lws_sul_schedule(ws_context, 0, &ws_connection.sul, connect_client,
+                   (lws_usec_t)(ws_connection.retry_after_ms + jitter) *
+                       LWS_US_PER_MS);
+  ws_connection.retry_after_ms = 0;
+  ws_connection.retry_count = 0;
+  return 0;
 
 do_retry:
   if (lws_retry_sul_schedule_retry_wsi(wsi, &ws_connection.sul, connect_client,
@@ -163,20 +398,37 @@ bool websocket_service_init(void) {
   info.options = LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
   info.port = CONTEXT_PORT_NO_LISTEN;
   info.protocols = protocols;
+#if !defined(LWS_WITHOUT_EXTENSIONS)
+  if (deflate_options.enabled) {
+    // Our window is ours to pick, the server's stays at what it offers
+    snprintf(deflate_offer, sizeof(deflate_offer),
+             "permessage-deflate; client_max_window_bits=%d%s",
+             deflate_options.window_bits,
+             deflate_options.no_context_takeover ?
+                 "; client_no_context_takeover" : "");
+    info.extensions = extensions;
+  }
+#endif
   // info.signal_cb = websocket_signal_cb;
 
   int logs = LLL_USER | LLL_ERR | LLL_WARN | LLL_NOTICE;
   lws_set_log_level(logs, NULL);
 
+  if (buf_pool_init(&rx_pool, max_message, RX_POOL_KEEP))
+    return false;
+
   ws_context = lws_create_context(&info);
-  if (!ws_context)
+  if (!ws_context) {
+    buf_pool_destroy(&rx_pool);
     return false;
+  }
 
   // Initialize message list
   ws_data.messages = message_list_create(100); // Store up to 100 messages
   if (!ws_data.messages) {
     lws_context_destroy(ws_context);
     ws_context = NULL;
+    buf_pool_destroy(&rx_pool);
     return false;
   }
 
@@ -239,6 +491,20 @@ void websocket_service_send_text(const char* username, const char* text) {
   websocket_service_send_message(&message);
 }
 
+void websocket_service_request_history(int count) {
+  if (!ws_connection.wsi || !ws_data.history_more || ws_data.history_pending ||
+      ws_connection.has_data_to_send)
+    return;
+
+  // "count@seq" asks for the count messages before seq
+  snprintf(ws_connection.send_buffer, sizeof(ws_connection.send_buffer),
+           "%d|0||%d@%llu|", (int)MSG_TYPE_HISTORY_REQUEST, count,
+           (unsigned long long)ws_data.history_before);
+  ws_connection.has_data_to_send = true;
+  ws_data.history_pending = true;
+  lws_callback_on_writable(ws_connection.wsi);
+}
+
 void websocket_service_cleanup(void) {
   // Clean up connection state
   memset(&ws_connection, 0, sizeof(ws_connection));
@@ -254,6 +520,11 @@ void websocket_service_cleanup(void) {
     lws_context_destroy(ws_context);
     ws_context = NULL;
   }
+
+  // After the context, a message may have been half way in
+  buf_pool_release(&rx_pool, &rx_msg);
+  buf_pool_destroy(&rx_pool);
+  rx_dropping = false;
   
   // Reset websocket data
   memset(&ws_data, 0, sizeof(ws_data));
@@ -304,6 +575,21 @@ void websocket_service_send_text(const char* username, const char* text) {
     (void)text;     // Suppress unused parameter warning
 }
 
+void websocket_service_set_deflate(const WebSocketDeflateOptions* options) {
+    // Nothing to compress when networking is disabled
+    (void)options; // Suppress unused parameter warning
+}
+
+void websocket_service_set_max_message(size_t max) {
+    // Nothing is received when networking is disabled
+    (void)max; // Suppress unused parameter warning
+}
+
+void websocket_service_request_history(int count) {
+    // Do nothing when networking is disabled
+    (void)count; // Suppress unused parameter warning
+}
+
 void websocket_service_cleanup(void) {
     // Nothing to clean up when networking is disabled
 }
@@ -17,6 +17,7 @@
 #endif // DISABLE_NETWORKING
 
 #include <stdbool.h>
+#include <stddef.h>
 #include "../clay.h"
 #include "message_types.h"
 
@@ -26,6 +27,16 @@ typedef struct {
   bool connected;
   bool error;
   char connection_status[100];
+  // Scrollback: where the next page of older history starts
+  uint64_t history_before;
+  bool history_more;
+  bool history_pending;
+  // Seq of the next lobby message we want, sent when reconnecting so only
+  // what we missed comes again; 0 until we've seen one
+  uint64_t next_seq;
+  bool resuming;
+  // zlib state held for permessage-deflate, 0 if it wasn't negotiated
+  uint32_t deflate_mem;
 } WebSocketData;
 
 #ifndef DISABLE_NETWORKING
@@ -33,6 +44,7 @@ typedef struct {
   lws_sorted_usec_list_t sul;
   struct lws *wsi;
   uint16_t retry_count;
+  uint32_t retry_after_ms; // The server asked us to wait this long, or 0
   char send_buffer[256];
   bool has_data_to_send;
   char* ipaddr;
@@ -48,6 +60,23 @@ typedef struct {
 } my_conn;
 #endif // DISABLE_NETWORKING
 
+// permessage-deflate settings, as zlib takes them
+typedef struct {
+  bool enabled;
+  int level;               // 1..9
+  int mem_level;           // 1..9
+  int window_bits;         // 9..15
+  bool no_context_takeover;
+} WebSocketDeflateOptions;
+
+// Call before websocket_service_init() to change the defaults
+void websocket_service_set_deflate(const WebSocketDeflateOptions* options);
+
+// Biggest message we put back together from fragments, bigger ones are
+// dropped.  Call before websocket_service_init() to change it
+#define WEBSOCKET_DEFAULT_MAX_MESSAGE (256 * 1024)
+void websocket_service_set_max_message(size_t max);
+
 // Initialize the websocket service
 bool websocket_service_init(void);
 
@@ -66,6 +95,10 @@ void websocket_service_send_message(const Message* message);
 // Send a simple text message
 void websocket_service_send_text(const char* username, const char* text);
 
+// Ask for up to count messages older than any we have, they are added to
+// the front of the message list as they arrive
+void websocket_service_request_history(int count);
+
 // Cleanup
 void websocket_service_cleanup(void);
 
@@ -6,6 +6,14 @@
 
 static WebSocketData stub_ws_data = {0};
 
+void websocket_service_set_deflate(const WebSocketDeflateOptions* options) {
+    (void)options; // Suppress unused parameter warning
+}
+
+void websocket_service_set_max_message(size_t max) {
+    (void)max; // Suppress unused parameter warning
+}
+
 bool websocket_service_init(void) {
     printf("Warning: Networking disabled - websocket_service_init called\n");
     stub_ws_data.connected = false;
@@ -36,6 +44,10 @@ void websocket_service_send_text(const char* username, const char* text) {
     printf("Warning: Networking disabled - cannot send text: %s\n", text);
 }
 
+void websocket_service_request_history(int count) {
+    printf("Warning: Networking disabled - cannot request history\n");
+}
+
 void websocket_service_cleanup(void) {
     printf("Warning: Networking disabled - websocket_service_cleanup called\n");
 }
\ No newline at end of file
@@ -77,6 +77,7 @@ typedef struct {
 } ScrollState;
 
 #define MAX_MESSAGES 100
+#define HISTORY_PAGE_SIZE 30
 ChatMessage chatMessages[MAX_MESSAGES];
 int chatMessageCount = 0;
 
@@ -123,6 +124,7 @@ typedef struct {
   // WebSocket data
   WebSocketData *ws_data;
   int last_processed_message_count;
+  MessageNode *last_tail; // Newest message seen, older pages don't scroll
   
   // Auto-scroll animation
   bool auto_scrolling;
@@ -180,6 +182,11 @@ void UpdateManualScrollVelocity(ChatApp_Data *data) {
     Vector2 scrollDelta = GetMouseWheelMoveV();
     bool hasScrollInput = (fabs(scrollDelta.y) > 0.01f);
     
+    // Scrolling up at the top loads the page of history before it
+    if (scrollDelta.y > 0.01f && scrollData.scrollPosition->y >= 0 &&
+        data->ws_data)
+      websocket_service_request_history(HISTORY_PAGE_SIZE);
+
     if (hasScrollInput) {
       data->manual_scroll_state.is_manual_scrolling = true;
       data->manual_scroll_state.last_manual_scroll_time = current_time;
@@ -254,39 +261,23 @@ void UpdateChatFromWebSocket(ChatApp_Data *data) {
   
   MessageList *msg_list = data->ws_data->messages;
   
-  // Store previous message count to detect new messages
-  int previous_message_count = chatMessageCount;
-  
   // Clear current chat messages
   chatMessageCount = 0;
   
   // Convert WebSocket messages to ChatMessage format
   MessageNode *current = msg_list->head;
   while (current && chatMessageCount < MAX_MESSAGES) {
-    Message *ws_msg = &current->message;
-    
     // Determine if this message is from current user
-    bool isCurrentUser = (strcmp(ws_msg->username, data->login_credentials->username_buf) == 0);
-    
-    // Create static strings for rendering (need to be persistent)
-    static char message_text_storage[MAX_MESSAGES][MAX_MESSAGE_LENGTH];
-    static char sender_storage[MAX_MESSAGES][MAX_USERNAME_LENGTH];
-    
-    strncpy(message_text_storage[chatMessageCount], ws_msg->content, MAX_MESSAGE_LENGTH - 1);
-    message_text_storage[chatMessageCount][MAX_MESSAGE_LENGTH - 1] = '\0';
-    
-    strncpy(sender_storage[chatMessageCount], ws_msg->username, MAX_USERNAME_LENGTH - 1);
-    sender_storage[chatMessageCount][MAX_USERNAME_LENGTH - 1] = '\0';
+    bool isCurrentUser = (strcmp(current->username, data->login_credentials->username_buf) == 0);
     
+    // The list only changes in websocket_service_update(), before the
+    // layout, so the strings can point straight into its records
     chatMessages[chatMessageCount].text = (Clay_String){
-      .chars = message_text_storage[chatMessageCount],
-      .length = (int)strlen(message_text_storage[chatMessageCount])
+      .chars = message_node_content(current),
+      .length = current->content_len
     };
     
-    chatMessages[chatMessageCount].sender = (Clay_String){
-      .chars = sender_storage[chatMessageCount], 
-      .length = (int)strlen(sender_storage[chatMessageCount])
-    };
+    chatMessages[chatMessageCount].sender = ClayStr(current->username);
     
     chatMessages[chatMessageCount].isSender = isCurrentUser;
     
@@ -294,14 +285,15 @@ void UpdateChatFromWebSocket(ChatApp_Data *data) {
     current = current->next;
   }
   
-  // Auto-scroll to bottom if new messages arrived
-  if (chatMessageCount > previous_message_count) {
+  // Auto-scroll to bottom if new messages arrived at the bottom
+  if (chatMessageCount && msg_list->tail != data->last_tail) {
     // Use placeholder target that will be calculated in UpdateAutoScroll
     data->scroll_target = -999999.0f;
     data->auto_scrolling = true;
     data->scroll_velocity = 0; // Reset velocity for new animation
     data->scroll_delay_frames = 2; // Wait 2 frames for layout to complete
   }
+  data->last_tail = msg_list->tail;
 }
 
 void HandleSidebarInteraction(Clay_ElementId elementId,
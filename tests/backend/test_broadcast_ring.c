@@ -0,0 +1,322 @@
+#include "unity.h"
+#include "broadcast_ring.h"
+#include <stdlib.h>
+#include <string.h>
+
+static struct bcast_ring ring;
+
+static int insert_text(const char *text) {
+    struct msg *m = msg_create(text, strlen(text) + 1);
+    int n;
+
+    TEST_ASSERT_NOT_NULL(m);
+    n = bcast_ring_insert(&ring, m);
+    msg_unref(m);
+    TEST_ASSERT_TRUE(n >= 0);
+
+    return n;
+}
+
+static const char *peek_text(struct bcast_reader *rd) {
+    const struct msg *m = bcast_ring_peek(&ring, rd);
+
+    return m ? (const char *)m->payload + LWS_PRE : NULL;
+}
+
+void setUp(void) {
+}
+
+void tearDown(void) {
+    bcast_ring_destroy(&ring);
+}
+
+void test_ring_init_rounds_to_power_of_two(void) {
+    TEST_ASSERT_EQUAL_INT(0, bcast_ring_init(&ring, 5, BCAST_SLOW_DROP_OLDEST));
+    TEST_ASSERT_EQUAL_INT(8, ring.size);
+    TEST_ASSERT_EQUAL_INT(1, bcast_ring_init(&ring, 0, BCAST_SLOW_DROP_OLDEST));
+}
+
+void test_ring_every_reader_sees_every_message(void) {
+    struct bcast_reader a, b;
+    int i;
+
+    bcast_ring_init(&ring, 8, BCAST_SLOW_DROP_OLDEST);
+    bcast_ring_attach(&ring, &a);
+    bcast_ring_attach(&ring, &b);
+
+    insert_text("one");
+    insert_text("two");
+
+    /* both readers share the same slot, no per-client copy */
+    TEST_ASSERT_EQUAL_PTR(bcast_ring_peek(&ring, &a), bcast_ring_peek(&ring, &b));
+
+    for (i = 0; i < 2; i++) {
+        TEST_ASSERT_EQUAL_STRING(i ? "two" : "one", peek_text(&a));
+        bcast_ring_consume(&ring, &a);
+    }
+    TEST_ASSERT_NULL(peek_text(&a));
+    TEST_ASSERT_EQUAL_INT(2, bcast_ring_pending(&ring, &b));
+    TEST_ASSERT_EQUAL_STRING("one", peek_text(&b));
+}
+
+void test_ring_burst_larger_than_one_message_is_not_lost(void) {
+    struct bcast_reader rd;
+    char text[16];
+    int i;
+
+    bcast_ring_init(&ring, 64, BCAST_SLOW_DROP_OLDEST);
+    bcast_ring_attach(&ring, &rd);
+
+    for (i = 0; i < 50; i++) {
+        snprintf(text, sizeof(text), "m%d", i);
+        insert_text(text);
+    }
+
+    for (i = 0; i < 50; i++) {
+        snprintf(text, sizeof(text), "m%d", i);
+        TEST_ASSERT_EQUAL_STRING(text, peek_text(&rd));
+        bcast_ring_consume(&ring, &rd);
+    }
+    TEST_ASSERT_EQUAL_INT(0, rd.dropped);
+}
+
+void test_ring_late_reader_starts_at_head(void) {
+    struct bcast_reader rd;
+
+    bcast_ring_init(&ring, 4, BCAST_SLOW_DROP_OLDEST);
+    insert_text("before");
+    bcast_ring_attach(&ring, &rd);
+
+    TEST_ASSERT_NULL(peek_text(&rd));
+    insert_text("after");
+    TEST_ASSERT_EQUAL_STRING("after", peek_text(&rd));
+}
+
+void test_ring_reclaims_without_readers(void) {
+    int i;
+
+    bcast_ring_init(&ring, 4, BCAST_SLOW_CLOSE);
+    for (i = 0; i < 20; i++)
+        insert_text("x");
+
+    TEST_ASSERT_EQUAL_INT(20, ring.head);
+}
+
+void test_ring_slow_policy_drop_oldest(void) {
+    struct bcast_reader fast, slow;
+    int i;
+
+    bcast_ring_init(&ring, 4, BCAST_SLOW_DROP_OLDEST);
+    bcast_ring_attach(&ring, &fast);
+    bcast_ring_attach(&ring, &slow);
+
+    insert_text("0");
+    insert_text("1");
+    insert_text("2");
+    insert_text("3");
+    for (i = 0; i < 4; i++)
+        bcast_ring_consume(&ring, &fast);
+
+    /* only the slow reader is parked on the oldest slot */
+    TEST_ASSERT_EQUAL_INT(1, insert_text("4"));
+
+    TEST_ASSERT_EQUAL_INT(1, slow.dropped);
+    TEST_ASSERT_EQUAL_INT(0, fast.dropped);
+    TEST_ASSERT_EQUAL_STRING("1", peek_text(&slow));
+    TEST_ASSERT_EQUAL_STRING("4", peek_text(&fast));
+}
+
+void test_ring_slow_policy_skip(void) {
+    struct bcast_reader slow;
+
+    bcast_ring_init(&ring, 2, BCAST_SLOW_SKIP);
+    bcast_ring_attach(&ring, &slow);
+
+    insert_text("0");
+    insert_text("1");
+    insert_text("2");
+
+    TEST_ASSERT_EQUAL_INT(2, slow.dropped);
+    TEST_ASSERT_FALSE(slow.kicked);
+    TEST_ASSERT_EQUAL_STRING("2", peek_text(&slow));
+}
+
+void test_ring_slow_policy_close(void) {
+    struct bcast_reader slow, fast;
+
+    bcast_ring_init(&ring, 2, BCAST_SLOW_CLOSE);
+    bcast_ring_attach(&ring, &slow);
+    bcast_ring_attach(&ring, &fast);
+
+    insert_text("0");
+    insert_text("1");
+    bcast_ring_consume(&ring, &fast);
+    bcast_ring_consume(&ring, &fast);
+    insert_text("2");
+
+    TEST_ASSERT_TRUE(slow.kicked);
+    TEST_ASSERT_FALSE(fast.kicked);
+    TEST_ASSERT_EQUAL_STRING("2", peek_text(&fast));
+}
+
+void test_ring_detach_releases_tail(void) {
+    struct bcast_reader gone, stays;
+    int i;
+
+    bcast_ring_init(&ring, 2, BCAST_SLOW_CLOSE);
+    bcast_ring_attach(&ring, &gone);
+    bcast_ring_attach(&ring, &stays);
+    bcast_ring_detach(&ring, &gone);
+
+    for (i = 0; i < 2; i++) {
+        insert_text("x");
+        bcast_ring_consume(&ring, &stays);
+    }
+    insert_text("y");
+
+    TEST_ASSERT_FALSE(stays.kicked);
+    TEST_ASSERT_EQUAL_STRING("y", peek_text(&stays));
+}
+
+void test_msg_create_has_headroom(void) {
+    struct msg *m = msg_create("hello", 5);
+
+    TEST_ASSERT_NOT_NULL(m);
+    TEST_ASSERT_EQUAL_INT(1, m->refcount);
+    TEST_ASSERT_EQUAL_INT(5, m->len);
+    TEST_ASSERT_EQUAL_PTR(m + 1, m->payload);
+    TEST_ASSERT_EQUAL_MEMORY("hello", (char *)m->payload + LWS_PRE, 5);
+
+    TEST_ASSERT_EQUAL_PTR(m, msg_ref(m));
+    TEST_ASSERT_EQUAL_INT(2, m->refcount);
+    msg_unref(m);
+    msg_unref(m);
+}
+
+void test_ring_drops_reference_after_last_reader(void) {
+    struct bcast_reader a, b;
+    struct msg *m = msg_create("shared", 6);
+
+    bcast_ring_init(&ring, 4, BCAST_SLOW_DROP_OLDEST);
+    bcast_ring_attach(&ring, &a);
+    bcast_ring_attach(&ring, &b);
+
+    bcast_ring_insert(&ring, m);
+    TEST_ASSERT_EQUAL_INT(2, m->refcount);
+
+    bcast_ring_consume(&ring, &a);
+    TEST_ASSERT_EQUAL_INT(2, m->refcount);
+    bcast_ring_consume(&ring, &b);
+    TEST_ASSERT_EQUAL_INT(1, m->refcount);
+
+    msg_unref(m);
+}
+
+void test_ring_detach_drops_pending_references(void) {
+    struct bcast_reader rd;
+    struct msg *m = msg_create("pending", 7);
+
+    bcast_ring_init(&ring, 4, BCAST_SLOW_DROP_OLDEST);
+    bcast_ring_attach(&ring, &rd);
+    bcast_ring_insert(&ring, m);
+    TEST_ASSERT_EQUAL_INT(2, m->refcount);
+
+    bcast_ring_detach(&ring, &rd);
+    TEST_ASSERT_EQUAL_INT(1, m->refcount);
+
+    msg_unref(m);
+}
+
+void test_ring_pending_bytes(void) {
+    struct bcast_reader a, b;
+
+    bcast_ring_init(&ring, 8, BCAST_SLOW_DROP_OLDEST);
+    bcast_ring_attach(&ring, &a);
+    insert_text("abc");       /* 4 bytes with the NUL */
+    bcast_ring_attach(&ring, &b);
+    insert_text("defghij");   /* 8 */
+
+    TEST_ASSERT_EQUAL_UINT64(12, bcast_ring_pending_bytes(&ring, &a));
+    TEST_ASSERT_EQUAL_UINT64(8, bcast_ring_pending_bytes(&ring, &b));
+
+    bcast_ring_consume(&ring, &a);
+    TEST_ASSERT_EQUAL_UINT64(8, bcast_ring_pending_bytes(&ring, &a));
+    bcast_ring_consume(&ring, &a);
+    TEST_ASSERT_EQUAL_UINT64(0, bcast_ring_pending_bytes(&ring, &a));
+}
+
+void test_ring_evict_one_reader(void) {
+    struct bcast_reader fast, stalled;
+
+    bcast_ring_init(&ring, 8, BCAST_SLOW_DROP_OLDEST);
+    bcast_ring_attach(&ring, &fast);
+    bcast_ring_attach(&ring, &stalled);
+    insert_text("one");
+    insert_text("two");
+    bcast_ring_consume(&ring, &fast);
+    bcast_ring_consume(&ring, &fast);
+
+    /* the stalled reader was all that kept them */
+    bcast_ring_evict(&ring, &stalled, BCAST_SLOW_SKIP);
+    TEST_ASSERT_EQUAL_UINT64(2, stalled.dropped);
+    TEST_ASSERT_EQUAL_INT(0, stalled.kicked);
+    TEST_ASSERT_EQUAL_UINT64(ring.head, ring.oldest);
+
+    insert_text("three");
+    bcast_ring_evict(&ring, &stalled, BCAST_SLOW_CLOSE);
+    TEST_ASSERT_EQUAL_INT(1, stalled.kicked);
+    TEST_ASSERT_EQUAL_STRING("three", peek_text(&fast));
+}
+
+void test_msg_live_bytes(void) {
+    uint64_t before = msg_live_bytes();
+    struct msg *m = msg_create("counted", 7);
+
+    TEST_ASSERT_TRUE(msg_live_bytes() >= before + 7);
+    msg_ref(m);
+    msg_unref(m);
+    TEST_ASSERT_TRUE(msg_live_bytes() >= before + 7);
+    msg_unref(m);
+    TEST_ASSERT_EQUAL_UINT64(before, msg_live_bytes());
+}
+
+void test_slow_policy_from_name(void) {
+    enum bcast_slow_policy p;
+
+    TEST_ASSERT_EQUAL_INT(0, bcast_slow_policy_from_name("skip", &p));
+    TEST_ASSERT_EQUAL_INT(BCAST_SLOW_SKIP, p);
+    TEST_ASSERT_EQUAL_INT(0, bcast_slow_policy_from_name("close", &p));
+    TEST_ASSERT_EQUAL_INT(BCAST_SLOW_CLOSE, p);
+    TEST_ASSERT_EQUAL_INT(0, bcast_slow_policy_from_name("drop", &p));
+    TEST_ASSERT_EQUAL_INT(BCAST_SLOW_DROP_OLDEST, p);
+    TEST_ASSERT_EQUAL_INT(1, bcast_slow_policy_from_name("bogus", &p));
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_ring_init_rounds_to_power_of_two);
+    RUN_TEST(test_ring_every_reader_sees_every_message);
+    RUN_TEST(test_ring_burst_larger_than_one_message_is_not_lost);
+    RUN_TEST(test_ring_late_reader_starts_at_head);
+    RUN_TEST(test_ring_reclaims_without_readers);
+
+    /* Refcounted buffers */
+    RUN_TEST(test_msg_create_has_headroom);
+    RUN_TEST(test_ring_drops_reference_after_last_reader);
+    RUN_TEST(test_ring_detach_drops_pending_references);
+    RUN_TEST(test_msg_live_bytes);
+
+    /* Slow reader policies */
+    RUN_TEST(test_ring_slow_policy_drop_oldest);
+    RUN_TEST(test_ring_slow_policy_skip);
+    RUN_TEST(test_ring_slow_policy_close);
+    RUN_TEST(test_ring_detach_releases_tail);
+    RUN_TEST(test_slow_policy_from_name);
+
+    /* Byte accounting */
+    RUN_TEST(test_ring_pending_bytes);
+    RUN_TEST(test_ring_evict_one_reader);
+
+    return UNITY_END();
+}
@@ -0,0 +1,121 @@
+#include "unity.h"
+#include "buf_pool.h"
+#include <string.h>
+
+static struct buf_pool pool;
+
+void setUp(void) {
+    TEST_ASSERT_EQUAL_INT(0, buf_pool_init(&pool, 4096, 2));
+}
+
+void tearDown(void) {
+    buf_pool_destroy(&pool);
+}
+
+void test_buf_pool_rounds_up_to_class(void) {
+    size_t cap;
+    void *b = buf_pool_get(&pool, 300, &cap);
+
+    TEST_ASSERT_NOT_NULL(b);
+    TEST_ASSERT_EQUAL_INT(512, (int)cap);
+    buf_pool_put(&pool, b, cap);
+
+    b = buf_pool_get(&pool, 1, &cap);
+    TEST_ASSERT_EQUAL_INT(BUF_POOL_MIN, (int)cap);
+    buf_pool_put(&pool, b, cap);
+}
+
+void test_buf_pool_reuses_buffers(void) {
+    size_t cap;
+    void *a = buf_pool_get(&pool, 1000, &cap), *b;
+
+    buf_pool_put(&pool, a, cap);
+    b = buf_pool_get(&pool, 700, &cap);
+    TEST_ASSERT_EQUAL_PTR(a, b);
+    TEST_ASSERT_EQUAL_UINT64(1, pool.mallocs);
+    buf_pool_put(&pool, b, cap);
+}
+
+void test_buf_pool_keeps_a_few(void) {
+    void *b[3];
+    size_t cap;
+    int n;
+
+    for (n = 0; n < 3; n++)
+        b[n] = buf_pool_get(&pool, 100, &cap);
+    for (n = 0; n < 3; n++)
+        buf_pool_put(&pool, b[n], cap);
+
+    TEST_ASSERT_EQUAL_INT(2, pool.classes[0].count_free);
+}
+
+void test_buf_pool_refuses_over_max(void) {
+    size_t cap;
+
+    TEST_ASSERT_NULL(buf_pool_get(&pool, 4097, &cap));
+    TEST_ASSERT_EQUAL_INT(1, buf_pool_init(&pool, 0, 2));
+}
+
+void test_buf_pool_append_reassembles(void) {
+    struct pool_buf b = { 0 };
+    char frag[200];
+    int n;
+
+    memset(frag, 'x', sizeof(frag));
+    for (n = 0; n < 10; n++)
+        TEST_ASSERT_EQUAL_INT(0, buf_pool_append(&pool, &b, frag, sizeof(frag)));
+
+    TEST_ASSERT_EQUAL_INT(2000, (int)b.len);
+    TEST_ASSERT_EQUAL_INT(2048, (int)b.cap);
+    TEST_ASSERT_EQUAL_INT('\0', b.data[b.len]);
+    TEST_ASSERT_EQUAL_MEMORY(frag, b.data + 1800, sizeof(frag));
+    buf_pool_release(&pool, &b);
+    TEST_ASSERT_NULL(b.data);
+}
+
+void test_buf_pool_append_up_to_max(void) {
+    struct pool_buf b = { 0 };
+    char big[4096];
+
+    memset(big, 'y', sizeof(big));
+    TEST_ASSERT_EQUAL_INT(0, buf_pool_append(&pool, &b, big, sizeof(big)));
+    TEST_ASSERT_EQUAL_INT(1, buf_pool_append(&pool, &b, "z", 1));
+    TEST_ASSERT_EQUAL_INT(4096, (int)b.len);
+    buf_pool_release(&pool, &b);
+}
+
+void test_buf_pool_warm_append_does_not_malloc(void) {
+    struct pool_buf b = { 0 };
+    char frag[100] = { 0 };
+    uint64_t mallocs;
+    int n, m;
+
+    for (n = 0; n < 30; n++)
+        buf_pool_append(&pool, &b, frag, sizeof(frag));
+    buf_pool_release(&pool, &b);
+    mallocs = pool.mallocs;
+
+    for (m = 0; m < 5; m++) {
+        for (n = 0; n < 30; n++)
+            buf_pool_append(&pool, &b, frag, sizeof(frag));
+        buf_pool_release(&pool, &b);
+    }
+
+    TEST_ASSERT_EQUAL_UINT64(mallocs, pool.mallocs);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_buf_pool_rounds_up_to_class);
+    RUN_TEST(test_buf_pool_reuses_buffers);
+    RUN_TEST(test_buf_pool_keeps_a_few);
+    RUN_TEST(test_buf_pool_refuses_over_max);
+
+    /* Reassembly */
+    RUN_TEST(test_buf_pool_append_reassembles);
+    RUN_TEST(test_buf_pool_append_up_to_max);
+    RUN_TEST(test_buf_pool_warm_append_does_not_malloc);
+
+    return UNITY_END();
+}
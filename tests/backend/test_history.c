@@ -0,0 +1,286 @@
+#include "unity.h"
+#include "history.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static struct history hist;
+
+static void append_text(const char *text) {
+    TEST_ASSERT_EQUAL_INT(0, history_append(&hist, text, strlen(text), 0, NULL));
+}
+
+static int record_is(uint64_t seq, const char *text) {
+    struct hist_rec *r = history_get(&hist, seq);
+
+    return r && r->len == strlen(text) &&
+           !memcmp(hist_rec_payload(r), text, r->len);
+}
+
+void setUp(void) {
+}
+
+void tearDown(void) {
+    history_destroy(&hist);
+}
+
+void test_history_init_rejects_bad_sizes(void) {
+    TEST_ASSERT_EQUAL_INT(1, history_init(&hist, 0, 4096));
+    TEST_ASSERT_EQUAL_INT(1, history_init(&hist, 10, 8));
+    TEST_ASSERT_EQUAL_INT(0, history_init(&hist, 10, 4096));
+    TEST_ASSERT_EQUAL_INT(0, hist.count);
+}
+
+void test_history_append_and_get(void) {
+    uint64_t seq;
+
+    history_init(&hist, 10, 4096);
+
+    TEST_ASSERT_EQUAL_INT(0, history_append(&hist, "first", 5, 42, &seq));
+    TEST_ASSERT_EQUAL_UINT64(0, seq);
+    append_text("second");
+
+    TEST_ASSERT_EQUAL_INT(2, hist.count);
+    TEST_ASSERT_TRUE(record_is(0, "first"));
+    TEST_ASSERT_TRUE(record_is(1, "second"));
+    TEST_ASSERT_EQUAL_UINT64(42, history_get(&hist, 0)->timestamp);
+    TEST_ASSERT_NULL(history_get(&hist, 2));
+}
+
+void test_history_arena_made_when_needed(void) {
+    history_init(&hist, 8, 1024);
+    TEST_ASSERT_NULL(hist.arena);
+    TEST_ASSERT_NULL(history_get(&hist, 0));
+
+    append_text("a");
+    TEST_ASSERT_NOT_NULL(hist.arena);
+    TEST_ASSERT_EQUAL_INT(1024, (int)hist.arena_size);
+
+    /* freed again, seqs carry on */
+    history_release(&hist);
+    TEST_ASSERT_NULL(hist.arena);
+    TEST_ASSERT_EQUAL_INT(0, hist.count);
+    append_text("b");
+    TEST_ASSERT_TRUE(record_is(1, "b"));
+}
+
+void test_history_counts_arena_bytes(void) {
+    uint64_t before = history_arena_bytes();
+
+    history_init(&hist, 8, 65536);
+    TEST_ASSERT_EQUAL_UINT64(before, history_arena_bytes());
+    append_text("a");
+    TEST_ASSERT_EQUAL_UINT64(before + 4096, history_arena_bytes());
+    history_release(&hist);
+    TEST_ASSERT_EQUAL_UINT64(before, history_arena_bytes());
+    append_text("b");
+    history_destroy(&hist);
+    TEST_ASSERT_EQUAL_UINT64(before, history_arena_bytes());
+}
+
+void test_history_grows_keeping_records(void) {
+    unsigned char buf[3000];
+    struct hist_rec *r;
+    uint64_t seq;
+    size_t len;
+    int n;
+
+    history_init(&hist, 8, 65536);
+
+    /* mixed sizes, so some grows find the records wrapped */
+    for (n = 0; n < 200; n++) {
+        len = (size_t)(n * 37) % sizeof(buf) + 1;
+        memset(buf, n, len);
+        TEST_ASSERT_EQUAL_INT(0, history_append(&hist, buf, len, 0, NULL));
+        TEST_ASSERT_TRUE(hist.arena_size <= 65536);
+
+        for (seq = hist.oldest_seq; seq < hist.next_seq; seq++) {
+            r = history_get(&hist, seq);
+            TEST_ASSERT_NOT_NULL(r);
+            TEST_ASSERT_EQUAL_INT((int)(seq * 37 % sizeof(buf) + 1), (int)r->len);
+            TEST_ASSERT_EQUAL_INT((int)(seq & 0xff), hist_rec_payload(r)[r->len - 1]);
+        }
+    }
+    TEST_ASSERT_EQUAL_INT(8, hist.count);
+    TEST_ASSERT_TRUE(hist.arena_size < 65536);
+}
+
+void test_history_records_have_headroom(void) {
+    struct hist_rec *r;
+
+    history_init(&hist, 4, 4096);
+    append_text("x");
+    r = history_get(&hist, 0);
+
+    TEST_ASSERT_EQUAL_PTR((unsigned char *)(r + 1) + LWS_PRE, hist_rec_payload(r));
+    TEST_ASSERT_EQUAL_INT(0, r->size % 8);
+}
+
+void test_history_evicts_by_count(void) {
+    char text[16];
+    int i;
+
+    history_init(&hist, 5, 4096);
+    for (i = 0; i < 7; i++) {
+        snprintf(text, sizeof(text), "Msg%d", i);
+        append_text(text);
+    }
+
+    TEST_ASSERT_EQUAL_INT(5, hist.count);
+    TEST_ASSERT_EQUAL_UINT64(2, hist.oldest_seq);
+    TEST_ASSERT_NULL(history_get(&hist, 1));
+    TEST_ASSERT_TRUE(record_is(2, "Msg2"));
+    TEST_ASSERT_TRUE(record_is(6, "Msg6"));
+}
+
+void test_history_evicts_by_bytes_and_wraps(void) {
+    char text[64];
+    uint32_t rec = (uint32_t)((sizeof(struct hist_rec) + LWS_PRE + 40 + 7) & ~7u);
+    int i;
+
+    /* room for exactly three 40 byte records */
+    history_init(&hist, 100, rec * 3);
+
+    for (i = 0; i < 20; i++) {
+        snprintf(text, sizeof(text), "%040d", i);
+        append_text(text);
+
+        TEST_ASSERT_TRUE(hist.count <= 3);
+        TEST_ASSERT_TRUE(record_is((uint64_t)i, text));
+    }
+
+    TEST_ASSERT_EQUAL_INT(3, hist.count);
+    TEST_ASSERT_EQUAL_UINT64(17, hist.oldest_seq);
+    TEST_ASSERT_EQUAL_INT(120, hist.bytes);
+}
+
+void test_history_mixed_sizes_stay_consistent(void) {
+    char text[300];
+    uint64_t seq;
+    int i, len;
+
+    history_init(&hist, 64, 2048);
+
+    for (i = 0; i < 500; i++) {
+        len = (i * 37) % 250;
+        memset(text, 'a' + (i % 26), (size_t)len);
+        text[len] = '\0';
+        append_text(text);
+
+        /* everything still held is intact and in order */
+        for (seq = hist.oldest_seq; seq < hist.next_seq; seq++)
+            TEST_ASSERT_EQUAL_UINT64(seq, history_get(&hist, seq)->seq);
+        TEST_ASSERT_TRUE(record_is((uint64_t)i, text));
+    }
+}
+
+void test_history_rejects_oversize_message(void) {
+    char big[512];
+
+    memset(big, 'z', sizeof(big));
+    history_init(&hist, 4, 256);
+
+    TEST_ASSERT_EQUAL_INT(1, history_append(&hist, big, sizeof(big), 0, NULL));
+    TEST_ASSERT_EQUAL_INT(0, hist.count);
+}
+
+void test_history_holds_many_small_messages(void) {
+    uint64_t i;
+
+    history_init(&hist, 100000, 100000 * 64);
+    for (i = 0; i < 150000; i++)
+        append_text("hi");
+
+    TEST_ASSERT_EQUAL_INT(100000, hist.count);
+    TEST_ASSERT_EQUAL_UINT64(50000, hist.oldest_seq);
+    TEST_ASSERT_TRUE(record_is(149999, "hi"));
+}
+
+void test_history_in_caller_memory(void) {
+    size_t size = history_mem_size(8, 1024);
+    void *mem;
+
+    TEST_ASSERT_EQUAL_INT(0, history_mem_size(0, 1024));
+    TEST_ASSERT_TRUE(size >= 1024 + 8 * sizeof(uint32_t));
+
+    mem = malloc(size);
+    TEST_ASSERT_EQUAL_INT(0, history_init_mem(&hist, mem, 8, 1024));
+    append_text("shared");
+    TEST_ASSERT_TRUE(record_is(0, "shared"));
+    TEST_ASSERT_TRUE((unsigned char *)hist.index + 8 * sizeof(uint32_t) <=
+                     (unsigned char *)mem + size);
+
+    /* the memory is ours, not the history's */
+    memset(&hist, 0, sizeof(hist));
+    free(mem);
+}
+
+void test_history_reset_keeps_seq(void) {
+    history_init(&hist, 8, 1024);
+    append_text("a");
+    append_text("b");
+    history_reset(&hist);
+
+    TEST_ASSERT_EQUAL_INT(0, hist.count);
+    TEST_ASSERT_NULL(history_get(&hist, 1));
+    append_text("c");
+    TEST_ASSERT_TRUE(record_is(2, "c"));
+    TEST_ASSERT_EQUAL_UINT64(2, hist.oldest_seq);
+}
+
+void test_history_seek(void) {
+    history_init(&hist, 8, 1024);
+    append_text("a");
+    history_seek(&hist, 1);
+    TEST_ASSERT_TRUE(record_is(0, "a"));
+
+    /* a gap forgets what was held */
+    history_seek(&hist, 1000);
+    TEST_ASSERT_EQUAL_INT(0, hist.count);
+    TEST_ASSERT_NULL(history_get(&hist, 0));
+    append_text("b");
+    TEST_ASSERT_TRUE(record_is(1000, "b"));
+    TEST_ASSERT_EQUAL_UINT64(1000, hist.oldest_seq);
+}
+
+void test_history_find_time(void) {
+    uint64_t n;
+
+    history_init(&hist, 8, 4096);
+    TEST_ASSERT_EQUAL_UINT64(0, history_find_time(&hist, 5));
+
+    for (n = 0; n < 12; n++)
+        history_append(&hist, "t", 1, n * 10, NULL);
+
+    /* 0..3 were evicted */
+    TEST_ASSERT_EQUAL_UINT64(4, history_find_time(&hist, 0));
+    TEST_ASSERT_EQUAL_UINT64(6, history_find_time(&hist, 55));
+    TEST_ASSERT_EQUAL_UINT64(6, history_find_time(&hist, 60));
+    TEST_ASSERT_EQUAL_UINT64(12, history_find_time(&hist, 1000));
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_history_init_rejects_bad_sizes);
+    RUN_TEST(test_history_append_and_get);
+    RUN_TEST(test_history_records_have_headroom);
+    RUN_TEST(test_history_arena_made_when_needed);
+    RUN_TEST(test_history_grows_keeping_records);
+    RUN_TEST(test_history_counts_arena_bytes);
+
+    /* Eviction and wraparound */
+    RUN_TEST(test_history_evicts_by_count);
+    RUN_TEST(test_history_evicts_by_bytes_and_wraps);
+    RUN_TEST(test_history_mixed_sizes_stay_consistent);
+    RUN_TEST(test_history_rejects_oversize_message);
+    RUN_TEST(test_history_holds_many_small_messages);
+    RUN_TEST(test_history_find_time);
+
+    /* Shared memory use */
+    RUN_TEST(test_history_in_caller_memory);
+    RUN_TEST(test_history_reset_keeps_seq);
+    RUN_TEST(test_history_seek);
+
+    return UNITY_END();
+}
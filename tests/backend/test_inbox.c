@@ -0,0 +1,137 @@
+#include "unity.h"
+#include "inbox.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PRODUCERS 4
+#define PER_PRODUCER 20000
+
+static struct inbox ib;
+
+static struct msg *make_msg(const char *text) {
+    struct msg *m = msg_create(text, strlen(text));
+
+    TEST_ASSERT_NOT_NULL(m);
+    return m;
+}
+
+void setUp(void) {
+}
+
+void tearDown(void) {
+    inbox_destroy(&ib);
+}
+
+void test_inbox_init_rounds_up(void) {
+    TEST_ASSERT_EQUAL_INT(1, inbox_init(&ib, 0));
+    TEST_ASSERT_EQUAL_INT(0, inbox_init(&ib, 5));
+    TEST_ASSERT_EQUAL_UINT32(7, ib.mask);
+    TEST_ASSERT_NULL(inbox_pop(&ib));
+}
+
+void test_inbox_is_fifo(void) {
+    struct msg *a, *b, *m;
+
+    inbox_init(&ib, 4);
+    a = make_msg("a");
+    b = make_msg("b");
+
+    TEST_ASSERT_EQUAL_INT(0, inbox_push(&ib, a));
+    TEST_ASSERT_EQUAL_INT(0, inbox_push(&ib, b));
+
+    m = inbox_pop(&ib);
+    TEST_ASSERT_EQUAL_PTR(a, m);
+    msg_unref(m);
+    m = inbox_pop(&ib);
+    TEST_ASSERT_EQUAL_PTR(b, m);
+    msg_unref(m);
+    TEST_ASSERT_NULL(inbox_pop(&ib));
+}
+
+void test_inbox_full_and_wraps(void) {
+    struct msg *m = make_msg("x");
+    int i, lap;
+
+    inbox_init(&ib, 4);
+
+    for (lap = 0; lap < 3; lap++) {
+        for (i = 0; i < 4; i++)
+            TEST_ASSERT_EQUAL_INT(0, inbox_push(&ib, msg_ref(m)));
+        TEST_ASSERT_EQUAL_INT(1, inbox_push(&ib, m));
+
+        for (i = 0; i < 4; i++)
+            msg_unref(inbox_pop(&ib));
+        TEST_ASSERT_NULL(inbox_pop(&ib));
+    }
+
+    TEST_ASSERT_EQUAL_UINT32(1, m->refcount);
+    msg_unref(m);
+}
+
+void test_inbox_destroy_drops_queued(void) {
+    struct msg *m = make_msg("left behind");
+
+    inbox_init(&ib, 8);
+    inbox_push(&ib, msg_ref(m));
+    inbox_push(&ib, msg_ref(m));
+    inbox_destroy(&ib);
+
+    TEST_ASSERT_EQUAL_UINT32(1, m->refcount);
+    msg_unref(m);
+}
+
+static void *producer(void *arg) {
+    struct msg *m;
+    uint64_t i;
+
+    for (i = 0; i < PER_PRODUCER; i++) {
+        m = msg_create(NULL, 0);
+        m->seq = ((uint64_t)(uintptr_t)arg << 32) | i;
+        while (inbox_push(&ib, m))
+            ;
+    }
+
+    return NULL;
+}
+
+void test_inbox_many_producers(void) {
+    uint64_t next[PRODUCERS] = { 0 };
+    pthread_t pts[PRODUCERS];
+    unsigned int p;
+    struct msg *m;
+    int got = 0;
+
+    inbox_init(&ib, 64);
+    for (p = 0; p < PRODUCERS; p++)
+        pthread_create(&pts[p], NULL, producer, (void *)(uintptr_t)p);
+
+    /* every message arrives once, in order per producer */
+    while (got < PRODUCERS * PER_PRODUCER) {
+        m = inbox_pop(&ib);
+        if (!m)
+            continue;
+        p = (unsigned int)(m->seq >> 32);
+        TEST_ASSERT_EQUAL_UINT64(next[p]++, m->seq & 0xffffffffu);
+        msg_unref(m);
+        got++;
+    }
+
+    for (p = 0; p < PRODUCERS; p++)
+        pthread_join(pts[p], NULL);
+    TEST_ASSERT_NULL(inbox_pop(&ib));
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_inbox_init_rounds_up);
+    RUN_TEST(test_inbox_is_fifo);
+    RUN_TEST(test_inbox_full_and_wraps);
+    RUN_TEST(test_inbox_destroy_drops_queued);
+
+    /* Concurrency */
+    RUN_TEST(test_inbox_many_producers);
+
+    return UNITY_END();
+}
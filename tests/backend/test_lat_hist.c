@@ -0,0 +1,92 @@
+#include "unity.h"
+#include "lat_hist.h"
+#include <stdlib.h>
+#include <string.h>
+
+static struct lat_hist *h;
+
+void setUp(void) {
+    h = calloc(1, sizeof(*h));
+    TEST_ASSERT_NOT_NULL(h);
+}
+
+void tearDown(void) {
+    free(h);
+}
+
+void test_lat_hist_empty(void) {
+    TEST_ASSERT_EQUAL_UINT64(0, lat_hist_quantile(h, 0.5));
+}
+
+void test_lat_hist_small_values_are_exact(void) {
+    int n;
+
+    for (n = 0; n < 10; n++)
+        lat_hist_record(h, (uint64_t)n);
+
+    TEST_ASSERT_EQUAL_UINT64(10, h->count);
+    TEST_ASSERT_EQUAL_UINT64(9, h->max);
+    TEST_ASSERT_EQUAL_UINT64(4, lat_hist_quantile(h, 0.5));
+    TEST_ASSERT_EQUAL_UINT64(9, lat_hist_quantile(h, 1.0));
+}
+
+void test_lat_hist_within_a_sixteenth(void) {
+    uint64_t v, q;
+
+    for (v = 17; v < (1ull << 40); v = v * 3 + 1) {
+        memset(h, 0, sizeof(*h));
+        lat_hist_record(h, v);
+        lat_hist_record(h, v + v / 2);
+        q = lat_hist_quantile(h, 0.5);
+        TEST_ASSERT_TRUE(q >= v);
+        TEST_ASSERT_TRUE(q - v <= v / 16);
+    }
+}
+
+void test_lat_hist_quantiles(void) {
+    int n;
+
+    /* 990 fast, 9 slow, 1 very slow */
+    for (n = 0; n < 990; n++)
+        lat_hist_record(h, 1000);
+    for (n = 0; n < 9; n++)
+        lat_hist_record(h, 100000);
+    lat_hist_record(h, 10000000);
+
+    TEST_ASSERT_UINT64_WITHIN(1000 / 16, 1000, lat_hist_quantile(h, 0.5));
+    TEST_ASSERT_UINT64_WITHIN(100000 / 16, 100000, lat_hist_quantile(h, 0.999));
+    TEST_ASSERT_EQUAL_UINT64(10000000, lat_hist_quantile(h, 1.0));
+}
+
+void test_lat_hist_huge_value(void) {
+    lat_hist_record(h, UINT64_MAX);
+
+    TEST_ASSERT_EQUAL_UINT64(UINT64_MAX, lat_hist_quantile(h, 0.5));
+}
+
+void test_lat_hist_merge(void) {
+    struct lat_hist *other = calloc(1, sizeof(*other));
+
+    lat_hist_record(h, 5);
+    lat_hist_record(other, 7);
+    lat_hist_record(other, 3000);
+    lat_hist_merge(h, other);
+
+    TEST_ASSERT_EQUAL_UINT64(3, h->count);
+    TEST_ASSERT_EQUAL_UINT64(3000, h->max);
+    TEST_ASSERT_EQUAL_UINT64(7, lat_hist_quantile(h, 0.5));
+    free(other);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_lat_hist_empty);
+    RUN_TEST(test_lat_hist_small_values_are_exact);
+    RUN_TEST(test_lat_hist_within_a_sixteenth);
+    RUN_TEST(test_lat_hist_quantiles);
+    RUN_TEST(test_lat_hist_huge_value);
+    RUN_TEST(test_lat_hist_merge);
+
+    return UNITY_END();
+}
@@ -0,0 +1,229 @@
+#include "unity.h"
+#include "msglog.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static char dir[64];
+static struct msglog log;
+
+static void append(const char *s, uint64_t ts) {
+    TEST_ASSERT_EQUAL_INT(0, msglog_append(&log, s, strlen(s), ts, 0, NULL));
+}
+
+static void assert_record(uint64_t seq, const char *s) {
+    char buf[64];
+    long long n = msglog_read(&log, seq, buf, sizeof(buf), NULL, NULL);
+
+    TEST_ASSERT_EQUAL_INT((int)strlen(s), (int)n);
+    TEST_ASSERT_EQUAL_MEMORY(s, buf, n);
+}
+
+void setUp(void) {
+    strcpy(dir, "/tmp/msglog-test-XXXXXX");
+    TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+    TEST_ASSERT_EQUAL_INT(0, msglog_open(&log, dir, 4, 4096, 0, 0));
+}
+
+void tearDown(void) {
+    char path[320];
+    struct dirent *de;
+    DIR *d;
+
+    msglog_close(&log);
+
+    d = opendir(dir);
+    while (d && (de = readdir(d))) {
+        if (de->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        unlink(path);
+    }
+    if (d)
+        closedir(d);
+    rmdir(dir);
+}
+
+void test_msglog_append_and_read(void) {
+    uint64_t seq, ts, tag;
+    char buf[4];
+
+    TEST_ASSERT_EQUAL_INT(0, msglog_append(&log, "hello", 5, 100, 7, &seq));
+    TEST_ASSERT_EQUAL_UINT64(0, seq);
+    append("world", 200);
+
+    assert_record(0, "hello");
+    TEST_ASSERT_EQUAL_INT(5, (int)msglog_read(&log, 0, buf, sizeof(buf), NULL, &tag));
+    TEST_ASSERT_EQUAL_UINT64(7, tag);
+    TEST_ASSERT_EQUAL_INT(5, (int)msglog_read(&log, 1, buf, sizeof(buf), &ts, NULL));
+    TEST_ASSERT_EQUAL_UINT64(200, ts);
+    TEST_ASSERT_EQUAL_INT(-1, (int)msglog_read(&log, 2, buf, sizeof(buf), NULL, NULL));
+}
+
+void test_msglog_rolls_segments(void) {
+    int n;
+
+    for (n = 0; n < 10; n++)
+        append("x", (uint64_t)n);
+
+    TEST_ASSERT_EQUAL_INT(3, log.count_segs);
+    TEST_ASSERT_EQUAL_UINT64(4, log.segs[1].base_seq);
+    TEST_ASSERT_EQUAL_UINT64(0, msglog_oldest(&log));
+    assert_record(9, "x");
+}
+
+void test_msglog_reopen_keeps_records(void) {
+    int n;
+
+    for (n = 0; n < 6; n++)
+        append(n & 1 ? "odd" : "even", (uint64_t)n);
+    msglog_close(&log);
+
+    TEST_ASSERT_EQUAL_INT(0, msglog_open(&log, dir, 4, 4096, 0, 0));
+    TEST_ASSERT_EQUAL_UINT64(6, log.next_seq);
+    assert_record(4, "even");
+    assert_record(5, "odd");
+
+    append("more", 6);
+    assert_record(6, "more");
+}
+
+void test_msglog_find_time(void) {
+    int n;
+
+    for (n = 0; n < 10; n++)
+        append("t", (uint64_t)n * 10);
+
+    TEST_ASSERT_EQUAL_UINT64(0, msglog_find_time(&log, 0));
+    TEST_ASSERT_EQUAL_UINT64(5, msglog_find_time(&log, 41));
+    TEST_ASSERT_EQUAL_UINT64(5, msglog_find_time(&log, 50));
+    TEST_ASSERT_EQUAL_UINT64(10, msglog_find_time(&log, 1000));
+}
+
+void test_msglog_cuts_torn_tail(void) {
+    char path[320];
+    struct stat st;
+
+    append("first", 1);
+    append("second", 2);
+    msglog_close(&log);
+
+    /* a crash part way through writing "second" */
+    snprintf(path, sizeof(path), "%s/%020llu.log", dir, 0ull);
+    TEST_ASSERT_EQUAL_INT(0, stat(path, &st));
+    TEST_ASSERT_EQUAL_INT(0, truncate(path, st.st_size - 4));
+
+    TEST_ASSERT_EQUAL_INT(0, msglog_open(&log, dir, 4, 4096, 0, 0));
+    TEST_ASSERT_EQUAL_UINT64(1, log.next_seq);
+    assert_record(0, "first");
+
+    append("again", 3);
+    assert_record(1, "again");
+}
+
+void test_msglog_indexes_unindexed_tail(void) {
+    char path[320];
+    int fd;
+
+    append("a", 1);
+    append("b", 2);
+    append("c", 3);
+    msglog_close(&log);
+
+    /* a crash after the records were written but before the index was */
+    snprintf(path, sizeof(path), "%s/%020llu.idx", dir, 0ull);
+    fd = open(path, O_WRONLY);
+    TEST_ASSERT_TRUE(fd >= 0);
+    TEST_ASSERT_EQUAL_INT(0, ftruncate(fd, 16));
+    TEST_ASSERT_EQUAL_INT(0, ftruncate(fd, 4 * 16));
+    close(fd);
+
+    TEST_ASSERT_EQUAL_INT(0, msglog_open(&log, dir, 4, 4096, 0, 0));
+    TEST_ASSERT_EQUAL_UINT64(3, log.next_seq);
+    assert_record(2, "c");
+    TEST_ASSERT_EQUAL_UINT64(2, msglog_find_time(&log, 3));
+}
+
+void test_msglog_readonly_alongside_writer(void) {
+    struct msglog ro;
+
+    append("shared", 1);
+    msglog_sync(&log);
+
+    TEST_ASSERT_EQUAL_INT(0, msglog_open(&ro, dir, 4, 4096, 0, 1));
+    TEST_ASSERT_EQUAL_UINT64(1, ro.next_seq);
+    TEST_ASSERT_EQUAL_INT(1, msglog_append(&ro, "no", 2, 2, 0, NULL));
+    msglog_close(&ro);
+}
+
+void test_msglog_passes_over_segment_being_made(void) {
+    struct msglog ro;
+    char path[320];
+    struct stat st;
+    int fd;
+
+    append("a", 1);
+    append("b", 2);
+    append("c", 3);
+    append("d", 4);
+    msglog_sync(&log);
+
+    /* the writer has made the next segment's files but not sized its index */
+    snprintf(path, sizeof(path), "%s/%020llu.log", dir, 4ull);
+    fd = open(path, O_CREAT | O_WRONLY, 0644);
+    TEST_ASSERT_TRUE(fd >= 0);
+    close(fd);
+    snprintf(path, sizeof(path), "%s/%020llu.idx", dir, 4ull);
+    fd = open(path, O_CREAT | O_WRONLY, 0644);
+    TEST_ASSERT_TRUE(fd >= 0);
+    close(fd);
+
+    TEST_ASSERT_EQUAL_INT(0, msglog_open(&ro, dir, 4, 4096, 0, 1));
+    TEST_ASSERT_EQUAL_UINT64(4, ro.next_seq);
+    msglog_close(&ro);
+    TEST_ASSERT_EQUAL_INT(0, stat(path, &st));
+
+    /* a writer finding it after a crash makes it again */
+    msglog_close(&log);
+    TEST_ASSERT_EQUAL_INT(0, msglog_open(&log, dir, 4, 4096, 0, 0));
+    TEST_ASSERT_EQUAL_UINT64(4, log.next_seq);
+    append("e", 5);
+    assert_record(4, "e");
+}
+
+void test_msglog_group_commit(void) {
+    int n;
+
+    msglog_close(&log);
+    TEST_ASSERT_EQUAL_INT(0, msglog_open(&log, dir, 64, 4096, 5, 0));
+
+    for (n = 0; n < 20; n++)
+        append("batched", (uint64_t)n);
+    usleep(20000);
+
+    TEST_ASSERT_EQUAL_INT(0, log.segs[0].dirty);
+    assert_record(19, "batched");
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_msglog_append_and_read);
+    RUN_TEST(test_msglog_rolls_segments);
+    RUN_TEST(test_msglog_reopen_keeps_records);
+    RUN_TEST(test_msglog_find_time);
+
+    /* Crash recovery */
+    RUN_TEST(test_msglog_cuts_torn_tail);
+    RUN_TEST(test_msglog_indexes_unindexed_tail);
+    RUN_TEST(test_msglog_readonly_alongside_writer);
+    RUN_TEST(test_msglog_passes_over_segment_being_made);
+
+    RUN_TEST(test_msglog_group_commit);
+
+    return UNITY_END();
+}
@@ -0,0 +1,185 @@
+#include "unity.h"
+#include "room.h"
+#include <stdio.h>
+#include <string.h>
+
+static struct room_table rooms;
+
+static struct room *get(const char *name) {
+    return room_get(&rooms, name, strlen(name));
+}
+
+static void parse(const char *frame, struct room_frame *f) {
+    room_frame_parse(frame, strlen(frame), f);
+}
+
+static int room_is(const struct room_frame *f, const char *name) {
+    return f->room_len == strlen(name) && !memcmp(f->room, name, f->room_len);
+}
+
+void setUp(void) {
+    TEST_ASSERT_EQUAL_INT(0, room_table_init(&rooms, 10000, 8, 4096, 16));
+}
+
+void tearDown(void) {
+    room_table_destroy(&rooms);
+}
+
+void test_room_get_creates_once(void) {
+    struct room *r = get("dev");
+
+    TEST_ASSERT_NOT_NULL(r);
+    TEST_ASSERT_EQUAL_STRING("dev", r->name);
+    TEST_ASSERT_EQUAL_PTR(r, get("dev"));
+    TEST_ASSERT_EQUAL_PTR(r, room_find(&rooms, "dev", 3));
+    TEST_ASSERT_EQUAL_INT(1, rooms.count);
+}
+
+void test_room_find_matches_whole_name(void) {
+    get("dev");
+
+    TEST_ASSERT_NULL(room_find(&rooms, "de", 2));
+    TEST_ASSERT_NULL(room_find(&rooms, "devs", 4));
+    TEST_ASSERT_NULL(room_find(&rooms, "ops", 3));
+}
+
+void test_room_rejects_bad_names(void) {
+    char name[ROOM_NAME_LEN + 1];
+
+    memset(name, 'x', sizeof(name));
+    TEST_ASSERT_NULL(room_get(&rooms, "", 0));
+    TEST_ASSERT_NULL(room_get(&rooms, name, ROOM_NAME_LEN));
+    TEST_ASSERT_NOT_NULL(room_get(&rooms, name, ROOM_NAME_LEN - 1));
+}
+
+void test_room_priv_is_zeroed(void) {
+    unsigned char zero[16] = { 0 };
+    struct room *r = get("dev");
+
+    TEST_ASSERT_EQUAL_MEMORY(zero, room_priv(r), sizeof(zero));
+}
+
+void test_room_has_own_history(void) {
+    struct room *a = get("a"), *b = get("b");
+
+    history_append(&a->history, "x", 1, 0, NULL);
+    TEST_ASSERT_EQUAL_INT(1, a->history.count);
+    TEST_ASSERT_EQUAL_INT(0, b->history.count);
+}
+
+void test_room_index_grows(void) {
+    char name[32];
+    int i;
+
+    for (i = 0; i < 5000; i++) {
+        snprintf(name, sizeof(name), "room-%d", i);
+        TEST_ASSERT_NOT_NULL(get(name));
+    }
+
+    TEST_ASSERT_EQUAL_INT(5000, rooms.count);
+    TEST_ASSERT_TRUE(rooms.mask + 1 >= 5000);
+    for (i = 0; i < 5000; i++) {
+        snprintf(name, sizeof(name), "room-%d", i);
+        TEST_ASSERT_EQUAL_STRING(name, room_find(&rooms, name, strlen(name))->name);
+    }
+}
+
+void test_room_table_is_bounded(void) {
+    room_table_destroy(&rooms);
+    room_table_init(&rooms, 2, 8, 4096, 0);
+
+    TEST_ASSERT_NOT_NULL(get("a"));
+    TEST_ASSERT_NOT_NULL(get("b"));
+    TEST_ASSERT_NULL(get("c"));
+    TEST_ASSERT_NOT_NULL(get("a"));
+}
+
+void test_room_frame_chat_uses_metadata(void) {
+    struct room_frame f;
+
+    parse("0|123|amy|hello|dev", &f);
+    TEST_ASSERT_EQUAL_INT(0, f.type);
+    TEST_ASSERT_TRUE(room_is(&f, "dev"));
+
+    parse("0|123|amy|hello|", &f);
+    TEST_ASSERT_EQUAL_INT(0, f.room_len);
+}
+
+void test_room_frame_timestamp_and_content(void) {
+    struct room_frame f;
+
+    parse("4|1700000000000000|amy|50@812|dev", &f);
+    TEST_ASSERT_EQUAL_INT(4, f.type);
+    TEST_ASSERT_EQUAL_UINT64(1700000000000000ull, f.timestamp);
+    TEST_ASSERT_EQUAL_INT(6, f.content_len);
+    TEST_ASSERT_EQUAL_MEMORY("50@812", f.content, 6);
+    TEST_ASSERT_TRUE(room_is(&f, "dev"));
+
+    parse("0|123|amy", &f);
+    TEST_ASSERT_NULL(f.content);
+}
+
+void test_room_frame_join_leave_use_content(void) {
+    struct room_frame f;
+
+    parse("1|123|amy|dev|", &f);
+    TEST_ASSERT_EQUAL_INT(1, f.type);
+    TEST_ASSERT_TRUE(room_is(&f, "dev"));
+
+    parse("2|123|amy|ops", &f);
+    TEST_ASSERT_EQUAL_INT(2, f.type);
+    TEST_ASSERT_TRUE(room_is(&f, "ops"));
+}
+
+void test_room_frame_malformed(void) {
+    struct room_frame f;
+
+    parse("hello there", &f);
+    TEST_ASSERT_EQUAL_INT(-1, f.type);
+    TEST_ASSERT_EQUAL_INT(0, f.room_len);
+
+    parse("0|123", &f);
+    TEST_ASSERT_EQUAL_INT(0, f.type);
+    TEST_ASSERT_EQUAL_INT(0, f.room_len);
+
+    parse("", &f);
+    TEST_ASSERT_EQUAL_INT(-1, f.type);
+}
+
+void test_room_frame_not_utf8(void) {
+    static const char *ok = "0|1|amy|caf\xc3\xa9|dev";
+    static const char *bad[] = {
+        "0|1|amy|\x80|dev",      /* a stray continuation byte */
+        "1|1|amy|lob\xc3",       /* a character cut short */
+    };
+    struct room_frame f;
+
+    TEST_ASSERT_EQUAL_INT(0, room_frame_parse(ok, strlen(ok), &f));
+    TEST_ASSERT_TRUE(room_is(&f, "dev"));
+
+    TEST_ASSERT_EQUAL_INT(-1, room_frame_parse(bad[0], strlen(bad[0]), &f));
+    TEST_ASSERT_EQUAL_INT(-1, room_frame_parse(bad[1], strlen(bad[1]), &f));
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_room_get_creates_once);
+    RUN_TEST(test_room_find_matches_whole_name);
+    RUN_TEST(test_room_rejects_bad_names);
+    RUN_TEST(test_room_priv_is_zeroed);
+    RUN_TEST(test_room_has_own_history);
+
+    /* Hash index */
+    RUN_TEST(test_room_index_grows);
+    RUN_TEST(test_room_table_is_bounded);
+
+    /* Frame routing */
+    RUN_TEST(test_room_frame_chat_uses_metadata);
+    RUN_TEST(test_room_frame_timestamp_and_content);
+    RUN_TEST(test_room_frame_join_leave_use_content);
+    RUN_TEST(test_room_frame_malformed);
+    RUN_TEST(test_room_frame_not_utf8);
+
+    return UNITY_END();
+}
@@ -0,0 +1,153 @@
+#include "unity.h"
+#include "shm_bus.h"
+#include <signal.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static struct shm_bus *bus;
+
+static void reap(pid_t pid) {
+    int st;
+
+    TEST_ASSERT_EQUAL_INT(pid, waitpid(pid, &st, 0));
+}
+
+void setUp(void) {
+    bus = shm_bus_create(16, 4096, 4);
+    TEST_ASSERT_NOT_NULL(bus);
+}
+
+void tearDown(void) {
+    shm_bus_destroy(bus);
+}
+
+void test_shm_bus_rejects_bad_sizes(void) {
+    TEST_ASSERT_NULL(shm_bus_create(0, 4096, 4));
+}
+
+void test_shm_bus_shared_with_child(void) {
+    struct hist_rec *r;
+    pid_t pid;
+
+    pid = fork();
+    if (!pid) {
+        shm_bus_lock(bus);
+        shm_bus_append(bus, 1, 0, "from child", 10, 0, NULL);
+        shm_bus_unlock(bus);
+        _exit(0);
+    }
+    reap(pid);
+
+    shm_bus_lock(bus);
+    r = history_get(&bus->history, 0);
+    TEST_ASSERT_NOT_NULL(r);
+    TEST_ASSERT_EQUAL_INT(10, (int)shm_bus_rec_len(r));
+    TEST_ASSERT_EQUAL_MEMORY("from child", shm_bus_rec_payload(r), 10);
+    shm_bus_unlock(bus);
+}
+
+void test_shm_bus_wait_sees_append(void) {
+    uint64_t seen = 0;
+    pid_t pid;
+
+    TEST_ASSERT_EQUAL_INT(0, shm_bus_wait(bus, &seen, 10));
+
+    pid = fork();
+    if (!pid) {
+        usleep(20000);
+        shm_bus_lock(bus);
+        shm_bus_append(bus, 1, 0, "wake", 4, 0, NULL);
+        shm_bus_unlock(bus);
+        _exit(0);
+    }
+
+    TEST_ASSERT_EQUAL_INT(1, shm_bus_wait(bus, &seen, 5000));
+    TEST_ASSERT_EQUAL_UINT64(1, seen);
+    reap(pid);
+}
+
+void test_shm_bus_room_seqs(void) {
+    uint64_t seq;
+    pid_t pid;
+    int n;
+
+    shm_bus_lock(bus);
+    TEST_ASSERT_EQUAL_INT(0, shm_bus_append(bus, 1, 1000, "a", 1, 0, &seq));
+    TEST_ASSERT_EQUAL_UINT64(1000, seq);
+    TEST_ASSERT_EQUAL_INT(0, shm_bus_append(bus, 2, 50, "b", 1, 0, &seq));
+    TEST_ASSERT_EQUAL_UINT64(50, seq);
+    shm_bus_unlock(bus);
+
+    /* another worker carries on from the same seqs */
+    pid = fork();
+    if (!pid) {
+        shm_bus_lock(bus);
+        shm_bus_append(bus, 1, 7, "c", 1, 0, NULL);
+        shm_bus_unlock(bus);
+        _exit(0);
+    }
+    reap(pid);
+
+    shm_bus_lock(bus);
+    TEST_ASSERT_EQUAL_UINT64(1001, shm_bus_rec_seq(history_get(&bus->history, 2)));
+    TEST_ASSERT_EQUAL_INT(0, shm_bus_append(bus, 2, 0, "d", 1, 0, &seq));
+    TEST_ASSERT_EQUAL_UINT64(51, seq);
+
+    /* with every slot taken rooms are forgotten, and start from first */
+    for (n = 3; n < 40; n++)
+        shm_bus_append(bus, (uint64_t)n * 16, 5, "e", 1, 0, NULL);
+    TEST_ASSERT_EQUAL_INT(0, shm_bus_append(bus, 1000 * 16, 9, "f", 1, 0, &seq));
+    TEST_ASSERT_EQUAL_UINT64(9, seq);
+    shm_bus_unlock(bus);
+}
+
+void test_shm_bus_survives_owner_death(void) {
+    pid_t pid;
+
+    shm_bus_lock(bus);
+    shm_bus_append(bus, 1, 0, "kept", 4, 0, NULL);
+    shm_bus_unlock(bus);
+
+    /* dies holding the lock, but not mid-append: history is kept */
+    pid = fork();
+    if (!pid) {
+        shm_bus_lock(bus);
+        _exit(0);
+    }
+    reap(pid);
+
+    shm_bus_lock(bus);
+    TEST_ASSERT_EQUAL_INT(1, bus->history.count);
+    shm_bus_unlock(bus);
+
+    /* dies mid-append: history is reset, seq carries on */
+    pid = fork();
+    if (!pid) {
+        shm_bus_lock(bus);
+        bus->appending = 1;
+        kill(getpid(), SIGKILL);
+    }
+    reap(pid);
+
+    shm_bus_lock(bus);
+    TEST_ASSERT_EQUAL_INT(0, bus->history.count);
+    TEST_ASSERT_EQUAL_INT(0, bus->appending);
+    shm_bus_append(bus, 1, 0, "after", 5, 0, NULL);
+    TEST_ASSERT_NOT_NULL(history_get(&bus->history, 1));
+    shm_bus_unlock(bus);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_shm_bus_rejects_bad_sizes);
+    RUN_TEST(test_shm_bus_shared_with_child);
+    RUN_TEST(test_shm_bus_wait_sees_append);
+    RUN_TEST(test_shm_bus_room_seqs);
+
+    /* Worker crashes */
+    RUN_TEST(test_shm_bus_survives_owner_death);
+
+    return UNITY_END();
+}
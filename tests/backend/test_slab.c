@@ -0,0 +1,134 @@
+#include "unity.h"
+#include "slab.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#define ROUNDS 10000
+#define HELD 100
+
+void setUp(void) {
+}
+
+void tearDown(void) {
+    slab_thread_flush();
+}
+
+void test_slab_rounds_up_to_class(void) {
+    TEST_ASSERT_EQUAL_INT(SLAB_MIN, (int)slab_size(1));
+    TEST_ASSERT_EQUAL_INT(128, (int)slab_size(65));
+    TEST_ASSERT_EQUAL_INT(SLAB_MAX, (int)slab_size(SLAB_MAX));
+    TEST_ASSERT_EQUAL_INT(0, (int)slab_size(SLAB_MAX + 1));
+}
+
+void test_slab_reuses_objects(void) {
+    void *a = slab_alloc(200), *b;
+
+    TEST_ASSERT_NOT_NULL(a);
+    TEST_ASSERT_EQUAL_INT(0, (int)((uintptr_t)a & 15));
+    memset(a, 0x55, 200);
+    slab_free(a, 200);
+
+    b = slab_alloc(250);
+    TEST_ASSERT_EQUAL_PTR(a, b);
+    slab_free(b, 250);
+}
+
+void test_slab_big_objects_use_malloc(void) {
+    struct slab_stats st;
+    void *p = slab_alloc(SLAB_MAX + 1);
+
+    TEST_ASSERT_NOT_NULL(p);
+    slab_get_stats(&st);
+    TEST_ASSERT_EQUAL_UINT64(1, st.big_live);
+    slab_free(p, SLAB_MAX + 1);
+    slab_get_stats(&st);
+    TEST_ASSERT_EQUAL_UINT64(0, st.big_live);
+}
+
+void test_slab_steady_state_takes_no_slabs(void) {
+    struct slab_stats before, after;
+    void *held[HELD];
+    int n, r;
+
+    /* warm up, then the same traffic again must be served from the slabs */
+    for (n = 0; n < HELD; n++)
+        held[n] = slab_alloc(100 + (size_t)n * 40);
+    for (n = 0; n < HELD; n++)
+        slab_free(held[n], 100 + (size_t)n * 40);
+    slab_get_stats(&before);
+
+    for (r = 0; r < 100; r++) {
+        for (n = 0; n < HELD; n++)
+            held[n] = slab_alloc(100 + (size_t)n * 40);
+        for (n = 0; n < HELD; n++)
+            slab_free(held[n], 100 + (size_t)n * 40);
+    }
+
+    slab_get_stats(&after);
+    TEST_ASSERT_EQUAL_UINT64(before.slabs, after.slabs);
+    TEST_ASSERT_EQUAL_UINT64(before.slab_bytes, after.slab_bytes);
+}
+
+void test_slab_cache_overflows_to_depot(void) {
+    struct slab_stats before, after;
+    void *held[SLAB_CACHE * 2];
+    int n;
+
+    for (n = 0; n < SLAB_CACHE * 2; n++)
+        held[n] = slab_alloc(1000);
+    slab_get_stats(&before);
+    for (n = 0; n < SLAB_CACHE * 2; n++)
+        slab_free(held[n], 1000);
+    slab_get_stats(&after);
+
+    TEST_ASSERT_GREATER_THAN(before.depot_puts, after.depot_puts);
+}
+
+/* objects allocated on one thread and freed on another, like messages */
+
+static void *held_by[2][HELD];
+
+static void *freer(void *arg) {
+    void **held = arg;
+    int n;
+
+    for (n = 0; n < HELD; n++) {
+        memset(held[n], 0xaa, 64);
+        slab_free(held[n], 64);
+    }
+    slab_thread_flush();
+
+    return NULL;
+}
+
+void test_slab_free_on_another_thread(void) {
+    pthread_t pt[2];
+    int n, r, t;
+
+    for (r = 0; r < ROUNDS / HELD; r++) {
+        for (t = 0; t < 2; t++)
+            for (n = 0; n < HELD; n++) {
+                held_by[t][n] = slab_alloc(64);
+                TEST_ASSERT_NOT_NULL(held_by[t][n]);
+                memset(held_by[t][n], t, 64);
+            }
+        for (t = 0; t < 2; t++)
+            pthread_create(&pt[t], NULL, freer, held_by[t]);
+        for (t = 0; t < 2; t++)
+            pthread_join(pt[t], NULL);
+    }
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_slab_rounds_up_to_class);
+    RUN_TEST(test_slab_reuses_objects);
+    RUN_TEST(test_slab_big_objects_use_malloc);
+    RUN_TEST(test_slab_steady_state_takes_no_slabs);
+    RUN_TEST(test_slab_cache_overflows_to_depot);
+    RUN_TEST(test_slab_free_on_another_thread);
+
+    return UNITY_END();
+}
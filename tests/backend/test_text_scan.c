@@ -0,0 +1,165 @@
+#include "unity.h"
+#include "text_scan.h"
+#include <string.h>
+
+static const enum text_scan_kernel kernels[] = {
+    TEXT_SCAN_SCALAR, TEXT_SCAN_SSE2, TEXT_SCAN_AVX2, TEXT_SCAN_NEON
+};
+
+#define KERNELS (int)(sizeof(kernels) / sizeof(kernels[0]))
+
+static unsigned char big[65536];
+
+void setUp(void) {
+}
+
+void tearDown(void) {
+    text_scan_select(TEXT_SCAN_AUTO);
+}
+
+/* text_scan() with every kernel this CPU has, which must all agree */
+static int scan_all(const void *in, size_t len, size_t *bars, int max) {
+    size_t got[64];
+    int k, n, want = 0, ran = 0;
+
+    for (k = 0; k < KERNELS; k++) {
+        if (text_scan_select(kernels[k]))
+            continue;
+        n = text_scan(in, len, got, max);
+        if (!ran++) {
+            want = n;
+            if (n > 0)
+                memcpy(bars, got, (size_t)n * sizeof(*bars));
+            continue;
+        }
+        TEST_ASSERT_EQUAL_INT(want, n);
+        if (n > 0)
+            TEST_ASSERT_EQUAL_MEMORY(bars, got, (size_t)n * sizeof(*bars));
+    }
+    TEST_ASSERT_TRUE(ran);
+
+    return want;
+}
+
+void test_text_scan_finds_bars(void) {
+    const char *s = "0|1700000000123456|amy|hello|dev";
+    size_t bars[4];
+
+    TEST_ASSERT_EQUAL_INT(4, scan_all(s, strlen(s), bars, 4));
+    TEST_ASSERT_EQUAL_INT(1, (int)bars[0]);
+    TEST_ASSERT_EQUAL_INT(18, (int)bars[1]);
+    TEST_ASSERT_EQUAL_INT(22, (int)bars[2]);
+    TEST_ASSERT_EQUAL_INT(28, (int)bars[3]);
+
+    /* only the first max are noted */
+    TEST_ASSERT_EQUAL_INT(2, scan_all(s, strlen(s), bars, 2));
+    TEST_ASSERT_EQUAL_INT(0, scan_all("", 0, bars, 4));
+}
+
+void test_text_scan_valid_utf8(void) {
+    static const char *ok[] = {
+        "caf\xc3\xa9|",                 /* 2 bytes */
+        "\xe2\x82\xac 5|",              /* 3 bytes */
+        "\xed\x9f\xbf",                 /* U+D7FF, just below surrogates */
+        "\xef\xbf\xbf",                 /* U+FFFF */
+        "\xf0\x9f\x98\x80|",            /* 4 bytes */
+        "\xf4\x8f\xbf\xbf",             /* U+10FFFF */
+    };
+    size_t bars[4];
+    size_t n;
+
+    for (n = 0; n < sizeof(ok) / sizeof(ok[0]); n++)
+        TEST_ASSERT_TRUE(scan_all(ok[n], strlen(ok[n]), bars, 4) >= 0);
+}
+
+void test_text_scan_invalid_utf8(void) {
+    static const char *bad[] = {
+        "\x80",                         /* continuation on its own */
+        "\xc3",                         /* cut short */
+        "\xc3|",                        /* lead then no continuation */
+        "\xc0\xaf",                     /* overlong '/' */
+        "\xe0\x80\xaf",                 /* overlong, 3 bytes */
+        "\xf0\x80\x80\xaf",             /* overlong, 4 bytes */
+        "\xed\xa0\x80",                 /* surrogate */
+        "\xf4\x90\x80\x80",             /* past U+10FFFF */
+        "\xf5\x80\x80\x80",
+        "\xff",
+        "\xe2\x82",                     /* cut short at the end */
+    };
+    size_t bars[4];
+    size_t n;
+
+    for (n = 0; n < sizeof(bad) / sizeof(bad[0]); n++)
+        TEST_ASSERT_EQUAL_INT(-1, scan_all(bad[n], strlen(bad[n]), bars, 4));
+}
+
+void test_text_scan_errors_at_every_offset(void) {
+    unsigned char buf[100];
+    size_t bars[4];
+    size_t at;
+
+    /* the same bad byte in every lane and across block edges */
+    for (at = 0; at < sizeof(buf); at++) {
+        memset(buf, 'a', sizeof(buf));
+        buf[at] = 0x80;
+        TEST_ASSERT_EQUAL_INT(-1, scan_all(buf, sizeof(buf), bars, 4));
+    }
+
+    /* and a character split over a block edge is fine */
+    for (at = 0; at + 4 <= sizeof(buf); at++) {
+        memset(buf, '|', sizeof(buf));
+        memcpy(buf + at, "\xf0\x9f\x98\x80", 4);
+        TEST_ASSERT_EQUAL_INT(4, scan_all(buf, sizeof(buf), bars, 4));
+        TEST_ASSERT_EQUAL_INT(at ? 0 : 4, (int)bars[0]);
+    }
+}
+
+void test_text_scan_64k_frame(void) {
+    size_t bars[4];
+    size_t n;
+
+    /* mostly ASCII with some 2, 3 and 4 byte characters */
+    for (n = 0; n + 4 <= 65536; n += 4)
+        switch (n % 256) {
+        case 100:
+            memcpy(big + n, "\xc3\xa9\xc3\xa9", 4);
+            break;
+        case 200:
+            memcpy(big + n, "\xf0\x9f\x98\x80", 4);
+            break;
+        case 252:
+            memcpy(big + n, "\xe2\x82\xac|", 4);
+            break;
+        default:
+            memcpy(big + n, "abcd", 4);
+        }
+    memcpy(big, "0|1|amy|", 8);
+
+    TEST_ASSERT_EQUAL_INT(4, scan_all(big, 65536, bars, 4));
+    TEST_ASSERT_EQUAL_INT(1, (int)bars[0]);
+    TEST_ASSERT_EQUAL_INT(7, (int)bars[2]);
+    TEST_ASSERT_EQUAL_INT(255, (int)bars[3]);
+
+    big[65535] = 0xc3;
+    TEST_ASSERT_EQUAL_INT(-1, scan_all(big, 65536, bars, 4));
+}
+
+void test_text_scan_select(void) {
+    TEST_ASSERT_EQUAL_INT(0, text_scan_select(TEXT_SCAN_SCALAR));
+    TEST_ASSERT_EQUAL_STRING("scalar", text_scan_kernel_name());
+    TEST_ASSERT_EQUAL_INT(0, text_scan_select(TEXT_SCAN_AUTO));
+    TEST_ASSERT_NOT_NULL(text_scan_kernel_name());
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_text_scan_finds_bars);
+    RUN_TEST(test_text_scan_valid_utf8);
+    RUN_TEST(test_text_scan_invalid_utf8);
+    RUN_TEST(test_text_scan_errors_at_every_offset);
+    RUN_TEST(test_text_scan_64k_frame);
+    RUN_TEST(test_text_scan_select);
+
+    return UNITY_END();
+}
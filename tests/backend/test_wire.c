@@ -0,0 +1,182 @@
+#include "unity.h"
+#include "wire.h"
+#include <string.h>
+
+static unsigned char buf[1024], out[1024];
+
+void setUp(void) {
+}
+
+void tearDown(void) {
+}
+
+static void assert_field(const char *want, const char *field, size_t len) {
+    TEST_ASSERT_EQUAL_INT((int)strlen(want), (int)len);
+    TEST_ASSERT_EQUAL_MEMORY(want, field, len);
+}
+
+void test_wire_text_to_binary_and_back(void) {
+    const char *text = "0|1700000000123456|amy|hello|dev";
+    struct wire_frame f, g;
+    size_t n;
+
+    TEST_ASSERT_FALSE(wire_is_binary(text, strlen(text)));
+    TEST_ASSERT_EQUAL_INT(0, wire_parse(text, strlen(text), &f));
+    TEST_ASSERT_EQUAL_INT(0, f.type);
+    TEST_ASSERT_EQUAL_UINT64(1700000000123456ull, f.timestamp);
+    assert_field("amy", f.user, f.user_len);
+    assert_field("hello", f.content, f.content_len);
+    assert_field("dev", f.metadata, f.metadata_len);
+
+    n = wire_encode(&f, buf);
+    TEST_ASSERT_TRUE(n <= wire_bound(&f));
+    TEST_ASSERT_TRUE(wire_is_binary(buf, n));
+    TEST_ASSERT_EQUAL_INT(0, wire_parse(buf, n, &g));
+    TEST_ASSERT_EQUAL_UINT64(f.timestamp, g.timestamp);
+    assert_field("amy", g.user, g.user_len);
+    assert_field("hello", g.content, g.content_len);
+    assert_field("dev", g.metadata, g.metadata_len);
+
+    /* g points into buf */
+    n = wire_text_encode(&g, out);
+    TEST_ASSERT_EQUAL_INT((int)strlen(text), (int)n);
+    TEST_ASSERT_EQUAL_MEMORY(text, out, n);
+}
+
+void test_wire_text_without_metadata(void) {
+    struct wire_frame f;
+
+    TEST_ASSERT_EQUAL_INT(0, wire_parse("1|5|amy|dev", 11, &f));
+    assert_field("dev", f.content, f.content_len);
+    TEST_ASSERT_EQUAL_INT(0, (int)f.metadata_len);
+
+    TEST_ASSERT_EQUAL_INT(-1, wire_parse("1|5|amy", 7, &f));
+}
+
+void test_wire_binary_keeps_delimiters(void) {
+    struct wire_frame f = {0}, g;
+    size_t n;
+
+    f.type = 0;
+    f.user = "a|b";
+    f.user_len = 3;
+    f.content = "x||y";
+    f.content_len = 4;
+    f.metadata = "";
+
+    n = wire_encode(&f, buf);
+    TEST_ASSERT_EQUAL_INT(0, wire_parse(buf, n, &g));
+    assert_field("a|b", g.user, g.user_len);
+    assert_field("x||y", g.content, g.content_len);
+    TEST_ASSERT_EQUAL_INT(0, (int)g.metadata_len);
+}
+
+void test_wire_text_ok(void) {
+    struct wire_frame f = {0};
+
+    f.user = "amy";
+    f.user_len = 3;
+    f.content = "caf\xc3\xa9";
+    f.content_len = 5;
+    f.metadata = "a|b";
+    f.metadata_len = 3;
+    TEST_ASSERT_TRUE(wire_text_ok(&f));
+
+    /* '|' would move the text fields after it */
+    f.content = "x|y";
+    f.content_len = 3;
+    TEST_ASSERT_FALSE(wire_text_ok(&f));
+    f.content = "xy";
+    f.content_len = 2;
+    f.user = "a|b";
+    TEST_ASSERT_FALSE(wire_text_ok(&f));
+
+    /* and each field must be UTF-8 */
+    f.user = "amy";
+    f.metadata = "\xc3";
+    f.metadata_len = 1;
+    TEST_ASSERT_FALSE(wire_text_ok(&f));
+    f.metadata_len = 0;
+    f.content = "\xff";
+    f.content_len = 1;
+    TEST_ASSERT_FALSE(wire_text_ok(&f));
+}
+
+void test_wire_rejects_bad_binary(void) {
+    struct wire_frame f = {0}, g;
+    size_t n, cut;
+
+    f.type = 5;
+    f.seq = 300;
+    f.user = "amy";
+    f.user_len = 3;
+    f.content = "lobby";
+    f.content_len = 5;
+    f.metadata = "0|1|amy|hi|";
+    f.metadata_len = 11;
+    n = wire_encode(&f, buf);
+
+    for (cut = 1; cut < n; cut++)
+        TEST_ASSERT_EQUAL_INT(-1, wire_parse(buf, cut, &g));
+
+    buf[n] = 'x';
+    TEST_ASSERT_EQUAL_INT(-1, wire_parse(buf, n + 1, &g));
+
+    /* another version isn't taken for this one */
+    buf[0] = WIRE_VERSION + 1;
+    TEST_ASSERT_FALSE(wire_is_binary(buf, n));
+}
+
+void test_wire_multibyte_varints(void) {
+    static char big[300];
+    struct wire_frame f = {0}, g;
+    size_t n;
+
+    memset(big, 'z', sizeof(big));
+    f.type = 7;
+    f.timestamp = 0x0102030405060708ull;
+    f.seq = 0xffffffffffffffffull;
+    f.user = "";
+    f.content = big;
+    f.content_len = sizeof(big);
+    f.metadata = "";
+
+    n = wire_encode(&f, buf);
+    /* the header, a 10 byte seq, then 1 + 2 + 300 + 1 */
+    TEST_ASSERT_EQUAL_INT(WIRE_HDR + 10 + 304, (int)n);
+    TEST_ASSERT_EQUAL_INT(0, wire_parse(buf, n, &g));
+    TEST_ASSERT_EQUAL_INT(7, g.type);
+    TEST_ASSERT_EQUAL_UINT64(f.timestamp, g.timestamp);
+    TEST_ASSERT_EQUAL_UINT64(f.seq, g.seq);
+    TEST_ASSERT_EQUAL_INT((int)sizeof(big), (int)g.content_len);
+}
+
+void test_wire_text_puts_seq_for_user(void) {
+    struct wire_frame f = {0};
+    size_t n;
+
+    f.type = 5;
+    f.seq = 42;
+    f.content = "lobby";
+    f.content_len = 5;
+    f.metadata = "0|1|amy|hi|";
+    f.metadata_len = 11;
+
+    n = wire_text_encode(&f, buf);
+    TEST_ASSERT_EQUAL_INT(24, (int)n);
+    TEST_ASSERT_EQUAL_MEMORY("5|0|42|lobby|0|1|amy|hi|", buf, n);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_wire_text_to_binary_and_back);
+    RUN_TEST(test_wire_text_without_metadata);
+    RUN_TEST(test_wire_binary_keeps_delimiters);
+    RUN_TEST(test_wire_text_ok);
+    RUN_TEST(test_wire_rejects_bad_binary);
+    RUN_TEST(test_wire_multibyte_varints);
+    RUN_TEST(test_wire_text_puts_seq_for_user);
+
+    return UNITY_END();
+}
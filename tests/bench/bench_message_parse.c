@@ -0,0 +1,147 @@
+/*
+ * Messages per second one core parses, with the old strdup() / strtok_r()
+ * parser, with message_parse_from_string(), and with message_view_parse()
+ * alone, which is what a receive handler that only looks at a few fields
+ * pays.  Then the same messages in batches of PAGE, walked with
+ * message_batch_next().
+ *
+ *   ./bench_message_parse [messages]
+ */
+
+#include "message_types.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define FRAMES 1024
+#define PAGE 1000
+
+static char frames[FRAMES][256];
+static size_t frame_len[FRAMES];
+static char page[PAGE * 256];
+static int page_len;
+
+/* what message_parse_from_string() used to do, to compare against */
+static bool old_parse(const char* raw_message, Message* message) {
+    char* buffer = strdup(raw_message);
+    char* token;
+    char* saveptr;
+    int field = 0;
+
+    token = strtok_r(buffer, "|", &saveptr);
+    while (token && field < 5) {
+        switch (field) {
+            case 0:
+                message->type = (MessageType)atoi(token);
+                break;
+            case 1:
+                message->timestamp = strtoull(token, NULL, 10);
+                break;
+            case 2:
+                strncpy(message->username, token, MAX_USERNAME_LENGTH - 1);
+                message->username[MAX_USERNAME_LENGTH - 1] = '\0';
+                break;
+            case 3:
+                strncpy(message->content, token, MAX_MESSAGE_LENGTH - 1);
+                message->content[MAX_MESSAGE_LENGTH - 1] = '\0';
+                break;
+            case 4:
+                strncpy(message->metadata, token, MAX_METADATA_LENGTH - 1);
+                message->metadata[MAX_METADATA_LENGTH - 1] = '\0';
+                break;
+        }
+        token = strtok_r(NULL, "|", &saveptr);
+        field++;
+    }
+
+    free(buffer);
+    return field >= 4;
+}
+
+static double now_s(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Chat frames like the client sends, 20 to 200 bytes of text
+static void make_frames(void) {
+    int n, m, words;
+
+    srand(1);
+    for (n = 0; n < FRAMES; n++) {
+        m = snprintf(frames[n], sizeof(frames[n]), "0|%llu|user%d|",
+                     1700000000000000ull + (unsigned long long)n * 997,
+                     n % 50);
+        for (words = 4 + rand() % 36; words-- && m < 220; )
+            m += snprintf(frames[n] + m, sizeof(frames[n]) - (size_t)m,
+                          "%.*s ", 1 + rand() % 8, "abcdefghij");
+        m += snprintf(frames[n] + m, sizeof(frames[n]) - (size_t)m,
+                      "|%s", n % 4 ? "" : "dev");
+        frame_len[n] = (size_t)m;
+    }
+}
+
+// The first PAGE of them as one batch, like a page of history would go
+static void make_page(void) {
+    static Message messages[PAGE];
+    int n;
+
+    for (n = 0; n < PAGE; n++)
+        message_parse_from_string(frames[n], &messages[n]);
+    page_len = message_batch_serialize(messages, PAGE, page, sizeof(page));
+}
+
+int main(int argc, char** argv) {
+    long count = argc > 1 ? atol(argv[1]) : 5000000;
+    volatile uint64_t sink = 0;
+    MessageView view;
+    Message message;
+    MessageBatchIter it;
+    double t, old_rate, copy_rate, view_rate, batch_rate;
+    long n;
+
+    make_frames();
+    make_page();
+
+    t = now_s();
+    for (n = 0; n < count; n++)
+        if (old_parse(frames[n % FRAMES], &message))
+            sink += message.content[0];
+    old_rate = (double)count / (now_s() - t);
+
+    t = now_s();
+    for (n = 0; n < count; n++)
+        if (message_parse_from_string(frames[n % FRAMES], &message))
+            sink += message.content[0];
+    copy_rate = (double)count / (now_s() - t);
+
+    t = now_s();
+    for (n = 0; n < count; n++)
+        if (message_view_parse(frames[n % FRAMES], frame_len[n % FRAMES],
+                               &view))
+            sink += view.content.len;
+    view_rate = (double)count / (now_s() - t);
+
+    t = now_s();
+    for (n = 0; n < count; n += PAGE) {
+        message_batch_parse(page, (size_t)page_len, &it);
+        while (message_batch_next(&it, &view))
+            sink += view.content.len;
+    }
+    batch_rate = (double)n / (now_s() - t);
+
+    printf("%ld messages, per core:\n", count);
+    printf("  %-26s %12.0f msg/s\n", "strdup + strtok_r", old_rate);
+    printf("  %-26s %12.0f msg/s  %.1fx\n", "message_parse_from_string",
+           copy_rate, copy_rate / old_rate);
+    printf("  %-26s %12.0f msg/s  %.1fx\n", "message_view_parse", view_rate,
+           view_rate / old_rate);
+    printf("  %-26s %12.0f msg/s  %.1fx\n", "message_batch_next",
+           batch_rate, batch_rate / old_rate);
+
+    return 0;
+}
@@ -0,0 +1,94 @@
+/*
+ * Bytes per second one core checks and splits with text_scan(), for each
+ * kernel this CPU has, on chat frames of 64 and 512 bytes and on a 64KB
+ * frame.  The text is mostly ASCII with a multibyte character now and then,
+ * like chat is.
+ *
+ *   ./bench_text_scan [megabytes per run]
+ */
+
+#include "text_scan.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const struct {
+    enum text_scan_kernel k;
+    const char* name;
+} kernels[] = {
+    { TEXT_SCAN_SCALAR, "scalar" },
+    { TEXT_SCAN_SSE2, "sse2" },
+    { TEXT_SCAN_AVX2, "avx2" },
+    { TEXT_SCAN_NEON, "neon" },
+};
+
+static const size_t sizes[] = { 64, 512, 65536 };
+
+static unsigned char text[65536];
+
+static double now_s(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// A frame header, then words with a 2 or 3 byte character every so often
+static void make_text(void) {
+    size_t n = 0;
+
+    srand(1);
+    memcpy(text, "0|1700000000000000|amy|", 23);
+    n = 23;
+    while (n + 8 < sizeof(text)) {
+        switch (rand() % 16) {
+        case 0:
+            memcpy(text + n, "caf\xc3\xa9 ", 6);
+            n += 6;
+            break;
+        case 1:
+            memcpy(text + n, "\xe2\x82\xac" "5 ", 5);
+            n += 5;
+            break;
+        default:
+            n += (size_t)snprintf((char*)text + n, 9, "%.*s ",
+                                  1 + rand() % 7, "abcdefg");
+        }
+    }
+    memset(text + n, ' ', sizeof(text) - n);
+}
+
+int main(int argc, char** argv) {
+    double mb = argc > 1 ? atof(argv[1]) : 1000;
+    volatile long sink = 0;
+    size_t bars[4];
+    size_t s, len;
+    long n, count;
+    double t, rate;
+    int k;
+
+    make_text();
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        len = sizes[s];
+        count = (long)(mb * 1e6 / (double)len);
+        printf("%zu byte frames, per core:\n", len);
+
+        for (k = 0; k < (int)(sizeof(kernels) / sizeof(kernels[0])); k++) {
+            if (text_scan_select(kernels[k].k))
+                continue;
+
+            t = now_s();
+            for (n = 0; n < count; n++)
+                sink += text_scan(text, len, bars, 4);
+            rate = (double)count * (double)len / (now_s() - t);
+
+            printf("  %-8s %10.0f MB/s %12.0f frames/s\n", kernels[k].name,
+                   rate / 1e6, rate / (double)len);
+        }
+    }
+
+    return 0;
+}
@@ -78,7 +78,7 @@ void test_message_list_add_single_message(void) {
     TEST_ASSERT_NOT_NULL(list->head);
     TEST_ASSERT_NOT_NULL(list->tail);
     TEST_ASSERT_EQUAL_PTR(list->head, list->tail);
-    TEST_ASSERT_EQUAL_STRING("test_user", list->head->message.username);
+    TEST_ASSERT_EQUAL_STRING("test_user", list->head->username);
     
     message_list_destroy(list);
 }
@@ -149,6 +149,304 @@ void test_message_list_clear(void) {
     message_list_destroy(list);
 }
 
+void test_message_parse_history_response(void) {
+    const char* record;
+    uint64_t seq;
+
+    TEST_ASSERT_TRUE(message_parse_history_response(
+        "5|1700000000|812|lobby|0|123|amy|hi|", &seq, &record));
+    TEST_ASSERT_EQUAL_UINT64(812, seq);
+    TEST_ASSERT_EQUAL_STRING("0|123|amy|hi|", record);
+
+    // The end of a page has no record
+    TEST_ASSERT_TRUE(message_parse_history_response("5|0|0|dev|", &seq, &record));
+    TEST_ASSERT_EQUAL_UINT64(0, seq);
+    TEST_ASSERT_EQUAL_STRING("", record);
+
+    TEST_ASSERT_FALSE(message_parse_history_response("0|1|amy|hi|", &seq, &record));
+    TEST_ASSERT_FALSE(message_parse_history_response("5|0|7", &seq, &record));
+}
+
+void test_message_parse_sequenced(void) {
+    const char* record;
+    uint64_t seq;
+
+    TEST_ASSERT_TRUE(message_parse_sequenced(
+        "7|1700000000|42|lobby|0|123|amy|hi|", &seq, &record));
+    TEST_ASSERT_EQUAL_UINT64(42, seq);
+    TEST_ASSERT_EQUAL_STRING("0|123|amy|hi|", record);
+
+    // History pages aren't live messages
+    TEST_ASSERT_FALSE(message_parse_sequenced(
+        "5|1700000000|42|lobby|0|123|amy|hi|", &seq, &record));
+    TEST_ASSERT_FALSE(message_parse_history_response(
+        "7|1700000000|42|lobby|0|123|amy|hi|", &seq, &record));
+    TEST_ASSERT_FALSE(message_parse_sequenced("7|0|7", &seq, &record));
+}
+
+void test_message_view_parse(void) {
+    // Not NUL-terminated, and more after it that isn't ours
+    const char frame[] = "0|1234567890|amy|hi there|dev||XXXX";
+    MessageView view;
+
+    TEST_ASSERT_TRUE(message_view_parse(frame, 29, &view));
+    TEST_ASSERT_EQUAL_INT(MSG_TYPE_CHAT, view.type);
+    TEST_ASSERT_EQUAL_UINT64(1234567890, view.timestamp);
+    TEST_ASSERT_EQUAL_PTR(frame + 13, view.username.data);
+    TEST_ASSERT_EQUAL_INT(3, (int)view.username.len);
+    TEST_ASSERT_EQUAL_INT(8, (int)view.content.len);
+    TEST_ASSERT_EQUAL_INT(0, memcmp("hi there", view.content.data, 8));
+    TEST_ASSERT_EQUAL_INT(3, (int)view.metadata.len);
+
+    // Empty fields stay where they are, metadata may be left out
+    TEST_ASSERT_TRUE(message_view_parse("1|5||dev", 8, &view));
+    TEST_ASSERT_EQUAL_INT(MSG_TYPE_JOIN, view.type);
+    TEST_ASSERT_EQUAL_INT(0, (int)view.username.len);
+    TEST_ASSERT_EQUAL_INT(3, (int)view.content.len);
+    TEST_ASSERT_EQUAL_INT(0, (int)view.metadata.len);
+
+    TEST_ASSERT_FALSE(message_view_parse("0|1|amy|hi", 7, &view));
+    TEST_ASSERT_FALSE(message_view_parse("", 0, &view));
+}
+
+void test_message_view_parse_rejects_invalid_utf8(void) {
+    MessageView view;
+    Message message;
+
+    TEST_ASSERT_TRUE(message_view_parse("0|1|amy|\xe2\x82\xac" "5|", 13, &view));
+    TEST_ASSERT_EQUAL_INT(4, (int)view.content.len);
+
+    // Overlong, a surrogate, and cut short
+    TEST_ASSERT_FALSE(message_view_parse("0|1|amy|\xc0\xaf|", 11, &view));
+    TEST_ASSERT_FALSE(message_view_parse("0|1|amy|\xed\xa0\x80|", 12, &view));
+    TEST_ASSERT_FALSE(message_parse_from_string("0|1|amy|hi\xe2\x82", &message));
+}
+
+void test_message_from_view_truncates(void) {
+    char frame[MAX_MESSAGE_LENGTH + 32] = "0|1|amy|";
+    MessageView view;
+    Message message;
+
+    memset(frame + 8, 'x', MAX_MESSAGE_LENGTH + 10);
+    TEST_ASSERT_TRUE(message_view_parse(frame, 8 + MAX_MESSAGE_LENGTH + 10,
+                                        &view));
+    message_from_view(&view, &message);
+
+    TEST_ASSERT_EQUAL_INT(MAX_MESSAGE_LENGTH - 1,
+                          (int)strlen(message.content));
+    TEST_ASSERT_EQUAL_STRING("amy", message.username);
+    TEST_ASSERT_EQUAL_STRING("", message.metadata);
+}
+
+void test_message_parse_retry_after(void) {
+    uint32_t ms = 0;
+
+    TEST_ASSERT_TRUE(message_parse_retry_after(
+        "3|1700000000|server|retry-after|2500", &ms));
+    TEST_ASSERT_EQUAL_UINT32(2500, ms);
+
+    // Other status frames, and chat saying the same, aren't
+    TEST_ASSERT_FALSE(message_parse_retry_after(
+        "3|1700000000|server|shutting down|", &ms));
+    TEST_ASSERT_FALSE(message_parse_retry_after(
+        "0|1700000000|amy|retry-after|2500", &ms));
+    TEST_ASSERT_FALSE(message_parse_retry_after("3|0", &ms));
+}
+
+void test_message_list_prepend(void) {
+    MessageList* list = message_list_create(3);
+    Message message = {.type = MSG_TYPE_CHAT};
+
+    strcpy(message.content, "newer");
+    message_list_add(list, &message);
+    strcpy(message.content, "older");
+    TEST_ASSERT_TRUE(message_list_prepend(list, &message));
+
+    TEST_ASSERT_EQUAL_INT(2, list->count);
+    TEST_ASSERT_EQUAL_STRING("older", message_node_content(list->head));
+    TEST_ASSERT_EQUAL_STRING("newer", message_node_content(list->tail));
+
+    // A full list keeps its newest messages
+    TEST_ASSERT_TRUE(message_list_prepend(list, &message));
+    TEST_ASSERT_FALSE(message_list_prepend(list, &message));
+    TEST_ASSERT_EQUAL_INT(3, list->count);
+
+    message_list_destroy(list);
+}
+
+void test_message_list_interns_usernames(void) {
+    MessageList* list = message_list_create(10);
+    Message message = {.timestamp = 7, .type = MSG_TYPE_CHAT};
+    Message copy;
+
+    strcpy(message.username, "amy");
+    strcpy(message.content, "hi");
+    strcpy(message.metadata, "dev");
+    message_list_add(list, &message);
+    strcpy(message.content, "again");
+    message_list_add(list, &message);
+    strcpy(message.username, "bob");
+    message_list_add(list, &message);
+
+    TEST_ASSERT_EQUAL_PTR(list->head->username, list->head->next->username);
+    TEST_ASSERT_EQUAL_STRING("bob", list->tail->username);
+    TEST_ASSERT_EQUAL_INT(2, (int)list->interns.count);
+
+    message_node_to_message(list->head, &copy);
+    TEST_ASSERT_EQUAL_UINT64(7, copy.timestamp);
+    TEST_ASSERT_EQUAL_STRING("amy", copy.username);
+    TEST_ASSERT_EQUAL_STRING("hi", copy.content);
+    TEST_ASSERT_EQUAL_STRING("dev", copy.metadata);
+    TEST_ASSERT_EQUAL_STRING("dev", message_node_metadata(list->tail));
+
+    message_list_destroy(list);
+}
+
+void test_message_list_drops_unused_names(void) {
+    MessageList* list = message_list_create(10);
+    Message message = {.type = MSG_TYPE_CHAT};
+    int n;
+
+    // Short and long names sharing a hash slot's run, then names that only
+    // come once, all pushed out by newer messages
+    for (n = 0; n < 200; n++) {
+        if (n < 100)
+            strcpy(message.username, n % 2 ? "a" : "a-much-longer-name");
+        else
+            snprintf(message.username, MAX_USERNAME_LENGTH, "user%d", n);
+        TEST_ASSERT_TRUE(message_list_add(list, &message));
+        TEST_ASSERT_EQUAL_STRING(message.username, list->tail->username);
+    }
+
+    TEST_ASSERT_EQUAL_INT(10, (int)list->interns.count);
+    TEST_ASSERT_EQUAL_STRING("user190", list->head->username);
+
+    message_list_clear(list);
+    TEST_ASSERT_EQUAL_INT(0, (int)list->interns.bytes);
+    message_list_destroy(list);
+}
+
+void test_message_list_is_compact(void) {
+    MessageList* list = message_list_create(100000);
+    Message message = {.type = MSG_TYPE_CHAT};
+    size_t bytes;
+
+    for (int i = 0; i < 100000; i++) {
+        sprintf(message.username, "user_%d", i % 8);
+        sprintf(message.content, "message %d", i);
+        TEST_ASSERT_TRUE(message_list_add(list, &message));
+    }
+
+    // 100k fixed Messages would be 70MB
+    bytes = message_list_bytes(list);
+    TEST_ASSERT_TRUE(bytes < 8 * 1024 * 1024);
+    TEST_ASSERT_EQUAL_STRING("message 99999", message_node_content(list->tail));
+
+    // Turning the whole list over holds no more than it did
+    for (int i = 0; i < 200000; i++) {
+        sprintf(message.content, "message %d", i);
+        message_list_add(list, &message);
+    }
+    TEST_ASSERT_TRUE(message_list_bytes(list) <= bytes + MESSAGE_CHUNK_SIZE);
+    TEST_ASSERT_EQUAL_INT(100000, list->count);
+
+    message_list_clear(list);
+    TEST_ASSERT_TRUE(message_list_bytes(list) <= 2 * MESSAGE_CHUNK_SIZE);
+
+    message_list_destroy(list);
+}
+
+void test_message_batch_round_trip(void) {
+    Message messages[3] = {
+        {.type = MSG_TYPE_CHAT, .timestamp = 1},
+        {.type = MSG_TYPE_JOIN, .timestamp = 1700000000000000ull},
+        {.type = MSG_TYPE_CHAT, .timestamp = 3},
+    };
+    char buffer[512];
+    MessageBatchIter it;
+    MessageView view;
+    int len;
+
+    strcpy(messages[0].username, "amy");
+    strcpy(messages[0].content, "a|b");
+    strcpy(messages[1].username, "bob");
+    strcpy(messages[1].content, "dev");
+    strcpy(messages[2].username, "amy");
+    strcpy(messages[2].metadata, "dev");
+
+    len = message_batch_serialize(messages, 3, buffer, sizeof(buffer));
+    TEST_ASSERT_GREATER_THAN(0, len);
+    TEST_ASSERT_EQUAL_INT(len, (int)strlen(buffer));
+    TEST_ASSERT_EQUAL_STRING_LEN("8|0|3||12:0|1|amy|a|b|", buffer, 22);
+
+    TEST_ASSERT_TRUE(message_batch_parse(buffer, (size_t)len, &it));
+    TEST_ASSERT_EQUAL_INT(3, it.count);
+
+    TEST_ASSERT_TRUE(message_batch_next(&it, &view));
+    TEST_ASSERT_EQUAL_INT(1, (int)view.timestamp);
+    TEST_ASSERT_EQUAL_INT(1, (int)view.content.len); // '|' splits a record
+
+    TEST_ASSERT_TRUE(message_batch_next(&it, &view));
+    TEST_ASSERT_EQUAL_INT(MSG_TYPE_JOIN, view.type);
+    TEST_ASSERT_EQUAL_UINT64(1700000000000000ull, view.timestamp);
+    TEST_ASSERT_EQUAL_STRING_LEN("dev", view.content.data, view.content.len);
+
+    TEST_ASSERT_TRUE(message_batch_next(&it, &view));
+    TEST_ASSERT_EQUAL_INT(0, (int)view.content.len);
+    TEST_ASSERT_EQUAL_STRING_LEN("dev", view.metadata.data, view.metadata.len);
+
+    TEST_ASSERT_FALSE(message_batch_next(&it, &view));
+}
+
+void test_message_batch_rejects_bad_input(void) {
+    Message message = {.type = MSG_TYPE_CHAT};
+    char buffer[64];
+    MessageBatchIter it;
+    MessageView view;
+    int len;
+
+    strcpy(message.content, "this won't fit in a small buffer at all");
+    TEST_ASSERT_EQUAL_INT(-1, message_batch_serialize(&message, 1, buffer, 32));
+
+    TEST_ASSERT_FALSE(message_batch_parse("0|1|amy|hi|", 11, &it));
+    TEST_ASSERT_FALSE(message_batch_parse("8|0|||", 6, &it));
+
+    // A record longer than what is left ends the walk
+    len = message_batch_serialize(&message, 1, buffer, sizeof(buffer));
+    TEST_ASSERT_GREATER_THAN(0, len);
+    TEST_ASSERT_TRUE(message_batch_parse(buffer, (size_t)len - 1, &it));
+    TEST_ASSERT_FALSE(message_batch_next(&it, &view));
+    TEST_ASSERT_EQUAL_INT(0, it.remaining);
+
+    // So does one missing its ':'
+    TEST_ASSERT_TRUE(message_batch_parse("8|0|2||4|0|0|||", 15, &it));
+    TEST_ASSERT_FALSE(message_batch_next(&it, &view));
+}
+
+void test_message_batch_large_page(void) {
+    static Message messages[1000];
+    static char buffer[1000 * 64];
+    MessageBatchIter it;
+    MessageView view;
+    int len, n = 0;
+
+    for (int i = 0; i < 1000; i++) {
+        messages[i].type = MSG_TYPE_CHAT;
+        messages[i].timestamp = (uint64_t)i;
+        sprintf(messages[i].username, "user_%d", i % 8);
+        sprintf(messages[i].content, "message %d", i);
+    }
+
+    len = message_batch_serialize(messages, 1000, buffer, sizeof(buffer));
+    TEST_ASSERT_GREATER_THAN(0, len);
+    TEST_ASSERT_TRUE(message_batch_parse(buffer, (size_t)len, &it));
+    while (message_batch_next(&it, &view)) {
+        TEST_ASSERT_EQUAL_INT(n, (int)view.timestamp);
+        n++;
+    }
+    TEST_ASSERT_EQUAL_INT(1000, n);
+}
+
 int main(void) {
     UNITY_BEGIN();
     
@@ -160,6 +458,19 @@ int main(void) {
     RUN_TEST(test_message_list_add_multiple_messages);
     RUN_TEST(test_message_list_overflow_protection);
     RUN_TEST(test_message_list_clear);
+    RUN_TEST(test_message_parse_history_response);
+    RUN_TEST(test_message_parse_sequenced);
+    RUN_TEST(test_message_view_parse);
+    RUN_TEST(test_message_view_parse_rejects_invalid_utf8);
+    RUN_TEST(test_message_from_view_truncates);
+    RUN_TEST(test_message_parse_retry_after);
+    RUN_TEST(test_message_list_prepend);
+    RUN_TEST(test_message_list_interns_usernames);
+    RUN_TEST(test_message_list_drops_unused_names);
+    RUN_TEST(test_message_list_is_compact);
+    RUN_TEST(test_message_batch_round_trip);
+    RUN_TEST(test_message_batch_rejects_bad_input);
+    RUN_TEST(test_message_batch_large_page);
     
     return UNITY_END();
 }
\ No newline at end of file